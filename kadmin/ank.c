@@ -219,10 +219,13 @@ out:
  * Parse arguments and add all the principals.
  */
 
+extern int local_flag;
+
 int
 add_new_key(struct add_options *opt, int argc, char **argv)
 {
-    krb5_error_code ret = 0;
+    krb5_error_code ret = 0, ret2;
+    int batch = (local_flag && argc > 1);
     int i;
     int num;
     krb5_key_data key_data[3];
@@ -255,6 +258,10 @@ add_new_key(struct add_options *opt, int argc, char **argv)
 	kdp = key_data;
     }
 
+    /* Adding principals in bulk to the local database shares log fsyncs */
+    if (batch)
+	kadm5_log_batch_begin(kadm_handle);
+
     for(i = 0; i < argc; i++) {
 	ret = add_one_principal (argv[i],
 				 opt->random_key_flag,
@@ -273,6 +280,14 @@ add_new_key(struct add_options *opt, int argc, char **argv)
 	    break;
 	}
     }
+    if (batch) {
+	ret2 = kadm5_log_batch_end(kadm_handle);
+	if (ret2) {
+	    krb5_warn (context, ret2, "syncing the log");
+	    if (ret == 0)
+		ret = ret2;
+	}
+    }
     if (kdp) {
 	int16_t dummy = 3;
 	kadm5_free_key_data (kadm_handle, &dummy, key_data);
@@ -34,9 +34,56 @@
 
 #include "kcm_locl.h"
 
-HEIMDAL_MUTEX ccache_mutex = HEIMDAL_MUTEX_INITIALIZER;
-kcm_ccache_data *ccache_head = NULL;
+/*
+ * Caches are found through two hash indexes, by name and by uuid.  Each
+ * bucket has its own lock, so operations on different caches do not
+ * contend; locks are taken in the order name bucket, uuid bucket,
+ * cache.
+ */
+
+#define KCM_CCACHE_BUCKETS	4096
+
+struct kcm_ccache_bucket {
+    HEIMDAL_MUTEX mutex;
+    kcm_ccache head;
+};
+
+static struct kcm_ccache_bucket ccache_names[KCM_CCACHE_BUCKETS];
+static struct kcm_ccache_bucket ccache_uuids[KCM_CCACHE_BUCKETS];
+
+static HEIMDAL_MUTEX ccache_mutex = HEIMDAL_MUTEX_INITIALIZER;
 static unsigned int ccache_nextid = 0;
+static unsigned long ccache_seq = 0;
+
+void
+kcm_ccache_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < KCM_CCACHE_BUCKETS; i++) {
+	HEIMDAL_MUTEX_init(&ccache_names[i].mutex);
+	HEIMDAL_MUTEX_init(&ccache_uuids[i].mutex);
+    }
+}
+
+static struct kcm_ccache_bucket *
+name_bucket(const char *name)
+{
+    uint32_t h = 2166136261U;
+
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619U;
+    return &ccache_names[h % KCM_CCACHE_BUCKETS];
+}
+
+static struct kcm_ccache_bucket *
+uuid_bucket(const kcmuuid_t uuid)
+{
+    uint32_t h;
+
+    memcpy(&h, uuid, sizeof(h)); /* uuids are random */
+    return &ccache_uuids[h % KCM_CCACHE_BUCKETS];
+}
 
 char *kcm_ccache_nextid(pid_t pid, uid_t uid, gid_t gid)
 {
@@ -60,6 +107,7 @@ kcm_ccache_resolve(krb5_context context,
 		   const char *name,
 		   kcm_ccache *ccache)
 {
+    struct kcm_ccache_bucket *b = name_bucket(name);
     kcm_ccache p;
     krb5_error_code ret;
 
@@ -67,9 +115,9 @@ kcm_ccache_resolve(krb5_context context,
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_MUTEX_lock(&b->mutex);
 
-    for (p = ccache_head; p != NULL; p = p->next) {
+    for (p = b->head; p != NULL; p = p->next) {
 	if ((p->flags & KCM_FLAGS_VALID) == 0)
 	    continue;
 	if (strcmp(p->name, name) == 0) {
@@ -83,7 +131,7 @@ kcm_ccache_resolve(krb5_context context,
 	*ccache = p;
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
 
     return ret;
 }
@@ -93,6 +141,7 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 			   kcmuuid_t uuid,
 			   kcm_ccache *ccache)
 {
+    struct kcm_ccache_bucket *b = uuid_bucket(uuid);
     kcm_ccache p;
     krb5_error_code ret;
 
@@ -100,9 +149,9 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_MUTEX_lock(&b->mutex);
 
-    for (p = ccache_head; p != NULL; p = p->next) {
+    for (p = b->head; p != NULL; p = p->uuid_next) {
 	if ((p->flags & KCM_FLAGS_VALID) == 0)
 	    continue;
 	if (memcmp(p->uuid, uuid, sizeof(kcmuuid_t)) == 0) {
@@ -116,7 +165,7 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 	*ccache = p;
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
 
     return ret;
 }
@@ -126,24 +175,25 @@ kcm_ccache_get_uuids(krb5_context context, kcm_client *client, kcm_operation opc
 {
     krb5_error_code ret;
     kcm_ccache p;
+    size_t i;
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
-
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if ((p->flags & KCM_FLAGS_VALID) == 0)
-	    continue;
-	ret = kcm_access(context, client, opcode, p);
-	if (ret) {
-	    ret = 0;
-	    continue;
+    for (i = 0; i < KCM_CCACHE_BUCKETS; i++) {
+	HEIMDAL_MUTEX_lock(&ccache_names[i].mutex);
+	for (p = ccache_names[i].head; p != NULL; p = p->next) {
+	    if ((p->flags & KCM_FLAGS_VALID) == 0)
+		continue;
+	    ret = kcm_access(context, client, opcode, p);
+	    if (ret) {
+		ret = 0;
+		continue;
+	    }
+	    krb5_storage_write(sp, p->uuid, sizeof(p->uuid));
 	}
-	krb5_storage_write(sp, p->uuid, sizeof(p->uuid));
+	HEIMDAL_MUTEX_unlock(&ccache_names[i].mutex);
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
-
     return ret;
 }
 
@@ -151,38 +201,41 @@ kcm_ccache_get_uuids(krb5_context context, kcm_client *client, kcm_operation opc
 krb5_error_code kcm_debug_ccache(krb5_context context)
 {
     kcm_ccache p;
+    size_t i;
 
-    for (p = ccache_head; p != NULL; p = p->next) {
-	char *cpn = NULL, *spn = NULL;
-	int ncreds = 0;
-	struct kcm_creds *k;
+    for (i = 0; i < KCM_CCACHE_BUCKETS; i++) {
+	for (p = ccache_names[i].head; p != NULL; p = p->next) {
+	    char *cpn = NULL, *spn = NULL;
+	    int ncreds = 0;
+	    struct kcm_creds *k;
 
-	if ((p->flags & KCM_FLAGS_VALID) == 0) {
-	    kcm_log(7, "cache %08x: empty slot");
-	    continue;
-	}
+	    if ((p->flags & KCM_FLAGS_VALID) == 0) {
+		kcm_log(7, "cache %08x: empty slot");
+		continue;
+	    }
 
-	KCM_ASSERT_VALID(p);
+	    KCM_ASSERT_VALID(p);
 
-	for (k = p->creds; k != NULL; k = k->next)
-	    ncreds++;
+	    for (k = p->creds; k != NULL; k = k->next)
+		ncreds++;
 
-	if (p->client != NULL)
-	    krb5_unparse_name(context, p->client, &cpn);
-	if (p->server != NULL)
-	    krb5_unparse_name(context, p->server, &spn);
+	    if (p->client != NULL)
+		krb5_unparse_name(context, p->client, &cpn);
+	    if (p->server != NULL)
+		krb5_unparse_name(context, p->server, &spn);
 
-	kcm_log(7, "cache %08x: name %s refcnt %d flags %04x mode %04o "
-		"uid %d gid %d client %s server %s ncreds %d",
-		p, p->name, p->refcnt, p->flags, p->mode, p->uid, p->gid,
-		(cpn == NULL) ? "<none>" : cpn,
-		(spn == NULL) ? "<none>" : spn,
-		ncreds);
+	    kcm_log(7, "cache %08x: name %s refcnt %d flags %04x mode %04o "
+		    "uid %d gid %d client %s server %s ncreds %d",
+		    p, p->name, p->refcnt, p->flags, p->mode, p->uid, p->gid,
+		    (cpn == NULL) ? "<none>" : cpn,
+		    (spn == NULL) ? "<none>" : spn,
+		    ncreds);
 
-	if (cpn != NULL)
-	    free(cpn);
-	if (spn != NULL)
-	    free(spn);
+	    if (cpn != NULL)
+		free(cpn);
+	    if (spn != NULL)
+		free(spn);
+	}
     }
 
     return 0;
@@ -219,6 +272,7 @@ kcm_free_ccache_data_internal(krb5_context context,
     cache->renew_life = 0;
 
     cache->next = NULL;
+    cache->uuid_next = NULL;
     cache->refcnt = 0;
 
     HEIMDAL_MUTEX_unlock(&cache->mutex);
@@ -229,13 +283,14 @@ kcm_free_ccache_data_internal(krb5_context context,
 krb5_error_code
 kcm_ccache_destroy(krb5_context context, const char *name)
 {
-    kcm_ccache *p, ccache;
+    struct kcm_ccache_bucket *b = name_bucket(name), *ub;
+    kcm_ccache *p, *u, ccache;
     krb5_error_code ret;
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
-    for (p = &ccache_head; *p != NULL; p = &(*p)->next) {
+    HEIMDAL_MUTEX_lock(&b->mutex);
+    for (p = &b->head; *p != NULL; p = &(*p)->next) {
 	if (((*p)->flags & KCM_FLAGS_VALID) == 0)
 	    continue;
 	if (strcmp((*p)->name, name) == 0) {
@@ -246,18 +301,34 @@ kcm_ccache_destroy(krb5_context context, const char *name)
     if (ret)
 	goto out;
 
-    if ((*p)->refcnt != 1) {
+    /* hold both buckets so no new references can be taken */
+    ccache = *p;
+    ub = uuid_bucket(ccache->uuid);
+    HEIMDAL_MUTEX_lock(&ub->mutex);
+    HEIMDAL_MUTEX_lock(&ccache->mutex);
+    if (ccache->refcnt != 1) {
+	HEIMDAL_MUTEX_unlock(&ccache->mutex);
+	HEIMDAL_MUTEX_unlock(&ub->mutex);
 	ret = EAGAIN;
 	goto out;
     }
+    HEIMDAL_MUTEX_unlock(&ccache->mutex);
 
-    ccache = *p;
-    *p = (*p)->next;
+    *p = ccache->next;
+    for (u = &ub->head; *u != NULL; u = &(*u)->uuid_next) {
+	if (*u == ccache) {
+	    *u = ccache->uuid_next;
+	    break;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&ub->mutex);
+
+    HEIMDAL_MUTEX_lock(&ccache->mutex);
     kcm_free_ccache_data_internal(context, ccache);
     free(ccache);
 
 out:
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
 
     return ret;
 }
@@ -267,49 +338,40 @@ kcm_ccache_alloc(krb5_context context,
 		 const char *name,
 		 kcm_ccache *ccache)
 {
+    struct kcm_ccache_bucket *b = name_bucket(name), *ub;
     kcm_ccache slot = NULL, p;
     krb5_error_code ret;
-    int new_slot = 0;
 
     *ccache = NULL;
 
     /* First, check for duplicates */
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_MUTEX_lock(&b->mutex);
     ret = 0;
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if (p->flags & KCM_FLAGS_VALID) {
-	    if (strcmp(p->name, name) == 0) {
-		ret = KRB5_CC_WRITE;
-		break;
-	    }
-	} else if (slot == NULL)
-	    slot = p;
+    for (p = b->head; p != NULL; p = p->next) {
+	if ((p->flags & KCM_FLAGS_VALID) && strcmp(p->name, name) == 0) {
+	    ret = KRB5_CC_WRITE;
+	    goto out;
+	}
     }
 
-    if (ret)
-	goto out;
-
     /*
      * Create an enpty slot for us.
      */
+    slot = (kcm_ccache_data *)malloc(sizeof(*slot));
     if (slot == NULL) {
-	slot = (kcm_ccache_data *)malloc(sizeof(*slot));
-	if (slot == NULL) {
-	    ret = KRB5_CC_NOMEM;
-	    goto out;
-	}
-	slot->next = ccache_head;
-	HEIMDAL_MUTEX_init(&slot->mutex);
-	new_slot = 1;
+	ret = KRB5_CC_NOMEM;
+	goto out;
     }
 
-    RAND_bytes(slot->uuid, sizeof(slot->uuid));
-
     slot->name = strdup(name);
     if (slot->name == NULL) {
+	free(slot);
 	ret = KRB5_CC_NOMEM;
 	goto out;
     }
+    HEIMDAL_MUTEX_init(&slot->mutex);
+
+    RAND_bytes(slot->uuid, sizeof(slot->uuid));
 
     slot->refcnt = 1;
     slot->flags = KCM_FLAGS_VALID;
@@ -319,24 +381,30 @@ kcm_ccache_alloc(krb5_context context,
     slot->client = NULL;
     slot->server = NULL;
     slot->creds = NULL;
+    slot->creds_index = NULL;
+    slot->creds_index_size = 0;
+    slot->ncreds = 0;
     slot->key.keytab = NULL;
     slot->tkt_life = 0;
     slot->renew_life = 0;
 
-    if (new_slot)
-	ccache_head = slot;
+    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    slot->seq = ++ccache_seq;
+    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+
+    ub = uuid_bucket(slot->uuid);
+    HEIMDAL_MUTEX_lock(&ub->mutex);
+    slot->uuid_next = ub->head;
+    ub->head = slot;
+    HEIMDAL_MUTEX_unlock(&ub->mutex);
 
-    *ccache = slot;
+    slot->next = b->head;
+    b->head = slot;
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
-    return 0;
+    *ccache = slot;
 
 out:
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
-    if (new_slot && slot != NULL) {
-	HEIMDAL_MUTEX_destroy(&slot->mutex);
-	free(slot);
-    }
+    HEIMDAL_MUTEX_unlock(&b->mutex);
     return ret;
 }
 
@@ -356,6 +424,11 @@ kcm_ccache_remove_creds_internal(krb5_context context,
 	free(old);
     }
     ccache->creds = NULL;
+    ccache->ncreds = 0;
+
+    free(ccache->creds_index);
+    ccache->creds_index = NULL;
+    ccache->creds_index_size = 0;
 
     return 0;
 }
@@ -531,6 +604,82 @@ kcm_ccache_find_cred_uuid(krb5_context context,
 
 
 
+/*
+ * Credentials are also indexed by the name components of their server
+ * principal, which both krb5_principal_compare() and
+ * krb5_principal_compare_any_realm() look at.  Each bucket keeps the
+ * order of the creds list so a lookup finds the same entry as a scan.
+ */
+
+static size_t
+creds_index_bucket(kcm_ccache ccache, krb5_const_principal server)
+{
+    uint32_t h = 2166136261U;
+    const char *p;
+    size_t i;
+
+    for (i = 0; server != NULL && i < server->name.name_string.len; i++) {
+	for (p = server->name.name_string.val[i]; *p; p++)
+	    h = (h ^ (unsigned char)*p) * 16777619U;
+	h = (h ^ '/') * 16777619U;
+    }
+    return h % ccache->creds_index_size;
+}
+
+static void
+creds_index_add(kcm_ccache ccache, struct kcm_creds *c)
+{
+    struct kcm_creds **p;
+
+    c->index_next = NULL;
+    p = &ccache->creds_index[creds_index_bucket(ccache, c->cred.server)];
+    while (*p != NULL)
+	p = &(*p)->index_next;
+    *p = c;
+}
+
+/*
+ * Rebuild the index with room for the current creds; without memory
+ * for it, lookups fall back to scanning the list.
+ */
+
+static void
+creds_index_rebuild(kcm_ccache ccache)
+{
+    struct kcm_creds *c;
+    size_t size;
+
+    size = ccache->creds_index_size ? ccache->creds_index_size : 8;
+    while (size < ccache->ncreds)
+	size *= 2;
+
+    free(ccache->creds_index);
+    ccache->creds_index = calloc(size, sizeof(ccache->creds_index[0]));
+    if (ccache->creds_index == NULL) {
+	ccache->creds_index_size = 0;
+	return;
+    }
+    ccache->creds_index_size = size;
+    for (c = ccache->creds; c != NULL; c = c->next)
+	creds_index_add(ccache, c);
+}
+
+static void
+creds_index_remove(kcm_ccache ccache, struct kcm_creds *c)
+{
+    struct kcm_creds **p;
+
+    if (ccache->creds_index_size == 0)
+	return;
+    p = &ccache->creds_index[creds_index_bucket(ccache, c->cred.server)];
+    for (; *p != NULL; p = &(*p)->index_next) {
+	if (*p == c) {
+	    *p = c->index_next;
+	    break;
+	}
+    }
+}
+
 krb5_error_code
 kcm_ccache_store_cred_internal(krb5_context context,
 			       kcm_ccache ccache,
@@ -563,6 +712,14 @@ kcm_ccache_store_cred_internal(krb5_context context,
 	ret = 0;
     }
 
+    if (ret == 0) {
+	ccache->ncreds++;
+	if (ccache->ncreds > ccache->creds_index_size)
+	    creds_index_rebuild(ccache);
+	else
+	    creds_index_add(ccache, *c);
+    }
+
     return ret;
 }
 
@@ -582,6 +739,8 @@ kcm_ccache_remove_cred_internal(krb5_context context,
 	    struct kcm_creds *cred = *c;
 
 	    *c = cred->next;
+	    creds_index_remove(ccache, cred);
+	    ccache->ncreds--;
 	    krb5_free_cred_contents(context, &cred->cred);
 	    free(cred);
 	    ret = 0;
@@ -626,10 +785,19 @@ kcm_ccache_retrieve_cred_internal(krb5_context context,
     ret = KRB5_CC_END;
 
     match = FALSE;
-    for (c = ccache->creds; c != NULL; c = c->next) {
-	match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
-	if (match)
-	    break;
+    if (mcreds->server != NULL && ccache->creds_index_size != 0) {
+	c = ccache->creds_index[creds_index_bucket(ccache, mcreds->server)];
+	for (; c != NULL; c = c->index_next) {
+	    match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
+	    if (match)
+		break;
+	}
+    } else {
+	for (c = ccache->creds; c != NULL; c = c->next) {
+	    match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
+	    if (match)
+		break;
+	}
     }
 
     if (match) {
@@ -662,17 +830,24 @@ kcm_ccache_retrieve_cred(krb5_context context,
 char *
 kcm_ccache_first_name(kcm_client *client)
 {
-    kcm_ccache p;
+    unsigned long newest = 0;
     char *name = NULL;
-
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
-
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if (kcm_is_same_session(client, p->uid, p->session))
-	    break;
+    kcm_ccache p;
+    size_t i;
+
+    /* the most recently created cache, as the head of the old list was */
+    for (i = 0; i < KCM_CCACHE_BUCKETS; i++) {
+	HEIMDAL_MUTEX_lock(&ccache_names[i].mutex);
+	for (p = ccache_names[i].head; p != NULL; p = p->next) {
+	    if (!kcm_is_same_session(client, p->uid, p->session))
+		continue;
+	    if (name == NULL || p->seq > newest) {
+		free(name);
+		name = strdup(p->name);
+		newest = p->seq;
+	    }
+	}
+	HEIMDAL_MUTEX_unlock(&ccache_names[i].mutex);
     }
-    if (p)
-	name = strdup(p->name);
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
     return name;
 }
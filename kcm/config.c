@@ -341,6 +341,8 @@ kcm_configure(int argc, char **argv)
     if (argc != 0)
 	usage(1);
 
+    kcm_ccache_init();
+
     {
 	char **files;
 
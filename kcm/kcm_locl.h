@@ -80,6 +80,7 @@ struct kcm_creds {
     kcmuuid_t uuid;
     krb5_creds cred;
     struct kcm_creds *next;
+    struct kcm_creds *index_next; /* same bucket of creds_index */
 };
 
 typedef struct kcm_ccache_data {
@@ -94,6 +95,9 @@ typedef struct kcm_ccache_data {
     krb5_principal client; /* primary client principal */
     krb5_principal server; /* primary server principal (TGS if NULL) */
     struct kcm_creds *creds;
+    struct kcm_creds **creds_index; /* by server principal */
+    size_t creds_index_size;
+    size_t ncreds;
     krb5_deltat tkt_life;
     krb5_deltat renew_life;
     int32_t kdc_offset;
@@ -102,7 +106,9 @@ typedef struct kcm_ccache_data {
 	krb5_keyblock keyblock;
     } key;
     HEIMDAL_MUTEX mutex;
-    struct kcm_ccache_data *next;
+    unsigned long seq; /* creation order */
+    struct kcm_ccache_data *next; /* same bucket of the name index */
+    struct kcm_ccache_data *uuid_next; /* same bucket of the uuid index */
 } kcm_ccache_data;
 
 #define KCM_ASSERT_VALID(_ccache)		do { \
@@ -987,6 +987,9 @@ kcm_op_move_cache(krb5_context context,
 	MOVE(newid, oldid, client);
 	MOVE(newid, oldid, server);
 	MOVE(newid, oldid, creds);
+	MOVE(newid, oldid, creds_index);
+	MOVE(newid, oldid, creds_index_size);
+	MOVE(newid, oldid, ncreds);
 	MOVE(newid, oldid, tkt_life);
 	MOVE(newid, oldid, renew_life);
 	MOVE(newid, oldid, key);
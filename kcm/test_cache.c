@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Drive the KCM operations through kcm_dispatch() and check that caches
+ * are found by name and by uuid, and credentials by server, as caches
+ * come and go.
+ */
+
+#include "kcm_locl.h"
+#include <getarg.h>
+
+krb5_context kcm_context = NULL;
+
+const char *service_name = "org.h5l.kcm.test";
+
+#define NCACHES	200
+#define NCREDS	100
+
+static kcm_client client;
+
+/* Send `request' (opcode and arguments) and return the reply's status */
+static krb5_error_code
+call(krb5_storage *request, krb5_storage **reply)
+{
+    krb5_error_code ret;
+    krb5_data req, resp;
+    int32_t status;
+
+    if (reply)
+	*reply = NULL;
+    ret = krb5_storage_to_data(request, &req);
+    krb5_storage_free(request);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "krb5_storage_to_data");
+    ret = kcm_dispatch(kcm_context, &client, &req, &resp);
+    krb5_data_free(&req);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "kcm_dispatch");
+    if (resp.length < 4)
+	krb5_errx(kcm_context, 1, "short reply");
+    request = krb5_storage_emem();
+    if (request == NULL ||
+	krb5_storage_write(request, resp.data, resp.length) !=
+	(krb5_ssize_t)resp.length ||
+	krb5_storage_seek(request, 0, SEEK_SET) != 0 ||
+	krb5_ret_int32(request, &status) != 0)
+	krb5_errx(kcm_context, 1, "out of memory");
+    krb5_data_free(&resp);
+    if (reply && status == 0)
+	*reply = request;
+    else
+	krb5_storage_free(request);
+    return status;
+}
+
+static krb5_storage *
+request(kcm_operation opcode, const char *name)
+{
+    krb5_storage *sp;
+
+    sp = krb5_storage_emem();
+    if (sp == NULL ||
+	krb5_store_uint16(sp, opcode) != 0 ||
+	(name && krb5_store_stringz(sp, name) != 0))
+	krb5_errx(kcm_context, 1, "out of memory");
+    return sp;
+}
+
+static char *
+gen_new(void)
+{
+    krb5_storage *reply;
+    krb5_error_code ret;
+    char *name;
+
+    ret = call(request(KCM_OP_GEN_NEW, NULL), &reply);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "gen_new");
+    if (krb5_ret_stringz(reply, &name) != 0)
+	krb5_errx(kcm_context, 1, "gen_new: no name");
+    krb5_storage_free(reply);
+    return name;
+}
+
+/* Look `name' up through the name index (RESOLVE is a no-op) */
+static krb5_error_code
+resolve(const char *name)
+{
+    return call(request(KCM_OP_GET_NAME, name), NULL);
+}
+
+static void
+initialize(const char *name, krb5_const_principal client_princ)
+{
+    krb5_storage *sp = request(KCM_OP_INITIALIZE, name);
+    krb5_error_code ret;
+
+    if (krb5_store_principal(sp, client_princ) != 0)
+	krb5_errx(kcm_context, 1, "out of memory");
+    ret = call(sp, NULL);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "initialize %s", name);
+}
+
+static krb5_error_code
+destroy(const char *name)
+{
+    return call(request(KCM_OP_DESTROY, name), NULL);
+}
+
+static krb5_error_code
+move(const char *from, const char *to)
+{
+    krb5_storage *sp = request(KCM_OP_MOVE_CACHE, from);
+
+    if (krb5_store_stringz(sp, to) != 0)
+	krb5_errx(kcm_context, 1, "out of memory");
+    return call(sp, NULL);
+}
+
+/* Return the uuid of the cache `name', found by scanning the uuid list */
+static void
+cache_uuid(const char *name, kcmuuid_t uuid)
+{
+    krb5_storage *reply, *sp;
+    krb5_error_code ret;
+    char *found;
+
+    ret = call(request(KCM_OP_GET_CACHE_UUID_LIST, NULL), &reply);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "get_cache_uuid_list");
+    while (krb5_storage_read(reply, uuid, sizeof(kcmuuid_t)) ==
+	   sizeof(kcmuuid_t)) {
+	sp = request(KCM_OP_GET_CACHE_BY_UUID, NULL);
+	krb5_storage_write(sp, uuid, sizeof(kcmuuid_t));
+	ret = call(sp, &sp);
+	if (ret)
+	    krb5_err(kcm_context, 1, ret, "get_cache_by_uuid");
+	if (krb5_ret_stringz(sp, &found) != 0)
+	    krb5_errx(kcm_context, 1, "get_cache_by_uuid: no name");
+	krb5_storage_free(sp);
+	if (strcmp(found, name) == 0) {
+	    free(found);
+	    krb5_storage_free(reply);
+	    return;
+	}
+	free(found);
+    }
+    krb5_errx(kcm_context, 1, "%s not in the uuid list", name);
+}
+
+static krb5_error_code
+by_uuid(const kcmuuid_t uuid, char **name)
+{
+    krb5_storage *sp = request(KCM_OP_GET_CACHE_BY_UUID, NULL);
+    krb5_error_code ret;
+
+    krb5_storage_write(sp, uuid, sizeof(kcmuuid_t));
+    ret = call(sp, &sp);
+    if (ret == 0) {
+	if (krb5_ret_stringz(sp, name) != 0)
+	    krb5_errx(kcm_context, 1, "get_cache_by_uuid: no name");
+	krb5_storage_free(sp);
+    }
+    return ret;
+}
+
+static void
+make_creds(krb5_const_principal client_princ, const char *server,
+	   int n, krb5_creds *creds)
+{
+    krb5_error_code ret;
+
+    memset(creds, 0, sizeof(*creds));
+    ret = krb5_copy_principal(kcm_context, client_princ, &creds->client);
+    if (ret == 0)
+	ret = krb5_parse_name(kcm_context, server, &creds->server);
+    if (ret == 0)
+	ret = krb5_data_alloc(&creds->ticket, sizeof(n));
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "make_creds");
+    memcpy(creds->ticket.data, &n, sizeof(n));
+}
+
+static void
+store(const char *name, krb5_creds *creds)
+{
+    krb5_storage *sp = request(KCM_OP_STORE, name);
+    krb5_error_code ret;
+
+    if (krb5_store_creds(sp, creds) != 0)
+	krb5_errx(kcm_context, 1, "out of memory");
+    ret = call(sp, NULL);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "store in %s", name);
+}
+
+/*
+ * Retrieve the creds for `server' and return the number they were made
+ * with, or -1 if there are none.
+ */
+static int
+retrieve(const char *name, const char *server, uint32_t which)
+{
+    krb5_storage *sp = request(KCM_OP_RETRIEVE, name);
+    krb5_error_code ret;
+    krb5_creds mcreds, creds;
+    int n;
+
+    memset(&mcreds, 0, sizeof(mcreds));
+    ret = krb5_parse_name(kcm_context, server, &mcreds.server);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "krb5_parse_name");
+    if (krb5_store_uint32(sp, which | KRB5_GC_CACHED) != 0 ||
+	krb5_store_creds_tag(sp, &mcreds) != 0)
+	krb5_errx(kcm_context, 1, "out of memory");
+    krb5_free_cred_contents(kcm_context, &mcreds);
+    ret = call(sp, &sp);
+    if (ret == KRB5_CC_END || ret == KRB5_CC_NOTFOUND)
+	return -1;
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "retrieve %s from %s", server, name);
+    if (krb5_ret_creds(sp, &creds) != 0)
+	krb5_errx(kcm_context, 1, "retrieve: no creds");
+    krb5_storage_free(sp);
+    if (creds.ticket.length != sizeof(n))
+	krb5_errx(kcm_context, 1, "retrieve %s: wrong ticket", server);
+    memcpy(&n, creds.ticket.data, sizeof(n));
+    krb5_free_cred_contents(kcm_context, &creds);
+    return n;
+}
+
+static krb5_error_code
+remove_cred(const char *name, const char *server, uint32_t which)
+{
+    krb5_storage *sp = request(KCM_OP_REMOVE_CRED, name);
+    krb5_error_code ret;
+    krb5_creds mcreds;
+
+    memset(&mcreds, 0, sizeof(mcreds));
+    ret = krb5_parse_name(kcm_context, server, &mcreds.server);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "krb5_parse_name");
+    if (krb5_store_uint32(sp, which) != 0 ||
+	krb5_store_creds_tag(sp, &mcreds) != 0)
+	krb5_errx(kcm_context, 1, "out of memory");
+    krb5_free_cred_contents(kcm_context, &mcreds);
+    return call(sp, NULL);
+}
+
+static void
+test_caches(krb5_const_principal princ)
+{
+    char *names[NCACHES], *name, *found;
+    kcmuuid_t uuids[NCACHES];
+    krb5_error_code ret;
+    size_t i, j;
+
+    /* gen_new names are unique and do not exist until initialized */
+    for (i = 0; i < NCACHES; i++) {
+	names[i] = gen_new();
+	for (j = 0; j < i; j++)
+	    if (strcmp(names[i], names[j]) == 0)
+		krb5_errx(kcm_context, 1, "gen_new returned %s twice",
+			  names[i]);
+	ret = resolve(names[i]);
+	if (ret != KRB5_FCC_NOFILE)
+	    krb5_errx(kcm_context, 1, "new cache %s resolves: %d",
+		      names[i], ret);
+	initialize(names[i], princ);
+    }
+
+    for (i = 0; i < NCACHES; i++) {
+	ret = resolve(names[i]);
+	if (ret)
+	    krb5_err(kcm_context, 1, ret, "resolve %s", names[i]);
+	cache_uuid(names[i], uuids[i]);
+    }
+
+    /* Destroy every other cache, the rest must stay */
+    for (i = 0; i < NCACHES; i += 2) {
+	ret = destroy(names[i]);
+	if (ret)
+	    krb5_err(kcm_context, 1, ret, "destroy %s", names[i]);
+	ret = destroy(names[i]);
+	if (ret != KRB5_FCC_NOFILE)
+	    krb5_errx(kcm_context, 1, "destroyed %s twice: %d",
+		      names[i], ret);
+    }
+    for (i = 0; i < NCACHES; i++) {
+	ret = resolve(names[i]);
+	if ((i % 2 == 0) != (ret == KRB5_FCC_NOFILE) || (i % 2 && ret))
+	    krb5_errx(kcm_context, 1, "resolve %s after destroy: %d",
+		      names[i], ret);
+	ret = by_uuid(uuids[i], &found);
+	if (i % 2 == 0) {
+	    if (ret == 0)
+		krb5_errx(kcm_context, 1, "destroyed %s found by uuid as %s",
+			  names[i], found);
+	    continue;
+	}
+	if (ret)
+	    krb5_err(kcm_context, 1, ret, "uuid of %s", names[i]);
+	if (strcmp(found, names[i]) != 0)
+	    krb5_errx(kcm_context, 1, "uuid of %s finds %s", names[i], found);
+	free(found);
+    }
+
+    /* Move each remaining cache to a new name, then onto the next one */
+    for (i = 1; i < NCACHES; i += 2) {
+	name = gen_new();
+	ret = move(names[i], name);
+	if (ret)
+	    krb5_err(kcm_context, 1, ret, "move %s to %s", names[i], name);
+	if (resolve(names[i]) != KRB5_FCC_NOFILE || resolve(name) != 0)
+	    krb5_errx(kcm_context, 1, "%s not moved to %s", names[i], name);
+	if (by_uuid(uuids[i], &found) == 0)
+	    krb5_errx(kcm_context, 1, "moved %s still found by uuid as %s",
+		      names[i], found);
+	free(names[i]);
+	names[i] = name;
+	cache_uuid(names[i], uuids[i]);
+    }
+    for (i = 1; i + 2 < NCACHES; i += 4) {
+	ret = move(names[i], names[i + 2]);
+	if (ret)
+	    krb5_err(kcm_context, 1, ret, "move %s to %s",
+		     names[i], names[i + 2]);
+	if (resolve(names[i]) != KRB5_FCC_NOFILE ||
+	    resolve(names[i + 2]) != 0)
+	    krb5_errx(kcm_context, 1, "%s not moved onto %s",
+		      names[i], names[i + 2]);
+	if (by_uuid(uuids[i], &found) == 0)
+	    krb5_errx(kcm_context, 1, "moved %s still found by uuid as %s",
+		      names[i], found);
+    }
+
+    for (i = 0; i < NCACHES; i++) {
+	(void) destroy(names[i]);
+	free(names[i]);
+    }
+}
+
+static void
+test_creds(krb5_const_principal princ)
+{
+    char server[64], *name, *name2;
+    krb5_error_code ret;
+    krb5_creds creds;
+    int i;
+
+    name = gen_new();
+    initialize(name, princ);
+
+    /* Enough creds for the index to grow a few times */
+    for (i = 0; i < NCREDS; i++) {
+	snprintf(server, sizeof(server), "host/h%d@TEST.H5L.SE", i);
+	make_creds(princ, server, i, &creds);
+	store(name, &creds);
+	krb5_free_cred_contents(kcm_context, &creds);
+    }
+    /* Same service in other realms, found after the first on any realm */
+    make_creds(princ, "host/h0@OTHER.H5L.SE", NCREDS, &creds);
+    store(name, &creds);
+    krb5_free_cred_contents(kcm_context, &creds);
+    make_creds(princ, "host/h0@TEST.H5L.SE", NCREDS + 1, &creds);
+    store(name, &creds);
+    krb5_free_cred_contents(kcm_context, &creds);
+
+    for (i = 0; i < NCREDS; i++) {
+	snprintf(server, sizeof(server), "host/h%d@TEST.H5L.SE", i);
+	if (retrieve(name, server, 0) != i)
+	    krb5_errx(kcm_context, 1, "retrieve %s", server);
+    }
+    if (retrieve(name, "host/h0@OTHER.H5L.SE", 0) != NCREDS)
+	krb5_errx(kcm_context, 1, "retrieve host/h0 in another realm");
+    if (retrieve(name, "host/h0@THIRD.H5L.SE", KRB5_TC_DONT_MATCH_REALM) != 0)
+	krb5_errx(kcm_context, 1, "retrieve host/h0 in any realm");
+    if (retrieve(name, "host/h0@THIRD.H5L.SE", 0) != -1)
+	krb5_errx(kcm_context, 1, "retrieve host/h0 in an unknown realm");
+    if (retrieve(name, "host/nosuch@TEST.H5L.SE", 0) != -1)
+	krb5_errx(kcm_context, 1, "retrieve an unknown server");
+
+    /* Remove the odd ones, and both host/h0@TEST.H5L.SE */
+    for (i = 1; i < NCREDS; i += 2) {
+	snprintf(server, sizeof(server), "host/h%d@TEST.H5L.SE", i);
+	ret = remove_cred(name, server, 0);
+	if (ret)
+	    krb5_err(kcm_context, 1, ret, "remove %s", server);
+	if (remove_cred(name, server, 0) == 0)
+	    krb5_errx(kcm_context, 1, "removed %s twice", server);
+    }
+    ret = remove_cred(name, "host/h0@TEST.H5L.SE", 0);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "remove host/h0");
+    for (i = 1; i < NCREDS; i++) {
+	snprintf(server, sizeof(server), "host/h%d@TEST.H5L.SE", i);
+	if (retrieve(name, server, 0) != (i % 2 ? -1 : i))
+	    krb5_errx(kcm_context, 1, "retrieve %s after removal", server);
+    }
+    if (retrieve(name, "host/h0@TEST.H5L.SE", 0) != -1)
+	krb5_errx(kcm_context, 1, "removed host/h0 still there");
+    if (retrieve(name, "host/h0@THIRD.H5L.SE", KRB5_TC_DONT_MATCH_REALM) !=
+	NCREDS)
+	krb5_errx(kcm_context, 1, "retrieve host/h0 in any realm "
+		  "after removal");
+
+    /* The index moves with the creds */
+    name2 = gen_new();
+    ret = move(name, name2);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "move %s to %s", name, name2);
+    for (i = 2; i < NCREDS; i += 2) {
+	snprintf(server, sizeof(server), "host/h%d@TEST.H5L.SE", i);
+	if (retrieve(name2, server, 0) != i)
+	    krb5_errx(kcm_context, 1, "retrieve %s after move", server);
+	ret = remove_cred(name2, server, 0);
+	if (ret)
+	    krb5_err(kcm_context, 1, ret, "remove %s after move", server);
+	if (retrieve(name2, server, 0) != -1)
+	    krb5_errx(kcm_context, 1, "removed %s still there", server);
+    }
+
+    ret = destroy(name2);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "destroy %s", name2);
+    free(name);
+    free(name2);
+}
+
+static int version_flag = 0;
+static int help_flag	= 0;
+
+static struct getargs args[] = {
+    {"version",	0,	arg_flag,	&version_flag,
+     "print version", NULL },
+    {"help",	0,	arg_flag,	&help_flag,
+     NULL, NULL }
+};
+
+static void
+usage (int ret)
+{
+    arg_printusage (args,
+		    sizeof(args)/sizeof(*args),
+		    NULL,
+		    "");
+    exit (ret);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_principal princ;
+    krb5_error_code ret;
+    int optidx = 0;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage (0);
+
+    if(version_flag){
+	print_version(NULL);
+	exit(0);
+    }
+
+    ret = krb5_init_context(&kcm_context);
+    if (ret)
+	errx (1, "krb5_init_context failed: %d", ret);
+
+    kcm_ccache_init();
+
+    client.pid = getpid();
+    client.uid = getuid();
+    client.gid = getgid();
+    client.session = -1;
+
+    ret = krb5_parse_name(kcm_context, "lha@TEST.H5L.SE", &princ);
+    if (ret)
+	krb5_err(kcm_context, 1, ret, "krb5_parse_name");
+
+    test_caches(princ);
+    test_creds(princ);
+
+    krb5_free_principal(kcm_context, princ);
+    krb5_free_context(kcm_context);
+
+    return 0;
+}
@@ -58,6 +58,16 @@ static int version_flag;
 /* Should we enable the HTTP hack? */
 int enable_http = -1;
 
+/* Should each worker get its own SO_REUSEPORT sockets? */
+int reuse_port = -1;
+
+/* Should workers be pinned to CPUs? */
+int pin_workers = -1;
+
+/* Number of request processing threads in each worker */
+int num_threads = -1;
+struct kdc_thread *kdc_threads;
+
 /* Log over requests to the KDC */
 const char *request_log;
 
@@ -94,6 +104,15 @@ static struct getargs args[] = {
     {	"ports",	'P', 	arg_string, rk_UNCONST(&port_str),
 	"ports to listen to", "portspec"
     },
+    {	"reuse-port",	0,	arg_flag, &reuse_port,
+	"give each worker process its own sockets", NULL
+    },
+    {	"pin-workers",	0,	arg_flag, &pin_workers,
+	"pin each worker process to a CPU", NULL
+    },
+    {	"threads",	0,	arg_integer, &num_threads,
+	"number of request processing threads per worker", "number"
+    },
     {
 	"detach",       0 ,      arg_flag, &detach_from_console,
 	"detach from console", NULL
@@ -133,6 +152,63 @@ usage(int ret)
     exit (ret);
 }
 
+#ifdef KDC_USE_THREADS
+
+/*
+ * The request processing threads each get their own context read from
+ * the same configuration files as the main one.  They are set up here
+ * since the files (and the master keys) may not be reachable once we
+ * chroot.
+ */
+
+static void
+init_thread_contexts(krb5_context context)
+{
+    krb5_error_code ret;
+    char **files;
+    int i;
+
+    kdc_threads = calloc(num_threads, sizeof(kdc_threads[0]));
+    if (kdc_threads == NULL)
+	krb5_errx(context, 1, "out of memory");
+
+    ret = krb5_prepend_config_files_default(config_file, &files);
+    if (ret)
+	krb5_err(context, 1, ret, "getting configuration files");
+
+    for (i = 0; i < num_threads; i++) {
+	krb5_context tc;
+
+	ret = krb5_init_context(&tc);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_init_context");
+	ret = krb5_set_config_files(tc, files);
+	if (ret)
+	    krb5_err(context, 1, ret, "reading configuration files");
+	ret = krb5_kt_register(tc, &hdb_get_kt_ops);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kt_register(HDB)");
+	kdc_threads[i].context = tc;
+    }
+    krb5_free_config_files(files);
+}
+
+static void
+init_thread_configs(krb5_context context, krb5_kdc_configuration *config)
+{
+    krb5_error_code ret;
+    int i;
+
+    for (i = 0; i < num_threads; i++) {
+	ret = krb5_kdc_copy_config(kdc_threads[i].context, config,
+				   &kdc_threads[i].config);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_copy_config");
+    }
+}
+
+#endif
+
 static void
 add_one_address (krb5_context context, const char *str, int first)
 {
@@ -264,6 +340,18 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 	enable_http = krb5_config_get_bool(context, NULL, "kdc",
 					   "enable-http", NULL);
 
+    if(reuse_port == -1)
+	reuse_port = krb5_config_get_bool_default(context, NULL, FALSE,
+						  "kdc", "reuse-port", NULL);
+
+    if(pin_workers == -1)
+	pin_workers = krb5_config_get_bool_default(context, NULL, FALSE,
+						   "kdc", "pin-workers", NULL);
+
+    if(num_threads == -1)
+	num_threads = krb5_config_get_int_default(context, NULL, 0,
+						  "kdc", "num-threads", NULL);
+
     if(request_log == NULL)
 	request_log = krb5_config_get_string(context, NULL,
 					     "kdc",
@@ -283,6 +371,12 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
     if (port_str == NULL)
 	port_str = "+";
 
+#ifdef KDC_USE_THREADS
+    /* before disable-des, a new context may enable weak crypto again */
+    if (num_threads > 0)
+	init_thread_contexts(context);
+#endif
+
     if(disable_des == -1)
 	disable_des = krb5_config_get_bool_default(context, NULL,
 						   FALSE,
@@ -301,5 +395,10 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 
     krb5_kdc_pkinit_config(context, config);
 
+#ifdef KDC_USE_THREADS
+    if (num_threads > 0)
+	init_thread_configs(context, config);
+#endif
+
     return config;
 }
@@ -33,6 +33,21 @@
 
 #include "kdc_locl.h"
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#define KDC_USE_EPOLL 1
+#elif defined(HAVE_POLL_H) && defined(HAVE_POLL)
+#define KDC_USE_POLL 1
+#endif
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
 /*
  * a tuple describing on what to listen
  */
@@ -233,7 +248,8 @@ reinit_descrs (struct descr *d, int n)
 static void
 init_socket(krb5_context context,
 	    krb5_kdc_configuration *config,
-	    struct descr *d, krb5_address *a, int family, int type, int port)
+	    struct descr *d, krb5_address *a, int family, int type, int port,
+	    int reuseport)
 {
     krb5_error_code ret;
     struct sockaddr_storage __ss;
@@ -265,6 +281,13 @@ init_socket(krb5_context context,
 	int one = 1;
 	setsockopt(d->s, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
     }
+#endif
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && defined(SO_REUSEPORT)
+    if (reuseport) {
+	int one = 1;
+	if (setsockopt(d->s, SOL_SOCKET, SO_REUSEPORT, (void *)&one, sizeof(one)))
+	    krb5_warn(context, errno, "setsockopt(SO_REUSEPORT)");
+    }
 #endif
     d->type = type;
     d->port = port;
@@ -295,13 +318,14 @@ init_socket(krb5_context context,
 
 /*
  * Allocate descriptors for all the sockets that we should listen on
- * and return the number of them.
+ * and return the number of them.  With `worker' >= 0 the sockets are
+ * SO_REUSEPORT sockets private to that worker.
  */
 
 static int
 init_sockets(krb5_context context,
 	     krb5_kdc_configuration *config,
-	     struct descr **desc)
+	     struct descr **desc, int worker)
 {
     krb5_error_code ret;
     size_t i, j;
@@ -325,7 +349,8 @@ init_sockets(krb5_context context,
     for (i = 0; i < num_ports; i++){
 	for (j = 0; j < addresses.len; ++j) {
 	    init_socket(context, config, &d[num], &addresses.val[j],
-			ports[i].family, ports[i].type, ports[i].port);
+			ports[i].family, ports[i].type, ports[i].port,
+			worker >= 0);
 	    if(d[num].s != rk_INVALID_SOCKET){
 		char a_str[80];
 		size_t len;
@@ -333,10 +358,11 @@ init_sockets(krb5_context context,
 		krb5_print_address (&addresses.val[j], a_str,
 				    sizeof(a_str), &len);
 
-		kdc_log(context, config, 5, "listening on %s port %u/%s",
-			a_str,
-			ntohs(ports[i].port),
-			(ports[i].type == SOCK_STREAM) ? "tcp" : "udp");
+		if (worker <= 0)
+		    kdc_log(context, config, 5, "listening on %s port %u/%s",
+			    a_str,
+			    ntohs(ports[i].port),
+			    (ports[i].type == SOCK_STREAM) ? "tcp" : "udp");
 		/* XXX */
 		num++;
 	    }
@@ -416,38 +442,303 @@ send_reply(krb5_context context,
 }
 
 /*
- * Handle the request in `buf, len' to socket `d'
+ * Process the request in `buf, len' from socket `d', the reply (if
+ * any) is returned in `reply'.
  */
 
 static void
-do_request(krb5_context context,
-	   krb5_kdc_configuration *config,
-	   void *buf, size_t len, krb5_boolean prependlength,
-	   struct descr *d)
+process_request(krb5_context context,
+		krb5_kdc_configuration *config,
+		void *buf, size_t len, krb5_boolean *prependlength,
+		struct descr *d, krb5_data *reply)
 {
     krb5_error_code ret;
-    krb5_data reply;
     int datagram_reply = (d->type == SOCK_DGRAM);
 
     krb5_kdc_update_time(NULL);
 
-    krb5_data_zero(&reply);
+    krb5_data_zero(reply);
     ret = krb5_kdc_process_request(context, config,
-				   buf, len, &reply, &prependlength,
+				   buf, len, reply, prependlength,
 				   d->addr_string, d->sa,
 				   datagram_reply);
     if(request_log)
-	krb5_kdc_save_request(context, request_log, buf, len, &reply, d->sa);
-    if(reply.length){
-	send_reply(context, config, prependlength, d, &reply);
-	krb5_data_free(&reply);
-    }
+	krb5_kdc_save_request(context, request_log, buf, len, reply, d->sa);
     if(ret)
 	kdc_log(context, config, 0,
 		"Failed processing %lu byte request from %s",
 		(unsigned long)len, d->addr_string);
 }
 
+/*
+ * Handle the request in `buf, len' to socket `d'
+ */
+
+static void
+do_request(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   void *buf, size_t len, krb5_boolean prependlength,
+	   struct descr *d)
+{
+    krb5_data reply;
+
+    process_request(context, config, buf, len, &prependlength, d, &reply);
+    if(reply.length){
+	send_reply(context, config, prependlength, d, &reply);
+	krb5_data_free(&reply);
+    }
+}
+
+static void
+clear_descr(struct descr *d)
+{
+    if(d->buf)
+	memset(d->buf, 0, d->size);
+    d->len = 0;
+    if(d->s != rk_INVALID_SOCKET)
+	rk_closesocket(d->s);
+    d->s = rk_INVALID_SOCKET;
+}
+
+#ifdef KDC_USE_THREADS
+
+/*
+ * Thread pool mode, see [kdc] num-threads.  The thread running loop()
+ * does all the socket I/O and queues complete requests as jobs.  The
+ * request processing threads take them off the queue in order, each
+ * using its own context and database handles (see kdc_threads), and
+ * put the replies on the `done' list.  A byte on the wakeup pipe tells
+ * the I/O thread to send them.
+ */
+
+#define KDC_MAX_QUEUED 1024
+
+struct kdc_job {
+    struct kdc_job *next;
+    struct descr d;		/* owns d.buf, and d.s for TCP */
+    krb5_boolean prependlength;
+    krb5_data reply;
+};
+
+struct kdc_events;
+
+struct kdc_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct kdc_job *head;
+    struct kdc_job **tail;
+    size_t queued;
+    struct kdc_job *done;
+    int shutdown;
+    int wakeup[2];
+    pthread_t *tids;
+    struct kdc_events *ev;
+};
+
+static struct kdc_pool *pool;
+
+static void events_del(struct kdc_events *, krb5_socket_t);
+
+static void
+job_free(struct kdc_job *job)
+{
+    if (job->d.buf) {
+	memset(job->d.buf, 0, job->d.size);
+	free(job->d.buf);
+    }
+    if (job->d.type == SOCK_STREAM && !rk_IS_BAD_SOCKET(job->d.s))
+	rk_closesocket(job->d.s);
+    krb5_data_free(&job->reply);
+    free(job);
+}
+
+static void *
+pool_thread(void *arg)
+{
+    struct kdc_thread *t = arg;
+    struct kdc_job *job;
+    int notify;
+    char c = 0;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->head == NULL && !pool->shutdown)
+	    pthread_cond_wait(&pool->cond, &pool->mutex);
+	job = pool->head;
+	if (job == NULL) {
+	    pthread_mutex_unlock(&pool->mutex);
+	    break;
+	}
+	pool->head = job->next;
+	if (pool->head == NULL)
+	    pool->tail = &pool->head;
+	pool->queued--;
+	pthread_mutex_unlock(&pool->mutex);
+
+	process_request(t->context, t->config, job->d.buf, job->d.len,
+			&job->prependlength, &job->d, &job->reply);
+
+	pthread_mutex_lock(&pool->mutex);
+	notify = (pool->done == NULL);
+	job->next = pool->done;
+	pool->done = job;
+	pthread_mutex_unlock(&pool->mutex);
+
+	/* the pipe is non-blocking, a full one has a wakeup pending */
+	if (notify)
+	    (void)write(pool->wakeup[1], &c, 1);
+    }
+    return NULL;
+}
+
+/*
+ * Queue the request in `buf, len' from `d'.  The job takes over
+ * `buf'; for TCP it is `d->buf' and the job takes over the connection
+ * too, leaving `d' free for the next one.
+ */
+
+static void
+pool_submit(krb5_context context, krb5_kdc_configuration *config,
+	    struct descr *d, unsigned char *buf, size_t len,
+	    krb5_boolean prependlength)
+{
+    struct kdc_job *job;
+
+    job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+	kdc_log(context, config, 0, "Failed to allocate %lu bytes",
+		(unsigned long)sizeof(*job));
+	goto drop;
+    }
+    job->d = *d;
+    job->d.sa = (struct sockaddr *)&job->d.__ss;
+    job->d.buf = buf;
+    job->d.len = len;
+    if (d->type != SOCK_STREAM)
+	job->d.size = len;
+    job->prependlength = prependlength;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->queued >= KDC_MAX_QUEUED) {
+	pthread_mutex_unlock(&pool->mutex);
+	free(job);
+	kdc_log(context, config, 1,
+		"Too many queued requests, dropping request from %s",
+		d->addr_string);
+	goto drop;
+    }
+    *pool->tail = job;
+    pool->tail = &job->next;
+    pool->queued++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (d->type == SOCK_STREAM) {
+	events_del(pool->ev, d->s);
+	init_descr(d);
+    }
+    return;
+
+ drop:
+    if (d->type == SOCK_STREAM)
+	clear_descr(d);
+    else
+	free(buf);
+}
+
+/*
+ * Send the replies the request processing threads are done with.
+ */
+
+static void
+pool_reply(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_job *job, *next;
+    char buf[64];
+
+    /* drain the pipe first so that no wakeup for a new reply is lost */
+    while (read(pool->wakeup[0], buf, sizeof(buf)) > 0)
+	;
+
+    pthread_mutex_lock(&pool->mutex);
+    job = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (; job; job = next) {
+	next = job->next;
+	if (job->reply.length)
+	    send_reply(context, config, job->prependlength,
+		       &job->d, &job->reply);
+	job_free(job);
+    }
+}
+
+static void
+pool_create(krb5_context context, krb5_kdc_configuration *config)
+{
+    sigset_t sigs, osigs;
+    int i, ret;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+	krb5_errx(context, 1, "malloc: out of memory");
+    pool->tids = calloc(num_threads, sizeof(pool->tids[0]));
+    if (pool->tids == NULL)
+	krb5_errx(context, 1, "malloc: out of memory");
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->tail = &pool->head;
+
+    if (pipe(pool->wakeup) == -1)
+	krb5_err(context, 1, errno, "pipe");
+    socket_set_nonblocking(pool->wakeup[0], 1);
+    socket_set_nonblocking(pool->wakeup[1], 1);
+
+    /* signals are for the I/O thread */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, &osigs);
+    for (i = 0; i < num_threads; i++) {
+	ret = pthread_create(&pool->tids[i], NULL, pool_thread,
+			     &kdc_threads[i]);
+	if (ret)
+	    krb5_err(context, 1, ret, "pthread_create");
+    }
+    pthread_sigmask(SIG_SETMASK, &osigs, NULL);
+
+    kdc_log(context, config, 0, "KDC worker started %d request threads",
+	    num_threads);
+}
+
+static void
+pool_destroy(void)
+{
+    struct kdc_job *job;
+    int i;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < num_threads; i++)
+	pthread_join(pool->tids[i], NULL);
+
+    while ((job = pool->done) != NULL) {
+	pool->done = job->next;
+	job_free(job);
+    }
+    close(pool->wakeup[0]);
+    close(pool->wakeup[1]);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->tids);
+    free(pool);
+    pool = NULL;
+}
+
+#endif /* KDC_USE_THREADS */
+
 /*
  * Handle incoming data to the UDP socket in `d'
  */
@@ -492,23 +783,211 @@ handle_udp(krb5_context context,
 	    send_reply(context, config, FALSE, d, &data);
 	    krb5_data_free(&data);
 	} else {
+#ifdef KDC_USE_THREADS
+	    if (pool) {
+		pool_submit(context, config, d, buf, n, FALSE);
+		return;
+	    }
+#endif
 	    do_request(context, config, buf, n, FALSE, d);
 	}
     }
     free (buf);
 }
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+
+/*
+ * Batched UDP: drain up to KDC_UDP_BATCH datagrams with one
+ * recvmmsg(), process them and send all replies with one sendmmsg().
+ * Falls back to handle_udp() if the kernel doesn't support them.
+ */
+
+#define KDC_UDP_BATCH 16
+
+struct udp_batch {
+    unsigned char *buf;
+    struct mmsghdr in[KDC_UDP_BATCH];
+    struct iovec in_iov[KDC_UDP_BATCH];
+    struct sockaddr_storage from[KDC_UDP_BATCH];
+    struct mmsghdr out[KDC_UDP_BATCH];
+    struct iovec out_iov[KDC_UDP_BATCH];
+    krb5_data reply[KDC_UDP_BATCH];
+};
+
+static struct udp_batch *udp_batch;
+static int udp_batch_disabled;
+
+/*
+ * How often, and for how many milliseconds each time, send_batch()
+ * waits for room in the socket buffer before it gives up on the rest
+ * of a batch.
+ */
+
+#define KDC_UDP_SEND_TRIES 3
+#define KDC_UDP_SEND_WAIT 100
+
+static int
+wait_writable(krb5_socket_t s)
+{
+#ifdef HAVE_POLL
+    struct pollfd pfd;
+
+    pfd.fd = s;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    return poll(&pfd, 1, KDC_UDP_SEND_WAIT) > 0;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * A full socket buffer (EAGAIN, ENOBUFS) holds up the whole batch, so
+ * wait for it to drain and send again.  Any other error is about the
+ * destination of the first unsent reply, which is skipped.
+ */
+
 static void
-clear_descr(struct descr *d)
+send_batch(krb5_context context, krb5_kdc_configuration *config,
+	   struct descr *d, struct udp_batch *b, unsigned int num)
 {
-    if(d->buf)
-	memset(d->buf, 0, d->size);
-    d->len = 0;
-    if(d->s != rk_INVALID_SOCKET)
-	rk_closesocket(d->s);
-    d->s = rk_INVALID_SOCKET;
+    unsigned int sent = 0;
+    int n, tries = 0;
+
+    while (sent < num) {
+	n = sendmmsg(d->s, &b->out[sent], num - sent, 0);
+	if (n < 0) {
+	    int save_errno = errno;
+
+	    if (save_errno == EINTR)
+		continue;
+	    if (save_errno == EAGAIN || save_errno == EWOULDBLOCK ||
+		save_errno == ENOBUFS) {
+		if (tries++ < KDC_UDP_SEND_TRIES && wait_writable(d->s))
+		    continue;
+		kdc_log(context, config, 0,
+			"sendmmsg: %s, dropping %u replies",
+			strerror(save_errno), num - sent);
+		return;
+	    }
+	    addr_to_string(context,
+			   (struct sockaddr *)b->out[sent].msg_hdr.msg_name,
+			   b->out[sent].msg_hdr.msg_namelen,
+			   d->addr_string, sizeof(d->addr_string));
+	    kdc_log(context, config, 0, "sendmmsg(%s): %s",
+		    d->addr_string, strerror(save_errno));
+	    /* skip the failing reply and keep going */
+	    n = 1;
+	}
+	sent += n;
+    }
 }
 
+static void
+handle_udp_batch(krb5_context context,
+		 krb5_kdc_configuration *config,
+		 struct descr *d)
+{
+    struct udp_batch *b = udp_batch;
+    unsigned int i, nout = 0;
+    int n;
+
+    if (udp_batch_disabled) {
+	handle_udp(context, config, d);
+	return;
+    }
+
+    if (b == NULL) {
+	b = calloc(1, sizeof(*b));
+	if (b == NULL || (b->buf = malloc(KDC_UDP_BATCH * max_request_udp)) == NULL) {
+	    free(b);
+	    kdc_log(context, config, 0, "Failed to allocate %lu bytes",
+		    (unsigned long)(KDC_UDP_BATCH * max_request_udp));
+	    handle_udp(context, config, d);
+	    return;
+	}
+	udp_batch = b;
+    }
+
+    for (i = 0; i < KDC_UDP_BATCH; i++) {
+	b->in_iov[i].iov_base = b->buf + i * max_request_udp;
+	b->in_iov[i].iov_len = max_request_udp;
+	memset(&b->in[i].msg_hdr, 0, sizeof(b->in[i].msg_hdr));
+	b->in[i].msg_hdr.msg_name = &b->from[i];
+	b->in[i].msg_hdr.msg_namelen = sizeof(b->from[i]);
+	b->in[i].msg_hdr.msg_iov = &b->in_iov[i];
+	b->in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    n = recvmmsg(d->s, b->in, KDC_UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+	if (errno == ENOSYS || errno == EOPNOTSUPP) {
+	    kdc_log(context, config, 0,
+		    "recvmmsg not supported, not batching UDP requests");
+	    udp_batch_disabled = 1;
+	    handle_udp(context, config, d);
+	} else if (rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EINTR)
+	    krb5_warn(context, rk_SOCK_ERRNO, "recvmmsg");
+	return;
+    }
+
+    for (i = 0; i < (unsigned int)n; i++) {
+	krb5_data *reply = &b->reply[nout];
+	krb5_boolean prependlength = FALSE;
+	size_t len = b->in[i].msg_len;
+
+	memcpy(d->sa, &b->from[i], b->in[i].msg_hdr.msg_namelen);
+	d->sock_len = b->in[i].msg_hdr.msg_namelen;
+	addr_to_string (context, d->sa, d->sock_len,
+			d->addr_string, sizeof(d->addr_string));
+
+	if (len == max_request_udp || (b->in[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+	    krb5_warnx(context,
+		       "recvmmsg: truncated packet from %s, asking for TCP",
+		       d->addr_string);
+	    krb5_data_zero(reply);
+	    krb5_mk_error(context,
+			  KRB5KRB_ERR_RESPONSE_TOO_BIG,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  reply);
+	} else {
+	    process_request(context, config, b->in_iov[i].iov_base, len,
+			    &prependlength, d, reply);
+	}
+	if (reply->length == 0)
+	    continue;
+
+	kdc_log(context, config, 5,
+		"sending %lu bytes to %s", (unsigned long)reply->length,
+		d->addr_string);
+	b->out_iov[nout].iov_base = reply->data;
+	b->out_iov[nout].iov_len = reply->length;
+	memset(&b->out[nout].msg_hdr, 0, sizeof(b->out[nout].msg_hdr));
+	b->out[nout].msg_hdr.msg_name = &b->from[i];
+	b->out[nout].msg_hdr.msg_namelen = d->sock_len;
+	b->out[nout].msg_hdr.msg_iov = &b->out_iov[nout];
+	b->out[nout].msg_hdr.msg_iovlen = 1;
+	nout++;
+    }
+
+    send_batch(context, config, d, b, nout);
+
+    for (i = 0; i < nout; i++)
+	krb5_data_free(&b->reply[i]);
+}
+
+#else
+
+#define handle_udp_batch handle_udp
+
+#endif
+
 
 /* remove HTTP %-quoting from buf */
 static int
@@ -553,7 +1032,7 @@ add_new_tcp (krb5_context context,
 	return;
     }
 
-#ifdef FD_SETSIZE
+#if !defined(KDC_USE_EPOLL) && !defined(KDC_USE_POLL) && defined(FD_SETSIZE)
     if (s >= FD_SETSIZE) {
 	krb5_warnx(context, "socket FD too large");
 	rk_closesocket (s);
@@ -825,6 +1304,12 @@ handle_tcp(krb5_context context,
     if (ret < 0)
 	return;
     else if (ret == 1) {
+#ifdef KDC_USE_THREADS
+	if (pool) {
+	    pool_submit(context, config, &d[idx], d[idx].buf, d[idx].len, TRUE);
+	    return;
+	}
+#endif
 	do_request(context, config,
 		   d[idx].buf, d[idx].len, TRUE, &d[idx]);
 	clear_descr(d + idx);
@@ -886,71 +1371,420 @@ next_min_free(krb5_context context, struct descr **d, unsigned int *ndescr)
     return min_free;
 }
 
+/*
+ * Readiness notification for our sockets.  We use epoll(7) where
+ * available and poll(2) otherwise; neither is limited by FD_SETSIZE.
+ * select(2) remains as a last resort for platforms that have
+ * neither.
+ *
+ * events_wait() returns the indices into `d' of the ready
+ * descriptors in ev->ready, -1 stands for the islive socket and -2
+ * for the wakeup pipe of the thread pool.
+ */
+
+#define KDC_MAX_EVENTS 64
+
+struct kdc_events {
+    int islive;
+    int wakeup;
+    int *ready;
+    size_t ready_size;
+#ifdef KDC_USE_EPOLL
+    int epfd;
+    struct epoll_event events[KDC_MAX_EVENTS];
+#elif defined(KDC_USE_POLL)
+    struct pollfd *pfds;
+#endif
+};
+
+static int
+events_grow(struct kdc_events *ev, size_t n)
+{
+    int *ready;
+
+    if (ev->ready_size >= n)
+	return 0;
+    ready = realloc(ev->ready, n * sizeof(ev->ready[0]));
+    if (ready == NULL)
+	return ENOMEM;
+    ev->ready = ready;
+    ev->ready_size = n;
+#ifdef KDC_USE_POLL
+    {
+	struct pollfd *pfds;
+
+	pfds = realloc(ev->pfds, n * sizeof(ev->pfds[0]));
+	if (pfds == NULL)
+	    return ENOMEM;
+	ev->pfds = pfds;
+    }
+#endif
+    return 0;
+}
+
+#ifdef KDC_USE_EPOLL
+static int
+epoll_add(int epfd, int fd, int idx)
+{
+    struct epoll_event e;
+
+    memset(&e, 0, sizeof(e));
+    e.events = EPOLLIN;
+    e.data.u64 = ((uint64_t)(unsigned int)fd << 32) | (uint32_t)idx;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
+}
+#endif
+
+/*
+ * Register the new socket `d[idx]', sockets are removed implicitly
+ * when they are closed.
+ */
+
 static void
-loop(krb5_context context, krb5_kdc_configuration *config,
-     struct descr *d, unsigned int ndescr, int islive)
+events_add(krb5_context context, struct kdc_events *ev,
+	   struct descr *d, int idx)
 {
+#ifdef KDC_USE_EPOLL
+    if (epoll_add(ev->epfd, d[idx].s, idx) == -1) {
+	krb5_warn(context, errno, "epoll_ctl");
+	clear_descr(&d[idx]);
+    }
+#endif
+}
 
-    while (exit_flag == 0) {
-	struct timeval tmout;
-	fd_set fds;
-	int min_free = -1;
-	int max_fd = 0;
-	size_t i;
-
-	FD_ZERO(&fds);
-        if (islive > -1) {
-            FD_SET(islive, &fds);
-            max_fd = islive;
-        }
-	for (i = 0; i < ndescr; i++) {
-	    if (!rk_IS_BAD_SOCKET(d[i].s)) {
-		if (d[i].type == SOCK_STREAM &&
-		   d[i].timeout && d[i].timeout < time(NULL)) {
-		    kdc_log(context, config, 1,
-			    "TCP-connection from %s expired after %lu bytes",
-			    d[i].addr_string, (unsigned long)d[i].len);
-		    clear_descr(&d[i]);
-		    continue;
-		}
+#ifdef KDC_USE_THREADS
+/*
+ * Unregister a socket that stays open but is no longer in `d'.
+ */
+
+static void
+events_del(struct kdc_events *ev, krb5_socket_t s)
+{
+#ifdef KDC_USE_EPOLL
+    epoll_ctl(ev->epfd, EPOLL_CTL_DEL, s, NULL);
+#endif
+}
+#endif
+
+static void
+events_init(krb5_context context, struct kdc_events *ev,
+	    struct descr *d, unsigned int ndescr, int islive, int wakeup)
+{
+    unsigned int i;
+
+    memset(ev, 0, sizeof(*ev));
+    ev->islive = islive;
+    ev->wakeup = wakeup;
+
+    if (events_grow(ev, KDC_MAX_EVENTS))
+	krb5_errx(context, 1, "malloc: out of memory");
+
+#ifdef KDC_USE_EPOLL
+    ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev->epfd == -1)
+	krb5_err(context, 1, errno, "epoll_create1");
+    if (islive > -1 && epoll_add(ev->epfd, islive, -1) == -1)
+	krb5_err(context, 1, errno, "epoll_ctl");
+    if (wakeup > -1 && epoll_add(ev->epfd, wakeup, -2) == -1)
+	krb5_err(context, 1, errno, "epoll_ctl");
+#endif
+
+    for (i = 0; i < ndescr; i++)
+	if (!rk_IS_BAD_SOCKET(d[i].s))
+	    events_add(context, ev, d, i);
+}
+
+static void
+events_free(struct kdc_events *ev)
+{
+#ifdef KDC_USE_EPOLL
+    close(ev->epfd);
+#elif defined(KDC_USE_POLL)
+    free(ev->pfds);
+#endif
+    free(ev->ready);
+}
+
+static int
+events_wait(krb5_context context, struct kdc_events *ev,
+	    struct descr *d, unsigned int ndescr, int timeout)
+{
+#ifdef KDC_USE_EPOLL
+    int i, n, num = 0;
+
+    n = epoll_wait(ev->epfd, ev->events, KDC_MAX_EVENTS, timeout);
+    for (i = 0; i < n; i++) {
+	int idx = (int)(uint32_t)ev->events[i].data.u64;
+	int fd = (int)(ev->events[i].data.u64 >> 32);
+
+	/* skip events for sockets that were closed and reused */
+	if (idx >= 0 && ((unsigned int)idx >= ndescr || d[idx].s != fd))
+	    continue;
+	ev->ready[num++] = idx;
+    }
+    return n < 0 ? -1 : num;
+#elif defined(KDC_USE_POLL)
+    unsigned int i;
+    nfds_t nfds = 0;
+    int n, num = 0;
+
+    if (events_grow(ev, ndescr + 2)) {
+	errno = ENOMEM;
+	return -1;
+    }
+    if (ev->islive > -1) {
+	ev->pfds[nfds].fd = ev->islive;
+	ev->pfds[nfds].events = POLLIN;
+	nfds++;
+    }
+    if (ev->wakeup > -1) {
+	ev->pfds[nfds].fd = ev->wakeup;
+	ev->pfds[nfds].events = POLLIN;
+	nfds++;
+    }
+    for (i = 0; i < ndescr; i++) {
+	ev->pfds[nfds].fd = rk_IS_BAD_SOCKET(d[i].s) ? -1 : d[i].s;
+	ev->pfds[nfds].events = POLLIN;
+	nfds++;
+    }
+
+    n = poll(ev->pfds, nfds, timeout);
+    if (n <= 0)
+	return n;
+
+    nfds = 0;
+    if (ev->islive > -1 && ev->pfds[nfds++].revents)
+	ev->ready[num++] = -1;
+    if (ev->wakeup > -1 && ev->pfds[nfds++].revents)
+	ev->ready[num++] = -2;
+    for (i = 0; i < ndescr; i++, nfds++)
+	if (ev->pfds[nfds].fd != -1 && ev->pfds[nfds].revents)
+	    ev->ready[num++] = i;
+    return num;
+#else
+    struct timeval tmout;
+    unsigned int i;
+    int max_fd = 0;
+    int n, num = 0;
+    fd_set fds;
+
+    if (events_grow(ev, ndescr + 2)) {
+	errno = ENOMEM;
+	return -1;
+    }
+
+    FD_ZERO(&fds);
+    if (ev->islive > -1) {
+	FD_SET(ev->islive, &fds);
+	max_fd = ev->islive;
+    }
+    if (ev->wakeup > -1) {
+	FD_SET(ev->wakeup, &fds);
+	max_fd = max(max_fd, ev->wakeup);
+    }
+    for (i = 0; i < ndescr; i++) {
+	if (rk_IS_BAD_SOCKET(d[i].s))
+	    continue;
 #ifndef NO_LIMIT_FD_SETSIZE
-		if (max_fd < d[i].s)
-		    max_fd = d[i].s;
+	if (max_fd < d[i].s)
+	    max_fd = d[i].s;
 #ifdef FD_SETSIZE
-		if (max_fd >= FD_SETSIZE)
-		    krb5_errx(context, 1, "fd too large");
+	if (max_fd >= FD_SETSIZE)
+	    krb5_errx(context, 1, "fd too large");
 #endif
 #endif
-		FD_SET(d[i].s, &fds);
+	FD_SET(d[i].s, &fds);
+    }
+
+    tmout.tv_sec = timeout / 1000;
+    tmout.tv_usec = (timeout % 1000) * 1000;
+    n = select(max_fd + 1, &fds, 0, 0, &tmout);
+    if (n <= 0)
+	return n;
+
+    if (ev->islive > -1 && FD_ISSET(ev->islive, &fds))
+	ev->ready[num++] = -1;
+    if (ev->wakeup > -1 && FD_ISSET(ev->wakeup, &fds))
+	ev->ready[num++] = -2;
+    for (i = 0; i < ndescr; i++)
+	if (!rk_IS_BAD_SOCKET(d[i].s) && FD_ISSET(d[i].s, &fds))
+	    ev->ready[num++] = i;
+    return num;
+#endif
+}
+
+/*
+ * Timer wheel for the TCP connection timeouts, with one slot per
+ * second.  Slots hold indices into `d'; entries for connections that
+ * were closed are dropped lazily when their slot comes up, so closing
+ * a connection needs no bookkeeping.  If the descriptor was reused
+ * since, the new connection was added to the slot of its own timeout
+ * and the old entry is dropped as well unless that is the same slot.
+ */
+
+#define TIMER_SLOTS (TCP_TIMEOUT + 2)
+
+struct kdc_timers {
+    time_t next;	/* first second not yet expired */
+    size_t pending;
+    struct {
+	int *idx;
+	size_t len;
+	size_t size;
+    } slots[TIMER_SLOTS];
+};
+
+static void
+timers_init(struct kdc_timers *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->next = time(NULL);
+}
+
+static void
+timers_free(struct kdc_timers *t)
+{
+    size_t i;
+
+    for (i = 0; i < TIMER_SLOTS; i++)
+	free(t->slots[i].idx);
+}
+
+static void
+timer_add(krb5_context context, struct kdc_timers *t,
+	  struct descr *d, int idx)
+{
+    size_t s = d[idx].timeout % TIMER_SLOTS;
+
+    if (t->slots[s].len == t->slots[s].size) {
+	size_t size = t->slots[s].size ? t->slots[s].size * 2 : 16;
+	int *tmp;
+
+	tmp = realloc(t->slots[s].idx, size * sizeof(tmp[0]));
+	if (tmp == NULL) {
+	    krb5_warnx(context, "No memory");
+	    clear_descr(&d[idx]);
+	    return;
+	}
+	t->slots[s].idx = tmp;
+	t->slots[s].size = size;
+    }
+    t->slots[s].idx[t->slots[s].len++] = idx;
+    t->pending++;
+}
+
+static void
+timers_expire(krb5_context context, krb5_kdc_configuration *config,
+	      struct kdc_timers *t, struct descr *d, unsigned int ndescr,
+	      time_t now)
+{
+    size_t i, j, s;
+
+    if (now - t->next > TIMER_SLOTS)
+	t->next = now - TIMER_SLOTS;
+
+    for (; t->next < now; t->next++) {
+	s = t->next % TIMER_SLOTS;
+	for (i = j = 0; i < t->slots[s].len; i++) {
+	    int idx = t->slots[s].idx[i];
+
+	    if ((unsigned int)idx >= ndescr || rk_IS_BAD_SOCKET(d[idx].s) ||
+		d[idx].timeout == 0 || d[idx].timeout % TIMER_SLOTS != s)
+		continue;
+	    if (d[idx].timeout < now) {
+		kdc_log(context, config, 1,
+			"TCP-connection from %s expired after %lu bytes",
+			d[idx].addr_string, (unsigned long)d[idx].len);
+		clear_descr(&d[idx]);
+		continue;
 	    }
+	    t->slots[s].idx[j++] = idx;
 	}
+	t->pending -= i - j;
+	t->slots[s].len = j;
+    }
+}
 
-	tmout.tv_sec = TCP_TIMEOUT;
-	tmout.tv_usec = 0;
-	switch(select(max_fd + 1, &fds, 0, 0, &tmout)){
-	case 0:
-	    break;
-	case -1:
-	    if (errno != EINTR)
-		krb5_warn(context, rk_SOCK_ERRNO, "select");
-	    break;
-	default:
+static void
+loop(krb5_context context, krb5_kdc_configuration *config,
+     struct descr *d, unsigned int ndescr, int islive)
+{
+    struct kdc_events ev;
+    struct kdc_timers timers;
+    int wakeup = -1;
+
+#ifdef KDC_USE_THREADS
+    if (num_threads > 0) {
+	pool_create(context, config);
+	wakeup = pool->wakeup[0];
+    }
+#endif
+
+    events_init(context, &ev, d, ndescr, islive, wakeup);
+    timers_init(&timers);
+#ifdef KDC_USE_THREADS
+    if (pool)
+	pool->ev = &ev;
+#endif
+
+    while (exit_flag == 0) {
+	int min_free;
+	int i, n;
+
+	n = events_wait(context, &ev, d, ndescr,
+			timers.pending ? 1000 : TCP_TIMEOUT * 1000);
+	if (n < 0 && rk_SOCK_ERRNO != EINTR)
+	    krb5_warn(context, rk_SOCK_ERRNO, "waiting for requests");
+
+	for (i = 0; i < n; i++) {
+	    int idx = ev.ready[i];
+
+	    if (idx == -1) {
 #ifdef HAVE_FORK
-	    if (islive > -1 && FD_ISSET(islive, &fds))
 		handle_islive(islive);
 #endif
-	    for (i = 0; i < ndescr; i++)
-		if (!rk_IS_BAD_SOCKET(d[i].s) && FD_ISSET(d[i].s, &fds)) {
-		    min_free = next_min_free(context, &d, &ndescr);
-
-		    if (d[i].type == SOCK_DGRAM)
-			handle_udp(context, config, &d[i]);
-		    else if (d[i].type == SOCK_STREAM)
-			handle_tcp(context, config, d, i, min_free);
+		continue;
+	    }
+#ifdef KDC_USE_THREADS
+	    if (idx == -2) {
+		pool_reply(context, config);
+		continue;
+	    }
+#endif
+	    if (rk_IS_BAD_SOCKET(d[idx].s))
+		continue;
+
+	    if (d[idx].type == SOCK_DGRAM) {
+#ifdef KDC_USE_THREADS
+		/* batching is for processing in this thread */
+		if (pool)
+		    handle_udp(context, config, &d[idx]);
+		else
+#endif
+		handle_udp_batch(context, config, &d[idx]);
+	    } else if (d[idx].type == SOCK_STREAM && d[idx].timeout == 0) {
+		/* listening socket, accept into a free slot */
+		min_free = next_min_free(context, &d, &ndescr);
+		handle_tcp(context, config, d, idx, min_free);
+		if (min_free != -1 && !rk_IS_BAD_SOCKET(d[min_free].s)) {
+		    events_add(context, &ev, d, min_free);
+		    timer_add(context, &timers, d, min_free);
 		}
+	    } else if (d[idx].type == SOCK_STREAM) {
+		handle_tcp(context, config, d, idx, -1);
+	    }
 	}
+
+	timers_expire(context, config, &timers, d, ndescr, time(NULL));
     }
 
+#ifdef KDC_USE_THREADS
+    if (pool)
+	pool_destroy();
+#endif
+    timers_free(&timers);
+    events_free(&ev);
+
     switch (exit_flag) {
     case -1:
 	kdc_log(context, config, 0,
@@ -1083,6 +1917,60 @@ select_sleep(int microseconds)
     tv.tv_usec = microseconds % 1000000;
     select(0, NULL, NULL, NULL, &tv);
 }
+
+/*
+ * Close the per-worker sockets of all workers but `worker'.
+ */
+
+static void
+close_other_workers(struct descr **wd, unsigned int *wndescr,
+		    int max_kdcs, int worker)
+{
+    unsigned int j;
+    int i;
+
+    for (i = 0; i < max_kdcs; i++) {
+	if (i == worker)
+	    continue;
+	for (j = 0; j < wndescr[i]; j++)
+	    clear_descr(&wd[i][j]);
+    }
+}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+/*
+ * Pin worker `worker' to one of the CPUs we are allowed to run on,
+ * round-robin.
+ */
+
+static void
+pin_worker(krb5_context context, krb5_kdc_configuration *config, int worker)
+{
+    cpu_set_t allowed, set;
+    int cpu, n;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+	kdc_log(context, config, 0, "sched_getaffinity: %s", strerror(errno));
+	return;
+    }
+    n = CPU_COUNT(&allowed);
+    if (n < 1)
+	return;
+    n = worker % n;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+	    break;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+	kdc_log(context, config, 0, "sched_setaffinity(%d): %s",
+		cpu, strerror(errno));
+    else
+	kdc_log(context, config, 3, "KDC worker process %d pinned to CPU %d",
+		(int)getpid(), cpu);
+}
+#endif
 #endif
 
 void
@@ -1091,10 +1979,12 @@ start_kdc(krb5_context context,
 {
     struct timeval tv1;
     struct timeval tv2;
-    struct descr *d;
-    unsigned int ndescr;
+    struct descr *d = NULL;
+    unsigned int ndescr = 0;
     pid_t pid;
 #ifdef HAVE_FORK
+    struct descr **wd = NULL;
+    unsigned int *wndescr = NULL;
     pid_t *pids;
     int max_kdcs = config->num_kdc_processes;
     int num_kdcs = 0;
@@ -1132,9 +2022,47 @@ start_kdc(krb5_context context,
     socket_set_nonblocking(islive[1], 1);
 #endif
 
-    ndescr = init_sockets(context, config, &d);
-    if(ndescr <= 0)
-	krb5_errx(context, 1, "No sockets!");
+#ifdef HAVE_FORK
+# ifdef SO_REUSEPORT
+    /*
+     * Give every worker its own set of SO_REUSEPORT sockets so that
+     * the kernel spreads requests over them instead of waking up
+     * every worker for each packet.  They are created here, while we
+     * can still bind privileged ports, and survive worker restarts.
+     */
+    if (reuse_port > 0) {
+	wd = calloc(max_kdcs, sizeof(*wd));
+	wndescr = calloc(max_kdcs, sizeof(*wndescr));
+	if (wd == NULL || wndescr == NULL)
+	    krb5_err(context, 1, errno, "malloc");
+	for (i = 0; i < max_kdcs; i++) {
+	    wndescr[i] = init_sockets(context, config, &wd[i], i);
+	    if (wndescr[i] <= 0)
+		krb5_errx(context, 1, "No sockets!");
+	}
+    }
+# else
+    if (reuse_port > 0)
+	kdc_log(context, config, 0,
+		"SO_REUSEPORT not supported, workers share their sockets");
+# endif
+# ifndef KDC_USE_THREADS
+    if (num_threads > 0)
+	kdc_log(context, config, 0,
+		"Threads not supported, processing requests in the workers");
+# endif
+# ifndef HAVE_SCHED_SETAFFINITY
+    if (pin_workers > 0)
+	kdc_log(context, config, 0,
+		"Pinning worker processes to CPUs not supported");
+# endif
+    if (wd == NULL)
+#endif
+    {
+	ndescr = init_sockets(context, config, &d, -1);
+	if(ndescr <= 0)
+	    krb5_errx(context, 1, "No sockets!");
+    }
 
 #ifdef HAVE_FORK
 
@@ -1176,10 +2104,23 @@ start_kdc(krb5_context context,
 	if (num_kdcs > 0)
 	    num_kdcs -= reap_kids(context, config, pids, max_kdcs);
 
+	for (i = 0; i < max_kdcs; i++)
+	    if (pids[i] <= 0)
+		break;
+
 	pid = fork();
 	switch (pid) {
 	case 0:
 	    close(islive[0]);
+	    if (wd) {
+		close_other_workers(wd, wndescr, max_kdcs, i);
+		d = wd[i];
+		ndescr = wndescr[i];
+	    }
+#ifdef HAVE_SCHED_SETAFFINITY
+	    if (pin_workers > 0)
+		pin_worker(context, config, i);
+#endif
 	    loop(context, config, d, ndescr, islive[1]);
 	    exit(0);
 	case -1:
@@ -1189,9 +2130,6 @@ start_kdc(krb5_context context,
 	    sleep(10);
 	    break;
 	default:
-	    for (i=0; i < max_kdcs; i++)
-		if (pids[i] == 0)
-		    break;
 	    pids[i] = pid;
 	    kdc_log(context, config, 0, "KDC worker process started: %d", pid);
 	    num_kdcs++;
@@ -1208,6 +2146,13 @@ start_kdc(krb5_context context,
     /* Close our listener sockets before terminating workers */
     for (i = 0; i < ndescr; ++i)
         clear_descr(&d[i]);
+    if (wd) {
+	close_other_workers(wd, wndescr, max_kdcs, -1);
+	for (i = 0; i < max_kdcs; i++)
+	    free(wd[i]);
+	free(wd);
+	free(wndescr);
+    }
 
     gettimeofday(&tv1, NULL);
     tv2 = tv1;
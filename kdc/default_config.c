@@ -65,12 +65,29 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
     c->pkinit_require_binding = TRUE;
     c->db = NULL;
     c->num_db = 0;
+    c->keep_db_open = FALSE;
+    c->entry_cache_size = 0;
+    c->entry_cache_lifetime = 60;
     c->logf = NULL;
 
     c->num_kdc_processes =
         krb5_config_get_int_default(context, NULL, c->num_kdc_processes,
 				    "kdc", "num-kdc-processes", NULL);
 
+    c->keep_db_open =
+	krb5_config_get_bool_default(context, NULL,
+				     c->keep_db_open,
+				     "kdc", "keep-db-open", NULL);
+
+    c->entry_cache_size =
+	krb5_config_get_int_default(context, NULL,
+				    c->entry_cache_size,
+				    "kdc", "entry-cache-size", NULL);
+    c->entry_cache_lifetime =
+	krb5_config_get_time_default(context, NULL,
+				     c->entry_cache_lifetime,
+				     "kdc", "entry-cache-lifetime", NULL);
+
     c->require_preauth =
 	krb5_config_get_bool_default(context, NULL,
 				     c->require_preauth,
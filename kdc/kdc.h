@@ -44,6 +44,9 @@
 #include <hdb.h>
 #include <krb5.h>
 
+struct kdc_db_handle;
+struct kdc_entry_cache;
+
 enum krb5_kdc_trpolicy {
     TRPOLICY_ALWAYS_CHECK,
     TRPOLICY_ALLOW_PER_PRINCIPAL,
@@ -57,6 +60,14 @@ typedef struct krb5_kdc_configuration {
     struct HDB **db;
     int num_db;
 
+    krb5_boolean keep_db_open; /* keep HDB handles open across requests */
+    struct kdc_db_handle *db_handles;
+    int num_db_handles;
+
+    int entry_cache_size; /* max number of cached hdb entries, 0 disables */
+    time_t entry_cache_lifetime;
+    struct kdc_entry_cache *entry_cache;
+
     int num_kdc_processes;
 
     krb5_boolean encode_as_rep_as_tgs_rep; /* bug compatibility */
@@ -40,6 +40,10 @@
 
 #include "headers.h"
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#define KDC_USE_THREADS 1
+#endif
+
 typedef struct pk_client_params pk_client_params;
 struct DigestREQ;
 struct Kx509Request;
@@ -98,6 +102,17 @@ extern const char *port_str;
 extern krb5_addresses explicit_addresses;
 
 extern int enable_http;
+extern int reuse_port;
+extern int pin_workers;
+extern int num_threads;
+
+/* Per request processing thread state, see [kdc] num-threads */
+struct kdc_thread {
+    krb5_context context;
+    krb5_kdc_configuration *config;
+};
+
+extern struct kdc_thread *kdc_threads;
 
 extern int detach_from_console;
 extern int daemon_child;
@@ -107,7 +122,7 @@ extern const struct units _kdc_digestunits[];
 
 #define KDC_LOG_FILE		"kdc.log"
 
-extern struct timeval _kdc_now;
+extern HEIMDAL_THREAD_LOCAL struct timeval _kdc_now;
 #define kdc_time (_kdc_now.tv_sec)
 
 extern char *runas_string;
@@ -323,6 +323,8 @@ pa_pkinit_validate(kdc_request_t r, const PA_DATA *pa)
     char *client_cert = NULL;
     krb5_error_code ret;
 
+    _kdc_pk_lock();
+
     ret = _kdc_pk_rd_padata(r->context, r->config, &r->req, pa, r->client, &pkp);
     if (ret || pkp == NULL) {
 	ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
@@ -361,6 +363,7 @@ pa_pkinit_validate(kdc_request_t r, const PA_DATA *pa)
  out:
     if (pkp)
 	_kdc_pk_free_client_param(r->context, pkp);
+    _kdc_pk_unlock();
 
     return ret;
 }
@@ -33,7 +33,511 @@
 
 #include "kdc_locl.h"
 
-struct timeval _kdc_now;
+HEIMDAL_THREAD_LOCAL struct timeval _kdc_now;
+
+/*
+ * State for the HDB handles used by _kdc_db_fetch().  When
+ * keep-db-open or the entry cache is enabled we track the identity
+ * of the database file and of its iprop log; any change (hprop/iprop
+ * replacing the database, kadmind or ipropd-slave modifying it) bumps
+ * the generation, which reopens persistent handles, and changes the
+ * fingerprint of the files, which flushes the entry cache.  The files
+ * are looked at no more than once a second.
+ */
+
+/* The database file is one of the first three, the iprop log the last */
+#define KDC_DB_FILES	4
+#define KDC_DB_LOG	(KDC_DB_FILES - 1)
+
+struct kdc_file_id {
+    int valid;
+    int racy;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+struct kdc_db_handle {
+    int openp;
+    unsigned long generation;
+    unsigned long open_generation;
+    time_t checked;			/* when the files were last stat()ed */
+    char *files[KDC_DB_FILES];
+    int db_file;			/* which of files[] the database was */
+    struct kdc_file_id db;
+    struct kdc_file_id log;
+};
+
+struct kdc_cache_entry {
+    struct kdc_cache_entry *next;
+    struct kdc_cache_entry *lru_prev;
+    struct kdc_cache_entry *lru_next;
+    unsigned hash;
+    int db;
+    unsigned flags;
+    krb5_kvno kvno;
+    krb5_principal principal;
+    time_t expires;
+    hdb_entry_ex entry;
+};
+
+struct kdc_entry_cache {
+    HEIMDAL_MUTEX mutex;
+    struct kdc_cache_entry **buckets;
+    size_t num_buckets;			/* power of two */
+    size_t num_entries;
+    struct kdc_cache_entry *lru_head;
+    struct kdc_cache_entry *lru_tail;
+    unsigned long generation;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+/*
+ * Returns 1 if the file changed since the last call (or can't be
+ * trusted not to have), 0 otherwise.  `sb' is NULL if the file
+ * doesn't exist.
+ */
+
+static int
+file_id_update(struct kdc_file_id *id, const struct stat *sb)
+{
+    if (sb == NULL) {
+	if (!id->valid)
+	    return 0;
+	memset(id, 0, sizeof(*id));
+	return 1;
+    }
+
+    if (id->valid && !id->racy && id->dev == sb->st_dev &&
+	id->ino == sb->st_ino && id->size == sb->st_size &&
+	id->mtime == sb->st_mtime)
+	return 0;
+
+    id->valid = 1;
+    id->dev = sb->st_dev;
+    id->ino = sb->st_ino;
+    id->size = sb->st_size;
+    id->mtime = sb->st_mtime;
+    /*
+     * A write in the same second as our stat() would not be visible
+     * in the mtime, so don't trust it until it is older.
+     */
+    id->racy = (sb->st_mtime >= time(NULL));
+    return 1;
+}
+
+static int
+db_tracking(krb5_kdc_configuration *config)
+{
+    return config->keep_db_open || config->entry_cache_size > 0;
+}
+
+static int
+db_persistent(krb5_kdc_configuration *config, int i)
+{
+    return config->keep_db_open &&
+	(config->db[i]->hdb_capability_flags & HDB_CAP_F_KEEP_OPEN);
+}
+
+static struct kdc_db_handle *
+db_handle(krb5_kdc_configuration *config, int i)
+{
+    struct kdc_db_handle *h;
+
+    if (!db_tracking(config))
+	return NULL;
+
+    if (config->num_db_handles < config->num_db) {
+	h = realloc(config->db_handles, config->num_db * sizeof(*h));
+	if (h == NULL)
+	    return NULL;
+	memset(&h[config->num_db_handles], 0,
+	       (config->num_db - config->num_db_handles) * sizeof(*h));
+	config->db_handles = h;
+	config->num_db_handles = config->num_db;
+    }
+    return &config->db_handles[i];
+}
+
+static int
+db_files(struct kdc_db_handle *h, HDB *db)
+{
+    static const char *suffixes[KDC_DB_FILES] = { ".mdb", ".db", "", ".log" };
+    int k;
+
+    if (h->files[0])
+	return 0;
+    for (k = 0; k < KDC_DB_FILES; k++) {
+	if (asprintf(&h->files[k], "%s%s", db->hdb_name, suffixes[k]) == -1) {
+	    while (k-- > 0) {
+		free(h->files[k]);
+		h->files[k] = NULL;
+	    }
+	    return ENOMEM;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Check whether database `i' changed.  The database file is named
+ * after the backend (".mdb" for LMDB, ".db" for Berkeley DB, the
+ * plain name for sqlite); backends without a file (ldap) only ever
+ * get invalidated through their iprop log, if any.
+ *
+ * A change in the same second as the last check is picked up in the
+ * next second; until then file_id_update() has the file marked racy.
+ */
+
+static void
+db_check(krb5_kdc_configuration *config, int i)
+{
+    struct kdc_db_handle *h;
+    struct stat sb;
+    int changed, found;
+    time_t now;
+    int k;
+
+    h = db_handle(config, i);
+    if (h == NULL)
+	return;
+
+    now = time(NULL);
+    if (h->checked == now || db_files(h, config->db[i]))
+	return;
+    h->checked = now;
+
+    /* the file we found last time is almost certainly still it */
+    found = (stat(h->files[h->db_file], &sb) == 0);
+    for (k = 0; !found && k < KDC_DB_LOG; k++) {
+	if (k != h->db_file && stat(h->files[k], &sb) == 0) {
+	    h->db_file = k;
+	    found = 1;
+	}
+    }
+    changed = file_id_update(&h->db, found ? &sb : NULL);
+
+    found = (stat(h->files[KDC_DB_LOG], &sb) == 0);
+    changed |= file_id_update(&h->log, found ? &sb : NULL);
+
+    if (changed)
+	h->generation++;
+}
+
+/*
+ * Open database `i' for a lookup; a persistent handle is only
+ * reopened when db_check() noticed a change.
+ */
+
+static krb5_error_code
+db_open(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    HDB *db = config->db[i];
+    struct kdc_db_handle *h;
+    krb5_error_code ret;
+
+    h = db_handle(config, i);
+    if (h == NULL || !db_persistent(config, i))
+	return db->hdb_open(context, db, O_RDONLY, 0);
+
+    if (h->openp) {
+	if (h->open_generation == h->generation)
+	    return 0;
+	kdc_log(context, config, 5, "Database %s changed, reopening",
+		db->hdb_name);
+	db->hdb_close(context, db);
+	h->openp = 0;
+    }
+
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret)
+	return ret;
+
+    h->openp = 1;
+    h->open_generation = h->generation;
+    return 0;
+}
+
+static void
+db_release(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    struct kdc_db_handle *h = db_handle(config, i);
+
+    if (h == NULL || !h->openp)
+	config->db[i]->hdb_close(context, config->db[i]);
+}
+
+static unsigned long
+file_id_hash(unsigned long hash, const struct kdc_file_id *id)
+{
+    hash = hash * 33 + (unsigned long)id->dev;
+    hash = hash * 33 + (unsigned long)id->ino;
+    hash = hash * 33 + (unsigned long)id->size;
+    hash = hash * 33 + (unsigned long)id->mtime;
+    return hash;
+}
+
+/*
+ * Fingerprint of the files of all databases, changes whenever any of
+ * them changed.  Unlike the generations it is the same for every
+ * thread looking at the same files, so a shared entry cache isn't
+ * flushed just because another thread did the lookup.  Sets `*racy'
+ * if a file may still change without us noticing.
+ */
+
+static unsigned long
+db_generation(krb5_kdc_configuration *config, int *racy)
+{
+    unsigned long generation = 5381;
+    struct kdc_db_handle *h;
+    int i;
+
+    *racy = 0;
+    if (!db_tracking(config))
+	return 0;
+
+    for (i = 0; i < config->num_db; i++) {
+	db_check(config, i);
+	if (i >= config->num_db_handles)
+	    continue;
+	h = &config->db_handles[i];
+	generation = file_id_hash(generation, &h->db);
+	generation = file_id_hash(generation, &h->log);
+	*racy |= h->db.racy | h->log.racy;
+    }
+    return generation;
+}
+
+/*
+ * Cache of decoded and decrypted entries, see [kdc] entry-cache-size.
+ * Entries are valid for entry-cache-lifetime seconds and the whole
+ * cache is flushed when any database changes.  The cache may be
+ * shared by several threads (see krb5_kdc_copy_config()), `mutex'
+ * protects everything in it.
+ */
+
+static unsigned
+cache_hash(krb5_const_principal principal, unsigned flags, krb5_kvno kvno)
+{
+    unsigned hash = 5381;
+    const char *p;
+    size_t i;
+
+    for (p = principal->realm; *p; p++)
+	hash = hash * 33 + (unsigned char)*p;
+    for (i = 0; i < principal->name.name_string.len; i++) {
+	hash = hash * 33 + '/';
+	for (p = principal->name.name_string.val[i]; *p; p++)
+	    hash = hash * 33 + (unsigned char)*p;
+    }
+    hash = hash * 33 + principal->name.name_type;
+    hash = hash * 33 + flags;
+    hash = hash * 33 + kvno;
+    return hash;
+}
+
+static void
+cache_unlink(struct kdc_entry_cache *cache, struct kdc_cache_entry *ce)
+{
+    struct kdc_cache_entry **pp;
+
+    for (pp = &cache->buckets[ce->hash & (cache->num_buckets - 1)];
+	 *pp != ce; pp = &(*pp)->next)
+	;
+    *pp = ce->next;
+
+    if (ce->lru_prev)
+	ce->lru_prev->lru_next = ce->lru_next;
+    else
+	cache->lru_head = ce->lru_next;
+    if (ce->lru_next)
+	ce->lru_next->lru_prev = ce->lru_prev;
+    else
+	cache->lru_tail = ce->lru_prev;
+
+    cache->num_entries--;
+}
+
+static void
+cache_free_entry(krb5_context context, struct kdc_cache_entry *ce)
+{
+    krb5_free_principal(context, ce->principal);
+    hdb_free_entry(context, &ce->entry);
+    free(ce);
+}
+
+static void
+cache_flush(krb5_context context, struct kdc_entry_cache *cache)
+{
+    struct kdc_cache_entry *ce;
+
+    while ((ce = cache->lru_head) != NULL) {
+	cache_unlink(cache, ce);
+	cache_free_entry(context, ce);
+    }
+}
+
+struct kdc_entry_cache *
+_kdc_get_entry_cache(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_entry_cache *cache = config->entry_cache;
+
+    if (config->entry_cache_size <= 0)
+	return NULL;
+    if (cache)
+	return cache;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+	return NULL;
+    /* A power of two with no more than one entry per bucket when full */
+    cache->num_buckets = 1;
+    while (cache->num_buckets < (size_t)config->entry_cache_size)
+	cache->num_buckets <<= 1;
+    cache->buckets = calloc(cache->num_buckets, sizeof(cache->buckets[0]));
+    if (cache->buckets == NULL) {
+	free(cache);
+	return NULL;
+    }
+    HEIMDAL_MUTEX_init(&cache->mutex);
+    config->entry_cache = cache;
+    return cache;
+}
+
+static void
+cache_log_stats(krb5_context context, krb5_kdc_configuration *config,
+		struct kdc_entry_cache *cache)
+{
+    if (((cache->hits + cache->misses) & 0xffff) != 0)
+	return;
+    kdc_log(context, config, 4,
+	    "entry cache: %lu entries, %lu hits, %lu misses, %lu evictions",
+	    (unsigned long)cache->num_entries, cache->hits, cache->misses,
+	    cache->evictions);
+}
+
+static krb5_error_code
+cache_lookup(krb5_context context, krb5_kdc_configuration *config,
+	     struct kdc_entry_cache *cache, unsigned long generation,
+	     krb5_const_principal principal, unsigned flags, krb5_kvno kvno,
+	     HDB **db, hdb_entry_ex **h)
+{
+    struct kdc_cache_entry *ce;
+    hdb_entry_ex *ent;
+    krb5_error_code ret;
+    unsigned hash;
+
+    if (cache->generation != generation) {
+	if (cache->num_entries)
+	    kdc_log(context, config, 5,
+		    "Database changed, flushing entry cache");
+	cache_flush(context, cache);
+	cache->generation = generation;
+    }
+
+    hash = cache_hash(principal, flags, kvno);
+    for (ce = cache->buckets[hash & (cache->num_buckets - 1)]; ce;
+	 ce = ce->next) {
+	if (ce->hash == hash && ce->flags == flags && ce->kvno == kvno &&
+	    ce->principal->name.name_type == principal->name.name_type &&
+	    krb5_principal_compare(context, ce->principal, principal))
+	    break;
+    }
+    if (ce == NULL) {
+	cache->misses++;
+	cache_log_stats(context, config, cache);
+	return HDB_ERR_NOENTRY;
+    }
+    if (ce->expires <= time(NULL)) {
+	cache_unlink(cache, ce);
+	cache_free_entry(context, ce);
+	cache->misses++;
+	cache_log_stats(context, config, cache);
+	return HDB_ERR_NOENTRY;
+    }
+
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+	return krb5_enomem(context);
+    ret = copy_hdb_entry(&ce->entry.entry, &ent->entry);
+    if (ret) {
+	free(ent);
+	return ret;
+    }
+
+    /* move to the front of the LRU list */
+    if (ce->lru_prev) {
+	ce->lru_prev->lru_next = ce->lru_next;
+	if (ce->lru_next)
+	    ce->lru_next->lru_prev = ce->lru_prev;
+	else
+	    cache->lru_tail = ce->lru_prev;
+	ce->lru_prev = NULL;
+	ce->lru_next = cache->lru_head;
+	cache->lru_head->lru_prev = ce;
+	cache->lru_head = ce;
+    }
+
+    if (db)
+	*db = config->db[ce->db];
+    *h = ent;
+    cache->hits++;
+    cache_log_stats(context, config, cache);
+    return 0;
+}
+
+static void
+cache_store(krb5_context context, krb5_kdc_configuration *config,
+	    struct kdc_entry_cache *cache, krb5_const_principal principal,
+	    unsigned flags, krb5_kvno kvno, int db, const hdb_entry_ex *ent)
+{
+    struct kdc_cache_entry *ce, **bucket;
+
+    /* Backends with private state in the entry can't be cached */
+    if (ent->ctx != NULL || ent->free_entry != NULL)
+	return;
+
+    ce = calloc(1, sizeof(*ce));
+    if (ce == NULL)
+	return;
+    if (krb5_copy_principal(context, principal, &ce->principal)) {
+	free(ce);
+	return;
+    }
+    if (copy_hdb_entry(&ent->entry, &ce->entry.entry)) {
+	krb5_free_principal(context, ce->principal);
+	free(ce);
+	return;
+    }
+    ce->hash = cache_hash(principal, flags, kvno);
+    ce->db = db;
+    ce->flags = flags;
+    ce->kvno = kvno;
+    ce->expires = time(NULL) + config->entry_cache_lifetime;
+
+    while (cache->num_entries >= (size_t)config->entry_cache_size &&
+	   cache->lru_tail != NULL) {
+	struct kdc_cache_entry *old = cache->lru_tail;
+
+	cache_unlink(cache, old);
+	cache_free_entry(context, old);
+	cache->evictions++;
+    }
+
+    bucket = &cache->buckets[ce->hash & (cache->num_buckets - 1)];
+    ce->next = *bucket;
+    *bucket = ce;
+    ce->lru_next = cache->lru_head;
+    if (cache->lru_head)
+	cache->lru_head->lru_prev = ce;
+    else
+	cache->lru_tail = ce;
+    cache->lru_head = ce;
+    cache->num_entries++;
+}
 
 krb5_error_code
 _kdc_db_fetch(krb5_context context,
@@ -44,9 +548,11 @@ _kdc_db_fetch(krb5_context context,
 	      HDB **db,
 	      hdb_entry_ex **h)
 {
+    struct kdc_entry_cache *cache;
+    unsigned long generation;
     hdb_entry_ex *ent;
     krb5_error_code ret = HDB_ERR_NOENTRY;
-    int i;
+    int i, racy;
     unsigned kvno = 0;
     krb5_principal enterprise_principal = NULL;
     krb5_const_principal princ;
@@ -60,6 +566,18 @@ _kdc_db_fetch(krb5_context context,
 	flags |= HDB_F_ALL_KVNOS;
     }
 
+    generation = db_generation(config, &racy);
+    cache = racy ? NULL : _kdc_get_entry_cache(context, config);
+    if (cache) {
+	HEIMDAL_MUTEX_lock(&cache->mutex);
+	ret = cache_lookup(context, config, cache, generation,
+			   principal, flags, kvno, db, h);
+	HEIMDAL_MUTEX_unlock(&cache->mutex);
+	if (ret != HDB_ERR_NOENTRY)
+	    return ret;
+	ret = HDB_ERR_NOENTRY;
+    }
+
     ent = calloc(1, sizeof (*ent));
     if (ent == NULL)
         return krb5_enomem(context);
@@ -80,7 +598,7 @@ _kdc_db_fetch(krb5_context context,
     }
 
     for (i = 0; i < config->num_db; i++) {
-	ret = config->db[i]->hdb_open(context, config->db[i], O_RDONLY, 0);
+	ret = db_open(context, config, i);
 	if (ret) {
 	    const char *msg = krb5_get_error_message(context, ret);
 	    kdc_log(context, config, 0, "Failed to open database: %s", msg);
@@ -98,17 +616,23 @@ _kdc_db_fetch(krb5_context context,
 					    flags | HDB_F_DECRYPT,
 					    kvno,
 					    ent);
-	config->db[i]->hdb_close(context, config->db[i]);
+	db_release(context, config, i);
 
 	switch (ret) {
+	case 0:
+	    if (cache) {
+		HEIMDAL_MUTEX_lock(&cache->mutex);
+		cache_store(context, config, cache, principal, flags, kvno,
+			    i, ent);
+		HEIMDAL_MUTEX_unlock(&cache->mutex);
+	    }
+	    /* fall through */
 	case HDB_ERR_WRONG_REALM:
 	    /*
 	     * the ent->entry.principal just contains hints for the client
 	     * to retry. This is important for enterprise principal routing
 	     * between trusts.
 	     */
-	    /* fall through */
-	case 0:
 	    if (db)
 		*db = config->db[i];
 	    *h = ent;
@@ -85,6 +85,26 @@ static struct {
     time_t next_update;
 } ocsp;
 
+/*
+ * The KDC identity, trust anchors and OCSP response above are shared
+ * by all threads of a KDC and hx509 objects aren't safe to use from
+ * several threads at once, so PK-INIT requests are serialized.
+ */
+
+static HEIMDAL_MUTEX pk_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+void
+_kdc_pk_lock(void)
+{
+    HEIMDAL_MUTEX_lock(&pk_mutex);
+}
+
+void
+_kdc_pk_unlock(void)
+{
+    HEIMDAL_MUTEX_unlock(&pk_mutex);
+}
+
 /*
  *
  */
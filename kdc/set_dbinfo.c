@@ -64,8 +64,9 @@ add_db(krb5_context context, struct krb5_kdc_configuration *c,
     return 0;
 }
 
-krb5_error_code
-krb5_kdc_set_dbinfo(krb5_context context, struct krb5_kdc_configuration *c)
+static krb5_error_code
+set_dbinfo(krb5_context context, struct krb5_kdc_configuration *c,
+	   int verbose)
 {
     struct hdb_dbinfo *info, *d;
     krb5_error_code ret;
@@ -85,6 +86,9 @@ krb5_kdc_set_dbinfo(krb5_context context, struct krb5_kdc_configuration *c)
 	if (ret)
 	    goto out;
 
+	if (!verbose)
+	    continue;
+
 	kdc_log(context, c, 0, "label: %s",
 		hdb_dbinfo_get_label(context, d));
 	kdc_log(context, c, 0, "\tdbname: %s",
@@ -110,4 +114,48 @@ out:
     return ret;
 }
 
+krb5_error_code
+krb5_kdc_set_dbinfo(krb5_context context, struct krb5_kdc_configuration *c)
+{
+    return set_dbinfo(context, c, 1);
+}
+
+/*
+ * Make a copy of `config' for another thread using `context'.  The
+ * copy gets its own database handles but shares the entry cache and
+ * everything else with `config', which must outlive it.  Backends
+ * share whatever may only be opened once per process between handles
+ * (see hdb-mdb.c).
+ */
 
+krb5_error_code
+krb5_kdc_copy_config(krb5_context context,
+		     struct krb5_kdc_configuration *config,
+		     struct krb5_kdc_configuration **out)
+{
+    struct krb5_kdc_configuration *c;
+    krb5_error_code ret;
+
+    *out = NULL;
+
+    c = malloc(sizeof(*c));
+    if (c == NULL) {
+	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
+	return ENOMEM;
+    }
+    *c = *config;
+    c->db = NULL;
+    c->num_db = 0;
+    c->db_handles = NULL;
+    c->num_db_handles = 0;
+    c->entry_cache = _kdc_get_entry_cache(context, config);
+
+    ret = set_dbinfo(context, c, 0);
+    if (ret) {
+	free(c);
+	return ret;
+    }
+
+    *out = c;
+    return 0;
+}
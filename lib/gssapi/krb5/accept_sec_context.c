@@ -101,7 +101,7 @@ _gsskrb5_register_acceptor_identity(OM_uint32 *min_stat, const char *identity)
     return GSS_S_COMPLETE;
 }
 
-void
+krb5_error_code
 _gsskrb5i_is_cfx(krb5_context context, gsskrb5_ctx ctx, int acceptor)
 {
     krb5_keyblock *key;
@@ -121,7 +121,7 @@ _gsskrb5i_is_cfx(krb5_context context, gsskrb5_ctx ctx, int acceptor)
 	key = ctx->auth_context->keyblock;
 
     if (key == NULL)
-	return;
+	return 0;
 
     switch (key->keytype) {
     case ETYPE_DES_CBC_CRC:
@@ -145,6 +145,23 @@ _gsskrb5i_is_cfx(krb5_context context, gsskrb5_ctx ctx, int acceptor)
         krb5_crypto_destroy(context, ctx->crypto);
     /* XXX We really shouldn't ignore this; will come back to this */
     (void) krb5_crypto_init(context, key, 0, &ctx->crypto);
+
+    /*
+     * The CFX per-message functions run without the context lock and
+     * rely on never having to derive keys, so failing here has to fail
+     * the context.
+     */
+    if (ctx->crypto && (ctx->more_flags & IS_CFX)) {
+	static const krb5_key_usage cfx_usages[] = {
+	    KRB5_KU_USAGE_ACCEPTOR_SEAL,
+	    KRB5_KU_USAGE_ACCEPTOR_SIGN,
+	    KRB5_KU_USAGE_INITIATOR_SEAL,
+	    KRB5_KU_USAGE_INITIATOR_SIGN
+	};
+	return krb5_crypto_prederive(context, ctx->crypto, cfx_usages,
+				     sizeof(cfx_usages)/sizeof(cfx_usages[0]));
+    }
+    return 0;
 }
 
 
@@ -236,6 +253,7 @@ gsskrb5_acceptor_ready(OM_uint32 * minor_status,
 		       gss_cred_id_t *delegated_cred_handle)
 {
     OM_uint32 ret;
+    krb5_error_code kret;
     int32_t seq_number;
     int is_cfx = 0;
 
@@ -243,13 +261,18 @@ gsskrb5_acceptor_ready(OM_uint32 * minor_status,
 				      ctx->auth_context,
 				      &seq_number);
 
-    _gsskrb5i_is_cfx(context, ctx, 1);
+    kret = _gsskrb5i_is_cfx(context, ctx, 1);
+    if (kret) {
+	*minor_status = kret;
+	return GSS_S_FAILURE;
+    }
     is_cfx = (ctx->more_flags & IS_CFX);
 
     ret = _gssapi_msg_order_create(minor_status,
 				   &ctx->order,
 				   _gssapi_msg_order_f(ctx->flags),
-				   seq_number, 0, is_cfx);
+				   seq_number, _gssapi_msg_order_window(context),
+				   is_cfx);
     if (ret)
 	return ret;
 
@@ -572,7 +595,11 @@ gsskrb5_acceptor_start(OM_uint32 * minor_status,
 	krb5_data outbuf;
 	int use_subkey = 0;
 
-	_gsskrb5i_is_cfx(context, ctx, 1);
+	kret = _gsskrb5i_is_cfx(context, ctx, 1);
+	if (kret) {
+	    *minor_status = kret;
+	    return GSS_S_FAILURE;
+	}
 	is_cfx = (ctx->more_flags & IS_CFX);
 
 	if (is_cfx || (ap_options & AP_OPTS_USE_SUBKEY)) {
@@ -40,6 +40,36 @@
 #define CFXSealed		(1 << 1)
 #define CFXAcceptorSubkey	(1 << 2)
 
+/*
+ * Allocate the sequence number for an outgoing token.  Once the
+ * context is established only the per-message functions move the
+ * local sequence number, so where atomics are available this needs
+ * no lock and wrap/get_mic do not serialize with unwrap/verify_mic;
+ * the receive side state is in ctx->order, which has its own lock.
+ */
+
+static int32_t
+next_local_seqnumber(krb5_context context, gsskrb5_ctx ctx)
+{
+    int32_t seq_number;
+
+#if defined(__GNUC__) && defined(HAVE___SYNC_ADD_AND_FETCH)
+    seq_number = __sync_fetch_and_add(&ctx->auth_context->local_seqnumber, 1);
+#elif defined(_WIN32)
+    seq_number = InterlockedExchangeAdd((LONG volatile *)&ctx->auth_context->local_seqnumber, 1);
+#else
+    HEIMDAL_MUTEX_lock(&ctx->ctx_id_mutex);
+    krb5_auth_con_getlocalseqnumber(context,
+				    ctx->auth_context,
+				    &seq_number);
+    krb5_auth_con_setlocalseqnumber(context,
+				    ctx->auth_context,
+				    seq_number + 1);
+    HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
+#endif
+    return seq_number;
+}
+
 krb5_error_code
 _gsskrb5cfx_wrap_length_cfx(krb5_context context,
 			    krb5_crypto crypto,
@@ -158,6 +188,20 @@ _gssapi_wrap_size_cfx(OM_uint32 *minor_status,
     return 0;
 }
 
+static void
+reverse(u_char *p, size_t len)
+{
+    u_char *q, c;
+
+    if (len < 2)
+	return;
+    for (q = p + len - 1; p < q; p++, q--) {
+	c = *p;
+	*p = *q;
+	*q = c;
+    }
+}
+
 /*
  * Rotate "rrc" bytes to the front or back
  */
@@ -178,14 +222,21 @@ rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 
     left = len - rrc;
 
-    if (rrc <= sizeof(buf)) {
-	tmp = buf;
-    } else {
-	tmp = malloc(rrc);
-	if (tmp == NULL)
-	    return ENOMEM;
+    if (rrc > sizeof(buf)) {
+	/* rotate by reversing the two parts and then the whole */
+	if (unrotate) {
+	    reverse(data, rrc);
+	    reverse((u_char *)data + rrc, left);
+	} else {
+	    reverse(data, left);
+	    reverse((u_char *)data + left, rrc);
+	}
+	reverse(data, len);
+	return 0;
     }
 
+    tmp = buf;
+
     if (unrotate) {
 	memcpy(tmp, data, rrc);
 	memmove(data, (u_char *)data + rrc, left);
@@ -196,12 +247,30 @@ rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 	memcpy(data, tmp, rrc);
     }
 
-    if (rrc > sizeof(buf))
-	free(tmp);
-
     return 0;
 }
 
+/*
+ * Copy "len" bytes, starting "off" bytes into the unrotated message,
+ * out of a message of "msglen" bytes that was rotated by "rrc" bytes.
+ */
+
+static void
+rrc_copy(void *out, const void *msg, size_t msglen, size_t rrc,
+	 size_t off, size_t len)
+{
+    const u_char *p = msg;
+    size_t n;
+
+    if (len == 0)
+	return;
+
+    off = (off + rrc % msglen) % msglen;
+    n = min(len, msglen - off);
+    memcpy(out, p + off, n);
+    memcpy((u_char *)out + n, p, len - n);
+}
+
 gss_iov_buffer_desc *
 _gk_find_buffer(gss_iov_buffer_desc *iov, int iov_count, OM_uint32 type)
 {
@@ -472,16 +541,9 @@ _gssapi_wrap_cfx_iov(OM_uint32 *minor_status,
     token->RRC[0] = 0;
     token->RRC[1] = 0;
 
-    HEIMDAL_MUTEX_lock(&ctx->ctx_id_mutex);
-    krb5_auth_con_getlocalseqnumber(context,
-				    ctx->auth_context,
-				    &seq_number);
+    seq_number = next_local_seqnumber(context, ctx);
     _gsskrb5_encode_be_om_uint32(0,          &token->SND_SEQ[0]);
     _gsskrb5_encode_be_om_uint32(seq_number, &token->SND_SEQ[4]);
-    krb5_auth_con_setlocalseqnumber(context,
-				    ctx->auth_context,
-				    ++seq_number);
-    HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 
     data = calloc(iov_count + 3, sizeof(data[0]));
     if (data == NULL) {
@@ -638,72 +700,102 @@ _gssapi_wrap_cfx_iov(OM_uint32 *minor_status,
     return major_status;
 }
 
-/* This is slowpath */
+#define IOV_ROTATED(t) \
+    ((t) == GSS_IOV_BUFFER_TYPE_DATA || \
+     (t) == GSS_IOV_BUFFER_TYPE_PADDING || \
+     (t) == GSS_IOV_BUFFER_TYPE_TRAILER)
+
+/*
+ * Position in the stream formed by the DATA, PADDING and TRAILER
+ * buffers, the buffer index and the offset into it.
+ */
+
+struct rrc_cursor {
+    int i;
+    size_t off;
+};
+
+static size_t
+rrc_cursor_avail(gss_iov_buffer_desc *iov, int iov_count,
+		 struct rrc_cursor *c)
+{
+    while (c->i < iov_count &&
+	   (!IOV_ROTATED(GSS_IOV_BUFFER_TYPE(iov[c->i].type)) ||
+	    c->off == iov[c->i].buffer.length)) {
+	c->i++;
+	c->off = 0;
+    }
+    if (c->i == iov_count)
+	return 0;
+    return iov[c->i].buffer.length - c->off;
+}
+
+static u_char *
+rrc_cursor_ptr(gss_iov_buffer_desc *iov, struct rrc_cursor *c)
+{
+    return (u_char *)iov[c->i].buffer.value + c->off;
+}
+
+/*
+ * The sender rotated the trailer to the front of the stream, move it
+ * back where it belongs.  This is done in place: the first rrc bytes
+ * are saved, everything else is moved down and the saved bytes are
+ * written to the end.
+ */
+
 static OM_uint32
 unrotate_iov(OM_uint32 *minor_status, size_t rrc, gss_iov_buffer_desc *iov, int iov_count)
 {
-    uint8_t *p, *q;
-    size_t len = 0, skip;
+    struct rrc_cursor src = { 0, 0 }, dst = { 0, 0 };
+    u_char *tmp, *q, buf[256];
+    size_t len = 0, n;
     int i;
 
     for (i = 0; i < iov_count; i++)
-	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_DATA ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_PADDING ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_TRAILER)
+	if (IOV_ROTATED(GSS_IOV_BUFFER_TYPE(iov[i].type)))
 	    len += iov[i].buffer.length;
 
-    p = malloc(len);
-    if (p == NULL) {
-	*minor_status = ENOMEM;
-	return GSS_S_FAILURE;
-    }
-    q = p;
-
-    /* copy up */
+    if (len == 0)
+	return GSS_S_COMPLETE;
+    rrc %= len;
+    if (rrc == 0)
+	return GSS_S_COMPLETE;
 
-    for (i = 0; i < iov_count; i++) {
-	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_DATA ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_PADDING ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_TRAILER)
-	{
-	    memcpy(q, iov[i].buffer.value, iov[i].buffer.length);
-	    q += iov[i].buffer.length;
+    if (rrc <= sizeof(buf)) {
+	tmp = buf;
+    } else {
+	tmp = malloc(rrc);
+	if (tmp == NULL) {
+	    *minor_status = ENOMEM;
+	    return GSS_S_FAILURE;
 	}
     }
-    assert((size_t)(q - p) == len);
-
-    /* unrotate first part */
-    q = p + rrc;
-    skip = rrc;
-    for (i = 0; i < iov_count; i++) {
-	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_DATA ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_PADDING ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_TRAILER)
-	{
-	    if (iov[i].buffer.length <= skip) {
-		skip -= iov[i].buffer.length;
-	    } else {
-		memcpy(((uint8_t *)iov[i].buffer.value) + skip, q, iov[i].buffer.length - skip);
-		q += iov[i].buffer.length - skip;
-		skip = 0;
-	    }
-	}
+
+    /* save the rotated part, src ends up rrc bytes into the stream */
+    for (q = tmp; q < tmp + rrc; q += n) {
+	n = min(rrc_cursor_avail(iov, iov_count, &src), rrc - (q - tmp));
+	memcpy(q, rrc_cursor_ptr(iov, &src), n);
+	src.off += n;
     }
-    /* copy trailer */
-    q = p;
-    skip = rrc;
-    for (i = 0; i < iov_count; i++) {
-	if (GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_DATA ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_PADDING ||
-	    GSS_IOV_BUFFER_TYPE(iov[i].type) == GSS_IOV_BUFFER_TYPE_TRAILER)
-	{
-	    memcpy(q, iov[i].buffer.value, min(iov[i].buffer.length, skip));
-	    if (iov[i].buffer.length > skip)
-		break;
-	    skip -= iov[i].buffer.length;
-	    q += iov[i].buffer.length;
-	}
+
+    /* move the rest down */
+    while ((n = rrc_cursor_avail(iov, iov_count, &src)) != 0) {
+	n = min(n, rrc_cursor_avail(iov, iov_count, &dst));
+	memmove(rrc_cursor_ptr(iov, &dst), rrc_cursor_ptr(iov, &src), n);
+	src.off += n;
+	dst.off += n;
+    }
+
+    /* and put the saved part at the end */
+    for (q = tmp; q < tmp + rrc; q += n) {
+	n = min(rrc_cursor_avail(iov, iov_count, &dst), rrc - (q - tmp));
+	memcpy(rrc_cursor_ptr(iov, &dst), q, n);
+	dst.off += n;
     }
+
+    if (tmp != buf)
+	free(tmp);
+
     return GSS_S_COMPLETE;
 }
 
@@ -793,14 +885,11 @@ _gssapi_unwrap_cfx_iov(OM_uint32 *minor_status,
 	return GSS_S_UNSEQ_TOKEN;
     }
 
-    HEIMDAL_MUTEX_lock(&ctx->ctx_id_mutex);
     ret = _gssapi_msg_order_check(ctx->order, seq_number_lo);
     if (ret != 0) {
 	*minor_status = 0;
-	HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 	return ret;
     }
-    HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 
     /*
      * Decrypt and/or verify checksum
@@ -825,7 +914,6 @@ _gssapi_unwrap_cfx_iov(OM_uint32 *minor_status,
 	krb5_crypto_length(context, ctx->crypto, KRB5_CRYPTO_TYPE_HEADER, &k5hsize);
 	krb5_crypto_length(context, ctx->crypto, KRB5_CRYPTO_TYPE_TRAILER, &k5tsize);
 
-	/* Rotate by RRC; bogus to do this in-place XXX */
 	/* Check RRC */
 
 	if (trailer == NULL) {
@@ -853,7 +941,7 @@ _gssapi_unwrap_cfx_iov(OM_uint32 *minor_status,
 	    major_status = GSS_S_DEFECTIVE_TOKEN;
 	    goto failure;
 	} else if (rrc != 0) {
-	    /* go though slowpath */
+	    /* the buffers are ours to modify, unrotate in place */
 	    major_status = unrotate_iov(minor_status, rrc, iov, iov_count);
 	    if (major_status)
 		goto failure;
@@ -1164,7 +1252,6 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
     gss_cfx_wrap_token token;
     krb5_error_code ret;
     unsigned usage;
-    krb5_data cipher;
     size_t wrapped_len, cksumsize;
     uint16_t padlength, rrc = 0;
     int32_t seq_number;
@@ -1235,16 +1322,9 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
     token->RRC[0] = 0;
     token->RRC[1] = 0;
 
-    HEIMDAL_MUTEX_lock(&ctx->ctx_id_mutex);
-    krb5_auth_con_getlocalseqnumber(context,
-				    ctx->auth_context,
-				    &seq_number);
+    seq_number = next_local_seqnumber(context, ctx);
     _gsskrb5_encode_be_om_uint32(0,          &token->SND_SEQ[0]);
     _gsskrb5_encode_be_om_uint32(seq_number, &token->SND_SEQ[4]);
-    krb5_auth_con_setlocalseqnumber(context,
-				    ctx->auth_context,
-				    ++seq_number);
-    HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 
     /*
      * If confidentiality is requested, the token header is
@@ -1262,7 +1342,34 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
     }
 
     if (conf_req_flag) {
+	krb5_crypto_iov data[5];
+	size_t k5hsize, k5tsize, rot;
+	u_char *pad, *etoken;
+
+	ret = krb5_crypto_length(context, ctx->crypto,
+				 KRB5_CRYPTO_TYPE_HEADER, &k5hsize);
+	if (ret == 0)
+	    ret = krb5_crypto_length(context, ctx->crypto,
+				     KRB5_CRYPTO_TYPE_TRAILER, &k5tsize);
+	if (ret != 0) {
+	    *minor_status = ret;
+	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
+	    return GSS_S_FAILURE;
+	}
+	assert(sizeof(*token) + k5hsize + input_message_buffer->length +
+	       padlength + sizeof(*token) + k5tsize == wrapped_len);
+
 	/*
+	 * The ciphertext is
+	 *
+	 *   krb5-header | plaintext | ec-padding | E"header" | krb5-trailer
+	 *
+	 * and it is rotated by rrc, or rrc + ec in DCE style since
+	 * windows rotates by EC+RRC, to bring the end of it to the
+	 * front.  Lay the plaintext out already rotated and encrypt it
+	 * where it is, so the only copy of the message is the one into
+	 * the output buffer.
+	 *
 	 * Any necessary padding is added here to ensure that the
 	 * encrypted token header is always at the end of the
 	 * ciphertext.
@@ -1271,41 +1378,46 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
 	 * bytes are initialized.
 	 */
 	p += sizeof(*token);
-	memcpy(p, input_message_buffer->value, input_message_buffer->length);
-	memset(p + input_message_buffer->length, 0xFF, padlength);
-	memcpy(p + input_message_buffer->length + padlength,
-	       token, sizeof(*token));
-
-	ret = krb5_encrypt(context, ctx->crypto,
-			   usage, p,
-			   input_message_buffer->length + padlength +
-				sizeof(*token),
-			   &cipher);
-	if (ret != 0) {
-	    *minor_status = ret;
-	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
-	    return GSS_S_FAILURE;
-	}
-	assert(sizeof(*token) + cipher.length == wrapped_len);
-	token->RRC[0] = (rrc >> 8) & 0xFF;
-	token->RRC[1] = (rrc >> 0) & 0xFF;
-
-	/*
-	 * this is really ugly, but needed against windows
-	 * for DCERPC, as windows rotates by EC+RRC.
-	 */
 	if (IS_DCE_STYLE(ctx)) {
-		ret = rrc_rotate(cipher.data, cipher.length, rrc+padlength, FALSE);
+	    rot = rrc + padlength;
+	    pad = p;
+	    etoken = p + padlength;
 	} else {
-		ret = rrc_rotate(cipher.data, cipher.length, rrc, FALSE);
+	    rot = rrc;
+	    pad = p + rot + k5hsize + input_message_buffer->length;
+	    etoken = p;
 	}
+
+	data[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	data[0].data.data = p + rot;
+	data[0].data.length = k5hsize;
+	data[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	data[1].data.data = p + rot + k5hsize;
+	data[1].data.length = input_message_buffer->length;
+	data[2].flags = KRB5_CRYPTO_TYPE_DATA;
+	data[2].data.data = pad;
+	data[2].data.length = padlength;
+	data[3].flags = KRB5_CRYPTO_TYPE_DATA;
+	data[3].data.data = etoken;
+	data[3].data.length = sizeof(*token);
+	data[4].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	data[4].data.data = etoken + sizeof(*token);
+	data[4].data.length = k5tsize;
+
+	memcpy(data[1].data.data, input_message_buffer->value,
+	       input_message_buffer->length);
+	memset(pad, 0xFF, padlength);
+	memcpy(etoken, token, sizeof(*token));
+
+	ret = krb5_encrypt_iov_ivec(context, ctx->crypto, usage,
+				    data, 5, NULL);
 	if (ret != 0) {
 	    *minor_status = ret;
 	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
 	    return GSS_S_FAILURE;
 	}
-	memcpy(p, cipher.data, cipher.length);
-	krb5_data_free(&cipher);
+	token->RRC[0] = (rrc >> 8) & 0xFF;
+	token->RRC[1] = (rrc >> 0) & 0xFF;
     } else {
 	char *buf;
 	Checksum cksum;
@@ -1375,7 +1487,6 @@ OM_uint32 _gssapi_unwrap_cfx(OM_uint32 *minor_status,
     u_char token_flags;
     krb5_error_code ret;
     unsigned usage;
-    krb5_data data;
     uint16_t ec, rrc;
     OM_uint32 seq_number_lo, seq_number_hi;
     size_t len;
@@ -1434,15 +1545,12 @@ OM_uint32 _gssapi_unwrap_cfx(OM_uint32 *minor_status,
 	return GSS_S_UNSEQ_TOKEN;
     }
 
-    HEIMDAL_MUTEX_lock(&ctx->ctx_id_mutex);
     ret = _gssapi_msg_order_check(ctx->order, seq_number_lo);
     if (ret != 0) {
 	*minor_status = 0;
-	HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 	_gsskrb5_release_buffer(minor_status, output_message_buffer);
 	return ret;
     }
-    HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 
     /*
      * Decrypt and/or verify checksum
@@ -1459,46 +1567,84 @@ OM_uint32 _gssapi_unwrap_cfx(OM_uint32 *minor_status,
     len -= (p - (u_char *)input_message_buffer->value);
 
     if (token_flags & CFXSealed) {
+	krb5_crypto_iov data[3];
+	u_char k5hdr[64], k5trl[64];
+	size_t k5hsize, k5tsize, rot, n;
+	OM_uint32 junk;
+
+	ret = krb5_crypto_length(context, ctx->crypto,
+				 KRB5_CRYPTO_TYPE_HEADER, &k5hsize);
+	if (ret == 0)
+	    ret = krb5_crypto_length(context, ctx->crypto,
+				     KRB5_CRYPTO_TYPE_TRAILER, &k5tsize);
+	if (ret != 0) {
+	    *minor_status = ret;
+	    return GSS_S_FAILURE;
+	}
+	if (k5hsize > sizeof(k5hdr) || k5tsize > sizeof(k5trl)) {
+	    *minor_status = KRB5_BAD_MSIZE;
+	    return GSS_S_FAILURE;
+	}
+	/* Check that there is room for the pad and token header */
+	if (len < k5hsize + ec + sizeof(*token) + k5tsize)
+	    return GSS_S_DEFECTIVE_TOKEN;
+
 	/*
 	 * this is really ugly, but needed against windows
 	 * for DCERPC, as windows rotates by EC+RRC.
 	 */
-	if (IS_DCE_STYLE(ctx)) {
-		*minor_status = rrc_rotate(p, len, rrc+ec, TRUE);
-	} else {
-		*minor_status = rrc_rotate(p, len, rrc, TRUE);
-	}
-	if (*minor_status != 0) {
+	rot = rrc;
+	if (IS_DCE_STYLE(ctx))
+	    rot += ec;
+
+	/*
+	 * Unrotate while copying the ciphertext out of the input,
+	 * which is left alone, and decrypt it in place in the output
+	 * buffer.  Only the krb5 header and trailer are kept aside.
+	 */
+	n = len - k5hsize - k5tsize;
+	output_message_buffer->value = malloc(n);
+	if (output_message_buffer->value == NULL) {
+	    *minor_status = ENOMEM;
 	    return GSS_S_FAILURE;
 	}
-
-	ret = krb5_decrypt(context, ctx->crypto, usage,
-	    p, len, &data);
+	rrc_copy(k5hdr, p, len, rot, 0, k5hsize);
+	rrc_copy(output_message_buffer->value, p, len, rot, k5hsize, n);
+	rrc_copy(k5trl, p, len, rot, k5hsize + n, k5tsize);
+
+	data[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	data[0].data.data = k5hdr;
+	data[0].data.length = k5hsize;
+	data[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	data[1].data.data = output_message_buffer->value;
+	data[1].data.length = n;
+	data[2].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	data[2].data.data = k5trl;
+	data[2].data.length = k5tsize;
+
+	ret = krb5_decrypt_iov_ivec(context, ctx->crypto, usage,
+				    data, 3, NULL);
+	memset(k5hdr, 0, sizeof(k5hdr));
 	if (ret != 0) {
 	    *minor_status = ret;
+	    _gsskrb5_release_buffer(&junk, output_message_buffer);
 	    return GSS_S_BAD_MIC;
 	}
 
-	/* Check that there is room for the pad and token header */
-	if (data.length < ec + sizeof(*token)) {
-	    krb5_data_free(&data);
-	    return GSS_S_DEFECTIVE_TOKEN;
-	}
-	p = data.data;
-	p += data.length - sizeof(*token);
+	p = output_message_buffer->value;
+	p += n - sizeof(*token);
 
-	/* RRC is unprotected; don't modify input buffer */
+	/* RRC is unprotected */
 	((gss_cfx_wrap_token)p)->RRC[0] = token->RRC[0];
 	((gss_cfx_wrap_token)p)->RRC[1] = token->RRC[1];
 
 	/* Check the integrity of the header */
 	if (ct_memcmp(p, token, sizeof(*token)) != 0) {
-	    krb5_data_free(&data);
+	    _gsskrb5_release_buffer(&junk, output_message_buffer);
 	    return GSS_S_BAD_MIC;
 	}
 
-	output_message_buffer->value = data.data;
-	output_message_buffer->length = data.length - ec - sizeof(*token);
+	output_message_buffer->length = n - ec - sizeof(*token);
     } else {
 	Checksum cksum;
 
@@ -1603,16 +1749,9 @@ OM_uint32 _gssapi_mic_cfx(OM_uint32 *minor_status,
 	token->Flags |= CFXAcceptorSubkey;
     memset(token->Filler, 0xFF, 5);
 
-    HEIMDAL_MUTEX_lock(&ctx->ctx_id_mutex);
-    krb5_auth_con_getlocalseqnumber(context,
-				    ctx->auth_context,
-				    &seq_number);
+    seq_number = next_local_seqnumber(context, ctx);
     _gsskrb5_encode_be_om_uint32(0,          &token->SND_SEQ[0]);
     _gsskrb5_encode_be_om_uint32(seq_number, &token->SND_SEQ[4]);
-    krb5_auth_con_setlocalseqnumber(context,
-				    ctx->auth_context,
-				    ++seq_number);
-    HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 
     if (ctx->more_flags & LOCAL) {
 	usage = KRB5_KU_USAGE_INITIATOR_SIGN;
@@ -1708,14 +1847,11 @@ OM_uint32 _gssapi_verify_mic_cfx(OM_uint32 *minor_status,
 	return GSS_S_UNSEQ_TOKEN;
     }
 
-    HEIMDAL_MUTEX_lock(&ctx->ctx_id_mutex);
     ret = _gssapi_msg_order_check(ctx->order, seq_number_lo);
     if (ret != 0) {
 	*minor_status = 0;
-	HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 	return ret;
     }
-    HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
 
     /*
      * Verify checksum
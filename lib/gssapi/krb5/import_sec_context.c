@@ -204,9 +204,14 @@ _gsskrb5_import_sec_context (
     if (ret)
         goto failure;
 
-    krb5_storage_free (sp);
+    kret = _gsskrb5i_is_cfx(context, ctx, (ctx->more_flags & LOCAL) == 0);
+    if (kret) {
+	*minor_status = kret;
+	ret = GSS_S_FAILURE;
+	goto failure;
+    }
 
-    _gsskrb5i_is_cfx(context, ctx, (ctx->more_flags & LOCAL) == 0);
+    krb5_storage_free (sp);
 
     *context_handle = (gss_ctx_id_t)ctx;
 
@@ -225,6 +230,8 @@ failure:
 	krb5_free_address (context, remotep);
     if(ctx->order)
 	_gssapi_msg_order_destroy(&ctx->order);
+    if (ctx->crypto)
+	krb5_crypto_destroy(context, ctx->crypto);
     HEIMDAL_MUTEX_destroy(&ctx->ctx_id_mutex);
     krb5_storage_free (sp);
     free (ctx);
@@ -277,6 +277,7 @@ gsskrb5_initiator_ready(
 	krb5_context context)
 {
     OM_uint32 ret;
+    krb5_error_code kret;
     int32_t seq_number;
     int is_cfx = 0;
     OM_uint32 flags = ctx->flags;
@@ -290,13 +291,18 @@ gsskrb5_initiator_ready(
 
     krb5_auth_con_getremoteseqnumber (context, ctx->auth_context, &seq_number);
 
-    _gsskrb5i_is_cfx(context, ctx, 0);
+    kret = _gsskrb5i_is_cfx(context, ctx, 0);
+    if (kret) {
+	*minor_status = kret;
+	return GSS_S_FAILURE;
+    }
     is_cfx = (ctx->more_flags & IS_CFX);
 
     ret = _gssapi_msg_order_create(minor_status,
 				   &ctx->order,
 				   _gssapi_msg_order_f(flags),
-				   seq_number, 0, is_cfx);
+				   seq_number, _gssapi_msg_order_window(context),
+				   is_cfx);
     if (ret) return ret;
 
     ctx->state	= INITIATOR_READY;
@@ -34,14 +34,34 @@
 #include "gsskrb5_locl.h"
 
 #define DEFAULT_JITTER_WINDOW 20
+#define MAX_JITTER_WINDOW 65536
+
+/*
+ * The receive side state of a context.  It has its own lock so that
+ * checking incoming tokens does not need the context lock and does
+ * not serialize with the send side.
+ *
+ * Sequence numbers seen are kept in a bitmap covering the
+ * jitter_window sequence numbers up to and including last_seq, like
+ * the IPsec anti-replay window, so checking a token is O(1) whatever
+ * the size of the window.  The bitmap is a ring indexed by the
+ * sequence number modulo its size; the size is a power of two so the
+ * ring stays consistent when the sequence numbers wrap.
+ *
+ * length is the number of sequence numbers recorded, capped at
+ * jitter_window; it is zero only until the first token arrives.
+ */
 
 struct gss_msg_order {
+    HEIMDAL_MUTEX mutex;
     OM_uint32 flags;
     OM_uint32 start;
     OM_uint32 length;
     OM_uint32 jitter_window;
     OM_uint32 first_seq;
-    OM_uint32 elem[1];
+    OM_uint32 last_seq;
+    OM_uint32 mask;
+    uint64_t window[1];
 };
 
 
@@ -54,22 +74,42 @@ msg_order_alloc(OM_uint32 *minor_status,
 		struct gss_msg_order **o,
 		OM_uint32 jitter_window)
 {
+    OM_uint32 bits = 64;
     size_t len;
 
-    len = jitter_window * sizeof((*o)->elem[0]);
+    while (bits < jitter_window)
+	bits <<= 1;
+
+    len = (bits / 64) * sizeof((*o)->window[0]);
     len += sizeof(**o);
-    len -= sizeof((*o)->elem[0]);
+    len -= sizeof((*o)->window[0]);
 
     *o = calloc(1, len);
     if (*o == NULL) {
 	*minor_status = ENOMEM;
 	return GSS_S_FAILURE;
     }
+    HEIMDAL_MUTEX_init(&(*o)->mutex);
+    (*o)->jitter_window = jitter_window;
+    (*o)->mask = bits - 1;
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
 }
 
+/*
+ * Size of the replay window for new contexts, from krb5.conf.
+ */
+
+OM_uint32
+_gssapi_msg_order_window(krb5_context context)
+{
+    return krb5_config_get_int_default(context, NULL, DEFAULT_JITTER_WINDOW,
+				       "libdefaults",
+				       "gssapi_replay_window",
+				       NULL);
+}
+
 /*
  *
  */
@@ -86,6 +126,8 @@ _gssapi_msg_order_create(OM_uint32 *minor_status,
 
     if (jitter_window == 0)
 	jitter_window = DEFAULT_JITTER_WINDOW;
+    if (jitter_window > MAX_JITTER_WINDOW)
+	jitter_window = MAX_JITTER_WINDOW;
 
     ret = msg_order_alloc(minor_status, o, jitter_window);
     if(ret != GSS_S_COMPLETE)
@@ -94,8 +136,7 @@ _gssapi_msg_order_create(OM_uint32 *minor_status,
     (*o)->flags = flags;
     (*o)->length = 0;
     (*o)->first_seq = seq_num;
-    (*o)->jitter_window = jitter_window;
-    (*o)->elem[0] = seq_num - 1;
+    (*o)->last_seq = seq_num - 1;
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
@@ -104,54 +145,78 @@ _gssapi_msg_order_create(OM_uint32 *minor_status,
 OM_uint32
 _gssapi_msg_order_destroy(struct gss_msg_order **m)
 {
+    if (*m)
+	HEIMDAL_MUTEX_destroy(&(*m)->mutex);
     free(*m);
     *m = NULL;
     return GSS_S_COMPLETE;
 }
 
-static void
-elem_set(struct gss_msg_order *o, unsigned int slot, OM_uint32 val)
+static int
+window_test(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    o->elem[slot % o->jitter_window] = val;
+    OM_uint32 i = seq_num & o->mask;
+    return (o->window[i / 64] >> (i % 64)) & 1;
 }
 
 static void
-elem_insert(struct gss_msg_order *o,
-	    unsigned int after_slot,
-	    OM_uint32 seq_num)
+window_set(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    assert(o->jitter_window > after_slot);
-
-    if (o->length > after_slot)
-	memmove(&o->elem[after_slot + 1], &o->elem[after_slot],
-		(o->length - after_slot - 1) * sizeof(o->elem[0]));
-
-    elem_set(o, after_slot, seq_num);
+    OM_uint32 i = seq_num & o->mask;
 
+    o->window[i / 64] |= (uint64_t)1 << (i % 64);
     if (o->length < o->jitter_window)
 	o->length++;
 }
 
+/*
+ * Move the top of the window to seq_num, forgetting the slots that
+ * the sequence numbers between the old and the new top take over.
+ */
+
+static void
+window_advance(struct gss_msg_order *o, OM_uint32 seq_num)
+{
+    OM_uint32 n = seq_num - o->last_seq;
+    OM_uint32 s = o->last_seq + 1;
+
+    if (n > o->mask) {
+	memset(o->window, 0, ((o->mask + 1) / 64) * sizeof(o->window[0]));
+	o->length = 0;
+    } else {
+	while (n) {
+	    OM_uint32 i = s & o->mask;
+	    OM_uint32 chunk = 64 - (i % 64);
+	    uint64_t m;
+
+	    if (chunk > n)
+		chunk = n;
+	    if (chunk == 64)
+		m = ~(uint64_t)0;
+	    else
+		m = (((uint64_t)1 << chunk) - 1) << (i % 64);
+	    o->window[i / 64] &= ~m;
+	    s += chunk;
+	    n -= chunk;
+	}
+    }
+    o->last_seq = seq_num;
+}
+
 /* rule 1: expected sequence number */
 /* rule 2: > expected sequence number */
 /* rule 3: seqnum < seqnum(first) */
 /* rule 4+5: seqnum in [seqnum(first),seqnum(last)]  */
 
-OM_uint32
-_gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
+static OM_uint32
+msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 {
     OM_uint32 r;
-    size_t i;
-
-    if (o == NULL)
-	return GSS_S_COMPLETE;
-
-    if ((o->flags & (GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG)) == 0)
-	return GSS_S_COMPLETE;
 
     /* check if the packet is the next in order */
-    if (o->elem[0] == seq_num - 1) {
-	elem_insert(o, 0, seq_num);
+    if (o->last_seq == seq_num - 1) {
+	window_advance(o, seq_num);
+	window_set(o, seq_num);
 	return GSS_S_COMPLETE;
     }
 
@@ -159,11 +224,12 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 
     /* sequence number larger then largest sequence number
      * or smaller then the first sequence number */
-    if (seq_num > o->elem[0]
+    if (seq_num > o->last_seq
 	|| seq_num < o->first_seq
 	|| o->length == 0)
     {
-	elem_insert(o, 0, seq_num);
+	window_advance(o, seq_num);
+	window_set(o, seq_num);
 	if (r) {
 	    return GSS_S_COMPLETE;
 	} else {
@@ -171,33 +237,39 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 	}
     }
 
-    assert(o->length > 0);
-
-    /* sequence number smaller the first sequence number */
-    if (seq_num < o->elem[o->length - 1]) {
+    /* sequence number older than the window */
+    if (o->last_seq - seq_num >= o->jitter_window) {
 	if (r)
 	    return(GSS_S_OLD_TOKEN);
 	else
 	    return(GSS_S_UNSEQ_TOKEN);
     }
 
-    if (seq_num == o->elem[o->length - 1]) {
+    if (window_test(o, seq_num))
 	return GSS_S_DUPLICATE_TOKEN;
-    }
 
-    for (i = 0; i < o->length - 1; i++) {
-	if (o->elem[i] == seq_num)
-	    return GSS_S_DUPLICATE_TOKEN;
-	if (o->elem[i + 1] < seq_num && o->elem[i] < seq_num) {
-	    elem_insert(o, i, seq_num);
-	    if (r)
-		return GSS_S_COMPLETE;
-	    else
-		return GSS_S_UNSEQ_TOKEN;
-	}
-    }
+    window_set(o, seq_num);
+    if (r)
+	return GSS_S_COMPLETE;
+    else
+	return GSS_S_UNSEQ_TOKEN;
+}
 
-    return GSS_S_FAILURE;
+OM_uint32
+_gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
+{
+    OM_uint32 ret;
+
+    if (o == NULL)
+	return GSS_S_COMPLETE;
+
+    if ((o->flags & (GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG)) == 0)
+	return GSS_S_COMPLETE;
+
+    HEIMDAL_MUTEX_lock(&o->mutex);
+    ret = msg_order_check(o, seq_num);
+    HEIMDAL_MUTEX_unlock(&o->mutex);
+    return ret;
 }
 
 OM_uint32
@@ -208,37 +280,69 @@ _gssapi_msg_order_f(OM_uint32 flags)
 
 /*
  * Translate `o` into inter-process format and export in to `sp'.
+ *
+ * The format predates the bitmap: a list of jitter_window slots
+ * holding the recorded sequence numbers, highest first, of which the
+ * first length are used.  When nothing has been recorded yet the
+ * first slot holds the sequence number before the expected one.
  */
 
 krb5_error_code
 _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
 {
     krb5_error_code kret;
-    OM_uint32 i;
+    OM_uint32 i, n;
+
+    HEIMDAL_MUTEX_lock(&o->mutex);
+
+    n = 0;
+    if (o->length) {
+	for (i = 0; i < o->jitter_window; i++)
+	    if (window_test(o, o->last_seq - i))
+		n++;
+    }
 
     kret = krb5_store_int32(sp, o->flags);
     if (kret)
-        return kret;
+        goto out;
     kret = krb5_store_int32(sp, o->start);
     if (kret)
-        return kret;
-    kret = krb5_store_int32(sp, o->length);
+        goto out;
+    kret = krb5_store_int32(sp, n);
     if (kret)
-        return kret;
+        goto out;
     kret = krb5_store_int32(sp, o->jitter_window);
     if (kret)
-        return kret;
+        goto out;
     kret = krb5_store_int32(sp, o->first_seq);
     if (kret)
-        return kret;
+        goto out;
 
-    for (i = 0; i < o->jitter_window; i++) {
-        kret = krb5_store_int32(sp, o->elem[i]);
+    n = 0;
+    if (o->length == 0) {
+	kret = krb5_store_int32(sp, o->last_seq);
 	if (kret)
-	    return kret;
+	    goto out;
+	n++;
+    } else {
+	for (i = 0; i < o->jitter_window; i++) {
+	    if (!window_test(o, o->last_seq - i))
+		continue;
+	    kret = krb5_store_int32(sp, o->last_seq - i);
+	    if (kret)
+		goto out;
+	    n++;
+	}
+    }
+    for (; n < o->jitter_window; n++) {
+        kret = krb5_store_int32(sp, 0);
+	if (kret)
+	    goto out;
     }
 
-    return 0;
+ out:
+    HEIMDAL_MUTEX_unlock(&o->mutex);
+    return kret;
 }
 
 OM_uint32
@@ -248,7 +352,9 @@ _gssapi_msg_order_import(OM_uint32 *minor_status,
 {
     OM_uint32 ret;
     krb5_error_code kret;
-    int32_t i, flags, start, length, jitter_window, first_seq;
+    int32_t i, flags, start, length, jitter_window, first_seq, seq;
+
+    *o = NULL;
 
     kret = krb5_ret_int32(sp, &flags);
     if (kret)
@@ -266,20 +372,29 @@ _gssapi_msg_order_import(OM_uint32 *minor_status,
     if (kret)
 	goto failed;
 
+    if (jitter_window <= 0 || jitter_window > MAX_JITTER_WINDOW ||
+	length < 0 || length > jitter_window) {
+	*minor_status = EINVAL;
+	return GSS_S_FAILURE;
+    }
+
     ret = msg_order_alloc(minor_status, o, jitter_window);
     if (ret != GSS_S_COMPLETE)
         return ret;
 
     (*o)->flags = flags;
     (*o)->start = start;
-    (*o)->length = length;
-    (*o)->jitter_window = jitter_window;
     (*o)->first_seq = first_seq;
 
     for( i = 0; i < jitter_window; i++ ) {
-        kret = krb5_ret_int32(sp, (int32_t*)&((*o)->elem[i]));
+	kret = krb5_ret_int32(sp, &seq);
 	if (kret)
 	    goto failed;
+	if (i == 0)
+	    (*o)->last_seq = seq;
+	if (i < length &&
+	    (OM_uint32)((*o)->last_seq - seq) < (OM_uint32)jitter_window)
+	    window_set(*o, seq);
     }
 
     *minor_status = 0;
@@ -32,6 +32,7 @@
  */
 
 #include "gsskrb5_locl.h"
+#include <getarg.h>
 
 struct range {
     size_t lower;
@@ -132,7 +133,343 @@ test_special(krb5_context context, krb5_crypto crypto,
 }
 
 
+static void
+init_ctx(krb5_context context, krb5_crypto crypto, int initiator,
+	 OM_uint32 flags, struct gsskrb5_ctx *ctx)
+{
+    krb5_error_code ret;
+    OM_uint32 maj_stat, min_stat;
+
+    memset(ctx, 0, sizeof(*ctx));
+    HEIMDAL_MUTEX_init(&ctx->ctx_id_mutex);
+    ctx->crypto = crypto;
+    ctx->flags = flags;
+    ctx->more_flags = IS_CFX | (initiator ? LOCAL : 0);
+
+    ret = krb5_auth_con_init(context, &ctx->auth_context);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_auth_con_init");
+    krb5_auth_con_setlocalseqnumber(context, ctx->auth_context, 0);
+
+    maj_stat = _gssapi_msg_order_create(&min_stat, &ctx->order,
+					GSS_C_REPLAY_FLAG, 0, 20, 1);
+    if (maj_stat)
+	errx(1, "_gssapi_msg_order_create: %d", (int)maj_stat);
+}
+
+static void
+free_ctx(krb5_context context, struct gsskrb5_ctx *ctx)
+{
+    _gssapi_msg_order_destroy(&ctx->order);
+    krb5_auth_con_free(context, ctx->auth_context);
+    HEIMDAL_MUTEX_destroy(&ctx->ctx_id_mutex);
+}
+
+enum { IOV_HEADER, IOV_DATA, IOV_PADDING, IOV_TRAILER };
+
+static void
+setup_iov(gss_iov_buffer_desc *iov, void *buf, size_t size,
+	  int with_trailer)
+{
+    iov[IOV_HEADER].type = GSS_IOV_BUFFER_TYPE_HEADER |
+	GSS_IOV_BUFFER_FLAG_ALLOCATE;
+    iov[IOV_HEADER].buffer.length = 0;
+    iov[IOV_HEADER].buffer.value = NULL;
+    iov[IOV_DATA].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[IOV_DATA].buffer.length = size;
+    iov[IOV_DATA].buffer.value = buf;
+    iov[IOV_PADDING].type = GSS_IOV_BUFFER_TYPE_PADDING |
+	GSS_IOV_BUFFER_FLAG_ALLOCATE;
+    iov[IOV_PADDING].buffer.length = 0;
+    iov[IOV_PADDING].buffer.value = NULL;
+    iov[IOV_TRAILER].type = with_trailer ? GSS_IOV_BUFFER_TYPE_TRAILER |
+	GSS_IOV_BUFFER_FLAG_ALLOCATE : GSS_IOV_BUFFER_TYPE_EMPTY;
+    iov[IOV_TRAILER].buffer.length = 0;
+    iov[IOV_TRAILER].buffer.value = NULL;
+}
+
+static void
+check_data(const char *what, size_t size, int conf,
+	   const void *data, size_t len, const void *orig)
+{
+    if (len != size || memcmp(data, orig, size) != 0)
+	errx(1, "%s size %lu conf %d: message differs",
+	     what, (unsigned long)size, conf);
+}
+
+/*
+ * Rotate the stream of data, padding and trailer buffers right by rrc
+ * bytes and record it in the token, the way a peer may send it.
+ */
+
+static void
+rotate_iov(gss_iov_buffer_desc *iov, size_t rrc)
+{
+    gss_cfx_wrap_token token = iov[IOV_HEADER].buffer.value;
+    size_t i, len = 0, off = 0;
+    u_char *p;
+    int j;
+
+    for (j = IOV_DATA; j <= IOV_TRAILER; j++)
+	len += iov[j].buffer.length;
+    p = malloc(len);
+    if (p == NULL)
+	errx(1, "out of memory");
+    for (j = IOV_DATA; j <= IOV_TRAILER; j++) {
+	for (i = 0; i < iov[j].buffer.length; i++)
+	    p[(off + i + rrc) % len] = ((u_char *)iov[j].buffer.value)[i];
+	off += iov[j].buffer.length;
+    }
+    for (off = 0, j = IOV_DATA; j <= IOV_TRAILER; j++) {
+	memcpy(iov[j].buffer.value, p + off, iov[j].buffer.length);
+	off += iov[j].buffer.length;
+    }
+    free(p);
+
+    token->RRC[0] = (rrc >> 8) & 0xFF;
+    token->RRC[1] = (rrc >> 0) & 0xFF;
+}
+
+/*
+ * Wrap with the initiator and unwrap with the acceptor, through the
+ * buffer and the iov interfaces and across them.
+ */
+
+static void
+test_wrap(krb5_context context, krb5_crypto crypto, OM_uint32 flags,
+	  size_t size, int conf)
+{
+    struct gsskrb5_ctx ictx, actx;
+    gss_buffer_desc in, token, out;
+    gss_iov_buffer_desc iov[4];
+    OM_uint32 maj_stat, min_stat;
+    int conf_state, dce = (flags & GSS_C_DCE_STYLE) != 0;
+    u_char *orig, *buf, *p;
+    size_t i;
+
+    init_ctx(context, crypto, 1, flags, &ictx);
+    init_ctx(context, crypto, 0, flags, &actx);
+
+    orig = malloc(size + 1);
+    buf = malloc(size + 1);
+    if (orig == NULL || buf == NULL)
+	errx(1, "out of memory");
+    for (i = 0; i < size; i++)
+	orig[i] = (u_char)(i * 7 + size);
+
+    /* gss_wrap -> gss_unwrap */
+    in.value = orig;
+    in.length = size;
+    maj_stat = _gssapi_wrap_cfx(&min_stat, &ictx, context, conf, &in,
+				&conf_state, &token);
+    if (maj_stat)
+	errx(1, "_gssapi_wrap_cfx: %d/%d", (int)maj_stat, (int)min_stat);
+    if (conf_state != conf)
+	errx(1, "_gssapi_wrap_cfx: conf_state");
+    maj_stat = _gssapi_unwrap_cfx(&min_stat, &actx, context, &token, &out,
+				  &conf_state, NULL);
+    if (maj_stat)
+	errx(1, "_gssapi_unwrap_cfx: %d/%d", (int)maj_stat, (int)min_stat);
+    check_data("wrap/unwrap", size, conf, out.value, out.length, orig);
+    gss_release_buffer(&min_stat, &out);
+    gss_release_buffer(&min_stat, &token);
+
+    /* a modified token must not unwrap */
+    maj_stat = _gssapi_wrap_cfx(&min_stat, &ictx, context, conf, &in,
+				&conf_state, &token);
+    if (maj_stat)
+	errx(1, "_gssapi_wrap_cfx: %d/%d", (int)maj_stat, (int)min_stat);
+    ((u_char *)token.value)[token.length - 1 - size / 2] ^= 1;
+    maj_stat = _gssapi_unwrap_cfx(&min_stat, &actx, context, &token, &out,
+				  &conf_state, NULL);
+    if (maj_stat == GSS_S_COMPLETE)
+	errx(1, "_gssapi_unwrap_cfx: modified token accepted");
+    gss_release_buffer(&min_stat, &token);
+
+    if (dce && !conf)
+	goto out;
+
+    /* gss_wrap_iov -> gss_unwrap_iov, with and without trailer */
+    for (i = 0; i < 2; i++) {
+	if (dce && i == 0)
+	    continue;
+	memcpy(buf, orig, size);
+	setup_iov(iov, buf, size, i == 0);
+	if (dce)
+	    iov[IOV_PADDING].type = GSS_IOV_BUFFER_TYPE_EMPTY;
+	maj_stat = _gssapi_wrap_cfx_iov(&min_stat, &ictx, context, conf,
+					&conf_state, iov, 4);
+	if (maj_stat)
+	    errx(1, "_gssapi_wrap_cfx_iov: %d/%d",
+		 (int)maj_stat, (int)min_stat);
+	if (conf && size >= 16 && memcmp(buf, orig, size) == 0)
+	    errx(1, "_gssapi_wrap_cfx_iov: data not encrypted");
+
+	/* rotate the trailer to the front, unwrap has to undo it */
+	if (i == 0 && conf)
+	    rotate_iov(iov, 1 + size % 40);
+
+	maj_stat = _gssapi_unwrap_cfx_iov(&min_stat, &actx, context,
+					  &conf_state, NULL, iov, 4);
+	if (maj_stat)
+	    errx(1, "_gssapi_unwrap_cfx_iov: %d/%d",
+		 (int)maj_stat, (int)min_stat);
+	check_data("wrap_iov/unwrap_iov", size, conf,
+		   buf, size, orig);
+	gss_release_iov_buffer(&min_stat, iov, 4);
+    }
 
+    /* gss_wrap_iov without trailer produces a gss_wrap token */
+    memcpy(buf, orig, size);
+    setup_iov(iov, buf, size, 0);
+    if (dce)
+	iov[IOV_PADDING].type = GSS_IOV_BUFFER_TYPE_EMPTY;
+    maj_stat = _gssapi_wrap_cfx_iov(&min_stat, &ictx, context, conf,
+				    &conf_state, iov, 4);
+    if (maj_stat)
+	errx(1, "_gssapi_wrap_cfx_iov: %d/%d", (int)maj_stat, (int)min_stat);
+    token.length = iov[IOV_HEADER].buffer.length + size +
+	iov[IOV_PADDING].buffer.length;
+    token.value = p = malloc(token.length);
+    if (p == NULL)
+	errx(1, "out of memory");
+    memcpy(p, iov[IOV_HEADER].buffer.value, iov[IOV_HEADER].buffer.length);
+    p += iov[IOV_HEADER].buffer.length;
+    memcpy(p, buf, size);
+    p += size;
+    if (iov[IOV_PADDING].buffer.length)
+	memcpy(p, iov[IOV_PADDING].buffer.value,
+	       iov[IOV_PADDING].buffer.length);
+    gss_release_iov_buffer(&min_stat, iov, 4);
+
+    maj_stat = _gssapi_unwrap_cfx(&min_stat, &actx, context, &token, &out,
+				  &conf_state, NULL);
+    if (maj_stat)
+	errx(1, "_gssapi_unwrap_cfx: wrap_iov token: %d/%d",
+	     (int)maj_stat, (int)min_stat);
+    check_data("wrap_iov/unwrap", size, conf, out.value, out.length, orig);
+    gss_release_buffer(&min_stat, &out);
+    free(token.value);
+
+ out:
+    free(orig);
+    free(buf);
+    free_ctx(context, &ictx);
+    free_ctx(context, &actx);
+}
+
+static void
+print_rate(const char *name, size_t size, int iterations,
+	   struct timeval *tv)
+{
+    double t = tv->tv_sec + tv->tv_usec / 1000000.0;
+
+    if (t <= 0)
+	t = 0.000001;
+
+    printf("%-18s size: %8lu iterations: %6d time: %3ld.%06ld "
+	   "%9.2f MB/s\n",
+	   name, (unsigned long)size, iterations,
+	   (long)tv->tv_sec, (long)tv->tv_usec,
+	   (double)size * iterations / t / (1024 * 1024));
+}
+
+/*
+ * Throughput of a wrap and unwrap round trip with confidentiality.
+ */
+
+static void
+time_wrap(krb5_context context, krb5_crypto crypto, size_t size,
+	  int iterations)
+{
+    struct gsskrb5_ctx ictx, actx;
+    gss_buffer_desc in, token, out;
+    gss_iov_buffer_desc iov[4];
+    OM_uint32 maj_stat, min_stat;
+    struct timeval tv1, tv2;
+    u_char *buf;
+    int i;
+
+    init_ctx(context, crypto, 1, 0, &ictx);
+    init_ctx(context, crypto, 0, 0, &actx);
+
+    buf = calloc(1, size);
+    if (buf == NULL)
+	errx(1, "out of memory");
+
+    in.value = buf;
+    in.length = size;
+
+    gettimeofday(&tv1, NULL);
+    for (i = 0; i < iterations; i++) {
+	maj_stat = _gssapi_wrap_cfx(&min_stat, &ictx, context, 1, &in,
+				    NULL, &token);
+	if (maj_stat)
+	    errx(1, "_gssapi_wrap_cfx: %d/%d", (int)maj_stat, (int)min_stat);
+	maj_stat = _gssapi_unwrap_cfx(&min_stat, &actx, context, &token,
+				      &out, NULL, NULL);
+	if (maj_stat)
+	    errx(1, "_gssapi_unwrap_cfx: %d/%d",
+		 (int)maj_stat, (int)min_stat);
+	gss_release_buffer(&min_stat, &token);
+	gss_release_buffer(&min_stat, &out);
+    }
+    gettimeofday(&tv2, NULL);
+    timevalsub(&tv2, &tv1);
+    print_rate("wrap/unwrap", size, iterations, &tv2);
+
+    gettimeofday(&tv1, NULL);
+    for (i = 0; i < iterations; i++) {
+	setup_iov(iov, buf, size, 1);
+	maj_stat = _gssapi_wrap_cfx_iov(&min_stat, &ictx, context, 1,
+					NULL, iov, 4);
+	if (maj_stat)
+	    errx(1, "_gssapi_wrap_cfx_iov: %d/%d",
+		 (int)maj_stat, (int)min_stat);
+	maj_stat = _gssapi_unwrap_cfx_iov(&min_stat, &actx, context,
+					  NULL, NULL, iov, 4);
+	if (maj_stat)
+	    errx(1, "_gssapi_unwrap_cfx_iov: %d/%d",
+		 (int)maj_stat, (int)min_stat);
+	gss_release_iov_buffer(&min_stat, iov, 4);
+    }
+    gettimeofday(&tv2, NULL);
+    timevalsub(&tv2, &tv1);
+    print_rate("wrap_iov/unwrap_iov", size, iterations, &tv2);
+
+    free(buf);
+    free_ctx(context, &ictx);
+    free_ctx(context, &actx);
+}
+
+static size_t wrap_sizes[] = {
+    0, 1, 15, 16, 17, 31, 32, 33, 60, 100, 1000, 4099, 65536
+};
+
+static size_t time_sizes[] = {
+    1024, 16384, 65536, 1024 * 1024
+};
+
+static int benchmark_flag = 0;
+static int iterations = 100;
+static int version_flag = 0;
+static int help_flag	= 0;
+
+static struct getargs args[] = {
+    {"benchmark", 0,	arg_flag,	&benchmark_flag,
+     "time wrap and unwrap", NULL },
+    {"iterations", 0,	arg_integer,	&iterations,
+     "number of iterations for the benchmark", NULL },
+    {"version",	0,	arg_flag,	&version_flag, "print version", NULL },
+    {"help",	0,	arg_flag,	&help_flag,  NULL, NULL }
+};
+
+static void
+usage (int ret)
+{
+    arg_printusage (args, sizeof(args)/sizeof(*args), NULL, "");
+    exit (ret);
+}
 
 int
 main(int argc, char **argv)
@@ -141,7 +478,26 @@ main(int argc, char **argv)
     krb5_error_code ret;
     krb5_context context;
     krb5_crypto crypto;
-    int i;
+    int i, optidx = 0;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage (0);
+
+    if(version_flag){
+	print_version(NULL);
+	exit(0);
+    }
+
+    argc -= optidx;
+    argv += optidx;
+
+    if (argc != 0)
+	usage(1);
 
     ret = krb5_init_context(&context);
     if (ret)
@@ -165,6 +521,17 @@ main(int argc, char **argv)
 	test_range(&tests[i], 0, context, crypto);
     }
 
+    for (i = 0; i < sizeof(wrap_sizes)/sizeof(wrap_sizes[0]); i++) {
+	test_wrap(context, crypto, 0, wrap_sizes[i], 1);
+	test_wrap(context, crypto, 0, wrap_sizes[i], 0);
+	test_wrap(context, crypto, GSS_C_DCE_STYLE, wrap_sizes[i], 1);
+    }
+
+    if (benchmark_flag) {
+	for (i = 0; i < sizeof(time_sizes)/sizeof(time_sizes[0]); i++)
+	    time_wrap(context, crypto, time_sizes[i], iterations);
+    }
+
     krb5_free_keyblock_contents(context, &keyblock);
     krb5_crypto_destroy(context, crypto);
     krb5_free_context(context);
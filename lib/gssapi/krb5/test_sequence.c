@@ -347,6 +347,70 @@ struct {
     }
 };
 
+/*
+ * A large window with heavy reordering, checked again after an
+ * export/import in the middle of the stream.
+ */
+
+static int
+check(struct gss_msg_order *o, OM_uint32 seq, OM_uint32 expected)
+{
+    OM_uint32 maj_stat = _gssapi_msg_order_check(o, seq);
+
+    if (maj_stat != expected) {
+	printf("window test seq %lu failed with %d (should have been %d)\n",
+	       (unsigned long)seq, (int)maj_stat, (int)expected);
+	return 1;
+    }
+    return 0;
+}
+
+static int
+test_window(void)
+{
+    struct gss_msg_order *o;
+    OM_uint32 maj_stat, min_stat, i, j;
+    krb5_storage *sp;
+    int failed = 0;
+
+    maj_stat = _gssapi_msg_order_create(&min_stat, &o, GSS_C_REPLAY_FLAG,
+					0, 4096, 0);
+    if (maj_stat)
+	errx(1, "create: %d %d", maj_stat, min_stat);
+
+    /* blocks of 1000 arriving backwards */
+    for (i = 0; i < 10000; i += 1000)
+	for (j = 1000; j > 0; j--)
+	    failed += check(o, i + j - 1, GSS_S_COMPLETE);
+
+    failed += check(o, 9990, GSS_S_DUPLICATE_TOKEN);
+    failed += check(o, 9999 - 4096, GSS_S_OLD_TOKEN);
+
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	errx(1, "krb5_storage_from_emem");
+    if (_gssapi_msg_order_export(sp, o))
+	errx(1, "export");
+    _gssapi_msg_order_destroy(&o);
+
+    krb5_storage_seek(sp, 0, SEEK_SET);
+    maj_stat = _gssapi_msg_order_import(&min_stat, sp, &o);
+    if (maj_stat)
+	errx(1, "import: %d %d", maj_stat, min_stat);
+    krb5_storage_free(sp);
+
+    failed += check(o, 9990, GSS_S_DUPLICATE_TOKEN);
+    failed += check(o, 9999 - 4095, GSS_S_DUPLICATE_TOKEN);
+    failed += check(o, 9999 - 4096, GSS_S_OLD_TOKEN);
+    failed += check(o, 10001, GSS_S_COMPLETE);
+    failed += check(o, 10000, GSS_S_COMPLETE);
+    failed += check(o, 10000, GSS_S_DUPLICATE_TOKEN);
+
+    _gssapi_msg_order_destroy(&o);
+
+    return failed;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -361,6 +425,8 @@ main(int argc, char **argv)
 		     pl[i].error_code))
 	    failed++;
     }
+    if (test_window())
+	failed++;
     if (failed)
 	printf("FAILED %d tests\n", failed);
     return failed != 0;
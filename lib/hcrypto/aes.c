@@ -41,12 +41,211 @@
 #include "rijndael-alg-fst.h"
 #include "aes.h"
 
+/*
+ * On x86 the AES-NI instructions are used when the CPU has them.  The
+ * support is compiled with per-function target attributes so the rest
+ * of the library does not need -maes, and the choice is made at
+ * runtime with CPUID.
+ *
+ * The key schedule is still computed by rijndaelKeySetupEnc/Dec; the
+ * decryption schedule it produces (reversed, InvMixColumns applied to
+ * the inner round keys) is exactly what AESDEC expects.  The only
+ * difference is that the fst code keeps the round keys as host order
+ * words of the big endian key bytes, while AES-NI wants the bytes, so
+ * the words are rewritten in place when the AES-NI path is in use.
+ * The CPU cannot change under us, so an AES_KEY is always used by the
+ * same backend that set it up.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || \
+     (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define HC_AES_NI 1
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+#ifdef HC_AES_NI
+
+#define AESNI_FUNC __attribute__((target("aes,sse2")))
+
+static int aesni_state = -1;
+
+static int
+aesni_available(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    int state = aesni_state;
+
+    if (state < 0) {
+	state = 0;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+	    (ecx & bit_AES) && (edx & bit_SSE2))
+	    state = 1;
+	aesni_state = state;
+    }
+    return state;
+}
+
+static void
+aesni_key_bytes(AES_KEY *key)
+{
+    unsigned char *p;
+    uint32_t w;
+    int i;
+
+    for (i = 0; i < (key->rounds + 1) * 4; i++) {
+	w = key->key[i];
+	p = (unsigned char *)&key->key[i];
+	p[0] = (w >> 24) & 0xff;
+	p[1] = (w >> 16) & 0xff;
+	p[2] = (w >>  8) & 0xff;
+	p[3] = (w      ) & 0xff;
+    }
+}
+
+static AESNI_FUNC void
+aesni_load_key(const AES_KEY *key, __m128i *rk)
+{
+    const __m128i *k = (const __m128i *)key->key;
+    int r;
+
+    for (r = 0; r <= key->rounds; r++)
+	rk[r] = _mm_loadu_si128(&k[r]);
+}
+
+static AESNI_FUNC void
+aesni_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+    const __m128i *k = (const __m128i *)key->key;
+    __m128i b;
+    int r;
+
+    b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in),
+		      _mm_loadu_si128(&k[0]));
+    for (r = 1; r < key->rounds; r++)
+	b = _mm_aesenc_si128(b, _mm_loadu_si128(&k[r]));
+    b = _mm_aesenclast_si128(b, _mm_loadu_si128(&k[key->rounds]));
+    _mm_storeu_si128((__m128i *)out, b);
+}
+
+static AESNI_FUNC void
+aesni_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+    const __m128i *k = (const __m128i *)key->key;
+    __m128i b;
+    int r;
+
+    b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in),
+		      _mm_loadu_si128(&k[0]));
+    for (r = 1; r < key->rounds; r++)
+	b = _mm_aesdec_si128(b, _mm_loadu_si128(&k[r]));
+    b = _mm_aesdeclast_si128(b, _mm_loadu_si128(&k[key->rounds]));
+    _mm_storeu_si128((__m128i *)out, b);
+}
+
+/*
+ * CBC encryption is serial, all we can do is keep the round keys in
+ * registers across blocks.
+ */
+
+static AESNI_FUNC void
+aesni_cbc_encrypt(const unsigned char *in, unsigned char *out,
+		  unsigned long blocks, const AES_KEY *key, unsigned char *iv)
+{
+    __m128i rk[AES_MAXNR + 1], b;
+    int r, nr = key->rounds;
+
+    aesni_load_key(key, rk);
+    b = _mm_loadu_si128((const __m128i *)iv);
+    while (blocks--) {
+	b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)in));
+	b = _mm_xor_si128(b, rk[0]);
+	for (r = 1; r < nr; r++)
+	    b = _mm_aesenc_si128(b, rk[r]);
+	b = _mm_aesenclast_si128(b, rk[nr]);
+	_mm_storeu_si128((__m128i *)out, b);
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+    _mm_storeu_si128((__m128i *)iv, b);
+}
+
+/*
+ * CBC decryption of different blocks is independent, so run four
+ * blocks through the rounds interleaved to hide the AESDEC latency.
+ * All input is loaded before anything is stored, in == out is fine.
+ */
+
+static AESNI_FUNC void
+aesni_cbc_decrypt(const unsigned char *in, unsigned char *out,
+		  unsigned long blocks, const AES_KEY *key, unsigned char *iv)
+{
+    __m128i rk[AES_MAXNR + 1], prev, c0, c1, c2, c3, b0, b1, b2, b3;
+    int r, nr = key->rounds;
+
+    aesni_load_key(key, rk);
+    prev = _mm_loadu_si128((const __m128i *)iv);
+
+    while (blocks >= 4) {
+	c0 = _mm_loadu_si128((const __m128i *)(in + 0 * AES_BLOCK_SIZE));
+	c1 = _mm_loadu_si128((const __m128i *)(in + 1 * AES_BLOCK_SIZE));
+	c2 = _mm_loadu_si128((const __m128i *)(in + 2 * AES_BLOCK_SIZE));
+	c3 = _mm_loadu_si128((const __m128i *)(in + 3 * AES_BLOCK_SIZE));
+	b0 = _mm_xor_si128(c0, rk[0]);
+	b1 = _mm_xor_si128(c1, rk[0]);
+	b2 = _mm_xor_si128(c2, rk[0]);
+	b3 = _mm_xor_si128(c3, rk[0]);
+	for (r = 1; r < nr; r++) {
+	    b0 = _mm_aesdec_si128(b0, rk[r]);
+	    b1 = _mm_aesdec_si128(b1, rk[r]);
+	    b2 = _mm_aesdec_si128(b2, rk[r]);
+	    b3 = _mm_aesdec_si128(b3, rk[r]);
+	}
+	b0 = _mm_aesdeclast_si128(b0, rk[nr]);
+	b1 = _mm_aesdeclast_si128(b1, rk[nr]);
+	b2 = _mm_aesdeclast_si128(b2, rk[nr]);
+	b3 = _mm_aesdeclast_si128(b3, rk[nr]);
+	b0 = _mm_xor_si128(b0, prev);
+	b1 = _mm_xor_si128(b1, c0);
+	b2 = _mm_xor_si128(b2, c1);
+	b3 = _mm_xor_si128(b3, c2);
+	prev = c3;
+	_mm_storeu_si128((__m128i *)(out + 0 * AES_BLOCK_SIZE), b0);
+	_mm_storeu_si128((__m128i *)(out + 1 * AES_BLOCK_SIZE), b1);
+	_mm_storeu_si128((__m128i *)(out + 2 * AES_BLOCK_SIZE), b2);
+	_mm_storeu_si128((__m128i *)(out + 3 * AES_BLOCK_SIZE), b3);
+	blocks -= 4;
+	in += 4 * AES_BLOCK_SIZE;
+	out += 4 * AES_BLOCK_SIZE;
+    }
+
+    while (blocks--) {
+	c0 = _mm_loadu_si128((const __m128i *)in);
+	b0 = _mm_xor_si128(c0, rk[0]);
+	for (r = 1; r < nr; r++)
+	    b0 = _mm_aesdec_si128(b0, rk[r]);
+	b0 = _mm_aesdeclast_si128(b0, rk[nr]);
+	_mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, prev));
+	prev = c0;
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+    _mm_storeu_si128((__m128i *)iv, prev);
+}
+
+#endif /* HC_AES_NI */
+
 int
 AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
     key->rounds = rijndaelKeySetupEnc(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
+#ifdef HC_AES_NI
+    if (aesni_available())
+	aesni_key_bytes(key);
+#endif
     return 0;
 }
 
@@ -56,18 +255,34 @@ AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
     key->rounds = rijndaelKeySetupDec(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
+#ifdef HC_AES_NI
+    if (aesni_available())
+	aesni_key_bytes(key);
+#endif
     return 0;
 }
 
 void
 AES_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HC_AES_NI
+    if (aesni_available()) {
+	aesni_encrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelEncrypt(key->key, key->rounds, in, out);
 }
 
 void
 AES_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HC_AES_NI
+    if (aesni_available()) {
+	aesni_decrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelDecrypt(key->key, key->rounds, in, out);
 }
 
@@ -79,6 +294,20 @@ AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
     unsigned char tmp[AES_BLOCK_SIZE];
     int i;
 
+#ifdef HC_AES_NI
+    if (aesni_available() && size >= AES_BLOCK_SIZE) {
+	unsigned long blocks = size / AES_BLOCK_SIZE;
+
+	if (forward_encrypt)
+	    aesni_cbc_encrypt(in, out, blocks, key, iv);
+	else
+	    aesni_cbc_decrypt(in, out, blocks, key, iv);
+	in += blocks * AES_BLOCK_SIZE;
+	out += blocks * AES_BLOCK_SIZE;
+	size -= blocks * AES_BLOCK_SIZE;
+    }
+#endif
+
     if (forward_encrypt) {
 	while (size >= AES_BLOCK_SIZE) {
 	    for (i = 0; i < AES_BLOCK_SIZE; i++)
@@ -72,4 +72,64 @@ cshift64 (uint64_t x, unsigned int n)
   return ((uint64_t)x << (uint64_t)n) | ((uint64_t)x >> ((uint64_t)64 - (uint64_t)n));
 }
 
+/*
+ * SHA-1 and SHA-256 use the x86 SHA extensions when the CPU has them.
+ * As with AES-NI in aes.c the code is compiled with per-function
+ * target attributes and selected at runtime with CPUID, so callers
+ * and the EVP digests do not need to know which backend is in use.
+ *
+ * There is no AVX2 multi-buffer variant.  It only pays with several
+ * independent messages in flight.  The digest API hashes one stream
+ * at a time, and PBKDF2 for the AES enctypes runs at most two
+ * independent HMAC chains, which leaves most of the lanes empty.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define HC_SHA_NI 1
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHANI_FUNC __attribute__((target("sha,sse4.1")))
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+
+static inline int
+sha_ni_available(void)
+{
+    static int sha_ni_state = -1;
+    unsigned int eax, ebx, ecx, edx;
+    int state = sha_ni_state;
+
+    if (state < 0) {
+	state = 0;
+	if (__get_cpuid_max(0, NULL) >= 7 &&
+	    __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+	    (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)) {
+	    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+	    if (ebx & bit_SHA)
+		state = 1;
+	}
+	sha_ni_state = state;
+    }
+    return state;
+}
+#endif
+
+/* load a big endian 32 bit word from a possibly unaligned pointer */
+static inline uint32_t
+load_be32 (const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t
+load_be64 (const unsigned char *p)
+{
+    return ((uint64_t)load_be32(p) << 32) | load_be32(p + 4);
+}
+
 #endif /* __hash_h__ */
@@ -44,9 +44,36 @@
 #include <md5.h>
 #include <sha.h>
 #include <evp.h>
+#include <getarg.h>
 
 #define ONE_MILLION_A "one million a's"
 
+static int benchmark_flag;
+static int loops = 1000;
+static int version_flag;
+static int help_flag;
+
+static struct getargs args[] = {
+    { "benchmark",	0,	arg_flag,	&benchmark_flag,
+      "measure EVP digest throughput", NULL },
+    { "loops",		0,	arg_integer,	&loops,
+      "number of 64KB buffers hashed per size", "loops" },
+    { "version",	0,	arg_flag,	&version_flag,
+      "print version", NULL },
+    { "help",		0,	arg_flag,	&help_flag,
+      NULL, 	NULL }
+};
+
+static void
+usage (int ret)
+{
+    arg_printusage (args,
+		    sizeof(args)/sizeof(*args),
+		    NULL,
+		    "");
+    exit (ret);
+}
+
 struct hash_foo {
     const char *name;
     size_t psize;
@@ -334,10 +361,69 @@ hash_test (struct hash_foo *hash, struct test *tests)
     return 0;
 }
 
+/*
+ * Hash the same amount of data in messages of several sizes through
+ * the EVP interface, so both the per-message cost (padding, the final
+ * block) and the bulk rate show up.
+ */
+static void
+hash_benchmark (struct hash_foo *hash)
+{
+    static const size_t sizes[] = { 64, 1024, 16384, 65536 };
+    unsigned char res[EVP_MAX_MD_SIZE];
+    struct timeval start, stop;
+    unsigned char *buf;
+    unsigned int esize;
+    size_t i, j, n;
+    double usec;
+
+    if (hash->evp() == NULL) {
+	printf("%s: unavailable\n", hash->name);
+	return;
+    }
+
+    buf = emalloc(65536);
+    for (i = 0; i < 65536; i++)
+	buf[i] = i & 0xff;
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+	n = (size_t)loops * (65536 / sizes[i]);
+
+	gettimeofday(&start, NULL);
+	for (j = 0; j < n; j++)
+	    EVP_Digest(buf, sizes[i], res, &esize, hash->evp(), NULL);
+	gettimeofday(&stop, NULL);
+	timevalsub(&stop, &start);
+
+	usec = stop.tv_sec * 1000000.0 + stop.tv_usec;
+	if (usec < 1)
+	    usec = 1;
+	printf("%-8s %6lu bytes: %9.1f MB/s\n", hash->name,
+	       (unsigned long)sizes[i], (double)n * sizes[i] / usec);
+    }
+    free(buf);
+}
+
 int
-main (void)
+main (int argc, char **argv)
 {
-    return
+    int idx = 0;
+    int ret;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &idx))
+	usage(1);
+
+    if (help_flag)
+	usage(0);
+
+    if(version_flag) {
+	print_version(NULL);
+	exit(0);
+    }
+
+    ret =
 	hash_test(&md2, md2_tests) +
 	hash_test(&md4, md4_tests) +
 	hash_test(&md5, md5_tests) +
@@ -345,4 +431,15 @@ main (void)
 	hash_test(&sha256, sha256_tests) +
 	hash_test(&sha384, sha384_tests) +
 	hash_test(&sha512, sha512_tests);
+
+    if (ret == 0 && benchmark_flag) {
+	if (loops < 1)
+	    loops = 1;
+	hash_benchmark(&md5);
+	hash_benchmark(&sha1);
+	hash_benchmark(&sha256);
+	hash_benchmark(&sha512);
+    }
+
+    return ret;
 }
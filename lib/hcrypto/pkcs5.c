@@ -39,7 +39,69 @@
 #endif
 
 #include <evp.h>
-#include <hmac.h>
+#include <sha.h>
+
+/*
+ * HMAC-SHA1 with the key already absorbed: the ipad and opad blocks
+ * only depend on the password, so they are hashed once and every
+ * iteration of the PBKDF2 chain restarts from the saved SHA-1 states.
+ * That makes an iteration two compression function calls instead of
+ * four plus an EVP/HMAC context setup.
+ */
+
+struct hmac_sha1_pads {
+    SHA_CTX inner;
+    SHA_CTX outer;
+};
+
+static void
+hmac_sha1_pads_init(struct hmac_sha1_pads *pads,
+		    const void *password, size_t password_len)
+{
+    unsigned char pad[64], tk[SHA_DIGEST_LENGTH];
+    const unsigned char *k = password;
+    SHA_CTX ctx;
+    size_t i;
+
+    if (password_len > sizeof(pad)) {
+	SHA1_Init(&ctx);
+	SHA1_Update(&ctx, password, password_len);
+	SHA1_Final(tk, &ctx);
+	k = tk;
+	password_len = sizeof(tk);
+    }
+
+    memset(pad, 0x36, sizeof(pad));
+    for (i = 0; i < password_len; i++)
+	pad[i] ^= k[i];
+    SHA1_Init(&pads->inner);
+    SHA1_Update(&pads->inner, pad, sizeof(pad));
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (i = 0; i < password_len; i++)
+	pad[i] ^= k[i];
+    SHA1_Init(&pads->outer);
+    SHA1_Update(&pads->outer, pad, sizeof(pad));
+
+    memset(pad, 0, sizeof(pad));
+    memset(tk, 0, sizeof(tk));
+    memset(&ctx, 0, sizeof(ctx));
+}
+
+/* u = HMAC(key, u) */
+static void
+hmac_sha1_pads_step(const struct hmac_sha1_pads *pads,
+		    unsigned char u[SHA_DIGEST_LENGTH])
+{
+    SHA_CTX ctx;
+
+    ctx = pads->inner;
+    SHA1_Update(&ctx, u, SHA_DIGEST_LENGTH);
+    SHA1_Final(u, &ctx);
+    ctx = pads->outer;
+    SHA1_Update(&ctx, u, SHA_DIGEST_LENGTH);
+    SHA1_Final(u, &ctx);
+}
 
 /**
  * As descriped in PKCS5, convert a password, salt, and iteration counter into a crypto key.
@@ -63,54 +125,43 @@ PKCS5_PBKDF2_HMAC_SHA1(const void * password, size_t password_len,
 		       unsigned long iter,
 		       size_t keylen, void *key)
 {
-    size_t datalen, leftofkey, checksumsize;
-    char *data, *tmpcksum;
+    struct hmac_sha1_pads pads;
+    unsigned char u[SHA_DIGEST_LENGTH], keypartbuf[4];
+    size_t leftofkey, len;
     uint32_t keypart;
-    const EVP_MD *md;
     unsigned long i;
-    int j;
-    char *p;
-    unsigned int hmacsize;
-
-    md = EVP_sha1();
-    checksumsize = EVP_MD_size(md);
-    datalen = salt_len + 4;
-
-    tmpcksum = malloc(checksumsize + datalen);
-    if (tmpcksum == NULL)
-	return 0;
-
-    data = &tmpcksum[checksumsize];
+    unsigned char *p;
+    SHA_CTX ctx;
+    size_t j;
 
-    memcpy(data, salt, salt_len);
+    hmac_sha1_pads_init(&pads, password, password_len);
 
     keypart = 1;
     leftofkey = keylen;
     p = key;
 
     while (leftofkey) {
-	int len;
-
-	if (leftofkey > checksumsize)
-	    len = checksumsize;
-	else
-	    len = leftofkey;
-
-	data[datalen - 4] = (keypart >> 24) & 0xff;
-	data[datalen - 3] = (keypart >> 16) & 0xff;
-	data[datalen - 2] = (keypart >> 8)  & 0xff;
-	data[datalen - 1] = (keypart)       & 0xff;
-
-	HMAC(md, password, password_len, data, datalen,
-	     tmpcksum, &hmacsize);
-
-	memcpy(p, tmpcksum, len);
+	len = min(leftofkey, sizeof(u));
+
+	keypartbuf[0] = (keypart >> 24) & 0xff;
+	keypartbuf[1] = (keypart >> 16) & 0xff;
+	keypartbuf[2] = (keypart >> 8)  & 0xff;
+	keypartbuf[3] = (keypart)       & 0xff;
+
+	ctx = pads.inner;
+	SHA1_Update(&ctx, salt, salt_len);
+	SHA1_Update(&ctx, keypartbuf, sizeof(keypartbuf));
+	SHA1_Final(u, &ctx);
+	ctx = pads.outer;
+	SHA1_Update(&ctx, u, sizeof(u));
+	SHA1_Final(u, &ctx);
+
+	memcpy(p, u, len);
 	for (i = 1; i < iter; i++) {
-	    HMAC(md, password, password_len, tmpcksum, checksumsize,
-		 tmpcksum, &hmacsize);
+	    hmac_sha1_pads_step(&pads, u);
 
 	    for (j = 0; j < len; j++)
-		p[j] ^= tmpcksum[j];
+		p[j] ^= u[j];
 	}
 
 	p += len;
@@ -118,7 +169,9 @@ PKCS5_PBKDF2_HMAC_SHA1(const void * password, size_t password_len,
 	keypart++;
     }
 
-    free(tmpcksum);
+    memset(&pads, 0, sizeof(pads));
+    memset(&ctx, 0, sizeof(ctx));
+    memset(u, 0, sizeof(u));
 
     return 1;
 }
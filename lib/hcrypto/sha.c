@@ -197,30 +197,126 @@ calc (struct sha *m, uint32_t *in)
   E += EE;
 }
 
+#ifdef HC_SHA_NI
+
+#define SHA1_LOAD(M, p) \
+  M = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), mask)
+
 /*
- * From `Performance analysis of MD5' by Joseph D. Touch <touch@isi.edu>
+ * Four rounds of the middle of the schedule: M0 holds the current
+ * words, M1/M2/M3 the ones being prepared for later rounds.
  */
+#define SHA1_ROUNDS4(E, Enext, M0, M1, M2, M3, f) \
+  do { \
+    E = _mm_sha1nexte_epu32(E, M0); \
+    Enext = abcd; \
+    M1 = _mm_sha1msg2_epu32(M1, M0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, E, f); \
+    M3 = _mm_sha1msg1_epu32(M3, M0); \
+    M2 = _mm_xor_si128(M2, M0); \
+  } while (0)
 
-#if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-static inline uint32_t
-swap_uint32_t (uint32_t t)
+static SHANI_FUNC void
+shani_blocks(struct sha *m, const unsigned char *p, size_t blocks)
 {
-#define ROL(x,n) ((x)<<(n))|((x)>>(32-(n)))
-  uint32_t temp1, temp2;
-
-  temp1   = cshift(t, 16);
-  temp2   = temp1 >> 8;
-  temp1  &= 0x00ff00ff;
-  temp2  &= 0x00ff00ff;
-  temp1 <<= 8;
-  return temp1 | temp2;
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+				      0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+
+  abcd = _mm_loadu_si128((const __m128i *)m->counter);
+  abcd = _mm_shuffle_epi32(abcd, 0x1b);
+  e0 = _mm_set_epi32(m->counter[4], 0, 0, 0);
+
+  while (blocks--) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    /* t=[0,15] */
+    SHA1_LOAD(msg0, p);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    SHA1_LOAD(msg1, p + 16);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    SHA1_LOAD(msg2, p + 32);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    SHA1_LOAD(msg3, p + 48);
+    SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 0);
+
+    /* t=[16,67] */
+    SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 0);
+    SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 1);
+    SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 1);
+    SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 1);
+    SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 1);
+    SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 1);
+    SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 2);
+    SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 2);
+    SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 2);
+    SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 2);
+    SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 2);
+    SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 3);
+    SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 3);
+
+    /* t=[68,79], the schedule is winding down */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+
+    p += 64;
+  }
+
+  abcd = _mm_shuffle_epi32(abcd, 0x1b);
+  _mm_storeu_si128((__m128i *)m->counter, abcd);
+  m->counter[4] = _mm_extract_epi32(e0, 3);
 }
-#endif
 
-struct x32{
-  unsigned int a:32;
-  unsigned int b:32;
-};
+#endif /* HC_SHA_NI */
+
+static void
+calc_blocks (struct sha *m, const unsigned char *p, size_t blocks)
+{
+  uint32_t current[16];
+  int i;
+
+#ifdef HC_SHA_NI
+  if (sha_ni_available()) {
+    shani_blocks(m, p, blocks);
+    return;
+  }
+#endif
+  while (blocks--) {
+    for (i = 0; i < 16; i++)
+      current[i] = load_be32(p + 4 * i);
+    calc(m, current);
+    p += 64;
+  }
+}
 
 int
 SHA1_Update (struct sha *m, const void *v, size_t len)
@@ -233,28 +329,24 @@ SHA1_Update (struct sha *m, const void *v, size_t len)
   if (m->sz[0] < old_sz)
       ++m->sz[1];
   offset = (old_sz / 8)  % 64;
-  while(len > 0){
+  if (offset) {
     size_t l = min(len, 64 - offset);
     memcpy(m->save + offset, p, l);
     offset += l;
     p += l;
     len -= l;
-    if(offset == 64){
-#if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-      int i;
-      uint32_t SHA1current[16];
-      struct x32 *us = (struct x32*)m->save;
-      for(i = 0; i < 8; i++){
-	SHA1current[2*i+0] = swap_uint32_t(us[i].a);
-	SHA1current[2*i+1] = swap_uint32_t(us[i].b);
-      }
-      calc(m, SHA1current);
-#else
-      calc(m, (uint32_t*)m->save);
-#endif
-      offset = 0;
-    }
+    if (offset < 64)
+      return 1;
+    calc_blocks(m, m->save, 1);
+  }
+  /* whole blocks are hashed straight from the caller's buffer */
+  if (len >= 64) {
+    calc_blocks(m, p, len / 64);
+    p += len & ~(size_t)63;
+    len &= 63;
   }
+  if (len)
+    memcpy(m->save, p, len);
   return 1;
 }
 
@@ -287,14 +379,5 @@ SHA1_Final (void *res, struct sha *m)
 	  r[4*i]   = (m->counter[i] >> 24) & 0xFF;
       }
   }
-#if 0
-  {
-    int i;
-    uint32_t *r = (uint32_t *)res;
-
-    for (i = 0; i < 5; ++i)
-      r[i] = swap_uint32_t (m->counter[i]);
-  }
-#endif
   return 1;
 }
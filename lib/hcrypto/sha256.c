@@ -139,30 +139,119 @@ calc (SHA256_CTX *m, uint32_t *in)
     H += HH;
 }
 
-/*
- * From `Performance analysis of MD5' by Joseph D. Touch <touch@isi.edu>
- */
+#ifdef HC_SHA_NI
+
+#define SHA256_LOAD(M, p) \
+    M = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), mask)
+
+/* four rounds on the words in M with constants K[t..t+3] */
+#define SHA256_ROUNDS4(M, t) \
+    do { \
+	msg = _mm_add_epi32(M, \
+	    _mm_loadu_si128((const __m128i *)&constant_256[t])); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+	msg = _mm_shuffle_epi32(msg, 0x0e); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg); \
+    } while (0)
 
-#if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-static inline uint32_t
-swap_uint32_t (uint32_t t)
+/* finish the schedule words in Mnext from M0 and Mprev */
+#define SHA256_MSG2(Mnext, M0, Mprev) \
+    do { \
+	Mnext = _mm_add_epi32(Mnext, _mm_alignr_epi8(M0, Mprev, 4)); \
+	Mnext = _mm_sha256msg2_epu32(Mnext, M0); \
+    } while (0)
+
+#define SHA256_STEP(M0, M1, M3, t) \
+    do { \
+	SHA256_ROUNDS4(M0, t); \
+	SHA256_MSG2(M1, M0, M3); \
+	M3 = _mm_sha256msg1_epu32(M3, M0); \
+    } while (0)
+
+static SHANI_FUNC void
+shani_blocks(SHA256_CTX *m, const unsigned char *p, size_t blocks)
 {
-#define ROL(x,n) ((x)<<(n))|((x)>>(32-(n)))
-    uint32_t temp1, temp2;
-
-    temp1   = cshift(t, 16);
-    temp2   = temp1 >> 8;
-    temp1  &= 0x00ff00ff;
-    temp2  &= 0x00ff00ff;
-    temp1 <<= 8;
-    return temp1 | temp2;
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					0x0405060700010203ULL);
+    __m128i state0, state1, save0, save1, msg, tmp;
+    __m128i msg0, msg1, msg2, msg3;
+
+    /* the instructions want the state as ABEF and CDGH */
+    tmp = _mm_loadu_si128((const __m128i *)&m->counter[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&m->counter[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);
+    state1 = _mm_shuffle_epi32(state1, 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks--) {
+	save0 = state0;
+	save1 = state1;
+
+	SHA256_LOAD(msg0, p);
+	SHA256_ROUNDS4(msg0, 0);
+
+	SHA256_LOAD(msg1, p + 16);
+	SHA256_ROUNDS4(msg1, 4);
+	msg0 = _mm_sha256msg1_epu32(msg0, msg1);
+
+	SHA256_LOAD(msg2, p + 32);
+	SHA256_ROUNDS4(msg2, 8);
+	msg1 = _mm_sha256msg1_epu32(msg1, msg2);
+
+	SHA256_LOAD(msg3, p + 48);
+	SHA256_STEP(msg3, msg0, msg2, 12);
+	SHA256_STEP(msg0, msg1, msg3, 16);
+	SHA256_STEP(msg1, msg2, msg0, 20);
+	SHA256_STEP(msg2, msg3, msg1, 24);
+	SHA256_STEP(msg3, msg0, msg2, 28);
+	SHA256_STEP(msg0, msg1, msg3, 32);
+	SHA256_STEP(msg1, msg2, msg0, 36);
+	SHA256_STEP(msg2, msg3, msg1, 40);
+	SHA256_STEP(msg3, msg0, msg2, 44);
+	SHA256_STEP(msg0, msg1, msg3, 48);
+
+	SHA256_ROUNDS4(msg1, 52);
+	SHA256_MSG2(msg2, msg1, msg0);
+	SHA256_ROUNDS4(msg2, 56);
+	SHA256_MSG2(msg3, msg2, msg1);
+	SHA256_ROUNDS4(msg3, 60);
+
+	state0 = _mm_add_epi32(state0, save0);
+	state1 = _mm_add_epi32(state1, save1);
+
+	p += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&m->counter[0], state0);
+    _mm_storeu_si128((__m128i *)&m->counter[4], state1);
 }
-#endif
 
-struct x32{
-    unsigned int a:32;
-    unsigned int b:32;
-};
+#endif /* HC_SHA_NI */
+
+static void
+calc_blocks (SHA256_CTX *m, const unsigned char *p, size_t blocks)
+{
+    uint32_t current[16];
+    int i;
+
+#ifdef HC_SHA_NI
+    if (sha_ni_available()) {
+	shani_blocks(m, p, blocks);
+	return;
+    }
+#endif
+    while (blocks--) {
+	for (i = 0; i < 16; i++)
+	    current[i] = load_be32(p + 4 * i);
+	calc(m, current);
+	p += 64;
+    }
+}
 
 int
 SHA256_Update (SHA256_CTX *m, const void *v, size_t len)
@@ -175,28 +264,24 @@ SHA256_Update (SHA256_CTX *m, const void *v, size_t len)
     if (m->sz[0] < old_sz)
 	++m->sz[1];
     offset = (old_sz / 8) % 64;
-    while(len > 0){
+    if (offset) {
 	size_t l = min(len, 64 - offset);
 	memcpy(m->save + offset, p, l);
 	offset += l;
 	p += l;
 	len -= l;
-	if(offset == 64){
-#if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-	    int i;
-	    uint32_t current[16];
-	    struct x32 *us = (struct x32*)m->save;
-	    for(i = 0; i < 8; i++){
-		current[2*i+0] = swap_uint32_t(us[i].a);
-		current[2*i+1] = swap_uint32_t(us[i].b);
-	    }
-	    calc(m, current);
-#else
-	    calc(m, (uint32_t*)m->save);
-#endif
-	    offset = 0;
-	}
+	if (offset < 64)
+	    return 1;
+	calc_blocks(m, m->save, 1);
+    }
+    /* whole blocks are hashed straight from the caller's buffer */
+    if (len >= 64) {
+	calc_blocks(m, p, len / 64);
+	p += len & ~(size_t)63;
+	len &= 63;
     }
+    if (len)
+	memcpy(m->save, p, len);
     return 1;
 }
 
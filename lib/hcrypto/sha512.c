@@ -163,29 +163,20 @@ calc (SHA512_CTX *m, uint64_t *in)
     H += HH;
 }
 
-/*
- * From `Performance analysis of MD5' by Joseph D. Touch <touch@isi.edu>
- */
-
-#if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-static inline uint64_t
-swap_uint64_t (uint64_t t)
+static void
+calc_blocks (SHA512_CTX *m, const unsigned char *p, size_t blocks)
 {
-    uint64_t temp;
+    uint64_t current[16];
+    int i;
 
-    temp   = cshift64(t, 32);
-    temp = ((temp & 0xff00ff00ff00ff00ULL) >> 8) |
-           ((temp & 0x00ff00ff00ff00ffULL) << 8);
-    return ((temp & 0xffff0000ffff0000ULL) >> 16) |
-           ((temp & 0x0000ffff0000ffffULL) << 16);
+    while (blocks--) {
+	for (i = 0; i < 16; i++)
+	    current[i] = load_be64(p + 8 * i);
+	calc(m, current);
+	p += 128;
+    }
 }
 
-struct x64{
-    uint64_t a;
-    uint64_t b;
-};
-#endif
-
 int
 SHA512_Update (SHA512_CTX *m, const void *v, size_t len)
 {
@@ -197,28 +188,24 @@ SHA512_Update (SHA512_CTX *m, const void *v, size_t len)
     if (m->sz[0] < old_sz)
 	++m->sz[1];
     offset = (old_sz / 8) % 128;
-    while(len > 0){
+    if (offset) {
 	size_t l = min(len, 128 - offset);
 	memcpy(m->save + offset, p, l);
 	offset += l;
 	p += l;
 	len -= l;
-	if(offset == 128){
-#if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-	    int i;
-	    uint64_t current[16];
-	    struct x64 *us = (struct x64*)m->save;
-	    for(i = 0; i < 8; i++){
-		current[2*i+0] = swap_uint64_t(us[i].a);
-		current[2*i+1] = swap_uint64_t(us[i].b);
-	    }
-	    calc(m, current);
-#else
-	    calc(m, (uint64_t*)m->save);
-#endif
-	    offset = 0;
-	}
+	if (offset < 128)
+	    return 1;
+	calc_blocks(m, m->save, 1);
+    }
+    /* whole blocks are hashed straight from the caller's buffer */
+    if (len >= 128) {
+	calc_blocks(m, p, len / 128);
+	p += len & ~(size_t)127;
+	len &= 127;
     }
+    if (len)
+	memcpy(m->save, p, len);
     return 1;
 }
 
@@ -98,12 +98,16 @@ hdb_value2entry_alias(krb5_context context, krb5_data *value,
     return decode_hdb_entry_alias(value->data, value->length, ent, NULL);
 }
 
+/*
+ * The database key for `principal', with enterprise names parsed
+ * into the principal they name.
+ */
+
 krb5_error_code
-_hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
-		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+_hdb_fetch_key(krb5_context context, krb5_const_principal principal,
+	       krb5_data *key)
 {
     krb5_principal enterprise_principal = NULL;
-    krb5_data key, value;
     krb5_error_code ret;
 
     if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
@@ -121,40 +125,23 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
 	principal = enterprise_principal;
     }
 
-    hdb_principal2key(context, principal, &key);
+    hdb_principal2key(context, principal, key);
     if (enterprise_principal)
 	krb5_free_principal(context, enterprise_principal);
-    ret = db->hdb__get(context, db, key, &value);
-    krb5_data_free(&key);
-    if(ret)
-	return ret;
-    ret = hdb_value2entry(context, &value, &entry->entry);
-    if (ret == ASN1_BAD_ID && (flags & HDB_F_CANON) == 0) {
-	krb5_data_free(&value);
-	return HDB_ERR_NOENTRY;
-    } else if (ret == ASN1_BAD_ID) {
-	hdb_entry_alias alias;
+    return 0;
+}
 
-	ret = hdb_value2entry_alias(context, &value, &alias);
-	if (ret) {
-	    krb5_data_free(&value);
-	    return ret;
-	}
-	hdb_principal2key(context, alias.principal, &key);
-	krb5_data_free(&value);
-	free_hdb_entry_alias(&alias);
+/*
+ * Decrypt the keys of a freshly fetched entry as asked for by
+ * `flags' and `kvno'.  The entry is freed on failure.
+ */
+
+krb5_error_code
+_hdb_fetch_decrypt(krb5_context context, HDB *db, unsigned flags,
+		   krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    krb5_error_code ret;
 
-	ret = db->hdb__get(context, db, key, &value);
-	krb5_data_free(&key);
-	if (ret)
-	    return ret;
-	ret = hdb_value2entry(context, &value, &entry->entry);
-	if (ret) {
-	    krb5_data_free(&value);
-	    return ret;
-	}
-    }
-    krb5_data_free(&value);
     if ((flags & HDB_F_DECRYPT) && (flags & HDB_F_ALL_KVNOS)) {
 	/* Decrypt the current keys */
 	ret = hdb_unseal_keys(context, db, &entry->entry);
@@ -194,6 +181,51 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
     return 0;
 }
 
+krb5_error_code
+_hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    krb5_data key, value;
+    krb5_error_code ret;
+
+    ret = _hdb_fetch_key(context, principal, &key);
+    if (ret)
+	return ret;
+    ret = db->hdb__get(context, db, key, &value);
+    krb5_data_free(&key);
+    if(ret)
+	return ret;
+    ret = hdb_value2entry(context, &value, &entry->entry);
+    if (ret == ASN1_BAD_ID && (flags & HDB_F_CANON) == 0) {
+	krb5_data_free(&value);
+	return HDB_ERR_NOENTRY;
+    } else if (ret == ASN1_BAD_ID) {
+	hdb_entry_alias alias;
+
+	ret = hdb_value2entry_alias(context, &value, &alias);
+	if (ret) {
+	    krb5_data_free(&value);
+	    return ret;
+	}
+	hdb_principal2key(context, alias.principal, &key);
+	krb5_data_free(&value);
+	free_hdb_entry_alias(&alias);
+
+	ret = db->hdb__get(context, db, key, &value);
+	krb5_data_free(&key);
+	if (ret)
+	    return ret;
+	ret = hdb_value2entry(context, &value, &entry->entry);
+	if (ret) {
+	    krb5_data_free(&value);
+	    return ret;
+	}
+    }
+    krb5_data_free(&value);
+
+    return _hdb_fetch_decrypt(context, db, flags, kvno, entry);
+}
+
 static krb5_error_code
 hdb_remove_aliases(krb5_context context, HDB *db, krb5_data *key)
 {
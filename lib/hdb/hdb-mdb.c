@@ -39,35 +39,260 @@
 /* LMDB */
 
 #include <lmdb.h>
+#include "heim_threads.h"
 
 #define	KILO	1024
 
+/*
+ * Lookups share one read-only transaction, `r', that is reset after
+ * every lookup and renewed for the next one.  That keeps the reader
+ * slot but holds on to no snapshot in between, so writers are not
+ * held up.  Values are decoded straight out of the map while the
+ * transaction is live.
+ *
+ * A read-only database opened by a KDC with keep-db-open set also
+ * keeps the environment across close and open, unless the file was
+ * replaced in between (hprop does that), as LMDB readers see new
+ * commits anyway.
+ */
+
+/*
+ * LMDB allows an environment to be opened only once per process, as
+ * its locks are per process: closing a second environment on the same
+ * file would drop the locks the first one relies on.  So all handles on
+ * a file in a process (e.g., those of the KDC's request threads) share
+ * one environment, each with its own transactions.
+ *
+ * Adopting a map grown by another process remaps the environment, which
+ * must not happen while other handles have transactions going, hence
+ * the `resize' lock.  Every transaction holds its read side, including
+ * the iteration's, which stays open from DB_firstkey() until the next
+ * DB_firstkey() or DB_close().  Operations on a handle that is iterating
+ * run under the iteration's hold rather than taking the lock again.
+ */
+
+typedef struct mdb_shared_env {
+    struct mdb_shared_env *next;
+    MDB_env *e;
+    MDB_dbi d;
+    dev_t dev;
+    ino_t ino;
+    int rdonly;
+    unsigned int refs;
+    HEIMDAL_RWLOCK resize;
+} mdb_shared_env;
+
+static HEIMDAL_MUTEX mdb_envs_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static mdb_shared_env *mdb_envs;
+
 typedef struct mdb_info {
+    mdb_shared_env *se;
     MDB_env *e;
     MDB_txn *t;
     MDB_dbi d;
     MDB_cursor *c;
+    MDB_txn *r;
+    int keep_env;
 } mdb_info;
 
 static krb5_error_code
-DB_close(krb5_context context, HDB *db)
+DB_env_get(krb5_context context, HDB *db, const char *fn, int myflags,
+	   mode_t mode, mdb_shared_env **out)
 {
-    mdb_info *mi = (mdb_info *)db->hdb_db;
+    mdb_shared_env *se;
+    MDB_txn *txn;
+    struct stat sb;
+    int ret, fd, tmp;
+
+    *out = NULL;
+
+    HEIMDAL_MUTEX_lock(&mdb_envs_mutex);
+    if (stat(fn, &sb) == 0) {
+	for (se = mdb_envs; se != NULL; se = se->next) {
+	    if (se->dev == sb.st_dev && se->ino == sb.st_ino)
+		break;
+	}
+	if (se != NULL && se->rdonly && !(myflags & MDB_RDONLY)) {
+	    HEIMDAL_MUTEX_unlock(&mdb_envs_mutex);
+	    krb5_set_error_message(context, EBUSY,
+				   "%s is already open read-only",
+				   db->hdb_name);
+	    return EBUSY;
+	}
+	if (se != NULL) {
+	    se->refs++;
+	    HEIMDAL_MUTEX_unlock(&mdb_envs_mutex);
+	    *out = se;
+	    return 0;
+	}
+    }
+
+    se = calloc(1, sizeof(*se));
+    if (se == NULL || mdb_env_create(&se->e)) {
+	HEIMDAL_MUTEX_unlock(&mdb_envs_mutex);
+	free(se);
+	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
+	return ENOMEM;
+    }
+
+    tmp = krb5_config_get_int_default(context, NULL, 0, "kdc",
+	"hdb-mdb-maxreaders", NULL);
+    if (tmp) {
+	ret = mdb_env_set_maxreaders(se->e, tmp);
+	if (ret) {
+	    krb5_set_error_message(context, ret, "setting maxreaders on %s: %s",
+		db->hdb_name, mdb_strerror(ret));
+	    goto out;
+	}
+    }
+
+    tmp = krb5_config_get_int_default(context, NULL, 0, "kdc",
+	"hdb-mdb-mapsize", NULL);
+    if (tmp) {
+	size_t maps = tmp;
+	maps *= KILO;
+	ret = mdb_env_set_mapsize(se->e, maps);
+	if (ret) {
+	    krb5_set_error_message(context, ret, "setting mapsize on %s: %s",
+		db->hdb_name, mdb_strerror(ret));
+	    goto out;
+	}
+    }
 
+    ret = mdb_env_open(se->e, fn, myflags, mode);
+    if (ret == 0)
+	ret = mdb_env_get_fd(se->e, &fd);
+    if (ret == 0 && fstat(fd, &sb) == -1)
+	ret = errno;
+    if (ret == 0)
+	ret = mdb_txn_begin(se->e, NULL, MDB_RDONLY, &txn);
+    if (ret == 0) {
+	ret = mdb_open(txn, NULL, 0, &se->d);
+	mdb_txn_abort(txn);
+    }
+    if (ret) {
+	krb5_set_error_message(context, ret, "opening %s: %s",
+			       db->hdb_name, mdb_strerror(ret));
+	goto out;
+    }
+
+    se->dev = sb.st_dev;
+    se->ino = sb.st_ino;
+    se->rdonly = (myflags & MDB_RDONLY) ? 1 : 0;
+    se->refs = 1;
+    HEIMDAL_RWLOCK_init(&se->resize);
+    se->next = mdb_envs;
+    mdb_envs = se;
+    *out = se;
+
+out:
+    if (ret) {
+	mdb_env_close(se->e);
+	free(se);
+    }
+    HEIMDAL_MUTEX_unlock(&mdb_envs_mutex);
+    return ret;
+}
+
+static void
+DB_env_put(mdb_shared_env *se)
+{
+    mdb_shared_env **p;
+
+    HEIMDAL_MUTEX_lock(&mdb_envs_mutex);
+    if (--se->refs == 0) {
+	for (p = &mdb_envs; *p != NULL; p = &(*p)->next) {
+	    if (*p == se) {
+		*p = se->next;
+		break;
+	    }
+	}
+	mdb_env_close(se->e);
+	HEIMDAL_RWLOCK_destroy(&se->resize);
+	free(se);
+    }
+    HEIMDAL_MUTEX_unlock(&mdb_envs_mutex);
+}
+
+static void
+DB_resize_rdlock(mdb_info *mi)
+{
+    if (mi->t == NULL)
+	HEIMDAL_RWLOCK_rdlock(&mi->se->resize);
+}
+
+static void
+DB_resize_unlock(mdb_info *mi)
+{
+    if (mi->t == NULL)
+	HEIMDAL_RWLOCK_unlock(&mi->se->resize);
+}
+
+/*
+ * Adopt the size of a map grown by another process; called with the
+ * read side held and returns with it held again.  Not possible while
+ * this handle is iterating, as its own transaction is still open.
+ */
+static int
+DB_remap(mdb_info *mi)
+{
+    int code;
+
+    if (mi->t)
+	return MDB_MAP_RESIZED;
+    HEIMDAL_RWLOCK_unlock(&mi->se->resize);
+    HEIMDAL_RWLOCK_wrlock(&mi->se->resize);
+    code = mdb_env_set_mapsize(mi->e, 0);
+    HEIMDAL_RWLOCK_unlock(&mi->se->resize);
+    HEIMDAL_RWLOCK_rdlock(&mi->se->resize);
+    return code;
+}
+
+/* end an iteration, releasing its transaction */
+static void
+DB_cursor_end(mdb_info *mi)
+{
+    if (mi->t == NULL)
+	return;
     mdb_cursor_close(mi->c);
     mdb_txn_abort(mi->t);
-    mdb_env_close(mi->e);
     mi->c = 0;
     mi->t = 0;
+    HEIMDAL_RWLOCK_unlock(&mi->se->resize);
+}
+
+static void
+DB_close_env(mdb_info *mi)
+{
+    mdb_txn_abort(mi->r);
+    DB_env_put(mi->se);
+    mi->r = 0;
+    mi->se = 0;
     mi->e = 0;
+    mi->keep_env = 0;
+}
+
+static krb5_error_code
+DB_close(krb5_context context, HDB *db)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+
+    DB_cursor_end(mi);
+    if (!mi->keep_env)
+	DB_close_env(mi);
     return 0;
 }
 
 static krb5_error_code
 DB_destroy(krb5_context context, HDB *db)
 {
+    mdb_info *mi = (mdb_info *)db->hdb_db;
     krb5_error_code ret;
 
+    if (mi->e) {
+	DB_cursor_end(mi);
+	DB_close_env(mi);
+    }
     ret = hdb_clear_master_key (context, db);
     free(db->hdb_name);
     free(db->hdb_db);
@@ -142,19 +367,29 @@ static krb5_error_code
 DB_firstkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 {
     mdb_info *mi = db->hdb_db;
+    MDB_txn *txn;
     int code;
 
     /* Always start with a fresh cursor to pick up latest DB state */
-    if (mi->t)
-	mdb_txn_abort(mi->t);
-
-    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->t);
-    if (code)
-	return code;
+    DB_cursor_end(mi);
 
-    code = mdb_cursor_open(mi->t, mi->d, &mi->c);
-    if (code)
+    HEIMDAL_RWLOCK_rdlock(&mi->se->resize);
+    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+    if (code == MDB_MAP_RESIZED) {
+	code = DB_remap(mi);
+	if (code == 0)
+	    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+    }
+    if (code == 0) {
+	code = mdb_cursor_open(txn, mi->d, &mi->c);
+	if (code)
+	    mdb_txn_abort(txn);
+    }
+    if (code) {
+	HEIMDAL_RWLOCK_unlock(&mi->se->resize);
 	return code;
+    }
+    mi->t = txn;
 
     return DB_seq(context, db, flags, entry, MDB_FIRST);
 }
@@ -193,30 +428,130 @@ DB_rename(krb5_context context, HDB *db, const char *new_name)
     return 0;
 }
 
+/* start a lookup, on the shared read transaction */
+static int
+DB_read_begin(mdb_info *mi)
+{
+    int code;
+
+    DB_resize_rdlock(mi);
+    if (mi->r) {
+	code = mdb_txn_renew(mi->r);
+	if (code == 0)
+	    return 0;
+	mdb_txn_abort(mi->r);
+	mi->r = 0;
+    }
+    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->r);
+    if (code == MDB_MAP_RESIZED) {
+	/* another process grew the map since we opened it */
+	code = DB_remap(mi);
+	if (code == 0)
+	    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->r);
+    }
+    if (code)
+	DB_resize_unlock(mi);
+    return code;
+}
+
+static void
+DB_read_end(mdb_info *mi)
+{
+    mdb_txn_reset(mi->r);
+    DB_resize_unlock(mi);
+}
+
 static krb5_error_code
 DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
 {
     mdb_info *mi = (mdb_info*)db->hdb_db;
-    MDB_txn *txn;
     MDB_val k, v;
     int code;
 
     k.mv_data = key.data;
     k.mv_size = key.length;
 
-    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+    code = DB_read_begin(mi);
     if (code)
 	return code;
 
-    code = mdb_get(txn, mi->d, &k, &v);
+    code = mdb_get(mi->r, mi->d, &k, &v);
     if (code == 0)
-	krb5_data_copy(reply, v.mv_data, v.mv_size);
-    mdb_txn_abort(txn);
+	code = krb5_data_copy(reply, v.mv_data, v.mv_size);
+    DB_read_end(mi);
     if(code == MDB_NOTFOUND)
 	return HDB_ERR_NOENTRY;
     return code;
 }
 
+/*
+ * Like _hdb_fetch_kvno(), but the entry (and the alias pointing to
+ * it, if any) is decoded straight from the map, and both are looked
+ * up in the same snapshot.
+ */
+
+static krb5_error_code
+DB_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+	      unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_data key, value;
+    krb5_error_code ret;
+    MDB_val k, v;
+    int code;
+
+    ret = _hdb_fetch_key(context, principal, &key);
+    if (ret)
+	return ret;
+
+    code = DB_read_begin(mi);
+    if (code) {
+	krb5_data_free(&key);
+	return code;
+    }
+
+    k.mv_data = key.data;
+    k.mv_size = key.length;
+    code = mdb_get(mi->r, mi->d, &k, &v);
+    krb5_data_free(&key);
+    if (code)
+	goto out;
+
+    value.data = v.mv_data;
+    value.length = v.mv_size;
+    code = hdb_value2entry(context, &value, &entry->entry);
+    if (code == ASN1_BAD_ID && (flags & HDB_F_CANON) == 0) {
+	code = HDB_ERR_NOENTRY;
+    } else if (code == ASN1_BAD_ID) {
+	hdb_entry_alias alias;
+
+	code = hdb_value2entry_alias(context, &value, &alias);
+	if (code)
+	    goto out;
+	hdb_principal2key(context, alias.principal, &key);
+	free_hdb_entry_alias(&alias);
+
+	k.mv_data = key.data;
+	k.mv_size = key.length;
+	code = mdb_get(mi->r, mi->d, &k, &v);
+	krb5_data_free(&key);
+	if (code)
+	    goto out;
+	value.data = v.mv_data;
+	value.length = v.mv_size;
+	code = hdb_value2entry(context, &value, &entry->entry);
+    }
+
+out:
+    DB_read_end(mi);
+    if (code == MDB_NOTFOUND)
+	return HDB_ERR_NOENTRY;
+    if (code)
+	return code;
+
+    return _hdb_fetch_decrypt(context, db, flags, kvno, entry);
+}
+
 static krb5_error_code
 DB__put(krb5_context context, HDB *db, int replace,
 	krb5_data key, krb5_data value)
@@ -231,15 +566,19 @@ DB__put(krb5_context context, HDB *db, int replace,
     v.mv_data = value.data;
     v.mv_size = value.length;
 
+    DB_resize_rdlock(mi);
     code = mdb_txn_begin(mi->e, NULL, 0, &txn);
-    if (code)
+    if (code) {
+	DB_resize_unlock(mi);
 	return code;
+    }
 
     code = mdb_put(txn, mi->d, &k, &v, replace ? 0 : MDB_NOOVERWRITE);
     if (code)
 	mdb_txn_abort(txn);
     else
 	code = mdb_txn_commit(txn);
+    DB_resize_unlock(mi);
     if(code == MDB_KEYEXIST)
 	return HDB_ERR_EXISTS;
     return code;
@@ -256,15 +595,19 @@ DB__del(krb5_context context, HDB *db, krb5_data key)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
+    DB_resize_rdlock(mi);
     code = mdb_txn_begin(mi->e, NULL, 0, &txn);
-    if (code)
+    if (code) {
+	DB_resize_unlock(mi);
 	return code;
+    }
 
     code = mdb_del(txn, mi->d, &k, NULL);
     if (code)
 	mdb_txn_abort(txn);
     else
 	code = mdb_txn_commit(txn);
+    DB_resize_unlock(mi);
     if(code == MDB_NOTFOUND)
 	return HDB_ERR_NOENTRY;
     return code;
@@ -274,10 +617,10 @@ static krb5_error_code
 DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 {
     mdb_info *mi = (mdb_info *)db->hdb_db;
-    MDB_txn *txn;
     char *fn;
     krb5_error_code ret;
-    int myflags = MDB_NOSUBDIR, tmp;
+    int myflags = MDB_NOSUBDIR | MDB_NOTLS;
+    struct stat sb;
 
     if((flags & O_ACCMODE) == O_RDONLY)
       myflags |= MDB_RDONLY;
@@ -286,56 +629,28 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
 	return ENOMEM;
     }
-    if (mdb_env_create(&mi->e)) {
-	free(fn);
-	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
-	return ENOMEM;
-    }
-
-    tmp = krb5_config_get_int_default(context, NULL, 0, "kdc",
-	"hdb-mdb-maxreaders", NULL);
-    if (tmp) {
-	ret = mdb_env_set_maxreaders(mi->e, tmp);
-	if (ret) {
-	    krb5_set_error_message(context, ret, "setting maxreaders on %s: %s",
-		db->hdb_name, mdb_strerror(ret));
-	    return ret;
-	}
-    }
 
-    tmp = krb5_config_get_int_default(context, NULL, 0, "kdc",
-	"hdb-mdb-mapsize", NULL);
-    if (tmp) {
-	size_t maps = tmp;
-	maps *= KILO;
-	ret = mdb_env_set_mapsize(mi->e, maps);
-	if (ret) {
-	    krb5_set_error_message(context, ret, "setting mapsize on %s: %s",
-		db->hdb_name, mdb_strerror(ret));
-	    return ret;
+    if (mi->e) {
+	/* kept from the last open, reuse it if it is still the same file */
+	if ((myflags & MDB_RDONLY) && stat(fn, &sb) == 0 &&
+	    sb.st_dev == mi->se->dev && sb.st_ino == mi->se->ino) {
+	    free(fn);
+	    return 0;
 	}
+	DB_close_env(mi);
     }
 
-    ret = mdb_env_open(mi->e, fn, myflags, mode);
-    if (ret) {
-fail:
-	mdb_env_close(mi->e);
-	mi->e = 0;
-	free(fn);
-	krb5_set_error_message(context, ret, "opening %s: %s",
-			      db->hdb_name, mdb_strerror(ret));
-	return ret;
-    }
+    ret = DB_env_get(context, db, fn, myflags, mode, &mi->se);
     free(fn);
-
-    ret = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
     if (ret)
-	goto fail;
+	return ret;
+    mi->e = mi->se->e;
+    mi->d = mi->se->d;
 
-    ret = mdb_open(txn, NULL, 0, &mi->d);
-    mdb_txn_abort(txn);
-    if (ret)
-	goto fail;
+    if ((myflags & MDB_RDONLY) &&
+	krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+				     "keep-db-open", NULL))
+	mi->keep_env = 1;
 
     if((flags & O_ACCMODE) == O_RDONLY)
 	ret = hdb_check_db_format(context, db);
@@ -344,6 +659,7 @@ fail:
     if(ret == HDB_ERR_NOENTRY)
 	return 0;
     if (ret) {
+	mi->keep_env = 0;
 	DB_close(context, db);
 	krb5_set_error_message(context, ret, "hdb_open: failed %s database %s",
 			       (flags & O_ACCMODE) == O_RDONLY ?
@@ -381,10 +697,11 @@ hdb_mdb_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL |
+	HDB_CAP_F_KEEP_OPEN;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
-    (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
+    (*db)->hdb_fetch_kvno = DB_fetch_kvno;
     (*db)->hdb_store = _hdb_store;
     (*db)->hdb_remove = _hdb_remove;
     (*db)->hdb_firstkey = DB_firstkey;
@@ -72,6 +72,7 @@ enum hdb_lockop{ HDB_RLOCK, HDB_WLOCK };
 #define HDB_CAP_F_HANDLE_PASSWORDS	2
 #define HDB_CAP_F_PASSWORD_UPDATE_KEYS	4
 #define HDB_CAP_F_SHARED_DIRECTORY      8
+#define HDB_CAP_F_KEEP_OPEN		16	/* readers may stay open across writes */
 
 /* auth status values */
 #define HDB_AUTH_SUCCESS		0
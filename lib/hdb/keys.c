@@ -709,6 +709,10 @@ hdb_generate_key_set_password(krb5_context context,
 			      Key **keys, size_t *num_keys)
 {
     krb5_error_code ret;
+    krb5_enctype *enctypes = NULL;
+    krb5_keyblock *kb = NULL;
+    krb5_salt *salts = NULL;
+    krb5_data pw;
     size_t i;
 
     ret = hdb_generate_key_set(context, principal, ks_tuple, n_ks_tuple,
@@ -716,23 +720,38 @@ hdb_generate_key_set_password(krb5_context context,
     if (ret)
 	return ret;
 
-    for (i = 0; i < (*num_keys); i++) {
-	krb5_salt salt;
-
-	salt.salttype = (*keys)[i].salt->type;
-	salt.saltvalue.length = (*keys)[i].salt->salt.length;
-	salt.saltvalue.data = (*keys)[i].salt->salt.data;
+    /*
+     * Derive all the keys in one go so that enctypes with common
+     * string-to-key work (the AES PBKDF2 iterations) only do it once.
+     */
+    enctypes = calloc(*num_keys, sizeof(enctypes[0]));
+    salts = calloc(*num_keys, sizeof(salts[0]));
+    kb = calloc(*num_keys, sizeof(kb[0]));
+    if (*num_keys && (enctypes == NULL || salts == NULL || kb == NULL)) {
+	ret = krb5_enomem(context);
+	goto out;
+    }
 
-	ret = krb5_string_to_key_salt (context,
-				       (*keys)[i].key.keytype,
-				       password,
-				       salt,
-				       &(*keys)[i].key);
+    for (i = 0; i < (*num_keys); i++) {
+	enctypes[i] = (*keys)[i].key.keytype;
+	salts[i].salttype = (*keys)[i].salt->type;
+	salts[i].saltvalue.length = (*keys)[i].salt->salt.length;
+	salts[i].saltvalue.data = (*keys)[i].salt->salt.data;
+    }
 
-	if(ret)
-	    break;
+    pw.data = rk_UNCONST(password);
+    pw.length = strlen(password);
+    ret = krb5_string_to_key_data_salt_multi(context, pw, *num_keys,
+					     enctypes, salts, kb);
+    if (ret == 0) {
+	for (i = 0; i < (*num_keys); i++)
+	    (*keys)[i].key = kb[i];
     }
 
+out:
+    free(enctypes);
+    free(salts);
+    free(kb);
     if(ret) {
 	hdb_free_keys (context, *num_keys, *keys);
 	return ret;
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2009 Kungliga Tekniska Hgskolan
+ * Copyright (c) 2009 Kungliga Tekniska H�gskolan
  * (Royal Institute of Technology, Stockholm, Sweden).
  * All rights reserved.
  *
@@ -36,6 +36,13 @@
 #include "hi_locl.h"
 #include <assert.h>
 
+#ifndef HAVE_GCD
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#define HEIM_IPC_EPOLL 1
+#endif
+#endif
+
 #define MAX_PACKET_SIZE (128 * 1024)
 
 struct heim_sipc {
@@ -456,6 +463,8 @@ struct client {
 #define WAITING_CLOSE	8
 
 #define HTTP_REPLY	16
+#define WRITE_QUEUED	32
+#define CLOSED		64
 
 #define INHERIT_MASK	0xffff0000
 #define INCLUDE_ERROR_CODE (1 << 16)
@@ -469,6 +478,9 @@ struct client {
 #ifdef HAVE_GCD
     dispatch_source_t in;
     dispatch_source_t out;
+#endif
+#ifdef HEIM_IPC_EPOLL
+    struct client *next;	/* on pending_writes or closed_clients */
 #endif
     struct {
 	uid_t uid;
@@ -479,11 +491,17 @@ struct client {
 
 #ifndef HAVE_GCD
 static unsigned num_clients = 0;
+#ifdef HEIM_IPC_EPOLL
+static int epfd = -1;
+static struct client *pending_writes = NULL;
+static struct client *closed_clients = NULL;
+#else
 static struct client **clients = NULL;
 #endif
+#endif
 
-static void handle_read(struct client *);
-static void handle_write(struct client *);
+static int handle_read(struct client *);
+static int handle_write(struct client *);
 static int maybe_close(struct client *);
 
 /*
@@ -668,6 +686,36 @@ add_new_socket(int fd,
 	});
 
     dispatch_resume(c->in);
+#elif defined(HEIM_IPC_EPOLL)
+    {
+	struct epoll_event ev;
+
+	if (epfd == -1) {
+	    epfd = epoll_create1(EPOLL_CLOEXEC);
+	    if (epfd == -1)
+		abort();
+	}
+
+	/*
+	 * Clients are registered once, for both directions, edge
+	 * triggered.  Listeners are level triggered, so connections
+	 * left in the backlog when accept() or calloc() fails are
+	 * reported again instead of waiting for a new one.
+	 */
+	memset(&ev, 0, sizeof(ev));
+	if (flags & LISTEN_SOCKET)
+	    ev.events = EPOLLIN;
+	else
+	    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+	    if ((flags & LISTEN_SOCKET) == 0)
+		close(c->fd);
+	    free(c);
+	    return NULL;
+	}
+	num_clients++;
+    }
 #else
     clients = erealloc(clients, sizeof(clients[0]) * (num_clients + 1));
     clients[num_clients] = c;
@@ -682,7 +730,7 @@ maybe_close(struct client *c)
 {
     if (c->calls != 0)
 	return 0;
-    if (c->flags & (WAITING_READ|WAITING_WRITE))
+    if (c->flags & (WAITING_READ|WAITING_WRITE|WRITE_QUEUED))
 	return 0;
 
 #ifdef HAVE_GCD
@@ -696,9 +744,24 @@ maybe_close(struct client *c)
 	dispatch_resume(c->out);
     dispatch_release(c->out);
 #endif
+#ifdef HEIM_IPC_EPOLL
+    /*
+     * Events for this client may still be pending in the current
+     * batch, so only free it once the batch is done.
+     */
+    if (c->flags & CLOSED)
+	return 1;
+    close(c->fd);
+    c->flags |= CLOSED;
+    c->next = closed_clients;
+    closed_clients = c;
+    num_clients--;
+    return 1;
+#else
     close(c->fd); /* ref count fd close */
     free(c);
     return 1;
+#endif
 }
 
 
@@ -717,6 +780,18 @@ output_data(struct client *c, const void *data, size_t len)
     memcpy(&c->outmsg[c->olen], data, len);
     c->olen += len;
     c->flags |= WAITING_WRITE;
+#ifdef HEIM_IPC_EPOLL
+    /*
+     * With edge triggered notification there is no write event to
+     * wait for until the socket buffer has been filled, so have the
+     * loop write it out.
+     */
+    if ((c->flags & WRITE_QUEUED) == 0) {
+	c->flags |= WRITE_QUEUED;
+	c->next = pending_writes;
+	pending_writes = c;
+    }
+#endif
 }
 
 static void
@@ -863,18 +938,21 @@ handle_http_tcp(struct client *c)
 }
 
 
-static void
+/*
+ * Returns non-zero if there may be more to read.
+ */
+
+static int
 handle_read(struct client *c)
 {
     ssize_t len;
     uint32_t dlen;
 
     if (c->flags & LISTEN_SOCKET) {
-	add_new_socket(c->fd,
-		       WAITING_READ | (c->flags & INHERIT_MASK),
-		       c->callback,
-		       c->userctx);
-	return;
+	return add_new_socket(c->fd,
+			      WAITING_READ | (c->flags & INHERIT_MASK),
+			      c->callback,
+			      c->userctx) != NULL;
     }
 
     if (c->ptr - c->len < 1024) {
@@ -884,10 +962,12 @@ handle_read(struct client *c)
     }
 
     len = read(c->fd, c->inmsg + c->ptr, c->len - c->ptr);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return 0;
     if (len <= 0) {
 	c->flags |= WAITING_CLOSE;
 	c->flags &= ~WAITING_READ;
-	return;
+	return 0;
     }
     c->ptr += len;
     if (c->ptr > c->len)
@@ -918,7 +998,7 @@ handle_read(struct client *c)
 	    if (dlen > MAX_PACKET_SIZE) {
 		c->flags |= WAITING_CLOSE;
 		c->flags &= ~WAITING_READ;
-		return;
+		return 0;
 	    }
 	    if (dlen > c->ptr - sizeof(dlen)) {
 		break;
@@ -948,43 +1028,251 @@ handle_read(struct client *c)
 		    cs->cred, socket_complete,
 		    (heim_sipc_call)cs);
     }
+    return (c->flags & WAITING_READ) != 0;
 }
 
-static void
+/*
+ * Returns non-zero if there may be room for more.
+ */
+
+static int
 handle_write(struct client *c)
 {
     ssize_t len;
 
     len = write(c->fd, c->outmsg, c->olen);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return 0;
     if (len <= 0) {
 	c->flags |= WAITING_CLOSE;
 	c->flags &= ~(WAITING_WRITE);
+	return 0;
     } else if (c->olen != (size_t)len) {
 	memmove(&c->outmsg[0], &c->outmsg[len], c->olen - len);
 	c->olen -= len;
+	return 1;
     } else {
 	c->olen = 0;
 	free(c->outmsg);
 	c->outmsg = NULL;
 	c->flags &= ~(WAITING_WRITE);
+	return 0;
     }
 }
 
 
 #ifndef HAVE_GCD
 
+/*
+ * Timers are kept in a binary heap ordered by expiry so the loop can
+ * take its wait from the first one and never has to scan them.
+ */
+
+struct heim_timer {
+    time_t when;
+    time_t interval;		/* rearm after firing if non-zero */
+    void (*func)(void);
+    size_t idx;			/* position in timers, or TIMER_IDLE */
+};
+
+#define TIMER_IDLE ((size_t)-1)
+
+static struct heim_timer **timers = NULL;
+static size_t num_timers = 0;
+static size_t max_timers = 0;
+
+static void
+default_timer_ev(void)
+{
+    exit(0);
+}
+
+static struct heim_timer idle_timer = {
+    0, 0, default_timer_ev, TIMER_IDLE
+};
+
+static void
+timer_swap(size_t i, size_t j)
+{
+    struct heim_timer *t = timers[i];
+
+    timers[i] = timers[j];
+    timers[j] = t;
+    timers[i]->idx = i;
+    timers[j]->idx = j;
+}
+
+static void
+timer_up(size_t i)
+{
+    while (i > 0 && timers[(i - 1) / 2]->when > timers[i]->when) {
+	timer_swap(i, (i - 1) / 2);
+	i = (i - 1) / 2;
+    }
+}
+
+static void
+timer_down(size_t i)
+{
+    size_t l, m;
+
+    for (;;) {
+	m = i;
+	l = 2 * i + 1;
+	if (l < num_timers && timers[l]->when < timers[m]->when)
+	    m = l;
+	if (l + 1 < num_timers && timers[l + 1]->when < timers[m]->when)
+	    m = l + 1;
+	if (m == i)
+	    break;
+	timer_swap(i, m);
+	i = m;
+    }
+}
+
+static void
+timer_remove(struct heim_timer *t)
+{
+    size_t i = t->idx;
+
+    if (i == TIMER_IDLE)
+	return;
+    t->idx = TIMER_IDLE;
+    if (i != --num_timers) {
+	timers[i] = timers[num_timers];
+	timers[i]->idx = i;
+	timer_up(i);
+	timer_down(timers[i]->idx);
+    }
+}
+
+static void
+timer_set(struct heim_timer *t, time_t when)
+{
+    if (t->idx == TIMER_IDLE) {
+	if (num_timers == max_timers) {
+	    max_timers = max_timers ? max_timers * 2 : 4;
+	    timers = erealloc(timers, max_timers * sizeof(timers[0]));
+	}
+	t->idx = num_timers;
+	timers[num_timers++] = t;
+    }
+    t->when = when;
+    timer_up(t->idx);
+    timer_down(t->idx);
+}
+
+/* milliseconds until the first timer, or -1 to wait forever */
+static int
+timer_wait(void)
+{
+    time_t now;
+
+    if (num_timers == 0)
+	return -1;
+    now = time(NULL);
+    if (timers[0]->when <= now)
+	return 0;
+    if (timers[0]->when - now > INT_MAX / 1000)
+	return INT_MAX;
+    return (timers[0]->when - now) * 1000;
+}
+
+static void
+timer_run(void)
+{
+    struct heim_timer *t;
+    time_t now = time(NULL);
+
+    while (num_timers > 0 && timers[0]->when <= now) {
+	t = timers[0];
+	if (t->interval)
+	    timer_set(t, now + t->interval);
+	else
+	    timer_remove(t);
+	(*t->func)();
+    }
+}
+
+/* the idle timeout restarts whenever there is activity */
+static void
+timer_activity(void)
+{
+    if (idle_timer.idx != TIMER_IDLE)
+	timer_set(&idle_timer, time(NULL) + idle_timer.interval);
+}
+
+#ifdef HEIM_IPC_EPOLL
+
+#define MAX_EVENTS 64
+
 static void
 process_loop(void)
 {
-    struct pollfd *fds;
+    struct epoll_event events[MAX_EVENTS];
+    struct client *c;
+    int i, n;
+
+    while (num_clients > 0) {
+
+	n = epoll_wait(epfd, events, MAX_EVENTS, timer_wait());
+
+	for (i = 0; i < n; i++) {
+	    c = events[i].data.ptr;
+
+	    /* drain both directions, there will be no new edge until then */
+	    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		while ((c->flags & WAITING_READ) && handle_read(c))
+		    ;
+	    }
+	    if (events[i].events & EPOLLOUT) {
+		while ((c->flags & WAITING_WRITE) && handle_write(c))
+		    ;
+	    }
+	    maybe_close(c);
+	}
+
+	while ((c = pending_writes) != NULL) {
+	    pending_writes = c->next;
+	    c->flags &= ~WRITE_QUEUED;
+	    if ((c->flags & CLOSED) == 0) {
+		while ((c->flags & WAITING_WRITE) && handle_write(c))
+		    ;
+	    }
+	    maybe_close(c);
+	}
+
+	while ((c = closed_clients) != NULL) {
+	    closed_clients = c->next;
+	    free(c->inmsg);
+	    free(c->outmsg);
+	    free(c);
+	}
+
+	if (n > 0)
+	    timer_activity();
+	timer_run();
+    }
+}
+
+#else /* !HEIM_IPC_EPOLL */
+
+static void
+process_loop(void)
+{
+    struct pollfd *fds = NULL;
+    unsigned max_fds = 0;
     unsigned n;
     unsigned num_fds;
+    int ret;
 
     while(num_clients > 0) {
 
-	fds = malloc(num_clients * sizeof(fds[0]));
-	if(fds == NULL)
-	    abort();
+	/* only grows, the array is kept between iterations */
+	if (num_clients > max_fds) {
+	    max_fds = num_clients * 2;
+	    fds = erealloc(fds, max_fds * sizeof(fds[0]));
+	}
 
 	num_fds = num_clients;
 
@@ -999,7 +1287,7 @@ process_loop(void)
 	    fds[n].revents = 0;
 	}
 
-	poll(fds, num_fds, -1);
+	ret = poll(fds, num_fds, timer_wait());
 
 	for (n = 0 ; n < num_fds; n++) {
 	    if (clients[n] == NULL)
@@ -1026,11 +1314,16 @@ process_loop(void)
 		n++;
 	}
 
-	free(fds);
+	if (ret > 0)
+	    timer_activity();
+	timer_run();
     }
+    free(fds);
 }
 
-#endif
+#endif /* HEIM_IPC_EPOLL */
+
+#endif /* !HAVE_GCD */
 
 static int
 socket_release(heim_sipc ctx)
@@ -1147,7 +1440,11 @@ heim_sipc_timeout(time_t t)
 	});
     dispatch_once(&timeoutonce, ^{  dispatch_resume(timer); });
 #else
-    abort();
+    idle_timer.interval = t;
+    if (t > 0)
+	timer_set(&idle_timer, time(NULL) + t);
+    else
+	timer_remove(&idle_timer);
 #endif
 }
 
@@ -1164,7 +1461,7 @@ heim_sipc_set_timeout_handler(void (*func)(void))
     init_globals();
     dispatch_sync(timerq, ^{ timer_ev = func; });
 #else
-    abort();
+    idle_timer.func = func;
 #endif
 }
 
@@ -60,6 +60,9 @@ kadm5_s_lock(void *server_handle)
     if (ret)
 	return ret;
 
+    /* Operations done while locked share log fsync()s */
+    (void) kadm5_log_batch_begin(context);
+
     context->keep_open = 1;
     return 0;
 }
@@ -68,14 +71,17 @@ static kadm5_ret_t
 kadm5_s_unlock(void *server_handle)
 {
     kadm5_server_context *context = server_handle;
-    kadm5_ret_t ret;
+    kadm5_ret_t ret, ret2;
 
     if (!context->keep_open)
 	return KADM5_NOT_LOCKED;
 
     context->keep_open = 0;
+    ret2 = kadm5_log_batch_end(context);
     ret = context->db->hdb_unlock(context->context, context->db);
     (void) context->db->hdb_close(context->context, context->db);
+    if (ret == 0)
+	ret = ret2;
     return ret;
 }
 
@@ -55,6 +55,7 @@ destroy_config (kadm5_config_params *c)
 static void
 destroy_kadm5_log_context (kadm5_log_context *c)
 {
+    _kadm5_log_index_close (c);
     free (c->log_file);
     rk_closesocket (c->socket_fd);
 #ifdef NO_UNIX_SOCKETS
@@ -76,6 +77,11 @@ kadm5_s_destroy(void *server_handle)
     kadm5_server_context *context = server_handle;
     krb5_context kcontext = context->context;
 
+    /* Sync what a batch that was never ended left unsynced */
+    if (context->log_context.batch > 0) {
+	context->log_context.batch = 1;
+	(void) kadm5_log_batch_end(context);
+    }
     ret = context->db->hdb_destroy(kcontext, context->db);
     destroy_kadm5_log_context (&context->log_context);
     destroy_config (&context->config);
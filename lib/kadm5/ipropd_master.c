@@ -34,6 +34,10 @@
 #include "iprop.h"
 #include <rtbl.h>
 
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID)
+#include <sys/wait.h>
+#endif
+
 static krb5_log_facility *log_facility;
 
 static int verbose;
@@ -132,6 +136,16 @@ struct slave {
     unsigned long flags;
 #define SLAVE_F_DEAD	0x1
 #define SLAVE_F_AYT	0x2
+#define SLAVE_F_DUMP_WAIT	0x4	/* waiting for the dumper to finish */
+#define SLAVE_F_BEHIND	0x8	/* diffs held back until output drains */
+    int dump_fd;		/* dump being streamed, shared lock held */
+    krb5_storage *dump;
+    uint32_t dump_version;
+    krb5_data input;		/* partial message from the slave */
+    unsigned char *out_buf;	/* framed messages queued for the slave */
+    size_t out_off;		/* how much of out_buf has been written */
+    size_t out_len;
+    size_t out_size;
     struct slave *next;
 };
 
@@ -195,11 +209,35 @@ slave_gone_p (slave *s)
     return 0;
 }
 
+static void
+dump_stream_end(slave *s)
+{
+    if (s->dump)
+	krb5_storage_free(s->dump);
+    if (s->dump_fd != -1)
+	close(s->dump_fd);
+    s->dump = NULL;
+    s->dump_fd = -1;
+}
+
+static void
+slave_queue_free(slave *s)
+{
+    krb5_data_free(&s->input);
+    free(s->out_buf);
+    s->out_buf = NULL;
+    s->out_off = s->out_len = s->out_size = 0;
+}
+
 static void
 slave_dead(krb5_context context, slave *s)
 {
     krb5_warnx(context, "slave %s dead", s->name);
 
+    dump_stream_end(s);
+    slave_queue_free(s);
+    s->flags &= ~(SLAVE_F_DUMP_WAIT|SLAVE_F_BEHIND);
+
     if (!rk_IS_BAD_SOCKET(s->fd)) {
 	rk_closesocket (s->fd);
 	s->fd = rk_INVALID_SOCKET;
@@ -215,6 +253,8 @@ remove_slave (krb5_context context, slave *s, slave **root)
 
     if (!rk_IS_BAD_SOCKET(s->fd))
 	rk_closesocket (s->fd);
+    dump_stream_end(s);
+    slave_queue_free(s);
     if (s->name)
 	free (s->name);
     if (s->ac)
@@ -246,6 +286,11 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
     }
     s->name = NULL;
     s->ac = NULL;
+    s->dump = NULL;
+    s->dump_fd = -1;
+    krb5_data_zero(&s->input);
+    s->out_buf = NULL;
+    s->out_off = s->out_len = s->out_size = 0;
 
     addr_len = sizeof(s->addr);
     s->fd = accept (fd, (struct sockaddr *)&s->addr, &addr_len);
@@ -303,6 +348,9 @@ add_slave (krb5_context context, krb5_keytab keytab, slave **root,
 
     krb5_warnx (context, "connection from %s", s->name);
 
+    /* From here on all I/O with the slave goes through its queues */
+    socket_set_nonblocking(s->fd, 1);
+
     s->version = 0;
     s->flags = 0;
     slave_seen(s);
@@ -313,6 +361,176 @@ error:
     remove_slave(context, s, root);
 }
 
+/*
+ * Messages to a slave are sealed and queued, and written out from the
+ * main loop as its socket becomes writable, so that one slow slave
+ * does not hold up the others.  Likewise messages from a slave are
+ * read as they arrive.
+ */
+
+#define SLAVE_MSG_MAX	(64 * 1024)	/* slaves only send short messages */
+
+/*
+ * A dump being streamed is queued this much at a time, so a slave
+ * receiving one holds a bounded amount of memory and the messages
+ * still leave in large writes.
+ */
+#define DUMP_CHUNK	(64 * 1024)
+
+static krb5_error_code
+slave_queue (krb5_context context, slave *s, const krb5_data *data)
+{
+    krb5_error_code ret;
+    krb5_data packet;
+    unsigned char *p;
+    size_t need;
+
+    ret = krb5_mk_priv(context, s->ac, data, &packet, NULL);
+    if (ret)
+	return ret;
+
+    need = s->out_len + 4 + packet.length;
+    if (need > s->out_size) {
+	size_t size = max(need, 2 * s->out_size);
+
+	p = realloc(s->out_buf, size);
+	if (p == NULL) {
+	    krb5_data_free(&packet);
+	    return krb5_enomem(context);
+	}
+	s->out_buf = p;
+	s->out_size = size;
+    }
+    p = s->out_buf + s->out_len;
+    p[0] = (packet.length >> 24) & 0xff;
+    p[1] = (packet.length >> 16) & 0xff;
+    p[2] = (packet.length >> 8) & 0xff;
+    p[3] = packet.length & 0xff;
+    memcpy(p + 4, packet.data, packet.length);
+    s->out_len = need;
+    krb5_data_free(&packet);
+    return 0;
+}
+
+static size_t
+slave_pending(slave *s)
+{
+    return s->out_len - s->out_off;
+}
+
+/* Write as much of the queue as the socket takes without blocking */
+static krb5_error_code
+slave_flush (krb5_context context, slave *s)
+{
+    krb5_ssize_t n;
+    int err;
+
+    while (s->out_off < s->out_len) {
+	n = send(s->fd, s->out_buf + s->out_off, s->out_len - s->out_off, 0);
+	if (rk_IS_SOCKET_ERROR(n)) {
+	    err = rk_SOCK_ERRNO;
+	    if (err == EINTR)
+		continue;
+	    if (err == EWOULDBLOCK || err == EAGAIN)
+		return 0;
+	    krb5_warn(context, err, "write to slave %s", s->name);
+	    return err;
+	}
+	s->out_off += n;
+	slave_seen(s);
+    }
+
+    /* Drained; don't keep a dump's worth of buffer around */
+    s->out_off = s->out_len = 0;
+    if (s->out_size > 4 * DUMP_CHUNK) {
+	free(s->out_buf);
+	s->out_buf = NULL;
+	s->out_size = 0;
+    }
+    return 0;
+}
+
+/*
+ * Read what the slave has sent so far.  Returns HEIM_ERR_EOF if it
+ * closed the connection.
+ */
+static krb5_error_code
+slave_read (krb5_context context, slave *s)
+{
+    krb5_error_code ret;
+    krb5_ssize_t n;
+    char buf[1024];
+    size_t len;
+    int err;
+
+    do {
+	n = recv(s->fd, buf, sizeof(buf), 0);
+    } while (rk_IS_SOCKET_ERROR(n) && rk_SOCK_ERRNO == EINTR);
+    if (rk_IS_SOCKET_ERROR(n)) {
+	err = rk_SOCK_ERRNO;
+	if (err == EWOULDBLOCK || err == EAGAIN)
+	    return 0;
+	krb5_warn(context, err, "error reading message from %s", s->name);
+	return err;
+    }
+    if (n == 0) {
+	krb5_warnx(context, "connection closed by %s", s->name);
+	return HEIM_ERR_EOF;
+    }
+
+    len = s->input.length;
+    if (len + n > SLAVE_MSG_MAX + 4) {
+	krb5_warnx(context, "message from %s too long", s->name);
+	return EMSGSIZE;
+    }
+    ret = krb5_data_realloc(&s->input, len + n);
+    if (ret)
+	return ret;
+    memcpy((char *)s->input.data + len, buf, n);
+    return 0;
+}
+
+/*
+ * Take the next complete message off the slave's input, if any, and
+ * unseal it into *out.
+ */
+static krb5_error_code
+slave_message (krb5_context context, slave *s, krb5_data *out, int *gotp)
+{
+    krb5_error_code ret;
+    krb5_data packet;
+    unsigned char *p = s->input.data;
+    size_t len;
+
+    *gotp = 0;
+    krb5_data_zero(out);
+
+    if (s->input.length < 4)
+	return 0;
+    len = ((size_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    if (len > SLAVE_MSG_MAX) {
+	krb5_warnx(context, "message from %s too long", s->name);
+	return EMSGSIZE;
+    }
+    if (s->input.length < 4 + len)
+	return 0;
+
+    packet.data = p + 4;
+    packet.length = len;
+    ret = krb5_rd_priv(context, s->ac, &packet, out, NULL);
+    if (ret) {
+	krb5_warn(context, ret, "error reading message from %s", s->name);
+	return ret;
+    }
+
+    memmove(p, p + 4 + len, s->input.length - 4 - len);
+    s->input.length -= 4 + len;
+    if (s->input.length == 0)
+	krb5_data_free(&s->input);
+    *gotp = 1;
+    return 0;
+}
+
 static int
 dump_one (krb5_context context, HDB *db, hdb_entry_ex *entry, void *v)
 {
@@ -354,7 +572,11 @@ write_dump (krb5_context context, krb5_storage *dump,
     krb5_data data;
     char buf[8];
 
-    /* we assume that the caller has obtained an exclusive lock */
+    /*
+     * We assume that the caller has obtained an exclusive lock.  This
+     * runs in the dumper child (see start_dump()), so errors are
+     * returned rather than exiting.
+     */
 
     ret = krb5_storage_truncate(dump, 0);
     if (ret)
@@ -374,15 +596,23 @@ write_dump (krb5_context context, krb5_storage *dump,
     ret = krb5_store_uint32(dump, 0);
 
     ret = hdb_create (context, &db, database);
-    if (ret)
-	krb5_err (context, IPROPD_RESTART, ret, "hdb_create: %s", database);
+    if (ret) {
+	krb5_warn (context, ret, "hdb_create: %s", database);
+	return ret;
+    }
     ret = db->hdb_open (context, db, O_RDONLY, 0);
-    if (ret)
-	krb5_err (context, IPROPD_RESTART, ret, "db->open");
+    if (ret) {
+	krb5_warn (context, ret, "db->open");
+	(*db->hdb_destroy)(context, db);
+	return ret;
+    }
 
     sp = krb5_storage_from_mem (buf, 4);
-    if (sp == NULL)
-	krb5_errx (context, IPROPD_RESTART, "krb5_storage_from_mem");
+    if (sp == NULL) {
+	ret = ENOMEM;
+	krb5_warnx (context, "write_dump: krb5_storage_from_mem");
+	goto close_db;
+    }
     krb5_store_uint32 (sp, TELL_YOU_EVERYTHING);
     krb5_storage_free (sp);
 
@@ -392,21 +622,24 @@ write_dump (krb5_context context, krb5_storage *dump,
     ret = krb5_store_data(dump, data);
     if (ret) {
 	krb5_warn (context, ret, "write_dump");
-	return ret;
+	goto close_db;
     }
 
     ret = hdb_foreach (context, db, HDB_F_ADMIN_DATA, dump_one, dump);
-    if (ret) {
+    if (ret)
 	krb5_warn (context, ret, "write_dump: hdb_foreach");
-	return ret;
-    }
 
+close_db:
     (*db->hdb_close)(context, db);
     (*db->hdb_destroy)(context, db);
+    if (ret)
+	return ret;
 
     sp = krb5_storage_from_mem (buf, 8);
-    if (sp == NULL)
-	krb5_errx (context, IPROPD_RESTART, "krb5_storage_from_mem");
+    if (sp == NULL) {
+	krb5_warnx (context, "write_dump: krb5_storage_from_mem");
+	return ENOMEM;
+    }
     ret = krb5_store_uint32(sp, NOW_YOU_HAVE);
     if (ret == 0)
       krb5_store_uint32(sp, current_version);
@@ -451,18 +684,29 @@ write_dump (krb5_context context, krb5_storage *dump,
     return ret;
 }
 
-static int
-send_complete (krb5_context context, slave *s, const char *database,
-	       uint32_t current_version, uint32_t oldest_version,
-	       uint32_t initial_log_tstamp)
+/*
+ * The full dump is written by a child process so that the select loop
+ * keeps serving the other slaves meanwhile, and only one dump is ever
+ * in progress: every slave that needs a complete database waits with
+ * SLAVE_F_DUMP_WAIT set until the child exits, and then streams the
+ * same dump file.  The versions the dump must cover are those of the
+ * slave that asked first.
+ */
+static pid_t dump_pid = -1;
+static int dump_pipe = -1;	/* EOF when the dumper exits */
+static uint32_t dump_current_version;
+static uint32_t dump_oldest_version;
+static uint32_t dump_initial_log_tstamp;
+
+static krb5_error_code
+open_dump(krb5_context context, int *fdp, krb5_storage **dumpp)
 {
     krb5_error_code ret;
-    krb5_storage *dump = NULL;
-    uint32_t vno = 0;
-    krb5_data data;
-    int fd = -1;
-    struct stat st;
     char *dfn;
+    int fd;
+
+    *fdp = -1;
+    *dumpp = NULL;
 
     ret = asprintf(&dfn, "%s/ipropd.dumpfile", hdb_db_dir(context));
     if (ret == -1 || !dfn) {
@@ -479,147 +723,276 @@ send_complete (krb5_context context, slave *s, const char *database,
     }
     free(dfn);
 
-    dump = krb5_storage_from_fd(fd);
-    if (!dump) {
+    *dumpp = krb5_storage_from_fd(fd);
+    if (*dumpp == NULL) {
 	ret = errno;
 	krb5_warn(context, ret, "krb5_storage_from_fd");
-	goto done;
+	close(fd);
+	return ret;
     }
+    *fdp = fd;
+    return 0;
+}
 
-    for (;;) {
-	ret = flock(fd, LOCK_SH);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "flock(fd, LOCK_SH)");
-	    goto done;
-	}
+/*
+ * Set *vnop to the version of the dump if it is valid and recent
+ * enough to bring a slave up to the log, else to zero.  On success the
+ * dump is positioned right after the version, at the first message.
+ */
+static krb5_error_code
+check_dump(krb5_context context, krb5_storage *dump, int fd,
+	   uint32_t current_version, uint32_t oldest_version,
+	   uint32_t initial_log_tstamp, uint32_t *vnop)
+{
+    krb5_error_code ret;
+    struct stat st;
+    uint32_t vno = 0;
 
-	if (krb5_storage_seek(dump, 0, SEEK_SET) == (off_t)-1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "krb5_storage_seek(dump, 0, SEEK_SET)");
-	    goto done;
-	}
+    *vnop = 0;
 
-	vno = 0;
-	ret = krb5_ret_uint32(dump, &vno);
-	if (ret && ret != HEIM_ERR_EOF) {
-	    krb5_warn(context, ret, "krb5_ret_uint32(dump, &vno)");
-	    goto done;
-	}
+    if (krb5_storage_seek(dump, 0, SEEK_SET) == (off_t)-1) {
+	ret = errno;
+	krb5_warn(context, ret, "krb5_storage_seek(dump, 0, SEEK_SET)");
+	return ret;
+    }
 
-        if (fstat(fd, &st) == -1) {
-            ret = errno;
-            krb5_warn(context, ret, "send_complete: could not stat dump file");
-            goto done;
-        }
+    ret = krb5_ret_uint32(dump, &vno);
+    if (ret == HEIM_ERR_EOF)
+	return 0;
+    if (ret) {
+	krb5_warn(context, ret, "krb5_ret_uint32(dump, &vno)");
+	return ret;
+    }
 
-	/*
-	 * If the current dump has an appropriate version, then we can
-	 * break out of the loop and send the file below.
-	 */
+    if (fstat(fd, &st) == -1) {
+	ret = errno;
+	krb5_warn(context, ret, "check_dump: could not stat dump file");
+	return ret;
+    }
 
-	if (ret == 0 && vno != 0 && st.st_mtime > initial_log_tstamp &&
-            vno >= oldest_version && vno <= current_version)
-	    break;
+    if (vno != 0 && st.st_mtime > initial_log_tstamp &&
+	vno >= oldest_version && vno <= current_version)
+	*vnop = vno;
+    return 0;
+}
 
-        if (verbose)
-            krb5_warnx(context, "send_complete: dumping HDB");
+/*
+ * Body of the dumper child: write a new dump file unless someone beat
+ * us to it while we were waiting for the exclusive lock.
+ */
+static krb5_error_code
+dump_child(krb5_context context, const char *database,
+	   uint32_t current_version, uint32_t oldest_version,
+	   uint32_t initial_log_tstamp)
+{
+    krb5_error_code ret;
+    krb5_storage *dump;
+    uint32_t vno;
+    int fd;
 
-	/*
-	 * Otherwise, we may need to write a new dump file.  We
-	 * obtain an exclusive lock on the fd.  Because this is
-	 * not guaranteed to be an upgrade of our existing shared
-	 * lock, someone else may have written a new dumpfile while
-	 * we were waiting and so we must first check the vno of
-	 * the dump to see if that happened.  If it did, we need
-	 * to go back to the top of the loop so that we can downgrade
-	 * our lock to a shared one.
-	 */
+    ret = open_dump(context, &fd, &dump);
+    if (ret)
+	return ret;
 
-	ret = flock(fd, LOCK_EX);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "flock(fd, LOCK_EX)");
-	    goto done;
-	}
+    if (flock(fd, LOCK_EX) == -1) {
+	ret = errno;
+	krb5_warn(context, ret, "flock(fd, LOCK_EX)");
+    }
+    if (ret == 0)
+	ret = check_dump(context, dump, fd, current_version, oldest_version,
+			 initial_log_tstamp, &vno);
+    if (ret == 0 && vno == 0)
+	ret = write_dump(context, dump, database, current_version);
 
-	ret = krb5_storage_seek(dump, 0, SEEK_SET);
-	if (ret == -1) {
-	    ret = errno;
-	    krb5_warn(context, ret, "krb5_storage_seek(dump, 0, SEEK_SET)");
-	    goto done;
-	}
+    krb5_storage_free(dump);
+    close(fd);
+    return ret;
+}
 
-	vno = 0;
-	ret = krb5_ret_uint32(dump, &vno);
-	if (ret && ret != HEIM_ERR_EOF) {
-	    krb5_warn(context, ret, "krb5_ret_uint32(dump, &vno)");
-	    goto done;
-	}
+/*
+ * Start the dumper if some slave is waiting for it.  Without fork()
+ * the dump is written right here.  Returns non-zero when the waiting
+ * slaves are to be woken up now, *okp telling whether there is a dump
+ * for them.
+ */
+static int
+start_dump(krb5_context context, slave *slaves, const char *database,
+	   int *okp)
+{
+    krb5_error_code ret;
+    slave *p;
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID)
+    int fds[2];
+    pid_t pid;
+#endif
 
-        if (fstat(fd, &st) == -1) {
-            ret = errno;
-            krb5_warn(context, ret, "send_complete: could not stat dump file");
-            goto done;
-        }
+    *okp = 0;
 
-	/* check if someone wrote a better version for us */
-        if (ret == 0 && vno != 0 && st.st_mtime > initial_log_tstamp &&
-            vno >= oldest_version && vno <= current_version)
-	    continue;
+    if (dump_pid != -1)
+	return 0;
+    for (p = slaves; p != NULL; p = p->next)
+	if (p->flags & SLAVE_F_DUMP_WAIT)
+	    break;
+    if (p == NULL)
+	return 0;
 
-	/* Now, we know that we must write a new dump file.  */
+    if (verbose)
+	krb5_warnx(context, "start_dump: dumping HDB");
 
-	ret = write_dump(context, dump, database, current_version);
-	if (ret)
-	    goto done;
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID)
+    if (pipe(fds) == -1) {
+	krb5_warn(context, errno, "start_dump: pipe");
+	return 1;
+    }
 
+    pid = fork();
+    if (pid == -1) {
+	krb5_warn(context, errno, "start_dump: fork");
+	close(fds[0]);
+	close(fds[1]);
+	return 1;
+    }
+    if (pid == 0) {
+	close(fds[0]);
 	/*
-	 * And we must continue to the top of the loop so that we can
-	 * downgrade to a shared lock.
+	 * Our copies of the dump fds being streamed share their shared
+	 * locks, we would never get the exclusive one with them open.
 	 */
+	for (p = slaves; p != NULL; p = p->next)
+	    if (p->dump_fd != -1)
+		close(p->dump_fd);
+	ret = dump_child(context, database, dump_current_version,
+			 dump_oldest_version, dump_initial_log_tstamp);
+	/* _exit() so that the parent's pidfile stays in place */
+	_exit(ret ? IPROPD_RESTART : IPROPD_DONE);
+    }
+
+    close(fds[1]);
+    dump_pid = pid;
+    dump_pipe = fds[0];
+    return 0;
+#else
+    ret = dump_child(context, database, dump_current_version,
+		     dump_oldest_version, dump_initial_log_tstamp);
+    *okp = (ret == 0);
+    return 1;
+#endif
+}
+
+/*
+ * Reap the dumper once its pipe reports EOF.  Returns true if it
+ * wrote (or found) a usable dump.
+ */
+static int
+finish_dump(krb5_context context)
+{
+#if defined(HAVE_FORK) && defined(HAVE_WAITPID)
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(dump_pid, &status, 0)) == -1 && errno == EINTR)
+	;
+    close(dump_pipe);
+    dump_pipe = -1;
+    dump_pid = -1;
+
+    if (pid == -1) {
+	krb5_warn(context, errno, "finish_dump: waitpid");
+	return 0;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != IPROPD_DONE) {
+	krb5_warnx(context, "finish_dump: dumper failed");
+	return 0;
     }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int
+send_complete (krb5_context context, slave *s, const char *database,
+	       uint32_t current_version, uint32_t oldest_version,
+	       uint32_t initial_log_tstamp)
+{
+    krb5_error_code ret;
+    krb5_storage *dump;
+    uint32_t vno = 0;
+    int fd;
+
+    ret = open_dump(context, &fd, &dump);
+    if (ret)
+	return ret;
 
     /*
-     * Leaving the above loop, dump should have a ptr right after the initial
-     * 4 byte DB version number and we should have a shared lock on the file
-     * (which we may have just created), so we are reading to simply blast
-     * the data down the wire.
+     * Don't block on the dumper's exclusive lock, if the dump is being
+     * written we just wait for it along with everyone else.  The
+     * shared lock is held until the whole dump has been streamed.
      */
+    if (flock(fd, LOCK_SH|LOCK_NB) == -1) {
+	if (errno != EWOULDBLOCK) {
+	    ret = errno;
+	    krb5_warn(context, ret, "flock(fd, LOCK_SH)");
+	}
+    } else {
+	ret = check_dump(context, dump, fd, current_version, oldest_version,
+			 initial_log_tstamp, &vno);
+    }
 
-    for (;;) {
-	ret = krb5_ret_data(dump, &data);
-	if (ret == HEIM_ERR_EOF) {
-	    ret = 0;	/* EOF is not an error, it's success */
-	    goto done;
+    if (ret || vno == 0) {
+	krb5_storage_free(dump);
+	close(fd);
+	if (ret)
+	    return ret;
+	if (dump_pid == -1) {
+	    dump_current_version = current_version;
+	    dump_oldest_version = oldest_version;
+	    dump_initial_log_tstamp = initial_log_tstamp;
 	}
+	s->flags |= SLAVE_F_DUMP_WAIT;
+	return 0;
+    }
 
+    /* The messages get queued from the main loop by send_dump_chunk() */
+    s->dump = dump;
+    s->dump_fd = fd;
+    s->dump_version = vno;
+    return 0;
+}
+
+/*
+ * Queue the next DUMP_CHUNK bytes or so of the dump being streamed to
+ * s.  Called whenever its queue runs low.
+ */
+static int
+send_dump_chunk (krb5_context context, slave *s)
+{
+    krb5_error_code ret;
+    krb5_data data;
+
+    while (slave_pending(s) < DUMP_CHUNK) {
+	ret = krb5_ret_data(s->dump, &data);
+	if (ret == HEIM_ERR_EOF) {
+	    /* EOF is not an error, it's success */
+	    s->version = s->dump_version;
+	    dump_stream_end(s);
+	    krb5_warnx(context, "sent complete database to slave %s "
+		       "(version %u)", s->name, s->version);
+	    return 0;
+	}
 	if (ret) {
 	    krb5_warn(context, ret, "krb5_ret_data(dump, &data)");
-	    slave_dead(context, s);
-	    goto done;
+	    return ret;
 	}
 
-	ret = krb5_write_priv_message(context, s->ac, &s->fd, &data);
+	ret = slave_queue(context, s, &data);
 	krb5_data_free(&data);
-
 	if (ret) {
-	    krb5_warn (context, ret, "krb5_write_priv_message");
-	    slave_dead(context, s);
-	    goto done;
+	    krb5_warn(context, ret, "send_dump_chunk: slave_queue");
+	    return ret;
 	}
     }
-
-done:
-    if (!ret) {
-	s->version = vno;
-	slave_seen(s);
-    }
-    if (fd != -1)
-	close(fd);
-    if (dump)
-	krb5_storage_free(dump);
-    return ret;
+    return 0;
 }
 
 static int
@@ -630,7 +1003,8 @@ send_are_you_there (krb5_context context, slave *s)
     char buf[4];
     int ret;
 
-    if (s->flags & (SLAVE_F_DEAD|SLAVE_F_AYT))
+    /* A slave receiving a dump would take an AYT for part of it */
+    if ((s->flags & (SLAVE_F_DEAD|SLAVE_F_AYT)) || s->dump != NULL)
 	return 0;
 
     krb5_warnx(context, "slave %s missing, sending AYT", s->name);
@@ -650,10 +1024,10 @@ send_are_you_there (krb5_context context, slave *s)
     krb5_storage_free (sp);
 
     if (ret == 0) {
-        ret = krb5_write_priv_message(context, s->ac, &s->fd, &data);
+        ret = slave_queue(context, s, &data);
 
         if (ret) {
-            krb5_warn(context, ret, "are_you_there: krb5_write_priv_message");
+            krb5_warn(context, ret, "are_you_there: slave_queue");
             slave_dead(context, s);
             return 1;
         }
@@ -662,6 +1036,44 @@ send_are_you_there (krb5_context context, slave *s)
     return 0;
 }
 
+/*
+ * The diffs most recently read from the log.  When the log moves on,
+ * every slave that was in sync needs the same records, so they are
+ * read once and only sealed separately for each slave.
+ */
+static struct {
+    uint32_t from_version;
+    uint32_t to_version;
+    uint32_t initial_version;	/* identify the log, as in send_diffs() */
+    uint32_t initial_tstamp;
+    krb5_data data;		/* the FOR_YOU message */
+} last_diffs;
+
+static int
+queue_diffs (krb5_context context, slave *s, const krb5_data *data,
+	     uint32_t current_version)
+{
+    krb5_error_code ret;
+
+    krb5_warnx(context,
+	       "syncing slave %s from version %lu to version %lu",
+	       s->name, (unsigned long)s->version,
+	       (unsigned long)current_version);
+
+    ret = slave_queue(context, s, data);
+    if (ret) {
+	krb5_warn (context, ret, "send_diffs: slave_queue");
+	slave_dead(context, s);
+	return 1;
+    }
+
+    s->version = current_version;
+
+    krb5_warnx(context, "slave %s is now up to date (%u)", s->name, s->version);
+
+    return 0;
+}
+
 static int
 send_diffs (kadm5_server_context *server_context, slave *s, int log_fd,
 	    const char *database, uint32_t current_version,
@@ -673,7 +1085,7 @@ send_diffs (kadm5_server_context *server_context, slave *s, int log_fd,
     uint32_t initial_tstamp, initial_tstamp2;
     enum kadm_ops op;
     uint32_t len;
-    off_t right, left;
+    off_t right, left = -1;
     krb5_ssize_t bytes;
     krb5_data data;
     int ret = 0;
@@ -683,6 +1095,24 @@ send_diffs (kadm5_server_context *server_context, slave *s, int log_fd,
         return 0;
     }
 
+    /* It will ask again with I_HAVE once it has the whole dump */
+    if (s->dump != NULL || (s->flags & SLAVE_F_DUMP_WAIT)) {
+        if (verbose)
+            krb5_warnx(context, "not sending diffs to slave %s while it "
+                       "waits for a complete database", s->name);
+        return 0;
+    }
+
+    /*
+     * Let a slow slave drain what it was sent before, it then gets
+     * everything since in one go (see the main loop).
+     */
+    if (slave_pending(s) > 0) {
+        s->flags |= SLAVE_F_BEHIND;
+        return 0;
+    }
+    s->flags &= ~SLAVE_F_BEHIND;
+
     if (s->version == current_version) {
 	char buf[4];
 
@@ -694,7 +1124,7 @@ send_diffs (kadm5_server_context *server_context, slave *s, int log_fd,
 	data.data   = buf;
 	data.length = 4;
         if (ret == 0) {
-            ret = krb5_write_priv_message(context, s->ac, &s->fd, &data);
+            ret = slave_queue(context, s, &data);
             if (ret) {
                 krb5_warn(context, ret, "send_diffs: failed to send to slave");
                 slave_dead(context, s);
@@ -736,6 +1166,16 @@ send_diffs (kadm5_server_context *server_context, slave *s, int log_fd,
                   "send_diffs: failed to read log");
         return errno ? errno : EINVAL;
     }
+
+    if (last_diffs.data.length != 0 &&
+        last_diffs.from_version == s->version &&
+        last_diffs.to_version == current_version &&
+        last_diffs.initial_version == initial_version &&
+        last_diffs.initial_tstamp == initial_tstamp) {
+        krb5_storage_free(sp);
+        return queue_diffs(context, s, &last_diffs.data, current_version);
+    }
+
     /*
      * We're not holding any locks here, so we can't prevent truncations.
      *
@@ -748,7 +1188,23 @@ send_diffs (kadm5_server_context *server_context, slave *s, int log_fd,
         send_are_you_there(context, s);
         return errno;
     }
-    for (;;) {
+
+    /*
+     * Find the slave's next version with the log's index, else walk the
+     * log backwards from its end until we get to it.
+     */
+    ver = s->version;
+    if (kadm5_log_seek_version(server_context, sp, s->version + 1) == 0) {
+        left = krb5_storage_seek(sp, 0, SEEK_CUR);
+        if (left > 0 && left < right)
+            ver = s->version + 1;
+        else if (krb5_storage_seek(sp, right, SEEK_SET) != right) {
+            krb5_storage_free(sp);
+            send_are_you_there(context, s);
+            return errno;
+        }
+    }
+    while (ver != s->version + 1) {
 	ret = kadm5_log_previous (context, sp, &ver, NULL, &op, &len);
 	if (ret)
 	    krb5_err(context, IPROPD_RESTART, ret,
@@ -792,11 +1248,6 @@ send_diffs (kadm5_server_context *server_context, slave *s, int log_fd,
 
     assert(ver == s->version + 1);
 
-    krb5_warnx(context,
-	       "syncing slave %s from version %lu to version %lu",
-	       s->name, (unsigned long)s->version,
-	       (unsigned long)current_version);
-
     ret = krb5_data_alloc (&data, right - left + 4);
     if (ret) {
 	krb5_storage_free(sp);
@@ -849,21 +1300,39 @@ send_diffs (kadm5_server_context *server_context, slave *s, int log_fd,
     krb5_store_uint32 (sp, FOR_YOU);
     krb5_storage_free(sp);
 
-    ret = krb5_write_priv_message(context, s->ac, &s->fd, &data);
-    krb5_data_free(&data);
+    krb5_data_free(&last_diffs.data);
+    last_diffs.from_version = s->version;
+    last_diffs.to_version = current_version;
+    last_diffs.initial_version = initial_version;
+    last_diffs.initial_tstamp = initial_tstamp;
+    last_diffs.data = data;
 
-    if (ret) {
-	krb5_warn (context, ret, "send_diffs: krb5_write_priv_message");
-	slave_dead(context, s);
-	return 1;
-    }
-    slave_seen(s);
-
-    s->version = current_version;
+    return queue_diffs(context, s, &last_diffs.data, current_version);
+}
 
-    krb5_warnx(context, "slave %s is now up to date (%u)", s->name, s->version);
+/*
+ * The dumper is done: start streaming to the slaves that waited for
+ * it.  send_diffs() has another look at the log, so a slave gets diffs
+ * instead if the dump turned out not to be needed after all.
+ */
+static void
+wake_dump_waiters (kadm5_server_context *server_context, slave *slaves,
+		   int ok, int log_fd, const char *database,
+		   uint32_t current_version, uint32_t current_tstamp)
+{
+    krb5_context context = server_context->context;
+    slave *p;
 
-    return 0;
+    for (p = slaves; p != NULL; p = p->next) {
+	if (!(p->flags & SLAVE_F_DUMP_WAIT))
+	    continue;
+	p->flags &= ~SLAVE_F_DUMP_WAIT;
+	if (!ok)
+	    slave_dead(context, p);
+	else if (send_diffs(server_context, p, log_fd, database,
+			    current_version, current_tstamp))
+	    slave_dead(context, p);
+    }
 }
 
 static int
@@ -876,73 +1345,80 @@ process_msg (kadm5_server_context *server_context, slave *s, int log_fd,
     krb5_data out;
     krb5_storage *sp;
     uint32_t tmp;
+    int got;
 
-    ret = krb5_read_priv_message(context, s->ac, &s->fd, &out);
-    if(ret) {
-	krb5_warn(context, ret, "error reading message from %s", s->name);
-	return 1;
-    }
-
-    sp = krb5_storage_from_mem(out.data, out.length);
-    if (sp == NULL) {
-	krb5_warnx(context, "process_msg: no memory");
-	krb5_data_free(&out);
-	return 1;
-    }
-    if (krb5_ret_uint32(sp, &tmp) != 0) {
-	krb5_warnx(context, "process_msg: client send too short command");
-	krb5_data_free(&out);
-	return 1;
-    }
-    switch (tmp) {
-    case I_HAVE :
-	ret = krb5_ret_uint32(sp, &tmp);
-	if (ret != 0) {
-	    krb5_warnx(context, "process_msg: client send too little I_HAVE data");
-	    break;
+    /* Handle every complete message read so far */
+    for (;;) {
+	ret = slave_message(context, s, &out, &got);
+	if (ret)
+	    return 1;
+	if (!got)
+	    return 0;
+
+	sp = krb5_storage_from_mem(out.data, out.length);
+	if (sp == NULL) {
+	    krb5_warnx(context, "process_msg: no memory");
+	    krb5_data_free(&out);
+	    return 1;
 	}
-	/* new started slave that have old log */
-	if (s->version == 0 && tmp != 0) {
-	    if (current_version < tmp) {
-		krb5_warnx(context, "Slave %s (version %u) have later version "
-			   "the master (version %u) OUT OF SYNC",
-			   s->name, tmp, current_version);
-	    }
-            if (verbose)
-                krb5_warnx(context, "slave %s updated from %u to %u",
-                           s->name, s->version, tmp);
-	    s->version = tmp;
+	if (krb5_ret_uint32(sp, &tmp) != 0) {
+	    krb5_warnx(context, "process_msg: client send too short command");
+	    krb5_data_free(&out);
+	    return 1;
 	}
-	if (tmp < s->version) {
-	    krb5_warnx(context, "Slave %s claims to not have "
-                       "version we already sent to it", s->name);
-            s->version = tmp;
+	switch (tmp) {
+	case I_HAVE :
+	    ret = krb5_ret_uint32(sp, &tmp);
+	    if (ret != 0) {
+		krb5_warnx(context, "process_msg: client send too little I_HAVE data");
+		break;
+	    }
+	    /* new started slave that have old log */
+	    if (s->version == 0 && tmp != 0) {
+		if (current_version < tmp) {
+		    krb5_warnx(context, "Slave %s (version %u) have later version "
+			       "the master (version %u) OUT OF SYNC",
+			       s->name, tmp, current_version);
+		}
+		if (verbose)
+		    krb5_warnx(context, "slave %s updated from %u to %u",
+			       s->name, s->version, tmp);
+		s->version = tmp;
+	    }
+	    if (tmp < s->version) {
+		krb5_warnx(context, "Slave %s claims to not have "
+			   "version we already sent to it", s->name);
+		s->version = tmp;
+	    }
+	    ret = send_diffs(server_context, s, log_fd, database, current_version,
+			     current_tstamp);
+	    break;
+	case I_AM_HERE :
+	    if (verbose)
+		krb5_warnx(context, "slave %s is there", s->name);
+	    break;
+	case ARE_YOU_THERE:
+	case FOR_YOU :
+	default :
+	    krb5_warnx(context, "Ignoring command %d", tmp);
+	    break;
 	}
-        ret = send_diffs(server_context, s, log_fd, database, current_version,
-                         current_tstamp);
-        break;
-    case I_AM_HERE :
-        if (verbose)
-            krb5_warnx(context, "slave %s is there", s->name);
-	break;
-    case ARE_YOU_THERE:
-    case FOR_YOU :
-    default :
-	krb5_warnx(context, "Ignoring command %d", tmp);
-	break;
-    }
 
-    krb5_data_free(&out);
-    krb5_storage_free(sp);
+	krb5_data_free(&out);
+	krb5_storage_free(sp);
 
-    slave_seen(s);
+	slave_seen(s);
 
-    return ret;
+	if (ret || (s->flags & SLAVE_F_DEAD))
+	    return ret;
+    }
 }
 
 #define SLAVE_NAME	"Name"
 #define SLAVE_ADDRESS	"Address"
 #define SLAVE_VERSION	"Version"
+#define SLAVE_LAG	"Lag"
+#define SLAVE_QUEUED	"Queued"
 #define SLAVE_STATUS	"Status"
 #define SLAVE_SEEN	"Last Seen"
 
@@ -1016,6 +1492,8 @@ write_stats(krb5_context context, slave *slaves, uint32_t current_version)
     rtbl_add_column(tbl, SLAVE_NAME, 0);
     rtbl_add_column(tbl, SLAVE_ADDRESS, 0);
     rtbl_add_column(tbl, SLAVE_VERSION, RTBL_ALIGN_RIGHT);
+    rtbl_add_column(tbl, SLAVE_LAG, RTBL_ALIGN_RIGHT);
+    rtbl_add_column(tbl, SLAVE_QUEUED, RTBL_ALIGN_RIGHT);
     rtbl_add_column(tbl, SLAVE_STATUS, 0);
     rtbl_add_column(tbl, SLAVE_SEEN, 0);
 
@@ -1038,8 +1516,18 @@ write_stats(krb5_context context, slave *slaves, uint32_t current_version)
 	snprintf(str, sizeof(str), "%u", (unsigned)slaves->version);
 	rtbl_add_column_entry(tbl, SLAVE_VERSION, str);
 
+	/* versions behind the master, and bytes not yet written to it */
+	snprintf(str, sizeof(str), "%u",
+		 slaves->version < current_version ?
+		 (unsigned)(current_version - slaves->version) : 0);
+	rtbl_add_column_entry(tbl, SLAVE_LAG, str);
+	snprintf(str, sizeof(str), "%lu", (unsigned long)slave_pending(slaves));
+	rtbl_add_column_entry(tbl, SLAVE_QUEUED, str);
+
 	if (slaves->flags & SLAVE_F_DEAD)
 	    rtbl_add_column_entry(tbl, SLAVE_STATUS, "Down");
+	else if (slaves->dump != NULL || (slaves->flags & SLAVE_F_DUMP_WAIT))
+	    rtbl_add_column_entry(tbl, SLAVE_STATUS, "Full sync");
 	else
 	    rtbl_add_column_entry(tbl, SLAVE_STATUS, "Up");
 
@@ -1212,8 +1700,9 @@ main(int argc, char **argv)
 
     while (exit_flag == 0){
 	slave *p;
-	fd_set readset;
+	fd_set readset, writeset;
 	int max_fd = 0;
+	int dump_ok;
 	struct timeval to = {30, 0};
 	uint32_t vers;
         struct stat st2;;
@@ -1224,7 +1713,32 @@ main(int argc, char **argv)
 	    krb5_errx (context, IPROPD_RESTART, "fd too large");
 #endif
 
+	/*
+	 * Slaves that need a complete database get it once the dumper
+	 * is done; or right away when the dump was written inline.
+	 */
+	if (start_dump(context, slaves, database, &dump_ok))
+	    wake_dump_waiters(server_context, slaves, dump_ok, log_fd,
+			      database, current_version, current_tstamp);
+
+	/*
+	 * Refill the queues of slaves being streamed a dump, and catch
+	 * up the ones whose diffs were held back now that they drained.
+	 */
+	for (p = slaves; p != NULL; p = p->next) {
+	    if (p->flags & SLAVE_F_DEAD)
+		continue;
+	    if (p->dump != NULL) {
+		if (send_dump_chunk(context, p))
+		    slave_dead(context, p);
+	    } else if ((p->flags & SLAVE_F_BEHIND) && slave_pending(p) == 0) {
+		send_diffs(server_context, p, log_fd, database,
+			   current_version, current_tstamp);
+	    }
+	}
+
 	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
 	FD_SET(signal_fd, &readset);
 	max_fd = max(max_fd, signal_fd);
 	FD_SET(listen_fd, &readset);
@@ -1234,15 +1748,22 @@ main(int argc, char **argv)
             max_fd = max(max_fd, restarter_fd);
         }
 
+        if (dump_pipe != -1) {
+            FD_SET(dump_pipe, &readset);
+            max_fd = max(max_fd, dump_pipe);
+        }
+
 	for (p = slaves; p != NULL; p = p->next) {
 	    if (p->flags & SLAVE_F_DEAD)
 		continue;
 	    FD_SET(p->fd, &readset);
+	    if (slave_pending(p) > 0)
+		FD_SET(p->fd, &writeset);
 	    max_fd = max(max_fd, p->fd);
 	}
 
 	ret = select (max_fd + 1,
-		      &readset, NULL, NULL, &to);
+		      &readset, &writeset, NULL, &to);
 	if (ret < 0) {
 	    if (errno == EINTR)
 		continue;
@@ -1359,14 +1880,34 @@ main(int argc, char **argv)
 	    }
         }
 
+	if (ret && dump_pipe != -1 && FD_ISSET(dump_pipe, &readset)) {
+	    --ret;
+	    assert(ret >= 0);
+	    dump_ok = finish_dump(context);
+	    wake_dump_waiters(server_context, slaves, dump_ok, log_fd,
+			      database, current_version, current_tstamp);
+	}
+
+	for (p = slaves; p != NULL; p = p->next) {
+	    if (p->flags & SLAVE_F_DEAD)
+	        continue;
+	    if (ret && FD_ISSET(p->fd, &writeset)) {
+		--ret;
+		assert(ret >= 0);
+		if (slave_flush(context, p))
+		    slave_dead(context, p);
+	    }
+	}
+
 	for(p = slaves; p != NULL; p = p->next) {
 	    if (p->flags & SLAVE_F_DEAD)
 	        continue;
 	    if (ret && FD_ISSET(p->fd, &readset)) {
 		--ret;
 		assert(ret >= 0);
-		if(process_msg (server_context, p, log_fd, database,
-				current_version, current_tstamp))
+		if (slave_read(context, p) ||
+		    process_msg (server_context, p, log_fd, database,
+				 current_version, current_tstamp))
 		    slave_dead(context, p);
 	    } else if (slave_gone_p (p))
 		slave_dead(context, p);
@@ -325,11 +325,22 @@ receive_loop (krb5_context context,
          * what we needed and just write this to the log file and let
          * kadm5_log_recover() do the rest.
          */
+        off = krb5_storage_seek(sp, 0, SEEK_CUR);
 	if (krb5_ret_uint32(sp, &vers) != 0 ||
             krb5_ret_uint32(sp, &timestamp) != 0 ||
             krb5_ret_uint32(sp, &op) != 0 ||
             krb5_ret_uint32(sp, &len) != 0) {
 
+            /*
+             * The master sends diffs again when our I_HAVE for earlier
+             * ones crosses diffs it already queued; we have them all.
+             */
+            if (off == krb5_storage_seek(sp, 0, SEEK_END)) {
+                if (verbose)
+                    krb5_warnx(context, "diffs from master are not new");
+                return 0;
+            }
+
             /*
              * This shouldn't happen.  Reconnecting probably won't help
              * if it does happen, but by reconnecting we get a chance to
@@ -33,6 +33,9 @@
 
 #include "kadm5_locl.h"
 #include "heim_threads.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 RCSID("$Id$");
 
@@ -460,6 +463,16 @@ get_max_log_size(krb5_context context)
     return 0;
 }
 
+static time_t
+get_commit_window(krb5_context context)
+{
+    /* Default to syncing every record even in a batch */
+    return krb5_config_get_time_default(context, NULL, 0,
+                                        "kdc",
+                                        "log-commit-window",
+                                        NULL);
+}
+
 static kadm5_ret_t truncate_if_needed(kadm5_server_context *);
 static krb5_storage *log_goto_first(kadm5_server_context *, int);
 
@@ -554,6 +567,18 @@ kadm5_log_set_version(kadm5_server_context *context, uint32_t vno)
     return 0;
 }
 
+/*
+ * While a batch has records that are not yet synced the log stays open
+ * and exclusively locked between its operations, see the group commit
+ * comment below.
+ */
+static int
+log_held_for_batch(kadm5_log_context *log_context)
+{
+    return log_context->batch > 0 && log_context->unsynced_since != 0 &&
+        log_context->log_fd != -1 && log_context->lock_mode == LOCK_EX;
+}
+
 /*
  * Open the log and setup server_context->log_context
  */
@@ -572,6 +597,10 @@ log_open(kadm5_server_context *server_context, int lock_mode)
         lock_nb = LOCK_NB;
     }
 
+    /* Don't downgrade or drop the lock a batch holds */
+    if (log_held_for_batch(log_context))
+        return 0;
+
     if (lock_mode == log_context->lock_mode && log_context->log_fd != -1)
         return 0;
 
@@ -740,6 +769,9 @@ kadm5_log_end(kadm5_server_context *server_context)
     kadm5_ret_t ret = 0;
     int fd = log_context->log_fd;
 
+    if (log_held_for_batch(log_context))
+        return 0;
+
     if (fd != -1) {
         if (log_context->lock_mode != LOCK_UN) {
             if (flock(fd, LOCK_UN) == -1 && errno == EBADF)
@@ -826,9 +858,432 @@ kadm5_log_signal_master(kadm5_server_context *context)
 #endif
 }
 
+/*
+ * Group commit.
+ *
+ * Between kadm5_log_batch_begin() and kadm5_log_batch_end() (which
+ * nest, and which kadm5_lock() and kadm5_unlock() call) records are
+ * still appended to the log before the HDB is updated, but the log is
+ * fsync()ed only once the oldest record not yet synced is `[kdc]
+ * log-commit-window' seconds old, and at the end of the batch.  Bulk
+ * operations then pay for one fsync() per window instead of one per
+ * principal.
+ *
+ * ipropd-master only reads the log under a shared lock, so to keep it
+ * from sending unsynced records to slaves kadm5_log_end() leaves the
+ * log open and exclusively locked while there are unsynced records in
+ * a batch; it is released by the operation that syncs them or by
+ * kadm5_log_batch_end().  ipropd-master, and other kadmind processes,
+ * block for up to the window (plus one operation) meanwhile.
+ *
+ * The cost is that a system crash (not just a process crash, the
+ * records are in the page cache then) inside the window can lose log
+ * records whose HDB updates made it to disk.  The window defaults to
+ * zero, which keeps the one fsync() per record and never holds the
+ * lock between operations.
+ */
+
+kadm5_ret_t
+kadm5_log_batch_begin(kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+
+    if (log_context->batch++ == 0)
+        log_context->commit_window = get_commit_window(context->context);
+    return 0;
+}
+
+kadm5_ret_t
+kadm5_log_batch_end(kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    kadm5_ret_t ret = 0;
+    int fd = log_context->log_fd;
+    int held;
+
+    if (log_context->batch == 0)
+        return 0;
+    held = log_held_for_batch(log_context);
+    if (--log_context->batch > 0)
+        return 0;
+
+    if (log_context->unsynced_since != 0) {
+        /* The log should still be open, see log_held_for_batch() */
+        if (fd == -1)
+            fd = open(log_context->log_file, O_RDONLY);
+        if (fd == -1 || fsync(fd) == -1)
+            ret = errno;
+        if (fd != -1 && fd != log_context->log_fd)
+            (void) close(fd);
+        if (ret == 0)
+            log_context->unsynced_since = 0;
+    }
+    if (held)
+        (void) kadm5_log_end(context);
+    if (ret)
+        return ret;
+    if (log_context->signal_pending) {
+        log_context->signal_pending = 0;
+        kadm5_log_signal_master(context);
+    }
+    return 0;
+}
+
+/* fsync() the log now, or later when in a batch and inside the window */
+static kadm5_ret_t
+log_sync(kadm5_server_context *context, krb5_storage *sp)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    time_t now;
+    kadm5_ret_t ret;
+
+    if (log_context->batch) {
+        now = time(NULL);
+        if (log_context->unsynced_since == 0)
+            log_context->unsynced_since = now;
+        if (now - log_context->unsynced_since < log_context->commit_window)
+            return 0;
+    }
+
+    ret = krb5_storage_fsync(sp);
+    if (ret)
+        return ret;
+    log_context->unsynced_since = 0;
+    if (log_context->signal_pending) {
+        log_context->signal_pending = 0;
+        kadm5_log_signal_master(context);
+    }
+    return 0;
+}
+
+/*
+ * The log index is a sidecar file, <log_file>.idx, that maps versions
+ * to the offsets of their records so that iprop can find where to start
+ * sending diffs to a slave that is far behind without walking the log
+ * backwards from its end:
+ *
+ * magic                        4 bytes
+ * version of first record      4 bytes
+ * offset of first record       8 bytes -\
+ * offset of second record      8 bytes   +> one per record after the
+ * ...                                 -/    uber record, in log order
+ *
+ * Record versions are consecutive, so a lookup is a single array access.
+ *
+ * The index is only a cache.  It is not fsync()ed, it is brought up to
+ * date with the log by walking forward from the last record it has
+ * whenever we append to the log, it is rebuilt from scratch when the log
+ * is truncated, and every offset found with it is checked against the
+ * log.
+ */
+#define LOG_INDEX_MAGIC         0x4c4f4749 /* "LOGI" */
+#define LOG_INDEX_HEADER_SZ     8
+#define LOG_INDEX_ENTRY_SZ      8
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && !defined(NO_MMAP)
+#define LOG_INDEX_MMAP 1
+#endif
+
+static char *
+log_index_file(kadm5_server_context *context)
+{
+    char *fn;
+
+    if (asprintf(&fn, "%s.idx", context->log_context.log_file) == -1)
+        return NULL;
+    return fn;
+}
+
+/* Index integers are big-endian, like everything else in the log */
+static void
+log_index_put(unsigned char *p, uint64_t v, size_t size)
+{
+    while (size-- > 0) {
+        p[size] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static uint64_t
+log_index_get(const unsigned char *p, size_t size)
+{
+    uint64_t v = 0;
+
+    while (size-- > 0)
+        v = (v << 8) | *p++;
+    return v;
+}
+
+/*
+ * The index stays open for as long as the server context, so appending
+ * to the log costs no open() of the index.  It is never unlinked, only
+ * truncated, so every process with it open writes the same file.
+ */
+static krb5_storage *
+log_index_storage(kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    size_t len = strlen(log_context->log_file);
+    int fd;
+
+    /* iprop-log may have pointed the context at another log since */
+    if (log_context->index_sp != NULL &&
+        (strncmp(log_context->index_file, log_context->log_file, len) != 0 ||
+         strcmp(log_context->index_file + len, ".idx") != 0))
+        _kadm5_log_index_close(log_context);
+    if (log_context->index_sp != NULL)
+        return log_context->index_sp;
+
+    if ((log_context->index_file = log_index_file(context)) == NULL)
+        return NULL;
+    fd = open(log_context->index_file, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        _kadm5_log_index_close(log_context);
+        return NULL;
+    }
+    log_context->index_sp = krb5_storage_from_fd(fd);
+    (void) close(fd);
+    if (log_context->index_sp == NULL)
+        _kadm5_log_index_close(log_context);
+    return log_context->index_sp;
+}
+
+void
+_kadm5_log_index_close(kadm5_log_context *log_context)
+{
+    krb5_storage_free(log_context->index_sp);
+    log_context->index_sp = NULL;
+    free(log_context->index_file);
+    log_context->index_file = NULL;
+}
+
+/*
+ * Bring the index up to date with the log, read through `lsp', a storage
+ * on the log fd.  Failures are not errors: the worst that happens is that
+ * lookups fail and iprop walks the log.
+ *
+ * Preserves lsp's offset.
+ */
+static void
+log_index_update(kadm5_server_context *context, krb5_storage *lsp,
+                 int rebuild)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    unsigned char entries[64 * LOG_INDEX_ENTRY_SZ];
+    krb5_storage *isp;
+    uint32_t magic, first = 0, ver, len;
+    uint64_t n = 0, off;
+    off_t log_pos, size, o;
+    enum kadm_ops op;
+    size_t nentries = 0;
+
+    if (log_context->log_fd == -1 || log_context->read_only)
+        return;
+    if ((isp = log_index_storage(context)) == NULL)
+        return;
+    log_pos = krb5_storage_seek(lsp, 0, SEEK_CUR);
+    if (log_pos == -1)
+        return;
+    if (rebuild)
+        (void) krb5_storage_truncate(isp, 0);
+
+    /* Find the end of the last record the index has, if it fits the log */
+    size = krb5_storage_seek(isp, 0, SEEK_END);
+    if (size >= LOG_INDEX_HEADER_SZ + LOG_INDEX_ENTRY_SZ &&
+        krb5_storage_seek(isp, 0, SEEK_SET) == 0 &&
+        krb5_ret_uint32(isp, &magic) == 0 && magic == LOG_INDEX_MAGIC &&
+        krb5_ret_uint32(isp, &first) == 0) {
+        n = (size - LOG_INDEX_HEADER_SZ) / LOG_INDEX_ENTRY_SZ;
+        o = LOG_INDEX_HEADER_SZ + (n - 1) * LOG_INDEX_ENTRY_SZ;
+        if (krb5_storage_seek(isp, o, SEEK_SET) != o ||
+            krb5_ret_uint64(isp, &off) != 0 ||
+            (o = off) < LOG_UBER_SZ ||
+            krb5_storage_seek(lsp, o, SEEK_SET) != o ||
+            get_header(lsp, LOG_DOPEEK, &ver, NULL, NULL, NULL) != 0 ||
+            ver != first + n - 1 ||
+            seek_next(lsp) == -1)
+            n = 0;
+    }
+
+    /* Else start over from the first record after the uber record */
+    if (n == 0) {
+        if (krb5_storage_seek(lsp, 0, SEEK_SET) != 0 ||
+            get_header(lsp, LOG_DOPEEK, &ver, NULL, &op, &len) != 0 ||
+            (op == kadm_nop && len == LOG_UBER_LEN && seek_next(lsp) == -1))
+            goto out;
+    }
+
+    /* New entries go after the last one, through the `entries' buffer */
+    o = LOG_INDEX_HEADER_SZ + n * LOG_INDEX_ENTRY_SZ;
+    if (krb5_storage_seek(isp, o, SEEK_SET) != o)
+        goto out;
+
+    for (;;) {
+        o = krb5_storage_seek(lsp, 0, SEEK_CUR);
+        if (o == -1 ||
+            get_header(lsp, LOG_DOPEEK, &ver, NULL, NULL, NULL) != 0)
+            break;
+        if (n == 0 || ver != first + n) {
+            /* Versions should be consecutive; index what follows if not */
+            first = ver;
+            n = nentries = 0;
+            if (krb5_storage_seek(isp, 0, SEEK_SET) != 0 ||
+                krb5_store_uint32(isp, LOG_INDEX_MAGIC) != 0 ||
+                krb5_store_uint32(isp, first) != 0)
+                goto out;
+        }
+        if (seek_next(lsp) == -1)
+            break;   /* partial record, to be truncated by recovery */
+        log_index_put(entries + nentries * LOG_INDEX_ENTRY_SZ, o,
+                      LOG_INDEX_ENTRY_SZ);
+        n++;
+        if (++nentries == sizeof(entries) / LOG_INDEX_ENTRY_SZ) {
+            if (krb5_storage_write(isp, entries, sizeof(entries)) !=
+                sizeof(entries))
+                goto out;
+            nentries = 0;
+        }
+    }
+
+    if (nentries > 0 &&
+        krb5_storage_write(isp, entries, nentries * LOG_INDEX_ENTRY_SZ) !=
+        (krb5_ssize_t)(nentries * LOG_INDEX_ENTRY_SZ))
+        goto out;
+    (void) krb5_storage_truncate(isp,
+                                 n ? LOG_INDEX_HEADER_SZ +
+                                     n * LOG_INDEX_ENTRY_SZ : 0);
+
+out:
+    (void) krb5_storage_seek(lsp, log_pos, SEEK_SET);
+}
+
+/* Look up the offset of the record with version `ver' in the index */
+static kadm5_ret_t
+log_index_lookup(kadm5_server_context *context, uint32_t ver, off_t *offp)
+{
+    kadm5_ret_t ret = 0;
+    uint64_t magic, first, off;
+    struct stat st;
+    unsigned char *p;
+    char *fn;
+    int fd;
+
+    *offp = -1;
+    if ((fn = log_index_file(context)) == NULL)
+        return ENOMEM;
+    fd = open(fn, O_RDONLY);
+    free(fn);
+    if (fd == -1)
+        return errno;
+    if (fstat(fd, &st) == -1) {
+        ret = errno;
+        (void) close(fd);
+        return ret;
+    }
+    if (st.st_size < LOG_INDEX_HEADER_SZ ||
+        (size_t)st.st_size != st.st_size) {
+        (void) close(fd);
+        return ENOENT;
+    }
+
+#ifdef LOG_INDEX_MMAP
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        ret = errno;
+        (void) close(fd);
+        return ret;
+    }
+#else
+    p = malloc(st.st_size);
+    if (p == NULL) {
+        (void) close(fd);
+        return ENOMEM;
+    }
+    if (net_read(fd, p, st.st_size) != st.st_size) {
+        ret = errno ? errno : EIO;
+        free(p);
+        (void) close(fd);
+        return ret;
+    }
+#endif
+    (void) close(fd);
+
+    magic = log_index_get(p, 4);
+    first = log_index_get(p + 4, 4);
+    if (magic != LOG_INDEX_MAGIC || ver < first ||
+        (st.st_size - LOG_INDEX_HEADER_SZ) / LOG_INDEX_ENTRY_SZ <=
+        (uint64_t)(ver - first)) {
+        ret = ENOENT;
+    } else {
+        off = log_index_get(p + LOG_INDEX_HEADER_SZ +
+                            (size_t)(ver - first) * LOG_INDEX_ENTRY_SZ, 8);
+        if (off < LOG_UBER_SZ || (off_t)off < 0 ||
+            (uint64_t)(off_t)off != off)
+            ret = KADM5_LOG_CORRUPT;
+        else
+            *offp = off;
+    }
+
+#ifdef LOG_INDEX_MMAP
+    (void) munmap(p, st.st_size);
+#else
+    free(p);
+#endif
+    return ret;
+}
+
+/*
+ * Seek `sp' to the start of the header of the record with version `ver'
+ * using the log's index, checking that the record is there.
+ *
+ * On error returns ENOENT if the index does not have the record, or
+ * KADM5_LOG_CORRUPT if the index does not match the log, and preserves
+ * sp's offset.  Callers should then find the record by walking the log.
+ */
+kadm5_ret_t
+kadm5_log_seek_version(kadm5_server_context *context,
+                       krb5_storage *sp,
+                       uint32_t ver)
+{
+    kadm5_ret_t ret;
+    uint32_t ver2;
+    off_t pos, off;
+
+    if (strcmp(context->log_context.log_file, "/dev/null") == 0)
+        return ENOENT;
+
+    pos = krb5_storage_seek(sp, 0, SEEK_CUR);
+    if (pos == -1)
+        return errno;
+
+    ret = log_index_lookup(context, ver, &off);
+    if (ret)
+        return ret;
+
+    if (krb5_storage_seek(sp, off, SEEK_SET) != off) {
+        ret = KADM5_LOG_CORRUPT;
+    } else {
+        ret = get_header(sp, LOG_DOPEEK, &ver2, NULL, NULL, NULL);
+        if (ret == 0 && ver2 != ver)
+            ret = KADM5_LOG_CORRUPT;
+        /* Check the trailer too */
+        if (ret == 0 && seek_next(sp) == -1)
+            ret = errno;
+        if (ret == 0 && krb5_storage_seek(sp, off, SEEK_SET) != off)
+            ret = errno;
+    }
+    if (ret) {
+        if (ret == HEIM_ERR_EOF)
+            ret = KADM5_LOG_CORRUPT;
+        (void) krb5_storage_seek(sp, pos, SEEK_SET);
+    }
+    return ret;
+}
+
 /*
  * Write sp's contents (which must be a fully formed record, complete
- * with header, payload, and trailer) to the log and fsync the log.
+ * with header, payload, and trailer) to the log and fsync the log
+ * (see log_sync()).
  *
  * Does not free sp.
  */
@@ -918,7 +1373,9 @@ kadm5_log_flush(kadm5_server_context *context, krb5_storage *sp)
         return EIO;
     }
 
-    ret = krb5_storage_fsync(sp);
+    ret = log_sync(context, sp);
+    if (ret == 0)
+        log_index_update(context, sp, 0);
     krb5_storage_free(sp);
     if (ret)
         return ret;
@@ -1655,7 +2112,9 @@ log_update_uber(kadm5_server_context *context, off_t off)
      */
 
 out:
-    if (ret == 0)
+    if (ret == 0 && log_context->unsynced_since != 0)
+        log_context->signal_pending = 1; /* signalled once synced */
+    else if (ret == 0)
         kadm5_log_signal_master(context);
     krb5_data_free(&data);
     krb5_storage_free(sp);
@@ -2549,6 +3008,8 @@ kadm5_log_truncate(kadm5_server_context *context, size_t keep, size_t maxbytes)
         return ENOMEM;
     ret = get_version_prev(sp, &context->log_context.version, &last_tstamp);
     context->log_context.last_time = last_tstamp;
+    if (ret == 0)
+        log_index_update(context, sp, 1);
     krb5_storage_free(sp);
     return ret;
 }
@@ -89,6 +89,12 @@ typedef struct kadm5_log_context {
     int lock_mode;
     uint32_t version;
     time_t last_time;
+    int batch;			/* kadm5_log_batch_begin() nesting depth */
+    time_t commit_window;	/* max. seconds a batch leaves records unsynced */
+    time_t unsynced_since;	/* when the oldest unsynced record was written */
+    int signal_pending;		/* signal ipropd-master once synced */
+    char *index_file;		/* log_file.idx, see log.c */
+    krb5_storage *index_sp;	/* index_file, kept open */
 #ifndef NO_UNIX_SOCKETS
     struct sockaddr_un socket_name;
 #else
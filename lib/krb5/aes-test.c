@@ -644,9 +644,10 @@ iov_test(krb5_context context)
     krb5_crypto crypto;
     krb5_keyblock key;
     krb5_data signonly, in, in2;
-    krb5_crypto_iov iov[6];
+    krb5_crypto_iov iov[6], iov2[7];
     size_t len, i;
-    unsigned char *base, *p;
+    unsigned char *base, *p, *copy;
+    unsigned char pad[16], pad2[16];
 
     ret = krb5_generate_random_keyblock(context, enctype, &key);
     if (ret)
@@ -802,10 +803,66 @@ iov_test(krb5_context context)
     if (krb5_data_cmp(&iov[3].data, &in2) != 0)
 	krb5_errx(context, 1, "decrypted data 2.2 not same");
 
+    /*
+     * Third try: a padding buffer is not part of the message when
+     * decrypting, whether the header comes first (decrypted in place)
+     * or not.
+     */
+
+    memcpy(iov[1].data.data, in.data, iov[1].data.length);
+    memcpy(iov[3].data.data, in2.data, iov[3].data.length);
+
+    ret = krb5_encrypt_iov_ivec(context, crypto, 7,
+				iov, sizeof(iov)/sizeof(iov[0]), NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt_iov_ivec");
+
+    copy = emalloc(len);
+    memcpy(copy, base, len);
+    memset(pad, 'x', sizeof(pad));
+    memset(pad2, 'x', sizeof(pad2));
+
+    iov2[0].flags = KRB5_CRYPTO_TYPE_EMPTY;
+    iov2[0].data.data = NULL;
+    iov2[0].data.length = 0;
+    for (i = 0; i < sizeof(iov)/sizeof(iov[0]); i++) {
+	iov2[i + 1] = iov[i];
+	if (iov[i].flags != KRB5_CRYPTO_TYPE_SIGN_ONLY)
+	    iov2[i + 1].data.data =
+		copy + ((unsigned char *)iov[i].data.data - base);
+    }
+    iov[4].data.data = pad;
+    iov[4].data.length = sizeof(pad);
+    iov2[5].data.data = pad2;
+    iov2[5].data.length = sizeof(pad2);
+
+    ret = krb5_decrypt_iov_ivec(context, crypto, 7,
+				iov, sizeof(iov)/sizeof(iov[0]), NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_decrypt_iov_ivec with padding");
+
+    ret = krb5_decrypt_iov_ivec(context, crypto, 7,
+				iov2, sizeof(iov2)/sizeof(iov2[0]), NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_decrypt_iov_ivec with padding 2");
+
+    if (krb5_data_cmp(&iov[1].data, &in) != 0 ||
+	krb5_data_cmp(&iov2[2].data, &in) != 0)
+	krb5_errx(context, 1, "decrypted data 3.1 not same");
+
+    if (krb5_data_cmp(&iov[3].data, &in2) != 0 ||
+	krb5_data_cmp(&iov2[4].data, &in2) != 0)
+	krb5_errx(context, 1, "decrypted data 3.2 not same");
+
+    for (i = 0; i < sizeof(pad); i++)
+	if (pad[i] != 'x' || pad2[i] != 'x')
+	    krb5_errx(context, 1, "padding buffer changed");
+
     /*
      * Free memory
      */
 
+    free(copy);
     free(base);
 
     krb5_crypto_destroy(context, crypto);
@@ -817,6 +874,64 @@ iov_test(krb5_context context)
 
 
 
+static int
+string_to_key_multi_test(krb5_context context)
+{
+    krb5_enctype enctypes[] = {
+	ETYPE_AES128_CTS_HMAC_SHA1_96,
+	ETYPE_AES256_CTS_HMAC_SHA1_96,
+	ETYPE_DES3_CBC_SHA1,
+	ETYPE_AES256_CTS_HMAC_SHA1_96,
+	ETYPE_AES128_CTS_HMAC_SHA1_96
+    };
+    const size_t num = sizeof(enctypes)/sizeof(enctypes[0]);
+    krb5_keyblock keys[sizeof(enctypes)/sizeof(enctypes[0])];
+    krb5_salt salts[sizeof(enctypes)/sizeof(enctypes[0])];
+    krb5_error_code ret;
+    krb5_data password;
+    krb5_keyblock key;
+    size_t i;
+    int val = 0;
+
+    password.data = "password";
+    password.length = strlen(password.data);
+
+    for (i = 0; i < num; i++) {
+	salts[i].salttype = KRB5_PW_SALT;
+	if (i < 3)
+	    salts[i].saltvalue.data = "ATHENA.MIT.EDUraeburn";
+	else
+	    salts[i].saltvalue.data = "EXAMPLE.COMpianist";
+	salts[i].saltvalue.length = strlen(salts[i].saltvalue.data);
+    }
+
+    ret = krb5_string_to_key_data_salt_multi(context, password, num,
+					     enctypes, salts, keys);
+    if (ret) {
+	krb5_warn(context, ret, "string_to_key_data_salt_multi");
+	return 1;
+    }
+
+    for (i = 0; i < num; i++) {
+	ret = krb5_string_to_key_data_salt(context, enctypes[i], password,
+					   salts[i], &key);
+	if (ret) {
+	    krb5_warn(context, ret, "%d: string_to_key_data_salt", (int)i);
+	    val = 1;
+	    continue;
+	}
+	if (keys[i].keytype != key.keytype ||
+	    krb5_data_cmp(&keys[i].keyvalue, &key.keyvalue) != 0) {
+	    krb5_warnx(context, "%d: multi key differs", (int)i);
+	    val = 1;
+	}
+	krb5_free_keyblock_contents(context, &key);
+	krb5_free_keyblock_contents(context, &keys[i]);
+    }
+
+    return val;
+}
+
 static int
 random_to_key(krb5_context context)
 {
@@ -864,6 +979,7 @@ main(int argc, char **argv)
 	errx (1, "krb5_init_context failed: %d", ret);
 
     val |= string_to_key_test(context);
+    val |= string_to_key_multi_test(context);
 
     val |= krb_enc_test(context);
     val |= random_to_key(context);
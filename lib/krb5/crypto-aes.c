@@ -152,7 +152,8 @@ struct _krb5_encryption_type _krb5_enctype_aes128_cts_hmac_sha1 = {
     F_DERIVED,
     _krb5_evp_encrypt_cts,
     16,
-    AES_PRF
+    AES_PRF,
+    _krb5_evp_encrypt_cts_hmac_sha1
 };
 
 struct _krb5_encryption_type _krb5_enctype_aes256_cts_hmac_sha1 = {
@@ -168,5 +169,6 @@ struct _krb5_encryption_type _krb5_enctype_aes256_cts_hmac_sha1 = {
     F_DERIVED,
     _krb5_evp_encrypt_cts,
     16,
-    AES_PRF
+    AES_PRF,
+    _krb5_evp_encrypt_cts_hmac_sha1
 };
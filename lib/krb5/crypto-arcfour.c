@@ -344,5 +344,6 @@ struct _krb5_encryption_type _krb5_enctype_arcfour_hmac_md5 = {
     F_SPECIAL | F_WEAK,
     ARCFOUR_encrypt,
     0,
-    ARCFOUR_prf
+    ARCFOUR_prf,
+    NULL
 };
@@ -61,7 +61,6 @@ _krb5_des_checksum(krb5_context context,
 		   size_t len,
 		   Checksum *cksum)
 {
-    struct _krb5_evp_schedule *ctx = key->schedule->data;
     EVP_MD_CTX *m;
     DES_cblock ivec;
     unsigned char *p = cksum->checksum.data;
@@ -78,10 +77,7 @@ _krb5_des_checksum(krb5_context context,
     EVP_DigestFinal_ex (m, p + 8, NULL);
     EVP_MD_CTX_destroy(m);
     memset (&ivec, 0, sizeof(ivec));
-    EVP_CipherInit_ex(&ctx->ectx, NULL, NULL, NULL, (void *)&ivec, -1);
-    EVP_Cipher(&ctx->ectx, p, p, 24);
-
-    return 0;
+    return _krb5_evp_cipher(context, key, 1, &ivec, p, p, 24);
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -92,7 +88,6 @@ _krb5_des_verify(krb5_context context,
 		 size_t len,
 		 Checksum *C)
 {
-    struct _krb5_evp_schedule *ctx = key->schedule->data;
     EVP_MD_CTX *m;
     unsigned char tmp[24];
     unsigned char res[16];
@@ -104,8 +99,11 @@ _krb5_des_verify(krb5_context context,
 	return krb5_enomem(context);
 
     memset(&ivec, 0, sizeof(ivec));
-    EVP_CipherInit_ex(&ctx->dctx, NULL, NULL, NULL, (void *)&ivec, -1);
-    EVP_Cipher(&ctx->dctx, tmp, C->checksum.data, 24);
+    ret = _krb5_evp_cipher(context, key, 0, &ivec, tmp, C->checksum.data, 24);
+    if (ret) {
+	EVP_MD_CTX_destroy(m);
+	return ret;
+    }
 
     EVP_DigestInit_ex(m, evp_md, NULL);
     EVP_DigestUpdate(m, tmp, 8); /* confounder */
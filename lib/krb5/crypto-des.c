@@ -221,14 +221,9 @@ evp_des_encrypt_null_ivec(krb5_context context,
 			  int usage,
 			  void *ignore_ivec)
 {
-    struct _krb5_evp_schedule *ctx = key->schedule->data;
-    EVP_CIPHER_CTX *c;
     DES_cblock ivec;
     memset(&ivec, 0, sizeof(ivec));
-    c = encryptp ? &ctx->ectx : &ctx->dctx;
-    EVP_CipherInit_ex(c, NULL, NULL, NULL, (void *)&ivec, -1);
-    EVP_Cipher(c, data, data, len);
-    return 0;
+    return _krb5_evp_cipher(context, key, encryptp, &ivec, data, data, len);
 }
 
 static krb5_error_code
@@ -240,14 +235,9 @@ evp_des_encrypt_key_ivec(krb5_context context,
 			 int usage,
 			 void *ignore_ivec)
 {
-    struct _krb5_evp_schedule *ctx = key->schedule->data;
-    EVP_CIPHER_CTX *c;
     DES_cblock ivec;
     memcpy(&ivec, key->key->keyvalue.data, sizeof(ivec));
-    c = encryptp ? &ctx->ectx : &ctx->dctx;
-    EVP_CipherInit_ex(c, NULL, NULL, NULL, (void *)&ivec, -1);
-    EVP_Cipher(c, data, data, len);
-    return 0;
+    return _krb5_evp_cipher(context, key, encryptp, &ivec, data, data, len);
 }
 
 static krb5_error_code
@@ -298,6 +288,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cbc_crc = {
     F_DISABLED|F_WEAK,
     evp_des_encrypt_key_ivec,
     0,
+    NULL,
     NULL
 };
 
@@ -314,6 +305,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cbc_md4 = {
     F_DISABLED|F_WEAK,
     evp_des_encrypt_null_ivec,
     0,
+    NULL,
     NULL
 };
 
@@ -330,6 +322,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cbc_md5 = {
     F_DISABLED|F_WEAK,
     evp_des_encrypt_null_ivec,
     0,
+    NULL,
     NULL
 };
 
@@ -346,6 +339,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cbc_none = {
     F_PSEUDO|F_DISABLED|F_WEAK,
     evp_des_encrypt_null_ivec,
     0,
+    NULL,
     NULL
 };
 
@@ -362,6 +356,7 @@ struct _krb5_encryption_type _krb5_enctype_des_cfb64_none = {
     F_PSEUDO|F_DISABLED|F_WEAK,
     DES_CFB64_encrypt_null_ivec,
     0,
+    NULL,
     NULL
 };
 
@@ -378,6 +373,7 @@ struct _krb5_encryption_type _krb5_enctype_des_pcbc_none = {
     F_PSEUDO|F_DISABLED|F_WEAK,
     DES_PCBC_encrypt_key_ivec,
     0,
+    NULL,
     NULL
 };
 #endif /* HEIM_WEAK_CRYPTO */
@@ -194,6 +194,7 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_md5 = {
     0,
     _krb5_evp_encrypt,
     0,
+    NULL,
     NULL
 };
 #endif
@@ -211,7 +212,8 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_sha1 = {
     F_DERIVED,
     _krb5_evp_encrypt,
     16,
-    DES3_prf
+    DES3_prf,
+    NULL
 };
 
 #ifdef DES3_OLD_ENCTYPE
@@ -228,6 +230,7 @@ struct _krb5_encryption_type _krb5_enctype_old_des3_cbc_sha1 = {
     0,
     _krb5_evp_encrypt,
     0,
+    NULL,
     NULL
 };
 #endif
@@ -245,6 +248,7 @@ struct _krb5_encryption_type _krb5_enctype_des3_cbc_none = {
     F_PSEUDO,
     _krb5_evp_encrypt,
     0,
+    NULL,
     NULL
 };
 
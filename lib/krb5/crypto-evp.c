@@ -33,27 +33,230 @@
 
 #include "krb5_locl.h"
 
+static const unsigned char zero_ivec[EVP_MAX_BLOCK_LENGTH] = { 0 };
+
+/*
+ * The key is only expanded when it is scheduled (and once more for
+ * every extra context, see below), after that the contexts are never
+ * reinitialized.  Instead of setting a new IV for every message the
+ * cbc chaining value left in the context is tracked and the
+ * difference to the wanted IV is xored into the first block.
+ *
+ * A krb5_crypto may be used by several threads at once, so each
+ * operation checks out a pair of contexts of its own from the
+ * schedule and puts it back when done.  More are only created when
+ * all of them are busy, so there are never more of them than threads
+ * that have used the key concurrently, and they all go away with the
+ * key.
+ */
+
+static void
+evp_ctx_init(struct _krb5_evp_schedule *key, struct _krb5_evp_ctx *ec,
+	     const void *keyvalue)
+{
+    const void *iv = EVP_CIPHER_iv_length(key->cipher) ? zero_ivec : NULL;
+
+    ec->next = NULL;
+    EVP_CIPHER_CTX_init(&ec->ectx);
+    EVP_CIPHER_CTX_init(&ec->dctx);
+    EVP_CipherInit_ex(&ec->ectx, key->cipher, NULL, keyvalue, iv, 1);
+    EVP_CipherInit_ex(&ec->dctx, key->cipher, NULL, keyvalue, iv, 0);
+    memset(ec->eiv, 0, sizeof(ec->eiv));
+    memset(ec->div, 0, sizeof(ec->div));
+}
+
+/*
+ * Returns CBC_CARRY for cbc mode if the backend carries the cbc
+ * state over from one EVP_Cipher() call to the next, not all do (the
+ * hcrypto single DES does not).  Checked by encrypting a zero block
+ * twice.
+ */
+
+static int
+evp_cbc_mode(EVP_CIPHER_CTX *c)
+{
+    unsigned char a[EVP_MAX_BLOCK_LENGTH], b[EVP_MAX_BLOCK_LENGTH];
+    size_t blocksize = EVP_CIPHER_CTX_block_size(c);
+    int carry;
+
+    if (EVP_CIPHER_CTX_mode(c) != EVP_CIPH_CBC_MODE)
+	return CBC_NONE;
+    if (blocksize > sizeof(a))
+	return CBC_RESET;
+
+    EVP_Cipher(c, a, zero_ivec, blocksize);
+    EVP_Cipher(c, b, zero_ivec, blocksize);
+    carry = memcmp(a, b, blocksize) != 0;
+    EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
+    memset(a, 0, sizeof(a));
+    memset(b, 0, sizeof(b));
+    return carry ? CBC_CARRY : CBC_RESET;
+}
+
 void
 _krb5_evp_schedule(krb5_context context,
 		   struct _krb5_key_type *kt,
 		   struct _krb5_key_data *kd)
 {
     struct _krb5_evp_schedule *key = kd->schedule->data;
-    const EVP_CIPHER *c = (*kt->evp)();
-
-    EVP_CIPHER_CTX_init(&key->ectx);
-    EVP_CIPHER_CTX_init(&key->dctx);
 
-    EVP_CipherInit_ex(&key->ectx, c, NULL, kd->key->keyvalue.data, NULL, 1);
-    EVP_CipherInit_ex(&key->dctx, c, NULL, kd->key->keyvalue.data, NULL, 0);
+    key->cipher = (*kt->evp)();
+    HEIMDAL_MUTEX_init(&key->mutex);
+    evp_ctx_init(key, &key->ctx, kd->key->keyvalue.data);
+    key->cbc = evp_cbc_mode(&key->ctx.ectx);
+    key->free = &key->ctx;
 }
 
 void
 _krb5_evp_cleanup(krb5_context context, struct _krb5_key_data *kd)
 {
     struct _krb5_evp_schedule *key = kd->schedule->data;
-    EVP_CIPHER_CTX_cleanup(&key->ectx);
-    EVP_CIPHER_CTX_cleanup(&key->dctx);
+    struct _krb5_evp_ctx *ec;
+
+    while ((ec = key->free) != NULL) {
+	key->free = ec->next;
+	EVP_CIPHER_CTX_cleanup(&ec->ectx);
+	EVP_CIPHER_CTX_cleanup(&ec->dctx);
+	if (ec != &key->ctx) {
+	    memset(ec, 0, sizeof(*ec));
+	    free(ec);
+	}
+    }
+    HEIMDAL_MUTEX_destroy(&key->mutex);
+}
+
+/*
+ * Check out a pair of contexts for the key, the caller has them to
+ * itself until it hands them back with _krb5_evp_ctx_put().  Returns
+ * NULL if out of memory.
+ */
+
+struct _krb5_evp_ctx *
+_krb5_evp_ctx_get(krb5_context context, struct _krb5_key_data *kd)
+{
+    struct _krb5_evp_schedule *key = kd->schedule->data;
+    struct _krb5_evp_ctx *ec;
+
+    HEIMDAL_MUTEX_lock(&key->mutex);
+    ec = key->free;
+    if (ec)
+	key->free = ec->next;
+    HEIMDAL_MUTEX_unlock(&key->mutex);
+
+    if (ec == NULL) {
+	ec = malloc(sizeof(*ec));
+	if (ec == NULL)
+	    return NULL;
+	evp_ctx_init(key, ec, kd->key->keyvalue.data);
+    }
+    return ec;
+}
+
+void
+_krb5_evp_ctx_put(struct _krb5_key_data *kd, struct _krb5_evp_ctx *ec)
+{
+    struct _krb5_evp_schedule *key = kd->schedule->data;
+
+    HEIMDAL_MUTEX_lock(&key->mutex);
+    ec->next = key->free;
+    key->free = ec;
+    HEIMDAL_MUTEX_unlock(&key->mutex);
+}
+
+/*
+ * Encrypt or decrypt len bytes from in to out, which may be the same
+ * buffer, with ivec as the IV or, if ivec is NULL, continuing the cbc
+ * chain from the last call on the same contexts.
+ */
+
+void
+_krb5_evp_ctx_cipher(struct _krb5_key_data *kd, struct _krb5_evp_ctx *ec,
+		     krb5_boolean encryptp, const void *ivec,
+		     void *out, const void *in, size_t len)
+{
+    struct _krb5_evp_schedule *key = kd->schedule->data;
+    EVP_CIPHER_CTX *c = encryptp ? &ec->ectx : &ec->dctx;
+    unsigned char *chain = encryptp ? ec->eiv : ec->div;
+    unsigned char tmp[EVP_MAX_BLOCK_LENGTH];
+    const unsigned char *iv = ivec;
+    const unsigned char *i = in;
+    unsigned char *o = out;
+    size_t n, blocksize;
+
+    if (len == 0)
+	return;
+
+    blocksize = EVP_CIPHER_CTX_block_size(c);
+
+    if (key->cbc == CBC_NONE) {
+	if (iv)
+	    EVP_CipherInit_ex(c, NULL, NULL, NULL, iv, -1);
+	EVP_Cipher(c, out, in, len);
+	return;
+    }
+
+    if (key->cbc == CBC_RESET || len % blocksize) {
+	/* set the chaining value the expensive way */
+	EVP_CipherInit_ex(c, NULL, NULL, NULL, iv ? iv : chain, -1);
+	if (len % blocksize) {
+	    /* partial last block, there is no chaining value to keep */
+	    EVP_Cipher(c, out, in, len);
+	    EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
+	    memset(chain, 0, blocksize);
+	    return;
+	}
+	if (!encryptp)
+	    memcpy(tmp, i + len - blocksize, blocksize);
+	EVP_Cipher(c, o, i, len);
+	memcpy(chain, encryptp ? o + len - blocksize : tmp, blocksize);
+	return;
+    }
+
+    if (encryptp) {
+	if (iv) {
+	    for (n = 0; n < blocksize; n++)
+		tmp[n] = i[n] ^ iv[n] ^ chain[n];
+	    EVP_Cipher(c, o, tmp, blocksize);
+	    memset(tmp, 0, blocksize);
+	    i += blocksize;
+	    o += blocksize;
+	    len -= blocksize;
+	}
+	if (len)
+	    EVP_Cipher(c, o, i, len);
+	memcpy(chain, o + len - blocksize, blocksize);
+    } else {
+	memcpy(tmp, i + len - blocksize, blocksize);
+	EVP_Cipher(c, o, i, len);
+	if (iv)
+	    for (n = 0; n < blocksize; n++)
+		o[n] ^= iv[n] ^ chain[n];
+	memcpy(chain, tmp, blocksize);
+    }
+}
+
+/*
+ * One shot version of the above, for callers that only do a single
+ * EVP_Cipher() with the key.
+ */
+
+krb5_error_code
+_krb5_evp_cipher(krb5_context context,
+		 struct _krb5_key_data *key,
+		 krb5_boolean encryptp,
+		 const void *ivec,
+		 void *out,
+		 const void *in,
+		 size_t len)
+{
+    struct _krb5_evp_ctx *ec;
+
+    ec = _krb5_evp_ctx_get(context, key);
+    if (ec == NULL)
+	return krb5_enomem(context);
+    _krb5_evp_ctx_cipher(key, ec, encryptp, ivec, out, in, len);
+    _krb5_evp_ctx_put(key, ec);
+    return 0;
 }
 
 krb5_error_code
@@ -65,26 +268,10 @@ _krb5_evp_encrypt(krb5_context context,
 		int usage,
 		void *ivec)
 {
-    struct _krb5_evp_schedule *ctx = key->schedule->data;
-    EVP_CIPHER_CTX *c;
-    c = encryptp ? &ctx->ectx : &ctx->dctx;
-    if (ivec == NULL) {
-	/* alloca ? */
-	size_t len2 = EVP_CIPHER_CTX_iv_length(c);
-	void *loiv = malloc(len2);
-	if (loiv == NULL)
-	    return krb5_enomem(context);
-	memset(loiv, 0, len2);
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, loiv, -1);
-	free(loiv);
-    } else
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, ivec, -1);
-    EVP_Cipher(c, data, data, len);
-    return 0;
+    return _krb5_evp_cipher(context, key, encryptp,
+			    ivec ? ivec : zero_ivec, data, data, len);
 }
 
-static const unsigned char zero_ivec[EVP_MAX_BLOCK_LENGTH] = { 0 };
-
 krb5_error_code
 _krb5_evp_encrypt_cts(krb5_context context,
 		      struct _krb5_key_data *key,
@@ -97,33 +284,32 @@ _krb5_evp_encrypt_cts(krb5_context context,
     size_t i, blocksize;
     struct _krb5_evp_schedule *ctx = key->schedule->data;
     unsigned char tmp[EVP_MAX_BLOCK_LENGTH], ivec2[EVP_MAX_BLOCK_LENGTH];
-    EVP_CIPHER_CTX *c;
+    struct _krb5_evp_ctx *ec;
     unsigned char *p;
 
-    c = encryptp ? &ctx->ectx : &ctx->dctx;
-
-    blocksize = EVP_CIPHER_CTX_block_size(c);
+    blocksize = EVP_CIPHER_block_size(ctx->cipher);
 
     if (len < blocksize) {
 	krb5_set_error_message(context, EINVAL,
 			       "message block too short");
 	return EINVAL;
-    } else if (len == blocksize) {
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
-	EVP_Cipher(c, data, data, len);
-	return 0;
     }
 
-    if (ivec)
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, ivec, -1);
-    else
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
+    ec = _krb5_evp_ctx_get(context, key);
+    if (ec == NULL)
+	return krb5_enomem(context);
+
+    if (len == blocksize) {
+	_krb5_evp_ctx_cipher(key, ec, encryptp, zero_ivec, data, data, len);
+	_krb5_evp_ctx_put(key, ec);
+	return 0;
+    }
 
     if (encryptp) {
 
 	p = data;
 	i = ((len - 1) / blocksize) * blocksize;
-	EVP_Cipher(c, p, p, i);
+	_krb5_evp_ctx_cipher(key, ec, 1, ivec ? ivec : zero_ivec, p, p, i);
 	p += i - blocksize;
 	len -= i;
 	memcpy(ivec2, p, blocksize);
@@ -133,8 +319,7 @@ _krb5_evp_encrypt_cts(krb5_context context,
 	for (; i < blocksize; i++)
 	    tmp[i] = 0 ^ ivec2[i];
 
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
-	EVP_Cipher(c, p, tmp, blocksize);
+	_krb5_evp_ctx_cipher(key, ec, 1, zero_ivec, p, tmp, blocksize);
 
 	memcpy(p + blocksize, ivec2, len);
 	if (ivec)
@@ -147,7 +332,7 @@ _krb5_evp_encrypt_cts(krb5_context context,
 	    /* remove last two blocks and round up, decrypt this with cbc, then do cts dance */
 	    i = ((((len - blocksize * 2) + blocksize - 1) / blocksize) * blocksize);
 	    memcpy(ivec2, p + i - blocksize, blocksize);
-	    EVP_Cipher(c, p, p, i);
+	    _krb5_evp_ctx_cipher(key, ec, 0, ivec ? ivec : zero_ivec, p, p, i);
 	    p += i;
 	    len -= i + blocksize;
 	} else {
@@ -159,8 +344,7 @@ _krb5_evp_encrypt_cts(krb5_context context,
 	}
 
 	memcpy(tmp, p, blocksize);
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
-	EVP_Cipher(c, tmp2, p, blocksize);
+	_krb5_evp_ctx_cipher(key, ec, 0, zero_ivec, tmp2, p, blocksize);
 
 	memcpy(tmp3, p + blocksize, len);
 	memcpy(tmp3 + len, tmp2 + len, blocksize - len); /* xor 0 */
@@ -168,13 +352,299 @@ _krb5_evp_encrypt_cts(krb5_context context,
 	for (i = 0; i < len; i++)
 	    p[i + blocksize] = tmp2[i] ^ tmp3[i];
 
-	EVP_CipherInit_ex(c, NULL, NULL, NULL, zero_ivec, -1);
-	EVP_Cipher(c, p, tmp3, blocksize);
+	_krb5_evp_ctx_cipher(key, ec, 0, zero_ivec, p, tmp3, blocksize);
 
 	for (i = 0; i < blocksize; i++)
 	    p[i] ^= ivec2[i];
 	if (ivec)
 	    memcpy(ivec, tmp, blocksize);
     }
+    _krb5_evp_ctx_put(key, ec);
+    return 0;
+}
+
+/*
+ * Single pass CTS mode encryption/decryption combined with the
+ * HMAC-SHA1 over the plaintext that the aes*-cts-hmac-sha1-96
+ * enctypes use.  The message is processed in chunks small enough to
+ * stay in the cache, each chunk is hashed and encrypted (or decrypted
+ * and hashed) before moving on to the next.
+ *
+ * The message is described by an array of krb5_crypto_iov that is
+ * processed in array order: HEADER and DATA buffers are encrypted and
+ * hashed, SIGN_ONLY buffers are only hashed and all other buffers,
+ * PADDING included as in krb5_decrypt_iov_ivec(), are skipped.  The buffers are transformed in place,
+ * only blocks that straddle two buffers and the CTS tail are gathered
+ * into temporary blocks.
+ *
+ * The IV only goes into the first block.  Instead of starting over
+ * with a zero IV for the CTS tail like _krb5_evp_encrypt_cts does, the
+ * CBC chain is simply continued and the chaining value is xored back
+ * out where needed.
+ *
+ * The HMAC starts from `hmac', which has the checksum key hashed in
+ * already and is not changed.  The digest, truncated to the size of
+ * the enctype's keyed checksum, is written to cksum; on decryption the
+ * caller compares it.
+ */
+
+#define CTS_HMAC_CHUNK 4096
+
+static void
+hmac_sha1_final(struct _krb5_hmac_state *hm,
+		unsigned char *cksum, size_t cksumlen)
+{
+    unsigned char digest[20];
+
+    SHA1_Final(digest, &hm->inner);
+    SHA1_Update(&hm->outer, digest, sizeof(digest));
+    SHA1_Final(digest, &hm->outer);
+    memcpy(cksum, digest, cksumlen);
+    memset(digest, 0, sizeof(digest));
+    memset(hm, 0, sizeof(*hm));
+}
+
+#define IOV_CIPHER(t) \
+    ((t) == KRB5_CRYPTO_TYPE_HEADER || (t) == KRB5_CRYPTO_TYPE_DATA)
+#define IOV_HASHED(t) (IOV_CIPHER(t) || (t) == KRB5_CRYPTO_TYPE_SIGN_ONLY)
+
+/*
+ * Position in the iov array, the buffer index and the offset into it.
+ */
+
+struct iov_cursor {
+    size_t i;
+    size_t off;
+};
+
+/* move to the next cipher buffer that still has bytes left */
+static void
+iov_skip(const krb5_crypto_iov *data, size_t num_data, struct iov_cursor *c)
+{
+    while (c->i < num_data &&
+	   (!IOV_CIPHER(data[c->i].flags) || c->off == data[c->i].data.length)) {
+	c->i++;
+	c->off = 0;
+    }
+}
+
+static void
+iov_gather(const krb5_crypto_iov *data, size_t num_data,
+	   struct iov_cursor *c, unsigned char *buf, size_t len)
+{
+    size_t n;
+
+    while (len) {
+	iov_skip(data, num_data, c);
+	n = min(len, data[c->i].data.length - c->off);
+	memcpy(buf, (unsigned char *)data[c->i].data.data + c->off, n);
+	c->off += n;
+	buf += n;
+	len -= n;
+    }
+}
+
+static void
+iov_scatter(krb5_crypto_iov *data, size_t num_data,
+	    struct iov_cursor c, const unsigned char *buf, size_t len)
+{
+    size_t n;
+
+    while (len) {
+	iov_skip(data, num_data, &c);
+	n = min(len, data[c.i].data.length - c.off);
+	memcpy((unsigned char *)data[c.i].data.data + c.off, buf, n);
+	c.off += n;
+	buf += n;
+	len -= n;
+    }
+}
+
+/*
+ * Hash everything between the hash position h and the cipher
+ * position c, including any SIGN_ONLY buffers in between.
+ */
+
+static void
+iov_hash(SHA_CTX *m, const krb5_crypto_iov *data, size_t num_data,
+	 struct iov_cursor *h, const struct iov_cursor *c)
+{
+    while (h->i < c->i) {
+	if (IOV_HASHED(data[h->i].flags))
+	    SHA1_Update(m, (unsigned char *)data[h->i].data.data + h->off,
+			data[h->i].data.length - h->off);
+	h->i++;
+	h->off = 0;
+    }
+    if (h->i < num_data && c->off > h->off) {
+	SHA1_Update(m, (unsigned char *)data[h->i].data.data + h->off,
+		    c->off - h->off);
+	h->off = c->off;
+    }
+}
+
+krb5_error_code
+_krb5_evp_encrypt_cts_hmac_sha1(krb5_context context,
+				struct _krb5_key_data *key,
+				struct _krb5_hmac_state *hmac,
+				krb5_crypto_iov *data,
+				int num_data,
+				krb5_boolean encryptp,
+				void *ivec,
+				void *cksum,
+				size_t cksumlen)
+{
+    struct _krb5_evp_schedule *ctx = key->schedule->data;
+    unsigned char tmp[EVP_MAX_BLOCK_LENGTH], prev[EVP_MAX_BLOCK_LENGTH];
+    unsigned char tmp2[EVP_MAX_BLOCK_LENGTH];
+    unsigned char tail[EVP_MAX_BLOCK_LENGTH * 2];
+    struct iov_cursor cur = { 0, 0 }, h = { 0, 0 }, start, end;
+    size_t i, n, len, done, bulk, blocksize;
+    struct _krb5_hmac_state hm;
+    struct _krb5_evp_ctx *ec;
+    const void *iv;
+    unsigned char *p;
+
+    if (num_data < 0)
+	return KRB5_CRYPTO_INTERNAL;
+
+    blocksize = EVP_CIPHER_block_size(ctx->cipher);
+
+    for (len = 0, i = 0; i < (size_t)num_data; i++)
+	if (IOV_CIPHER(data[i].flags))
+	    len += data[i].data.length;
+
+    if (len < blocksize) {
+	krb5_set_error_message(context, EINVAL,
+			       "message block too short");
+	return EINVAL;
+    }
+    if (cksumlen > 20)
+	return KRB5_CRYPTO_INTERNAL;
+
+    end.i = num_data;
+    end.off = 0;
+
+    hm = *hmac;
+
+    ec = _krb5_evp_ctx_get(context, key);
+    if (ec == NULL) {
+	memset(&hm, 0, sizeof(hm));
+	return krb5_enomem(context);
+    }
+
+    if (len == blocksize) {
+	if (encryptp)
+	    iov_hash(&hm.inner, data, num_data, &h, &end);
+	start = cur;
+	iov_gather(data, num_data, &cur, tmp, blocksize);
+	_krb5_evp_ctx_cipher(key, ec, encryptp, zero_ivec, tmp, tmp, blocksize);
+	iov_scatter(data, num_data, start, tmp, blocksize);
+	if (!encryptp)
+	    iov_hash(&hm.inner, data, num_data, &h, &end);
+	_krb5_evp_ctx_put(key, ec);
+	hmac_sha1_final(&hm, cksum, cksumlen);
+	return 0;
+    }
+
+    /* the IV goes with the first block, after that the chain continues */
+    iv = ivec ? ivec : zero_ivec;
+    memcpy(prev, iv, blocksize);
+
+    /*
+     * All but the last two blocks, of which the last may be partial,
+     * are plain cbc.  On decryption prev tracks the last cipher text
+     * block of it, the chaining value for the tail.
+     */
+    n = len % blocksize;
+    if (n == 0)
+	n = blocksize;
+    bulk = len - blocksize - n;
+
+    for (done = 0; done < bulk; done += n) {
+	iov_skip(data, num_data, &cur);
+	n = data[cur.i].data.length - cur.off;
+	if (n >= blocksize) {
+	    n = min(n, bulk - done);
+	    n = min(n, CTS_HMAC_CHUNK);
+	    n -= n % blocksize;
+	    p = (unsigned char *)data[cur.i].data.data + cur.off;
+	    cur.off += n;
+	    if (encryptp)
+		iov_hash(&hm.inner, data, num_data, &h, &cur);
+	    else
+		memcpy(prev, p + n - blocksize, blocksize);
+	    _krb5_evp_ctx_cipher(key, ec, encryptp, iv, p, p, n);
+	    iv = NULL;
+	    if (!encryptp)
+		iov_hash(&hm.inner, data, num_data, &h, &cur);
+	} else {
+	    /* the block straddles buffers */
+	    n = blocksize;
+	    start = cur;
+	    iov_gather(data, num_data, &cur, tmp, blocksize);
+	    if (encryptp)
+		iov_hash(&hm.inner, data, num_data, &h, &cur);
+	    else
+		memcpy(prev, tmp, blocksize);
+	    _krb5_evp_ctx_cipher(key, ec, encryptp, iv, tmp, tmp, blocksize);
+	    iv = NULL;
+	    iov_scatter(data, num_data, start, tmp, blocksize);
+	    if (!encryptp)
+		iov_hash(&hm.inner, data, num_data, &h, &cur);
+	}
+    }
+
+    len -= bulk + blocksize;
+    start = cur;
+    iov_gather(data, num_data, &cur, tail, blocksize + len);
+    p = tail;
+
+    if (encryptp) {
+	iov_hash(&hm.inner, data, num_data, &h, &cur);
+
+	/* encrypt the full block, then the zero padded last block */
+	_krb5_evp_ctx_cipher(key, ec, 1, iv, p, p, blocksize);
+	memcpy(tmp, p + blocksize, len);
+	memset(tmp + len, 0, blocksize - len);
+	_krb5_evp_ctx_cipher(key, ec, 1, NULL, tmp, tmp, blocksize);
+
+	/* and swap the last two */
+	memcpy(p + blocksize, p, len);
+	memcpy(p, tmp, blocksize);
+	if (ivec)
+	    memcpy(ivec, tmp, blocksize);
+	iov_scatter(data, num_data, start, tail, blocksize + len);
+    } else {
+	/*
+	 * The chaining value is prev, decrypt the full block and
+	 * remove it to get the raw block decryption; that holds the
+	 * last plaintext xored with the partial ciphertext block, and
+	 * the bytes that were cut off from it.
+	 */
+	memcpy(tmp, p, blocksize);
+	_krb5_evp_ctx_cipher(key, ec, 0, iv, tmp2, p, blocksize);
+	for (i = 0; i < blocksize; i++)
+	    tmp2[i] ^= prev[i];
+	for (i = 0; i < len; i++) {
+	    unsigned char x = p[i + blocksize];
+	    p[i + blocksize] = tmp2[i] ^ x;
+	    tmp2[i] = x;
+	}
+
+	/* the chaining value is now the full block, swap it for prev */
+	_krb5_evp_ctx_cipher(key, ec, 0, NULL, p, tmp2, blocksize);
+	for (i = 0; i < blocksize; i++)
+	    p[i] ^= tmp[i] ^ prev[i];
+	iov_scatter(data, num_data, start, tail, blocksize + len);
+	iov_hash(&hm.inner, data, num_data, &h, &cur);
+
+	if (ivec)
+	    memcpy(ivec, tmp, blocksize);
+    }
+    _krb5_evp_ctx_put(key, ec);
+    iov_hash(&hm.inner, data, num_data, &h, &end);
+    memset(tail, 0, sizeof(tail));
+    hmac_sha1_final(&hm, cksum, cksumlen);
     return 0;
 }
@@ -97,5 +97,6 @@ struct _krb5_encryption_type _krb5_enctype_null = {
     F_DISABLED,
     NULL_encrypt,
     0,
+    NULL,
     NULL
 };
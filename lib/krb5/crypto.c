@@ -36,6 +36,7 @@
 struct _krb5_key_usage {
     unsigned usage;
     struct _krb5_key_data key;
+    struct _krb5_hmac_state *hmac;	/* HMAC-SHA1 pads of checksum keys */
 };
 
 
@@ -46,6 +47,7 @@ struct _krb5_key_usage {
 static krb5_error_code _get_derived_key(krb5_context, krb5_crypto,
 					unsigned, struct _krb5_key_data**);
 static struct _krb5_key_data *_new_derived_key(krb5_crypto crypto, unsigned usage);
+static struct _krb5_key_usage *find_key_usage(krb5_crypto, unsigned);
 
 static void free_key_schedule(krb5_context,
 			      struct _krb5_key_data *,
@@ -176,6 +178,122 @@ SHA1_checksum(krb5_context context,
     return 0;
 }
 
+/*
+ * The HMAC-SHA1 ipad and opad blocks only depend on the key, so for
+ * checksum keys derived in a crypto context they are hashed once when
+ * the key is derived and kept with it in the key usage table.  A
+ * checksum then costs the compression calls over the message and the
+ * inner digest only, which is about half of the work for small
+ * messages like authenticators and GSS-API MICs.
+ */
+
+static krb5_error_code
+hmac_sha1_pads(const krb5_keyblock *key, struct _krb5_hmac_state *hm)
+{
+    const unsigned char *k = key->keyvalue.data;
+    size_t i, klen = key->keyvalue.length;
+    unsigned char pad[64];
+
+    if (klen > sizeof(pad))
+	return KRB5_CRYPTO_INTERNAL;
+
+    memset(pad, 0x36, sizeof(pad));
+    for (i = 0; i < klen; i++)
+	pad[i] ^= k[i];
+    SHA1_Init(&hm->inner);
+    SHA1_Update(&hm->inner, pad, sizeof(pad));
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (i = 0; i < klen; i++)
+	pad[i] ^= k[i];
+    SHA1_Init(&hm->outer);
+    SHA1_Update(&hm->outer, pad, sizeof(pad));
+
+    memset(pad, 0, sizeof(pad));
+    return 0;
+}
+
+/*
+ * Get the HMAC-SHA1 state for the checksum key `key' of `usage', ready
+ * to hash the message into hm->inner.
+ */
+
+static krb5_error_code
+hmac_sha1_state(krb5_crypto crypto, unsigned usage,
+		struct _krb5_key_data *key, struct _krb5_hmac_state *hm)
+{
+    struct _krb5_key_usage *ku = find_key_usage(crypto, usage);
+
+    if (ku && ku->hmac) {
+	*hm = *ku->hmac;
+	return 0;
+    }
+    return hmac_sha1_pads(key->key, hm);
+}
+
+/*
+ * Compute an HMAC-SHA1 checksum of type `ct' from the cached state of
+ * the key of `usage'.  Returns FALSE, and does nothing, when there is
+ * no such state.
+ */
+
+static krb5_boolean
+hmac_sha1_cached(krb5_crypto crypto, struct _krb5_checksum_type *ct,
+		 unsigned usage, const void *data, size_t len,
+		 Checksum *result)
+{
+    struct _krb5_key_usage *ku;
+    struct _krb5_hmac_state hm;
+    unsigned char digest[20];
+
+    if (ct->checksum != _krb5_SP_HMAC_SHA1_checksum ||
+	result->checksum.length > sizeof(digest))
+	return FALSE;
+    ku = find_key_usage(crypto, usage);
+    if (ku == NULL || ku->hmac == NULL)
+	return FALSE;
+
+    hm = *ku->hmac;
+    SHA1_Update(&hm.inner, data, len);
+    SHA1_Final(digest, &hm.inner);
+    SHA1_Update(&hm.outer, digest, sizeof(digest));
+    SHA1_Final(digest, &hm.outer);
+    memcpy(result->checksum.data, digest, result->checksum.length);
+    memset(digest, 0, sizeof(digest));
+    memset(&hm, 0, sizeof(hm));
+    return TRUE;
+}
+
+/*
+ * Failing to set up the cache is not an error, the key just stays on
+ * the slow path.
+ */
+
+static void
+hmac_state_init(struct _krb5_key_usage *ku)
+{
+    struct _krb5_hmac_state *hm;
+
+    hm = malloc(sizeof(*hm));
+    if (hm == NULL)
+	return;
+    if (hmac_sha1_pads(ku->key.key, hm)) {
+	free(hm);
+	return;
+    }
+    ku->hmac = hm;
+}
+
+static void
+hmac_state_free(struct _krb5_key_usage *ku)
+{
+    if (ku->hmac) {
+	memset(ku->hmac, 0, sizeof(*ku->hmac));
+	free(ku->hmac);
+	ku->hmac = NULL;
+    }
+}
+
 /* HMAC according to RFC2104 */
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 _krb5_internal_hmac(krb5_context context,
@@ -373,6 +491,9 @@ create_checksum (krb5_context context,
     ret = krb5_data_alloc(&result->checksum, ct->checksumsize);
     if (ret)
 	return (ret);
+    if (keyed_checksum &&
+	hmac_sha1_cached(crypto, ct, usage, data, len, result))
+	return 0;
     return (*ct->checksum)(context, dkey, data, len, usage, result);
 }
 
@@ -497,7 +618,11 @@ verify_checksum(krb5_context context,
     if (ret)
 	return ret;
 
-    ret = (*ct->checksum)(context, dkey, data, len, usage, &c);
+    if (keyed_checksum &&
+	hmac_sha1_cached(crypto, ct, usage, data, len, &c))
+	ret = 0;
+    else
+	ret = (*ct->checksum)(context, dkey, data, len, usage, &c);
     if (ret) {
 	krb5_data_free(&c.checksum);
 	return ret;
@@ -838,6 +963,45 @@ encrypt_internal_derived(krb5_context context,
     q += et->confoundersize;
     memcpy(q, data, len);
 
+    if (et->encrypt_cksum != NULL &&
+	(et->keyed_checksum->flags & F_DISABLED) == 0) {
+	struct _krb5_key_data *ckey;
+	struct _krb5_hmac_state hm;
+	krb5_crypto_iov iov;
+
+	/*
+	 * Deriving a new key may move the ones already derived, so
+	 * look up the encryption key again once both exist.
+	 */
+	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
+	if (ret)
+	    goto fail;
+	ret = _key_schedule(context, dkey);
+	if (ret)
+	    goto fail;
+	ret = get_checksum_key(context, crypto, INTEGRITY_USAGE(usage),
+			       et->keyed_checksum, &ckey);
+	if (ret)
+	    goto fail;
+	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
+	if (ret)
+	    goto fail;
+	ret = hmac_sha1_state(crypto, INTEGRITY_USAGE(usage), ckey, &hm);
+	if (ret)
+	    goto fail;
+	iov.flags = KRB5_CRYPTO_TYPE_DATA;
+	iov.data.data = p;
+	iov.data.length = block_sz;
+	ret = (*et->encrypt_cksum)(context, dkey, &hm, &iov, 1, 1, ivec,
+				   p + block_sz, checksum_sz);
+	memset(&hm, 0, sizeof(hm));
+	if (ret)
+	    goto fail;
+	result->data = p;
+	result->length = total_sz;
+	return 0;
+    }
+
     ret = create_checksum(context,
 			  et->keyed_checksum,
 			  crypto,
@@ -1018,6 +1182,46 @@ decrypt_internal_derived(krb5_context context,
 	free(p);
 	return ret;
     }
+
+    if (et->encrypt_cksum != NULL &&
+	(et->keyed_checksum->flags & F_DISABLED) == 0) {
+	struct _krb5_key_data *ckey;
+	unsigned char res[EVP_MAX_MD_SIZE];
+	struct _krb5_hmac_state hm;
+	krb5_crypto_iov iov;
+
+	/* deriving the checksum key may move dkey, look it up again */
+	ret = get_checksum_key(context, crypto, INTEGRITY_USAGE(usage),
+			       et->keyed_checksum, &ckey);
+	if (ret == 0)
+	    ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage),
+				   &dkey);
+	if (ret == 0 && checksum_sz > sizeof(res))
+	    ret = KRB5_CRYPTO_INTERNAL;
+	if (ret == 0)
+	    ret = hmac_sha1_state(crypto, INTEGRITY_USAGE(usage), ckey, &hm);
+	iov.flags = KRB5_CRYPTO_TYPE_DATA;
+	iov.data.data = p;
+	iov.data.length = len;
+	if (ret == 0)
+	    ret = (*et->encrypt_cksum)(context, dkey, &hm, &iov, 1, 0, ivec,
+				       res, checksum_sz);
+	memset(&hm, 0, sizeof(hm));
+	if (ret == 0 && ct_memcmp(res, p + len, checksum_sz) != 0) {
+	    ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
+	    krb5_set_error_message(context, ret,
+				   N_("Decrypt integrity check failed for checksum "
+				      "type %s, key type %s", ""),
+				   et->keyed_checksum->name, et->name);
+	}
+	memset(res, 0, sizeof(res));
+	if (ret) {
+	    free(p);
+	    return ret;
+	}
+	goto out;
+    }
+
     ret = (*et->encrypt)(context, dkey, p, len, 0, usage, ivec);
     if (ret) {
 	free(p);
@@ -1038,6 +1242,7 @@ decrypt_internal_derived(krb5_context context,
 	free(p);
 	return ret;
     }
+ out:
     l = len - et->confoundersize;
     memmove(p, p + et->confoundersize, l);
     result->data = realloc(p, l);
@@ -1265,6 +1470,40 @@ krb5_encrypt_iov_ivec(krb5_context context,
     if (tiv == NULL || tiv->data.length != trailersz)
 	return KRB5_BAD_MSIZE;
 
+    /*
+     * If the enctype can do it, encrypt and checksum the buffers
+     * where they are.  The confounder starts the plaintext, so the
+     * header has to be the first buffer.
+     */
+    if (et->encrypt_cksum != NULL &&
+	(et->keyed_checksum->flags & F_DISABLED) == 0 &&
+	hiv == &data[0] && piv == NULL) {
+	struct _krb5_key_data *ckey;
+	struct _krb5_hmac_state hm;
+
+	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
+	if (ret)
+	    return ret;
+	ret = _key_schedule(context, dkey);
+	if (ret)
+	    return ret;
+	ret = get_checksum_key(context, crypto, INTEGRITY_USAGE(usage),
+			       et->keyed_checksum, &ckey);
+	if (ret)
+	    return ret;
+	/* deriving the checksum key may move dkey, look it up again */
+	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
+	if (ret)
+	    return ret;
+	ret = hmac_sha1_state(crypto, INTEGRITY_USAGE(usage), ckey, &hm);
+	if (ret)
+	    return ret;
+	ret = (*et->encrypt_cksum)(context, dkey, &hm, data, num_data, 1,
+				   ivec, tiv->data.data, trailersz);
+	memset(&hm, 0, sizeof(hm));
+	return ret;
+    }
+
     /*
      * XXX replace with EVP_Sign? at least make create_checksum an iov
      * function.
@@ -1420,7 +1659,7 @@ krb5_decrypt_iov_ivec(krb5_context context,
     trailersz = CHECKSUMSIZE(et->keyed_checksum);
 
     tiv = find_iv(data, num_data, KRB5_CRYPTO_TYPE_TRAILER);
-    if (tiv->data.length != trailersz)
+    if (tiv == NULL || tiv->data.length != trailersz)
 	return KRB5_BAD_MSIZE;
 
     /* Find length of data we will decrypt */
@@ -1437,6 +1676,40 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	return KRB5_BAD_MSIZE;
     }
 
+    /* decrypt and checksum in place, see krb5_encrypt_iov_ivec */
+    if (et->encrypt_cksum != NULL &&
+	(et->keyed_checksum->flags & F_DISABLED) == 0 &&
+	hiv == &data[0]) {
+	struct _krb5_key_data *ckey;
+	unsigned char res[EVP_MAX_MD_SIZE];
+	struct _krb5_hmac_state hm;
+
+	ret = get_checksum_key(context, crypto, INTEGRITY_USAGE(usage),
+			       et->keyed_checksum, &ckey);
+	if (ret == 0)
+	    ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage),
+				   &dkey);
+	if (ret == 0)
+	    ret = _key_schedule(context, dkey);
+	if (ret == 0 && trailersz > sizeof(res))
+	    ret = KRB5_CRYPTO_INTERNAL;
+	if (ret == 0)
+	    ret = hmac_sha1_state(crypto, INTEGRITY_USAGE(usage), ckey, &hm);
+	if (ret == 0)
+	    ret = (*et->encrypt_cksum)(context, dkey, &hm, data, num_data, 0,
+				       ivec, res, trailersz);
+	memset(&hm, 0, sizeof(hm));
+	if (ret == 0 && ct_memcmp(res, tiv->data.data, trailersz) != 0) {
+	    ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
+	    krb5_set_error_message(context, ret,
+				   N_("Decrypt integrity check failed for checksum "
+				      "type %s, key type %s", ""),
+				   et->keyed_checksum->name, et->name);
+	}
+	memset(res, 0, sizeof(res));
+	return ret;
+    }
+
     /* XXX replace with EVP_Cipher */
 
     p = q = malloc(len);
@@ -1914,14 +2187,58 @@ _krb5_derive_key(krb5_context context,
     return ret;
 }
 
+static unsigned short *
+usage_index_slot(krb5_crypto crypto, unsigned usage)
+{
+    unsigned ku = usage >> 8;
+
+    if (ku >= CRYPTO_USAGE_TABLE_SIZE)
+	return NULL;
+    switch (usage & 0xff) {
+    case 0xAA:
+	return &crypto->usage_index[ku][0];
+    case 0x55:
+	return &crypto->usage_index[ku][1];
+    case 0x99:
+	return &crypto->usage_index[ku][2];
+    default:
+	return NULL;
+    }
+}
+
+static struct _krb5_key_usage *
+find_key_usage(krb5_crypto crypto, unsigned usage)
+{
+    unsigned short *slot;
+    int i;
+
+    slot = usage_index_slot(crypto, usage);
+    if (slot)
+	return *slot ? &crypto->key_usage[*slot - 1] : NULL;
+    for(i = 0; i < crypto->num_key_usage; i++)
+	if(crypto->key_usage[i].usage == usage)
+	    return &crypto->key_usage[i];
+    return NULL;
+}
+
 static struct _krb5_key_data *
 _new_derived_key(krb5_crypto crypto, unsigned usage)
 {
     struct _krb5_key_usage *d = crypto->key_usage;
-    d = realloc(d, (crypto->num_key_usage + 1) * sizeof(*d));
-    if(d == NULL)
-	return NULL;
-    crypto->key_usage = d;
+    unsigned short *slot;
+
+    if (crypto->num_key_usage == crypto->max_key_usage) {
+	int max = crypto->max_key_usage ? crypto->max_key_usage * 2 : 8;
+
+	d = realloc(d, max * sizeof(*d));
+	if(d == NULL)
+	    return NULL;
+	crypto->key_usage = d;
+	crypto->max_key_usage = max;
+    }
+    slot = usage_index_slot(crypto, usage);
+    if (slot)
+	*slot = crypto->num_key_usage + 1;
     d += crypto->num_key_usage++;
     memset(d, 0, sizeof(*d));
     d->usage = usage;
@@ -1965,21 +2282,26 @@ _get_derived_key(krb5_context context,
 		 unsigned usage,
 		 struct _krb5_key_data **key)
 {
-    int i;
+    struct _krb5_key_usage *ku;
     struct _krb5_key_data *d;
     unsigned char constant[5];
 
-    for(i = 0; i < crypto->num_key_usage; i++)
-	if(crypto->key_usage[i].usage == usage) {
-	    *key = &crypto->key_usage[i].key;
-	    return 0;
-	}
+    ku = find_key_usage(crypto, usage);
+    if (ku) {
+	*key = &ku->key;
+	return 0;
+    }
     d = _new_derived_key(crypto, usage);
     if (d == NULL)
 	return krb5_enomem(context);
     krb5_copy_keyblock(context, crypto->key.key, &d->key);
     _krb5_put_int(constant, usage, 5);
     _krb5_derive_key(context, crypto->et, d, constant, sizeof(constant));
+    /* Ke keys are never used to key an HMAC */
+    if (crypto->et->keyed_checksum &&
+	crypto->et->keyed_checksum->checksum == _krb5_SP_HMAC_SHA1_checksum &&
+	usage != ENCRYPTION_USAGE(usage >> 8))
+	hmac_state_init(&crypto->key_usage[crypto->num_key_usage - 1]);
     *key = d;
     return 0;
 }
@@ -2035,7 +2357,83 @@ krb5_crypto_init(krb5_context context,
     }
     (*crypto)->key.schedule = NULL;
     (*crypto)->num_key_usage = 0;
+    (*crypto)->max_key_usage = 0;
     (*crypto)->key_usage = NULL;
+    memset((*crypto)->usage_index, 0, sizeof((*crypto)->usage_index));
+    return 0;
+}
+
+static const krb5_key_usage prederive_usages[] = {
+    KRB5_KU_TICKET,
+    KRB5_KU_AS_REP_ENC_PART,
+    KRB5_KU_TGS_REQ_AUTH_CKSUM,
+    KRB5_KU_TGS_REQ_AUTH,
+    KRB5_KU_TGS_REP_ENC_PART_SESSION,
+    KRB5_KU_TGS_REP_ENC_PART_SUB_KEY,
+    KRB5_KU_AP_REQ_AUTH_CKSUM,
+    KRB5_KU_AP_REQ_AUTH,
+    KRB5_KU_AP_REQ_ENC_PART,
+    KRB5_KU_USAGE_ACCEPTOR_SEAL,
+    KRB5_KU_USAGE_ACCEPTOR_SIGN,
+    KRB5_KU_USAGE_INITIATOR_SEAL,
+    KRB5_KU_USAGE_INITIATOR_SIGN
+};
+
+/**
+ * Derive and schedule the encryption, integrity and checksum keys
+ * for a set of key usages up front, typically right after
+ * krb5_crypto_init() on a crypto context that is going to be used
+ * for many messages.  Later operations with these key usages then
+ * neither derive keys nor allocate memory for them.
+ *
+ * This is a no-op for encryption types that do not use derived keys.
+ *
+ * @param context Kerberos context
+ * @param crypto crypto context to prepare
+ * @param usages key usages to derive keys for, or NULL for the
+ *        usages used by tickets, AP-REQ/REP and GSS-API per-message
+ *        tokens
+ * @param num_usages number of entries in usages
+ *
+ * @return Return an error code or 0.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_crypto_prederive(krb5_context context,
+		      krb5_crypto crypto,
+		      const krb5_key_usage *usages,
+		      size_t num_usages)
+{
+    struct _krb5_checksum_type *ct = crypto->et->keyed_checksum;
+    struct _krb5_key_data *dkey;
+    krb5_error_code ret;
+    size_t i;
+
+    if (!derived_crypto(context, crypto))
+	return 0;
+
+    if (usages == NULL) {
+	usages = prederive_usages;
+	num_usages = sizeof(prederive_usages) / sizeof(prederive_usages[0]);
+    }
+
+    for (i = 0; i < num_usages; i++) {
+	ret = _get_derived_key(context, crypto,
+			       ENCRYPTION_USAGE(usages[i]), &dkey);
+	if (ret == 0)
+	    ret = _key_schedule(context, dkey);
+	if (ret == 0 && ct && (ct->flags & F_DERIVED)) {
+	    ret = get_checksum_key(context, crypto,
+				   INTEGRITY_USAGE(usages[i]), ct, &dkey);
+	    if (ret == 0)
+		ret = get_checksum_key(context, crypto,
+				       CHECKSUM_USAGE(usages[i]), ct, &dkey);
+	}
+	if (ret)
+	    return ret;
+    }
     return 0;
 }
 
@@ -2066,6 +2464,7 @@ free_key_usage(krb5_context context, struct _krb5_key_usage *ku,
 	       struct _krb5_encryption_type *et)
 {
     _krb5_free_key_data(context, &ku->key, et);
+    hmac_state_free(ku);
 }
 
 /**
@@ -35,6 +35,9 @@
 #define DES3_OLD_ENCTYPE 1
 #endif
 
+struct _krb5_hmac_state;
+struct _krb5_evp_ctx;
+
 struct _krb5_key_data {
     krb5_keyblock *key;
     krb5_data *schedule;
@@ -42,11 +45,20 @@ struct _krb5_key_data {
 
 struct _krb5_key_usage;
 
+/*
+ * Derived keys for key usages below this are found by direct index,
+ * the rest by searching key_usage.
+ */
+#define CRYPTO_USAGE_TABLE_SIZE 64
+
 struct krb5_crypto_data {
     struct _krb5_encryption_type *et;
     struct _krb5_key_data key;
     int num_key_usage;
+    int max_key_usage;
     struct _krb5_key_usage *key_usage;
+    /* index + 1 into key_usage, by key usage and Ke/Ki/Kc */
+    unsigned short usage_index[CRYPTO_USAGE_TABLE_SIZE][3];
 };
 
 #define CRYPTO_ETYPE(C) ((C)->et->type)
@@ -120,6 +132,14 @@ struct _krb5_encryption_type {
     size_t prf_length;
     krb5_error_code (*prf)(krb5_context,
 			   krb5_crypto, const krb5_data *, krb5_data *);
+    /* optional, encrypt/decrypt and HMAC-SHA1 in one pass */
+    krb5_error_code (*encrypt_cksum)(krb5_context context,
+				     struct _krb5_key_data *key,
+				     struct _krb5_hmac_state *hmac,
+				     krb5_crypto_iov *data, int num_data,
+				     krb5_boolean encryptp,
+				     void *ivec,
+				     void *cksum, size_t cksumlen);
 };
 
 #define ENCRYPTION_USAGE(U) (((U) << 8) | 0xAA)
@@ -176,12 +196,34 @@ extern int _krb5_num_etypes;
 /* NO_HCRYPTO_POLLUTION is defined in pkinit-ec.c.  See commentary there. */
 #ifndef NO_HCRYPTO_POLLUTION
 /* Interface to the EVP crypto layer provided by hcrypto */
-struct _krb5_evp_schedule {
+struct _krb5_evp_ctx {
+    struct _krb5_evp_ctx *next;
     /*
      * Normally we'd say EVP_CIPHER_CTX here, but!  this header gets
      * included in lib/krb5/pkinit-ec.ck
      */
     EVP_CIPHER_CTX ectx;
     EVP_CIPHER_CTX dctx;
+    /* the cbc chaining values ectx and dctx will use next */
+    unsigned char eiv[EVP_MAX_BLOCK_LENGTH];
+    unsigned char div[EVP_MAX_BLOCK_LENGTH];
+};
+
+struct _krb5_evp_schedule {
+    const EVP_CIPHER *cipher;
+    int cbc;			/* CBC_* below */
+    HEIMDAL_MUTEX mutex;	/* protects free */
+    struct _krb5_evp_ctx *free;	/* contexts not in use by any thread */
+    struct _krb5_evp_ctx ctx;	/* the first context */
+};
+
+#define CBC_NONE	0	/* not cbc mode */
+#define CBC_RESET	1	/* cbc, the IV has to be set every call */
+#define CBC_CARRY	2	/* cbc, the state carries over between calls */
+
+/* HMAC-SHA1 with the key already hashed into the inner and outer state */
+struct _krb5_hmac_state {
+    SHA_CTX inner;
+    SHA_CTX outer;
 };
 #endif
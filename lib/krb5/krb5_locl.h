@@ -147,12 +147,12 @@ struct _krb5_krb_auth_data;
 #include <hx509.h>
 #endif
 
+#include "heim_threads.h"
+
 #include "crypto.h"
 
 #include <krb5-private.h>
 
-#include "heim_threads.h"
-
 #define ALLOC(X, N) (X) = calloc((N), sizeof(*(X)))
 #define ALLOC_SEQ(X, N) do { (X)->len = (N); ALLOC((X)->val, (N)); } while(0)
 
@@ -34,8 +34,43 @@
 #include "krb5_locl.h"
 #include <vis.h>
 
+#if defined(HAVE_MMAP) && !defined(NO_MMAP) && defined(HAVE_FCNTL)
+#define RC_HASH 1
+#endif
+
+/*
+ * Replay cache types, selected by the prefix of the name.
+ */
+
+struct krb5_rc_ops {
+    const char *prefix;
+    krb5_error_code (*init)(krb5_context, krb5_rcache, krb5_deltat);
+    krb5_error_code (*destroy)(krb5_context, krb5_rcache);
+    void (*close)(krb5_context, krb5_rcache);
+    krb5_error_code (*store)(krb5_context, krb5_rcache,
+			     const unsigned char *, time_t);
+    krb5_error_code (*get_lifespan)(krb5_context, krb5_rcache, krb5_deltat *);
+};
+
 struct krb5_rcache_data {
+    const struct krb5_rc_ops *ops;
     char *name;
+    void *data;
+};
+
+static const struct krb5_rc_ops krb5_rc_file_ops;
+static const struct krb5_rc_ops krb5_rc_mem_ops;
+#ifdef RC_HASH
+static const struct krb5_rc_ops krb5_rc_hash_ops;
+#endif
+
+static const struct krb5_rc_ops *rc_types[] = {
+    &krb5_rc_file_ops,
+    &krb5_rc_mem_ops,
+#ifdef RC_HASH
+    &krb5_rc_hash_ops,
+#endif
+    NULL
 };
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -57,8 +92,13 @@ krb5_rc_resolve_type(krb5_context context,
 		     krb5_rcache *id,
 		     const char *type)
 {
+    size_t i;
+
     *id = NULL;
-    if(strcmp(type, "FILE")) {
+    for (i = 0; rc_types[i] != NULL; i++)
+	if (strcmp(type, rc_types[i]->prefix) == 0)
+	    break;
+    if(rc_types[i] == NULL) {
 	krb5_set_error_message (context, KRB5_RC_TYPE_NOTFOUND,
 				N_("replay cache type %s not supported", ""),
 				type);
@@ -70,6 +110,7 @@ krb5_rc_resolve_type(krb5_context context,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    (*id)->ops = rc_types[i];
     return 0;
 }
 
@@ -79,19 +120,29 @@ krb5_rc_resolve_full(krb5_context context,
 		     const char *string_name)
 {
     krb5_error_code ret;
+    const char *p;
+    char *type;
 
     *id = NULL;
 
-    if(strncmp(string_name, "FILE:", 5)) {
+    p = strchr(string_name, ':');
+    if(p == NULL) {
 	krb5_set_error_message(context, KRB5_RC_TYPE_NOTFOUND,
 			       N_("replay cache type %s not supported", ""),
 			       string_name);
 	return KRB5_RC_TYPE_NOTFOUND;
     }
-    ret = krb5_rc_resolve_type(context, id, "FILE");
+    type = strndup(string_name, p - string_name);
+    if (type == NULL) {
+	krb5_set_error_message(context, KRB5_RC_MALLOC,
+			       N_("malloc: out of memory", ""));
+	return KRB5_RC_MALLOC;
+    }
+    ret = krb5_rc_resolve_type(context, id, type);
+    free(type);
     if(ret)
 	return ret;
-    ret = krb5_rc_resolve(context, *id, string_name + 5);
+    ret = krb5_rc_resolve(context, *id, p + 1);
     if (ret) {
 	krb5_rc_close(context, *id);
 	*id = NULL;
@@ -118,15 +169,19 @@ krb5_rc_default(krb5_context context,
     return krb5_rc_resolve_full(context, id, krb5_rc_default_name(context));
 }
 
+/*
+ * FILE: a flat file of checksums, scanned on every store.
+ */
+
 struct rc_entry{
     time_t stamp;
     unsigned char data[16];
 };
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_rc_initialize(krb5_context context,
-		   krb5_rcache id,
-		   krb5_deltat auth_lifespan)
+static krb5_error_code
+file_initialize(krb5_context context,
+		krb5_rcache id,
+		krb5_deltat auth_lifespan)
 {
     FILE *f = fopen(id->name, "w");
     struct rc_entry tmp;
@@ -146,16 +201,9 @@ krb5_rc_initialize(krb5_context context,
     return 0;
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_rc_recover(krb5_context context,
-		krb5_rcache id)
-{
-    return 0;
-}
-
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_rc_destroy(krb5_context context,
-		krb5_rcache id)
+static krb5_error_code
+file_destroy(krb5_context context,
+	     krb5_rcache id)
 {
     int ret;
 
@@ -166,41 +214,20 @@ krb5_rc_destroy(krb5_context context,
 	krb5_set_error_message(context, ret, "remove(%s): %s", id->name, buf);
 	return ret;
     }
-    return krb5_rc_close(context, id);
-}
-
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_rc_close(krb5_context context,
-	      krb5_rcache id)
-{
-    free(id->name);
-    free(id);
     return 0;
 }
 
 static void
-checksum_authenticator(Authenticator *auth, void *data)
+file_close(krb5_context context,
+	   krb5_rcache id)
 {
-    EVP_MD_CTX *m = EVP_MD_CTX_create();
-    unsigned i;
-
-    EVP_DigestInit_ex(m, EVP_md5(), NULL);
-
-    EVP_DigestUpdate(m, auth->crealm, strlen(auth->crealm));
-    for(i = 0; i < auth->cname.name_string.len; i++)
-	EVP_DigestUpdate(m, auth->cname.name_string.val[i],
-		   strlen(auth->cname.name_string.val[i]));
-    EVP_DigestUpdate(m, &auth->ctime, sizeof(auth->ctime));
-    EVP_DigestUpdate(m, &auth->cusec, sizeof(auth->cusec));
-
-    EVP_DigestFinal_ex(m, data, NULL);
-    EVP_MD_CTX_destroy(m);
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_rc_store(krb5_context context,
-	      krb5_rcache id,
-	      krb5_donot_replay *rep)
+static krb5_error_code
+file_store(krb5_context context,
+	   krb5_rcache id,
+	   const unsigned char *data,
+	   time_t now)
 {
     struct rc_entry ent, tmp;
     time_t t;
@@ -208,8 +235,8 @@ krb5_rc_store(krb5_context context,
     int ret;
     size_t count;
 
-    ent.stamp = time(NULL);
-    checksum_authenticator(rep, ent.data);
+    ent.stamp = now;
+    memcpy(ent.data, data, sizeof(ent.data));
     f = fopen(id->name, "r");
     if(f == NULL) {
 	char buf[128];
@@ -255,17 +282,10 @@ krb5_rc_store(krb5_context context,
     return 0;
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_rc_expunge(krb5_context context,
-		krb5_rcache id)
-{
-    return 0;
-}
-
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_rc_get_lifespan(krb5_context context,
-		     krb5_rcache id,
-		     krb5_deltat *auth_lifespan)
+static krb5_error_code
+file_get_lifespan(krb5_context context,
+		  krb5_rcache id,
+		  krb5_deltat *auth_lifespan)
 {
     FILE *f = fopen(id->name, "r");
     int r;
@@ -280,6 +300,998 @@ krb5_rc_get_lifespan(krb5_context context,
     return KRB5_RC_IO_UNKNOWN;
 }
 
+static const struct krb5_rc_ops krb5_rc_file_ops = {
+    "FILE",
+    file_initialize,
+    file_destroy,
+    file_close,
+    file_store,
+    file_get_lifespan
+};
+
+/*
+ * MEMORY: a hash set private to the process, shared by all handles
+ * with the same name.  Each shard has its own lock and chained table.
+ * Entries older than the lifespan are dropped as chains are walked and
+ * when a shard is about to grow.
+ */
+
+#define RC_MEM_SHARDS		64
+#define RC_MEM_MINSIZE		16	/* per shard */
+
+struct rc_mem_entry {
+    struct rc_mem_entry *next;
+    time_t stamp;
+    unsigned char data[16];
+};
+
+struct rc_mem {
+    struct rc_mem *next;
+    char *name;
+    unsigned int refcount;
+    krb5_deltat lifespan;
+    struct rc_mem_shard {
+	HEIMDAL_MUTEX mutex;
+	struct rc_mem_entry **table;
+	size_t size;
+	size_t count;
+    } shard[RC_MEM_SHARDS];
+};
+
+static HEIMDAL_MUTEX rc_mem_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct rc_mem *rc_mem_caches;
+
+static size_t
+mem_bucket(const unsigned char *data, size_t size)
+{
+    uint64_t key;
+
+    memcpy(&key, data, sizeof(key));
+    return (key / RC_MEM_SHARDS) % size;
+}
+
+static void
+mem_free_shard(struct rc_mem_shard *s)
+{
+    struct rc_mem_entry *e, *next;
+    size_t i;
+
+    for (i = 0; i < s->size; i++) {
+	for (e = s->table[i]; e != NULL; e = next) {
+	    next = e->next;
+	    free(e);
+	}
+    }
+    free(s->table);
+    s->table = NULL;
+    s->size = s->count = 0;
+}
+
+static krb5_error_code
+mem_open(krb5_context context, krb5_rcache id, struct rc_mem **mp)
+{
+    struct rc_mem *m;
+    size_t i;
+
+    if (id->data) {
+	*mp = id->data;
+	return 0;
+    }
+
+    HEIMDAL_MUTEX_lock(&rc_mem_mutex);
+    for (m = rc_mem_caches; m != NULL; m = m->next)
+	if (strcmp(m->name, id->name) == 0)
+	    break;
+    if (m == NULL) {
+	m = calloc(1, sizeof(*m));
+	if (m == NULL || (m->name = strdup(id->name)) == NULL) {
+	    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+	    free(m);
+	    return krb5_enomem(context);
+	}
+	m->lifespan = context->max_skew > 0 ? context->max_skew : 300;
+	for (i = 0; i < RC_MEM_SHARDS; i++)
+	    HEIMDAL_MUTEX_init(&m->shard[i].mutex);
+	m->next = rc_mem_caches;
+	rc_mem_caches = m;
+    }
+    m->refcount++;
+    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+
+    id->data = m;
+    *mp = m;
+    return 0;
+}
+
+static void
+mem_unlink(struct rc_mem *m)
+{
+    struct rc_mem **p;
+
+    for (p = &rc_mem_caches; *p != NULL; p = &(*p)->next) {
+	if (*p == m) {
+	    *p = m->next;
+	    break;
+	}
+    }
+}
+
+static void
+mem_close(krb5_context context,
+	  krb5_rcache id)
+{
+    struct rc_mem *m = id->data;
+    size_t i;
+
+    if (m == NULL)
+	return;
+    id->data = NULL;
+
+    HEIMDAL_MUTEX_lock(&rc_mem_mutex);
+    if (--m->refcount > 0) {
+	HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+	return;
+    }
+    mem_unlink(m);
+    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+
+    for (i = 0; i < RC_MEM_SHARDS; i++) {
+	mem_free_shard(&m->shard[i]);
+	HEIMDAL_MUTEX_destroy(&m->shard[i].mutex);
+    }
+    free(m->name);
+    free(m);
+}
+
+static krb5_error_code
+mem_initialize(krb5_context context,
+	       krb5_rcache id,
+	       krb5_deltat auth_lifespan)
+{
+    krb5_error_code ret;
+    struct rc_mem *m;
+    size_t i;
+
+    ret = mem_open(context, id, &m);
+    if (ret)
+	return ret;
+    for (i = 0; i < RC_MEM_SHARDS; i++)
+	HEIMDAL_MUTEX_lock(&m->shard[i].mutex);
+    m->lifespan = auth_lifespan;
+    for (i = 0; i < RC_MEM_SHARDS; i++) {
+	mem_free_shard(&m->shard[i]);
+	HEIMDAL_MUTEX_unlock(&m->shard[i].mutex);
+    }
+    return 0;
+}
+
+/*
+ * Other handles keep using the set until they are closed, but it can
+ * no longer be found by name.
+ */
+
+static krb5_error_code
+mem_destroy(krb5_context context,
+	    krb5_rcache id)
+{
+    krb5_error_code ret;
+    struct rc_mem *m;
+
+    ret = mem_open(context, id, &m);
+    if (ret)
+	return ret;
+    HEIMDAL_MUTEX_lock(&rc_mem_mutex);
+    mem_unlink(m);
+    HEIMDAL_MUTEX_unlock(&rc_mem_mutex);
+    return 0;
+}
+
+/*
+ * Drop the expired entries of a shard and grow it if it is still more
+ * than half full, so that the sweep happens at most once every
+ * size / 2 inserts.
+ */
+
+static krb5_error_code
+mem_grow(struct rc_mem_shard *s, time_t t)
+{
+    struct rc_mem_entry **table, **p, *e, *next;
+    size_t i, size;
+
+    for (i = 0; i < s->size; i++) {
+	for (p = &s->table[i]; (e = *p) != NULL; ) {
+	    if (e->stamp < t) {
+		*p = e->next;
+		free(e);
+		s->count--;
+	    } else
+		p = &e->next;
+	}
+    }
+    if (s->size && s->count < s->size / 2)
+	return 0;
+
+    size = s->size ? s->size * 2 : RC_MEM_MINSIZE;
+    table = calloc(size, sizeof(table[0]));
+    if (table == NULL)
+	return ENOMEM;
+    for (i = 0; i < s->size; i++) {
+	for (e = s->table[i]; e != NULL; e = next) {
+	    next = e->next;
+	    p = &table[mem_bucket(e->data, size)];
+	    e->next = *p;
+	    *p = e;
+	}
+    }
+    free(s->table);
+    s->table = table;
+    s->size = size;
+    return 0;
+}
+
+static krb5_error_code
+mem_store(krb5_context context,
+	  krb5_rcache id,
+	  const unsigned char *data,
+	  time_t now)
+{
+    struct rc_mem_entry **p, *e;
+    struct rc_mem_shard *s;
+    krb5_error_code ret;
+    struct rc_mem *m;
+    uint64_t key;
+    time_t t;
+
+    ret = mem_open(context, id, &m);
+    if (ret)
+	return ret;
+
+    memcpy(&key, data, sizeof(key));
+    s = &m->shard[key % RC_MEM_SHARDS];
+
+    HEIMDAL_MUTEX_lock(&s->mutex);
+    t = now - m->lifespan;
+    if (s->size) {
+	p = &s->table[mem_bucket(data, s->size)];
+	while ((e = *p) != NULL) {
+	    if (e->stamp < t) {
+		*p = e->next;
+		free(e);
+		s->count--;
+		continue;
+	    }
+	    if (memcmp(e->data, data, sizeof(e->data)) == 0) {
+		HEIMDAL_MUTEX_unlock(&s->mutex);
+		krb5_clear_error_message(context);
+		return KRB5_RC_REPLAY;
+	    }
+	    p = &e->next;
+	}
+    }
+    if (s->count >= s->size && mem_grow(s, t) != 0) {
+	HEIMDAL_MUTEX_unlock(&s->mutex);
+	return krb5_enomem(context);
+    }
+    e = malloc(sizeof(*e));
+    if (e == NULL) {
+	HEIMDAL_MUTEX_unlock(&s->mutex);
+	return krb5_enomem(context);
+    }
+    e->stamp = now;
+    memcpy(e->data, data, sizeof(e->data));
+    p = &s->table[mem_bucket(data, s->size)];
+    e->next = *p;
+    *p = e;
+    s->count++;
+    HEIMDAL_MUTEX_unlock(&s->mutex);
+    return 0;
+}
+
+static krb5_error_code
+mem_get_lifespan(krb5_context context,
+		 krb5_rcache id,
+		 krb5_deltat *auth_lifespan)
+{
+    krb5_error_code ret;
+    struct rc_mem *m;
+
+    ret = mem_open(context, id, &m);
+    if (ret)
+	return ret;
+    HEIMDAL_MUTEX_lock(&m->shard[0].mutex);
+    *auth_lifespan = m->lifespan;
+    HEIMDAL_MUTEX_unlock(&m->shard[0].mutex);
+    return 0;
+}
+
+static const struct krb5_rc_ops krb5_rc_mem_ops = {
+    "MEMORY",
+    mem_initialize,
+    mem_destroy,
+    mem_close,
+    mem_store,
+    mem_get_lifespan
+};
+
+#ifdef RC_HASH
+
+/*
+ * HASH: an open addressed hash table of checksums in a memory mapped
+ * file, shared by all processes using the same name.
+ *
+ * Time is split into buckets of `lifespan' seconds and each shard of
+ * the table has one table for the current bucket and one for the
+ * previous; a store checks both and inserts into the current one.  A
+ * table is cleared when it is reused for a new bucket, so entries are
+ * remembered for between one and two lifespans without any per-entry
+ * expiry.
+ *
+ * An entry is the first 48 bits of the checksum and the low 16 bits of
+ * the time it was stored.  A key is only looked for in the
+ * RC_HASH_PROBES slots from where it hashes to.  When they are all in
+ * use the oldest of them is replaced, and a warning logged, rather
+ * than failing the store: forgetting an old authenticator is better
+ * than refusing new ones.  The table is sized from `[libdefaults]
+ * rcache_hash_rate' so that this should not happen.
+ *
+ * A store locks just its shard.  Where there are process shared
+ * robust mutexes that is a mutex in the shard header, so that a store
+ * makes no system calls.  Elsewhere it is fcntl() on the shard header
+ * against other processes and a mutex against other threads of this
+ * one.  Since fcntl() locks belong to the process and are all lost
+ * when any descriptor for the file is closed, each file is opened and
+ * mapped once per process and shared by all handles on it.
+ */
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && \
+    defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST) && \
+    defined(HAVE_PTHREAD_MUTEX_CONSISTENT)
+#define RC_HASH_MUTEX 1
+#endif
+
+#define RC_HASH_MAGIC		0x48524331	/* "HRC1" */
+#define RC_HASH_VERSION		2
+#define RC_HASH_SHARDS		64
+#define RC_HASH_RATE		1000		/* default, stores/second */
+#define RC_HASH_MAXSLOTS	(1 << 26)	/* per bucket */
+#define RC_HASH_PROBES		128
+#define RC_HASH_LOCK_TRIES	8
+
+#define RC_HASH_ENTRY(key, t)	(((key) << 16) | ((uint64_t)(t) & 0xffff))
+#define RC_HASH_KEY(e)		((e) >> 16)
+#define RC_HASH_AGE(e, t)	((uint16_t)((t) - (e)))
+
+#ifdef RC_HASH_MUTEX
+#define RC_HASH_MUTEX_SIZE	sizeof(pthread_mutex_t)
+#else
+#define RC_HASH_MUTEX_SIZE	0
+#endif
+
+struct rc_hash_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t lifespan;
+    uint32_t nslots;			/* per shard and bucket */
+    uint32_t mutex_size;		/* 0 if shards are locked with fcntl() */
+    uint32_t pad;
+    struct {
+	uint64_t bucket[2];		/* bucket held by each table */
+	uint64_t full;			/* last bucket that was full */
+#ifdef RC_HASH_MUTEX
+	pthread_mutex_t mutex;
+#endif
+    } shard[RC_HASH_SHARDS];
+};
+
+#define RC_HASH_HEADER \
+    ((sizeof(struct rc_hash_header) + 1 + 4095) & ~(size_t)4095)
+#define RC_HASH_LOCK		(RC_HASH_HEADER - 1) /* create/initialize */
+
+struct rc_hash {
+    struct rc_hash *next;
+    unsigned int refcount;
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    void *map;
+    size_t size;
+    struct rc_hash_header *hdr;
+    uint64_t *slots;
+    uint64_t warned;			/* last bucket warned about */
+#ifndef RC_HASH_MUTEX
+    HEIMDAL_MUTEX mutex[RC_HASH_SHARDS];
+#endif
+};
+
+static HEIMDAL_MUTEX rc_hash_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct rc_hash *rc_hash_files;
+
+static size_t
+hash_size(uint32_t nslots)
+{
+    return RC_HASH_HEADER +
+	(size_t)RC_HASH_SHARDS * 2 * nslots * sizeof(uint64_t);
+}
+
+static krb5_error_code
+hash_io_error(krb5_context context, krb5_rcache id, const char *op)
+{
+    krb5_error_code ret = errno;
+    char buf[128];
+
+    rk_strerror_r(ret, buf, sizeof(buf));
+    krb5_set_error_message(context, ret, "%s(%s): %s", op, id->name, buf);
+    return ret;
+}
+
+static krb5_error_code
+hash_lock(krb5_context context, krb5_rcache id, int fd,
+	  off_t start, off_t len, int type)
+{
+    struct flock l;
+    int ret, tries = 0;
+
+    l.l_start = start;
+    l.l_len = len;
+    l.l_type = type;
+    l.l_whence = SEEK_SET;
+    /*
+     * Deadlock detection is per process, so threads of two processes
+     * each waiting for a shard the other process holds look like a
+     * deadlock even though none is waiting for the other; back off
+     * and retry a few times before believing it.
+     */
+    while ((ret = fcntl(fd, F_SETLKW, &l)) < 0) {
+	if (errno == EDEADLK && tries < RC_HASH_LOCK_TRIES)
+	    usleep(1000 << tries++);
+	else if (errno != EINTR)
+	    break;
+    }
+    if (ret < 0)
+	return hash_io_error(context, id, "lock");
+    return 0;
+}
+
+static krb5_error_code
+hash_lock_shard(krb5_context context, krb5_rcache id,
+		struct rc_hash *h, uint32_t shard)
+{
+#ifdef RC_HASH_MUTEX
+    pthread_mutex_t *mutex = &h->hdr->shard[shard].mutex;
+    char buf[128];
+    int ret;
+
+    /*
+     * A store writes a single slot and a table is only marked as used
+     * for a new bucket once it has been cleared, so whatever a process
+     * that died holding the lock left behind can be used as is.
+     */
+    ret = pthread_mutex_lock(mutex);
+    if (ret == EOWNERDEAD)
+	ret = pthread_mutex_consistent(mutex);
+    if (ret) {
+	rk_strerror_r(ret, buf, sizeof(buf));
+	krb5_set_error_message(context, ret, "lock(%s): %s", id->name, buf);
+    }
+    return ret;
+#else
+    off_t off = offsetof(struct rc_hash_header, shard) +
+	shard * sizeof(h->hdr->shard[0]);
+    krb5_error_code ret;
+
+    HEIMDAL_MUTEX_lock(&h->mutex[shard]);
+    ret = hash_lock(context, id, h->fd, off, sizeof(h->hdr->shard[0]),
+		    F_WRLCK);
+    if (ret)
+	HEIMDAL_MUTEX_unlock(&h->mutex[shard]);
+    return ret;
+#endif
+}
+
+static void
+hash_unlock_shard(krb5_context context, krb5_rcache id,
+		  struct rc_hash *h, uint32_t shard)
+{
+#ifdef RC_HASH_MUTEX
+    pthread_mutex_unlock(&h->hdr->shard[shard].mutex);
+#else
+    off_t off = offsetof(struct rc_hash_header, shard) +
+	shard * sizeof(h->hdr->shard[0]);
+
+    hash_lock(context, id, h->fd, off, sizeof(h->hdr->shard[0]), F_UNLCK);
+    HEIMDAL_MUTEX_unlock(&h->mutex[shard]);
+#endif
+}
+
+/*
+ * Create the table in the empty file `fd', which must be locked.
+ *
+ * Each bucket gets twice the slots needed for `rcache_hash_rate'
+ * stores a second over the lifespan, unless `rcache_hash_slots' says
+ * otherwise.
+ */
+
+static krb5_error_code
+hash_format(krb5_context context, krb5_rcache id, int fd,
+	    krb5_deltat auth_lifespan)
+{
+    struct rc_hash_header *hdr;
+    uint32_t lifespan;
+    uint64_t nslots;
+    int rate, slots;
+#ifdef RC_HASH_MUTEX
+    pthread_mutexattr_t attr;
+    size_t i;
+    int ret;
+#endif
+
+    lifespan = auth_lifespan > 0 ? auth_lifespan : 300;
+    rate = krb5_config_get_int_default(context, NULL, RC_HASH_RATE,
+				       "libdefaults", "rcache_hash_rate",
+				       NULL);
+    if (rate < 1)
+	rate = 1;
+    slots = krb5_config_get_int_default(context, NULL, 0,
+					"libdefaults", "rcache_hash_slots",
+					NULL);
+    if (slots > 0)
+	nslots = slots;
+    else
+	nslots = 2 * (uint64_t)rate * lifespan;
+    if (nslots < RC_HASH_SHARDS)
+	nslots = RC_HASH_SHARDS;
+    if (nslots > RC_HASH_MAXSLOTS)
+	nslots = RC_HASH_MAXSLOTS;
+
+    if (ftruncate(fd, hash_size((nslots + RC_HASH_SHARDS - 1) /
+				RC_HASH_SHARDS)) < 0)
+	return hash_io_error(context, id, "ftruncate");
+    hdr = mmap(NULL, RC_HASH_HEADER, PROT_READ | PROT_WRITE, MAP_SHARED,
+	       fd, 0);
+    if (hdr == MAP_FAILED)
+	return hash_io_error(context, id, "mmap");
+
+#ifdef RC_HASH_MUTEX
+    ret = pthread_mutexattr_init(&attr);
+    if (ret == 0)
+	ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (ret == 0)
+	ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; ret == 0 && i < RC_HASH_SHARDS; i++)
+	ret = pthread_mutex_init(&hdr->shard[i].mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret) {
+	munmap(hdr, RC_HASH_HEADER);
+	errno = ret;
+	return hash_io_error(context, id, "pthread_mutex_init");
+    }
+#endif
+
+    hdr->version = RC_HASH_VERSION;
+    hdr->lifespan = lifespan;
+    hdr->nslots = (nslots + RC_HASH_SHARDS - 1) / RC_HASH_SHARDS;
+    hdr->mutex_size = RC_HASH_MUTEX_SIZE;
+    hdr->magic = RC_HASH_MAGIC;
+    munmap(hdr, RC_HASH_HEADER);
+    return 0;
+}
+
+static void
+hash_release(struct rc_hash *h)
+{
+    struct rc_hash **p;
+#ifndef RC_HASH_MUTEX
+    size_t i;
+#endif
+
+    HEIMDAL_MUTEX_lock(&rc_hash_mutex);
+    if (--h->refcount > 0) {
+	HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+	return;
+    }
+    for (p = &rc_hash_files; *p != NULL; p = &(*p)->next) {
+	if (*p == h) {
+	    *p = h->next;
+	    break;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+
+    munmap(h->map, h->size);
+    close(h->fd);
+#ifndef RC_HASH_MUTEX
+    for (i = 0; i < RC_HASH_SHARDS; i++)
+	HEIMDAL_MUTEX_destroy(&h->mutex[i]);
+#endif
+    free(h);
+}
+
+/*
+ * Open and map the table, creating it with the default lifespan if
+ * needed.  Called with rc_hash_mutex held.
+ */
+
+static krb5_error_code
+hash_open_file(krb5_context context, krb5_rcache id, struct rc_hash **hp)
+{
+    struct rc_hash_header hdr;
+    krb5_error_code ret;
+    struct rc_hash *h;
+    struct stat sb;
+#ifndef RC_HASH_MUTEX
+    size_t i;
+#endif
+    int fd;
+
+    /*
+     * Look for the file by name before opening it, a second descriptor
+     * that is later closed would drop the locks held through the first.
+     */
+    if (stat(id->name, &sb) == 0) {
+	for (h = rc_hash_files; h != NULL; h = h->next) {
+	    if (h->dev == sb.st_dev && h->ino == sb.st_ino) {
+		h->refcount++;
+		*hp = h;
+		return 0;
+	    }
+	}
+    }
+
+    fd = open(id->name, O_RDWR | O_CREAT | O_BINARY | O_CLOEXEC, 0600);
+    if (fd < 0)
+	return hash_io_error(context, id, "open");
+    rk_cloexec(fd);
+
+    ret = hash_lock(context, id, fd, RC_HASH_LOCK, 1, F_WRLCK);
+    if (ret) {
+	close(fd);
+	return ret;
+    }
+    if (fstat(fd, &sb) < 0)
+	ret = hash_io_error(context, id, "stat");
+    else if (sb.st_size == 0)
+	ret = hash_format(context, id, fd, context->max_skew);
+    if (ret == 0 && (lseek(fd, 0, SEEK_SET) < 0 ||
+		     read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)))
+	ret = KRB5_RC_IO_EOF;
+    if (ret == 0 && (hdr.magic != RC_HASH_MAGIC ||
+		     hdr.version != RC_HASH_VERSION ||
+		     hdr.mutex_size != RC_HASH_MUTEX_SIZE ||
+		     hdr.lifespan == 0 || hdr.nslots == 0))
+	ret = KRB5_RC_PARSE;
+    hash_lock(context, id, fd, RC_HASH_LOCK, 1, F_UNLCK);
+    if (ret == KRB5_RC_IO_EOF || ret == KRB5_RC_PARSE)
+	krb5_set_error_message(context, ret,
+			       N_("%s is not a HASH replay cache", ""),
+			       id->name);
+    if (ret) {
+	close(fd);
+	return ret;
+    }
+
+    h = calloc(1, sizeof(*h));
+    if (h == NULL) {
+	close(fd);
+	return krb5_enomem(context);
+    }
+    h->fd = fd;
+    h->dev = sb.st_dev;
+    h->ino = sb.st_ino;
+    h->size = hash_size(hdr.nslots);
+    h->map = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h->map == MAP_FAILED) {
+	ret = hash_io_error(context, id, "mmap");
+	close(fd);
+	free(h);
+	return ret;
+    }
+    h->hdr = h->map;
+    h->slots = (uint64_t *)((unsigned char *)h->map + RC_HASH_HEADER);
+#ifndef RC_HASH_MUTEX
+    for (i = 0; i < RC_HASH_SHARDS; i++)
+	HEIMDAL_MUTEX_init(&h->mutex[i]);
+#endif
+
+    h->refcount = 1;
+    h->next = rc_hash_files;
+    rc_hash_files = h;
+    *hp = h;
+    return 0;
+}
+
+static krb5_error_code
+hash_open(krb5_context context, krb5_rcache id, struct rc_hash **hp)
+{
+    krb5_error_code ret;
+
+    if (id->data) {
+	*hp = id->data;
+	return 0;
+    }
+    HEIMDAL_MUTEX_lock(&rc_hash_mutex);
+    ret = hash_open_file(context, id, hp);
+    HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+    if (ret == 0)
+	id->data = *hp;
+    return ret;
+}
+
+/*
+ * Empty the table and set its lifespan.  The number of slots is kept,
+ * other processes may have the file mapped; destroy the cache to
+ * change it.
+ */
+
+static krb5_error_code
+hash_initialize(krb5_context context,
+		krb5_rcache id,
+		krb5_deltat auth_lifespan)
+{
+    struct rc_hash_header *hdr;
+    krb5_error_code ret;
+    struct rc_hash *h;
+    size_t i, n;
+
+    ret = hash_open(context, id, &h);
+    if (ret)
+	return ret;
+    hdr = h->hdr;
+
+    ret = hash_lock(context, id, h->fd, RC_HASH_LOCK, 1, F_WRLCK);
+    if (ret)
+	return ret;
+    for (n = 0; ret == 0 && n < RC_HASH_SHARDS; n++)
+	ret = hash_lock_shard(context, id, h, n);
+    if (ret == 0) {
+	hdr->lifespan = auth_lifespan > 0 ? auth_lifespan : 300;
+	for (i = 0; i < RC_HASH_SHARDS; i++) {
+	    hdr->shard[i].bucket[0] = 0;
+	    hdr->shard[i].bucket[1] = 0;
+	    hdr->shard[i].full = 0;
+	}
+	memset(h->slots, 0, h->size - RC_HASH_HEADER);
+    } else
+	n--;
+    for (i = 0; i < n; i++)
+	hash_unlock_shard(context, id, h, i);
+    hash_lock(context, id, h->fd, RC_HASH_LOCK, 1, F_UNLCK);
+    return ret;
+}
+
+static void
+hash_close(krb5_context context,
+	   krb5_rcache id)
+{
+    if (id->data)
+	hash_release(id->data);
+    id->data = NULL;
+}
+
+static krb5_error_code
+hash_destroy(krb5_context context,
+	     krb5_rcache id)
+{
+    hash_close(context, id);
+    return file_destroy(context, id);
+}
+
+/*
+ * Look for `key' in the first RC_HASH_PROBES slots of `table' from
+ * `start'.  Returns 1 if found, otherwise 0 with the free slot where it
+ * goes, or if there is none the oldest entry to replace, in `*slotp'.
+ */
+
+static int
+hash_probe(uint64_t *table, uint32_t nslots, uint32_t start,
+	   uint64_t key, uint16_t now, uint64_t **slotp)
+{
+    uint32_t i, n, probes;
+    uint64_t *oldest = NULL;
+
+    probes = nslots < RC_HASH_PROBES ? nslots : RC_HASH_PROBES;
+    for (i = 0, n = start; i < probes; i++, n = (n + 1) % nslots) {
+	if (table[n] == 0) {
+	    *slotp = &table[n];
+	    return 0;
+	}
+	if (RC_HASH_KEY(table[n]) == key)
+	    return 1;
+	if (oldest == NULL ||
+	    RC_HASH_AGE(table[n], now) > RC_HASH_AGE(*oldest, now))
+	    oldest = &table[n];
+    }
+    *slotp = oldest;
+    return 0;
+}
+
+static void
+hash_warn_full(krb5_context context, krb5_rcache id,
+	       struct rc_hash *h, uint64_t bucket)
+{
+    HEIMDAL_MUTEX_lock(&rc_hash_mutex);
+    if (h->warned == bucket) {
+	HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+	return;
+    }
+    h->warned = bucket;
+    HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+    krb5_warnx(context, "replay cache %s is full, forgetting old "
+	       "authenticators; raise [libdefaults] rcache_hash_rate "
+	       "and recreate it", id->name);
+}
+
+static krb5_error_code
+hash_store(krb5_context context,
+	   krb5_rcache id,
+	   const unsigned char *data,
+	   time_t now)
+{
+    struct rc_hash_header *hdr;
+    uint64_t key, bucket, *cur, *prev, *slot;
+    uint32_t shard, start;
+    krb5_error_code ret;
+    struct rc_hash *h;
+    uint16_t stamp = now;
+    int full = 0;
+
+    ret = hash_open(context, id, &h);
+    if (ret)
+	return ret;
+    hdr = h->hdr;
+
+    memcpy(&key, data, sizeof(key));
+    shard = key % RC_HASH_SHARDS;
+    start = (key / RC_HASH_SHARDS) % hdr->nslots;
+    key >>= 16;
+    if (key == 0)
+	key = 1;	/* 0 marks a free slot */
+
+    ret = hash_lock_shard(context, id, h, shard);
+    if (ret)
+	return ret;
+
+    /* never go back in time, that would clear the current table */
+    bucket = now / hdr->lifespan;
+    if (bucket < hdr->shard[shard].bucket[0])
+	bucket = hdr->shard[shard].bucket[0];
+    if (bucket < hdr->shard[shard].bucket[1])
+	bucket = hdr->shard[shard].bucket[1];
+
+    cur = &h->slots[(shard * 2 + (bucket & 1)) * (size_t)hdr->nslots];
+    prev = &h->slots[(shard * 2 + !(bucket & 1)) * (size_t)hdr->nslots];
+
+    if (hdr->shard[shard].bucket[bucket & 1] != bucket) {
+	memset(cur, 0, hdr->nslots * sizeof(cur[0]));
+	hdr->shard[shard].bucket[bucket & 1] = bucket;
+    }
+
+    if ((hdr->shard[shard].bucket[!(bucket & 1)] == bucket - 1 &&
+	 hash_probe(prev, hdr->nslots, start, key, stamp, &slot)) ||
+	hash_probe(cur, hdr->nslots, start, key, stamp, &slot)) {
+	krb5_clear_error_message(context);
+	ret = KRB5_RC_REPLAY;
+    } else {
+	if (*slot != 0 && hdr->shard[shard].full != bucket) {
+	    hdr->shard[shard].full = bucket;
+	    full = 1;
+	}
+	*slot = RC_HASH_ENTRY(key, stamp);
+    }
+
+    hash_unlock_shard(context, id, h, shard);
+    if (full)
+	hash_warn_full(context, id, h, bucket);
+    return ret;
+}
+
+static krb5_error_code
+hash_get_lifespan(krb5_context context,
+		  krb5_rcache id,
+		  krb5_deltat *auth_lifespan)
+{
+    krb5_error_code ret;
+    struct rc_hash *h;
+
+    ret = hash_open(context, id, &h);
+    if (ret)
+	return ret;
+    *auth_lifespan = h->hdr->lifespan;
+    return 0;
+}
+
+static const struct krb5_rc_ops krb5_rc_hash_ops = {
+    "HASH",
+    hash_initialize,
+    hash_destroy,
+    hash_close,
+    hash_store,
+    hash_get_lifespan
+};
+
+#endif /* RC_HASH */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_rc_initialize(krb5_context context,
+		   krb5_rcache id,
+		   krb5_deltat auth_lifespan)
+{
+    return (*id->ops->init)(context, id, auth_lifespan);
+}
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_rc_recover(krb5_context context,
+		krb5_rcache id)
+{
+    return 0;
+}
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_rc_destroy(krb5_context context,
+		krb5_rcache id)
+{
+    krb5_error_code ret;
+
+    ret = (*id->ops->destroy)(context, id);
+    if (ret)
+	return ret;
+    return krb5_rc_close(context, id);
+}
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_rc_close(krb5_context context,
+	      krb5_rcache id)
+{
+    (*id->ops->close)(context, id);
+    free(id->name);
+    free(id);
+    return 0;
+}
+
+static void
+checksum_authenticator(Authenticator *auth, void *data)
+{
+    EVP_MD_CTX *m = EVP_MD_CTX_create();
+    unsigned i;
+
+    EVP_DigestInit_ex(m, EVP_md5(), NULL);
+
+    EVP_DigestUpdate(m, auth->crealm, strlen(auth->crealm));
+    for(i = 0; i < auth->cname.name_string.len; i++)
+	EVP_DigestUpdate(m, auth->cname.name_string.val[i],
+		   strlen(auth->cname.name_string.val[i]));
+    EVP_DigestUpdate(m, &auth->ctime, sizeof(auth->ctime));
+    EVP_DigestUpdate(m, &auth->cusec, sizeof(auth->cusec));
+
+    EVP_DigestFinal_ex(m, data, NULL);
+    EVP_MD_CTX_destroy(m);
+}
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_rc_store(krb5_context context,
+	      krb5_rcache id,
+	      krb5_donot_replay *rep)
+{
+    unsigned char data[16];
+
+    checksum_authenticator(rep, data);
+    return (*id->ops->store)(context, id, data, time(NULL));
+}
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_rc_expunge(krb5_context context,
+		krb5_rcache id)
+{
+    return 0;
+}
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_rc_get_lifespan(krb5_context context,
+		     krb5_rcache id,
+		     krb5_deltat *auth_lifespan)
+{
+    return (*id->ops->get_lifespan)(context, id, auth_lifespan);
+}
+
 KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_get_name(krb5_context context,
 		 krb5_rcache id)
@@ -291,7 +1303,7 @@ KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_get_type(krb5_context context,
 		 krb5_rcache id)
 {
-    return "FILE";
+    return id->ops->prefix;
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -35,6 +35,53 @@
 
 int _krb5_AES_string_to_default_iterator = 4096;
 
+static krb5_error_code
+AES_string_to_iter(krb5_data opaque, uint32_t *iter)
+{
+    if (opaque.length == 0)
+	*iter = _krb5_AES_string_to_default_iterator;
+    else if (opaque.length == 4) {
+	unsigned long v;
+	_krb5_get_int(opaque.data, &v, 4);
+	*iter = ((uint32_t)v);
+    } else
+	return KRB5_PROG_KEYTYPE_NOSUPP; /* XXX */
+    return 0;
+}
+
+/*
+ * Turn the PBKDF2 output into the key; `tkey' is at least
+ * et->keytype->size bytes long.
+ */
+
+static krb5_error_code
+AES_tkey_to_key(krb5_context context,
+		struct _krb5_encryption_type *et,
+		const void *tkey,
+		krb5_keyblock *key)
+{
+    krb5_error_code ret;
+    struct _krb5_key_data kd;
+
+    kd.schedule = NULL;
+    ALLOC(kd.key, 1);
+    if (kd.key == NULL)
+	return krb5_enomem(context);
+    kd.key->keytype = et->type;
+    ret = krb5_data_copy(&kd.key->keyvalue, tkey, et->keytype->size);
+    if (ret) {
+	free(kd.key);
+	return krb5_enomem(context);
+    }
+
+    ret = _krb5_derive_key(context, et, &kd, "kerberos", strlen("kerberos"));
+    if (ret == 0)
+	ret = krb5_copy_keyblock_contents(context, kd.key, key);
+    _krb5_free_key_data(context, &kd, et);
+
+    return ret;
+}
+
 static krb5_error_code
 AES_string_to_key(krb5_context context,
 		  krb5_enctype enctype,
@@ -46,27 +93,17 @@ AES_string_to_key(krb5_context context,
     krb5_error_code ret;
     uint32_t iter;
     struct _krb5_encryption_type *et;
-    struct _krb5_key_data kd;
+    krb5_data tkey;
 
-    if (opaque.length == 0)
-	iter = _krb5_AES_string_to_default_iterator;
-    else if (opaque.length == 4) {
-	unsigned long v;
-	_krb5_get_int(opaque.data, &v, 4);
-	iter = ((uint32_t)v);
-    } else
-	return KRB5_PROG_KEYTYPE_NOSUPP; /* XXX */
+    ret = AES_string_to_iter(opaque, &iter);
+    if (ret)
+	return ret;
 
     et = _krb5_find_enctype(enctype);
     if (et == NULL)
 	return KRB5_PROG_KEYTYPE_NOSUPP;
 
-    kd.schedule = NULL;
-    ALLOC(kd.key, 1);
-    if (kd.key == NULL)
-	return krb5_enomem(context);
-    kd.key->keytype = enctype;
-    ret = krb5_data_alloc(&kd.key->keyvalue, et->keytype->size);
+    ret = krb5_data_alloc(&tkey, et->keytype->size);
     if (ret) {
 	krb5_set_error_message (context, ret, N_("malloc: out of memory", ""));
 	return ret;
@@ -75,18 +112,106 @@ AES_string_to_key(krb5_context context,
     ret = PKCS5_PBKDF2_HMAC_SHA1(password.data, password.length,
 				 salt.saltvalue.data, salt.saltvalue.length,
 				 iter,
-				 et->keytype->size, kd.key->keyvalue.data);
+				 tkey.length, tkey.data);
     if (ret != 1) {
-	_krb5_free_key_data(context, &kd, et);
+	krb5_data_free(&tkey);
 	krb5_set_error_message(context, KRB5_PROG_KEYTYPE_NOSUPP,
 			       "Error calculating s2k");
 	return KRB5_PROG_KEYTYPE_NOSUPP;
     }
 
-    ret = _krb5_derive_key(context, et, &kd, "kerberos", strlen("kerberos"));
-    if (ret == 0)
-	ret = krb5_copy_keyblock_contents(context, kd.key, key);
-    _krb5_free_key_data(context, &kd, et);
+    ret = AES_tkey_to_key(context, et, tkey.data, key);
+    memset(tkey.data, 0, tkey.length);
+    krb5_data_free(&tkey);
+
+    return ret;
+}
+
+static int
+is_AES_pw_salt(krb5_enctype enctype, const krb5_salt *salt)
+{
+    struct _krb5_encryption_type *et = _krb5_find_enctype(enctype);
+
+    return et != NULL && et->keytype->string_to_key == _krb5_AES_salt &&
+	salt->salttype == KRB5_PW_SALT;
+}
+
+static int
+salt_equal(const krb5_salt *a, const krb5_salt *b)
+{
+    return a->salttype == b->salttype &&
+	krb5_data_cmp(&a->saltvalue, &b->saltvalue) == 0;
+}
+
+/*
+ * The AES part of krb5_string_to_key_data_salt_multi().  The PBKDF2
+ * output for a shorter key is a prefix of the output for a longer one
+ * with the same password, salt and iteration count, so all AES
+ * enctypes sharing a salt are served by one PBKDF2 run of the longest
+ * key length; for the usual aes256 + aes128 pair that is two SHA-1
+ * chains instead of three.  Keys produced here are flagged in `done'.
+ */
+
+krb5_error_code
+_krb5_AES_string_to_keys(krb5_context context,
+			 krb5_data password,
+			 size_t num_keys,
+			 const krb5_enctype *enctypes,
+			 const krb5_salt *salts,
+			 krb5_keyblock *keys,
+			 unsigned char *done)
+{
+    struct _krb5_encryption_type *et;
+    krb5_error_code ret = 0;
+    krb5_data tkey;
+    size_t i, j, size;
+
+    krb5_data_zero(&tkey);
+
+    for (i = 0; ret == 0 && i < num_keys; i++) {
+	if (done[i] || !is_AES_pw_salt(enctypes[i], &salts[i]))
+	    continue;
+
+	size = 0;
+	for (j = i; j < num_keys; j++) {
+	    if (done[j] || !is_AES_pw_salt(enctypes[j], &salts[j]) ||
+		!salt_equal(&salts[i], &salts[j]))
+		continue;
+	    et = _krb5_find_enctype(enctypes[j]);
+	    size = max(size, et->keytype->size);
+	}
+
+	ret = krb5_data_realloc(&tkey, size);
+	if (ret) {
+	    krb5_set_error_message(context, ret,
+				   N_("malloc: out of memory", ""));
+	    break;
+	}
+
+	if (PKCS5_PBKDF2_HMAC_SHA1(password.data, password.length,
+				   salts[i].saltvalue.data,
+				   salts[i].saltvalue.length,
+				   _krb5_AES_string_to_default_iterator,
+				   size, tkey.data) != 1) {
+	    ret = KRB5_PROG_KEYTYPE_NOSUPP;
+	    krb5_set_error_message(context, ret, "Error calculating s2k");
+	    break;
+	}
+
+	for (j = i; ret == 0 && j < num_keys; j++) {
+	    if (done[j] || !is_AES_pw_salt(enctypes[j], &salts[j]) ||
+		!salt_equal(&salts[i], &salts[j]))
+		continue;
+	    et = _krb5_find_enctype(enctypes[j]);
+	    ret = AES_tkey_to_key(context, et, tkey.data, &keys[j]);
+	    if (ret == 0)
+		done[j] = 1;
+	}
+    }
+
+    if (tkey.data)
+	memset(tkey.data, 0, tkey.length);
+    krb5_data_free(&tkey);
 
     return ret;
 }
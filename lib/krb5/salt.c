@@ -203,6 +203,68 @@ krb5_string_to_key_data_salt_opaque (krb5_context context,
     return HEIM_ERR_SALTTYPE_NOSUPP;
 }
 
+/**
+ * Do string -> key for several enctype/salt pairs from the same
+ * password at once, as is done when a principal's password is set.
+ * The result for `enctypes[i]' and `salts[i]' is returned in
+ * `keys[i]', with the default string-to-key parameters.
+ *
+ * This gives the same keys as calling krb5_string_to_key_data_salt()
+ * for each pair, but work that the enctypes have in common is only
+ * done once; AES keys with the same salt share the PBKDF2 iterations.
+ *
+ * @param context a Kerberos 5 context
+ * @param password the password
+ * @param num_keys number of enctype/salt pairs
+ * @param enctypes the enctypes
+ * @param salts the salt for each enctype
+ * @param keys the resulting keys, free with krb5_free_keyblock_contents()
+ *
+ * @return Return an error code or 0, on error no keys are returned.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_string_to_key_data_salt_multi (krb5_context context,
+				    krb5_data password,
+				    size_t num_keys,
+				    const krb5_enctype *enctypes,
+				    const krb5_salt *salts,
+				    krb5_keyblock *keys)
+{
+    krb5_error_code ret;
+    unsigned char *done;
+    size_t i;
+
+    if (num_keys == 0)
+	return 0;
+
+    done = calloc(num_keys, 1);
+    if (done == NULL)
+	return krb5_enomem(context);
+
+    ret = _krb5_AES_string_to_keys(context, password, num_keys,
+				   enctypes, salts, keys, done);
+    for (i = 0; ret == 0 && i < num_keys; i++) {
+	if (done[i])
+	    continue;
+	ret = krb5_string_to_key_data_salt(context, enctypes[i], password,
+					   salts[i], &keys[i]);
+	if (ret == 0)
+	    done[i] = 1;
+    }
+
+    if (ret) {
+	for (i = 0; i < num_keys; i++)
+	    if (done[i])
+		krb5_free_keyblock_contents(context, &keys[i]);
+    }
+    free(done);
+
+    return ret;
+}
+
 /*
  * Do a string -> key for encryption type `enctype' operation on the
  * string `password' (with salt `salt'), returning the resulting key
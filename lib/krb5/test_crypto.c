@@ -34,6 +34,22 @@
 #include <err.h>
 #include <getarg.h>
 
+static void
+print_rate(const char *etype_name, const char *op, size_t size,
+	   int iterations, struct timeval *tv)
+{
+    double t = tv->tv_sec + tv->tv_usec / 1000000.0;
+
+    if (t <= 0)
+	t = 0.000001;
+
+    printf("%s %s size: %7lu iterations: %d time: %3ld.%06ld "
+	   "%10.0f ops/s %9.2f MB/s\n",
+	   etype_name, op, (unsigned long)size, iterations,
+	   (long)tv->tv_sec, (long)tv->tv_usec,
+	   iterations / t, (double)size * iterations / t / (1024 * 1024));
+}
+
 static void
 time_encryption(krb5_context context, size_t size,
 		krb5_enctype etype, int iterations)
@@ -42,7 +58,7 @@ time_encryption(krb5_context context, size_t size,
     krb5_error_code ret;
     krb5_keyblock key;
     krb5_crypto crypto;
-    krb5_data data;
+    krb5_data data, cipher;
     char *etype_name;
     void *buf;
     int i;
@@ -77,10 +93,31 @@ time_encryption(krb5_context context, size_t size,
 
     timevalsub(&tv2, &tv1);
 
-    printf("%s size: %7lu iterations: %d time: %3ld.%06ld\n",
-	   etype_name, (unsigned long)size, iterations,
-	   (long)tv2.tv_sec, (long)tv2.tv_usec);
+    print_rate(etype_name, "encrypt", size, iterations, &tv2);
 
+    ret = krb5_encrypt(context, crypto, 0, buf, size, &cipher);
+    if (ret)
+	krb5_err(context, 1, ret, "encrypt");
+
+    gettimeofday(&tv1, NULL);
+
+    for (i = 0; i < iterations; i++) {
+	ret = krb5_decrypt(context, crypto, 0, cipher.data, cipher.length,
+			   &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "decrypt: %d", i);
+	if (data.length != size)
+	    krb5_errx(context, 1, "decrypt: %d: wrong length", i);
+	krb5_data_free(&data);
+    }
+
+    gettimeofday(&tv2, NULL);
+
+    timevalsub(&tv2, &tv1);
+
+    print_rate(etype_name, "decrypt", size, iterations, &tv2);
+
+    krb5_data_free(&cipher);
     free(buf);
     free(etype_name);
     krb5_crypto_destroy(context, crypto);
@@ -130,8 +167,14 @@ time_s2k(krb5_context context,
 
 static int version_flag = 0;
 static int help_flag	= 0;
+static int enc_iterations = 1000;
+static int s2k_iterations = 100;
 
 static struct getargs args[] = {
+    {"iterations", 0,	arg_integer,	&enc_iterations,
+     "encryption iterations per message size", "number" },
+    {"s2k-iterations", 0, arg_integer,	&s2k_iterations,
+     "string-to-key iterations", "number" },
     {"version",	0,	arg_flag,	&version_flag,
      "print version", NULL },
     {"help",	0,	arg_flag,	&help_flag,
@@ -153,7 +196,7 @@ main(int argc, char **argv)
 {
     krb5_context context;
     krb5_error_code ret;
-    int i, enciter, s2kiter;
+    int i, j;
     int optidx = 0;
     krb5_salt salt;
 
@@ -166,6 +209,9 @@ main(int argc, char **argv)
 	ETYPE_AES128_CTS_HMAC_SHA1_96,
 	ETYPE_AES256_CTS_HMAC_SHA1_96
     };
+    size_t sizes[] = {
+	16, 64, 256, 1024, 4096, 16384, 65536
+    };
 
     setprogname(argv[0]);
 
@@ -188,24 +234,15 @@ main(int argc, char **argv)
     if (ret)
 	errx (1, "krb5_init_context failed: %d", ret);
 
-    enciter = 1000;
-    s2kiter = 100;
-
     for (i = 0; i < sizeof(enctypes)/sizeof(enctypes[0]); i++) {
 
 	krb5_enctype_enable(context, enctypes[i]);
 
-	time_encryption(context, 16, enctypes[i], enciter);
-	time_encryption(context, 32, enctypes[i], enciter);
-	time_encryption(context, 512, enctypes[i], enciter);
-	time_encryption(context, 1024, enctypes[i], enciter);
-	time_encryption(context, 2048, enctypes[i], enciter);
-	time_encryption(context, 4096, enctypes[i], enciter);
-	time_encryption(context, 8192, enctypes[i], enciter);
-	time_encryption(context, 16384, enctypes[i], enciter);
-	time_encryption(context, 32768, enctypes[i], enciter);
-
-	time_s2k(context, enctypes[i], "mYsecreitPassword", salt, s2kiter);
+	for (j = 0; j < sizeof(sizes)/sizeof(sizes[0]); j++)
+	    time_encryption(context, sizes[j], enctypes[i], enc_iterations);
+
+	time_s2k(context, enctypes[i], "mYsecreitPassword", salt,
+		 s2k_iterations);
     }
 
     krb5_free_context(context);
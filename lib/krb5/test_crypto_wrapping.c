@@ -93,7 +93,70 @@ test_wrapping(krb5_context context,
     krb5_free_keyblock_contents(context, &key);
 }
 
+/*
+ * Keys derived up front with krb5_crypto_prederive() must match the
+ * ones derived on demand, both for key usages found by direct index
+ * and for those that are not.
+ */
+
+static void
+test_prederive(krb5_context context, krb5_enctype etype)
+{
+    krb5_key_usage usages[] = {
+	KRB5_KU_TICKET,
+	KRB5_KU_USAGE_INITIATOR_SEAL,
+	KRB5_KU_ENC_CHALLENGE_KDC,
+	KRB5_KU_DIGEST_ENCRYPT
+    };
+    krb5_error_code ret;
+    krb5_keyblock key;
+    krb5_crypto crypto, precrypto;
+    krb5_data data, plain;
+    char buf[100];
+    size_t i;
 
+    ret = krb5_generate_random_keyblock(context, etype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+
+    ret = krb5_crypto_init(context, &key, 0, &crypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+    ret = krb5_crypto_init(context, &key, 0, &precrypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+
+    ret = krb5_crypto_prederive(context, precrypto, NULL, 0);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_prederive");
+    ret = krb5_crypto_prederive(context, precrypto, usages,
+				sizeof(usages)/sizeof(usages[0]));
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_prederive");
+
+    memset(buf, 'a', sizeof(buf));
+
+    for (i = 0; i < sizeof(usages)/sizeof(usages[0]); i++) {
+	ret = krb5_encrypt(context, crypto, usages[i], buf, sizeof(buf), &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "encrypt usage %d", (int)usages[i]);
+	ret = krb5_decrypt(context, precrypto, usages[i],
+			   data.data, data.length, &plain);
+	if (ret)
+	    krb5_err(context, 1, ret, "decrypt usage %d", (int)usages[i]);
+	/* the DES enctypes hand back the plaintext padded to the block */
+	if (plain.length < sizeof(buf) ||
+	    memcmp(plain.data, buf, sizeof(buf)) != 0)
+	    krb5_errx(context, 1, "decrypt usage %d: wrong data",
+		      (int)usages[i]);
+	krb5_data_free(&plain);
+	krb5_data_free(&data);
+    }
+
+    krb5_crypto_destroy(context, precrypto);
+    krb5_crypto_destroy(context, crypto);
+    krb5_free_keyblock_contents(context, &key);
+}
 
 static int version_flag = 0;
 static int help_flag	= 0;
@@ -159,6 +222,7 @@ main(int argc, char **argv)
 
 	test_wrapping(context, 0, 1024, 1, enctypes[i]);
 	test_wrapping(context, 1024, 1024 * 100, 1024, enctypes[i]);
+	test_prederive(context, enctypes[i]);
     }
     krb5_free_context(context);
 
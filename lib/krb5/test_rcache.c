@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of KTH nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software without
+ *    specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY KTH AND ITS CONTRIBUTORS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL KTH OR ITS CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "krb5_locl.h"
+#include <err.h>
+#include <getarg.h>
+
+static void
+make_auth(Authenticator *auth, heim_general_string *name, time_t t, int usec)
+{
+    memset(auth, 0, sizeof(*auth));
+    auth->crealm = "TEST.H5L.SE";
+    auth->cname.name_type = KRB5_NT_PRINCIPAL;
+    auth->cname.name_string.len = 1;
+    auth->cname.name_string.val = name;
+    auth->ctime = t;
+    auth->cusec = usec;
+}
+
+static void
+test_type(krb5_context context, const char *type)
+{
+    heim_general_string name = "lha";
+    krb5_rcache id, id2;
+    krb5_error_code ret;
+    krb5_deltat lifespan;
+    Authenticator auth;
+    time_t now = time(NULL);
+    char *rcname;
+    int i;
+
+    if (asprintf(&rcname, "%s:test_rcache.%s", type, type) < 0 ||
+	rcname == NULL)
+	errx(1, "out of memory");
+
+    ret = krb5_rc_resolve_full(context, &id, rcname);
+    if (ret == KRB5_RC_TYPE_NOTFOUND) {
+	free(rcname);
+	return;
+    }
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", rcname);
+
+    if (strcmp(krb5_rc_get_type(context, id), type) != 0)
+	errx(1, "%s: wrong type %s", rcname, krb5_rc_get_type(context, id));
+    if (strcmp(krb5_rc_get_name(context, id), rcname + strlen(type) + 1) != 0)
+	errx(1, "%s: wrong name %s", rcname, krb5_rc_get_name(context, id));
+
+    ret = krb5_rc_initialize(context, id, 600);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", rcname);
+    ret = krb5_rc_get_lifespan(context, id, &lifespan);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_get_lifespan: %s", rcname);
+    if (lifespan != 600)
+	errx(1, "%s: lifespan %d != 600", rcname, (int)lifespan);
+
+    for (i = 0; i < 100; i++) {
+	make_auth(&auth, &name, now, i);
+	ret = krb5_rc_store(context, id, &auth);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_rc_store: %s %d", rcname, i);
+    }
+
+    make_auth(&auth, &name, now, 17);
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret != KRB5_RC_REPLAY)
+	errx(1, "%s: replay not detected", rcname);
+
+    /* a second handle on the same cache sees the same entries */
+    ret = krb5_rc_resolve_full(context, &id2, rcname);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", rcname);
+    make_auth(&auth, &name, now, 42);
+    ret = krb5_rc_store(context, id2, &auth);
+    if (ret != KRB5_RC_REPLAY)
+	errx(1, "%s: replay not detected by second handle", rcname);
+    make_auth(&auth, &name, now, 100);
+    ret = krb5_rc_store(context, id2, &auth);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store: %s", rcname);
+    krb5_rc_close(context, id2);
+
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret != KRB5_RC_REPLAY)
+	errx(1, "%s: replay from second handle not detected", rcname);
+
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy: %s", rcname);
+
+    free(rcname);
+}
+
+/*
+ * Overfill a HASH replay cache with one slot per shard: every new
+ * authenticator must still be accepted, and the latest still caught.
+ */
+
+static void
+test_hash_full(void)
+{
+    heim_general_string name = "lha";
+    static char conf[] = "test_rcache.conf";
+    char *files[] = { conf, NULL };
+    const char *rcname = "HASH:test_rcache.full";
+    krb5_context context;
+    krb5_error_code ret;
+    Authenticator auth;
+    time_t now = time(NULL);
+    krb5_rcache id;
+    FILE *f;
+    int i;
+
+    f = fopen(files[0], "w");
+    if (f == NULL)
+	err(1, "%s", files[0]);
+    fprintf(f, "[libdefaults]\n\trcache_hash_slots = 64\n");
+    fclose(f);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+    ret = krb5_set_config_files(context, files);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config_files");
+
+    unlink(rcname + strlen("HASH:"));
+    ret = krb5_rc_resolve_full(context, &id, rcname);
+    if (ret == KRB5_RC_TYPE_NOTFOUND)
+	goto out;
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", rcname);
+    ret = krb5_rc_initialize(context, id, 600);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", rcname);
+
+    for (i = 0; i < 10000; i++) {
+	make_auth(&auth, &name, now, i);
+	ret = krb5_rc_store(context, id, &auth);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_rc_store: %s %d", rcname, i);
+	ret = krb5_rc_store(context, id, &auth);
+	if (ret != KRB5_RC_REPLAY)
+	    errx(1, "%s: replay %d not detected", rcname, i);
+    }
+
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy: %s", rcname);
+out:
+    unlink(files[0]);
+    krb5_free_context(context);
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+
+struct bench {
+    const char *rcname;
+    time_t now;
+    int first;
+    int count;
+};
+
+static void *
+bench_thread(void *ptr)
+{
+    struct bench *b = ptr;
+    heim_general_string name = "lha";
+    krb5_context context;
+    krb5_error_code ret;
+    Authenticator auth;
+    krb5_rcache id;
+    int i;
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+    ret = krb5_rc_resolve_full(context, &id, b->rcname);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", b->rcname);
+    for (i = b->first; i < b->first + b->count; i++) {
+	make_auth(&auth, &name, b->now, i);
+	ret = krb5_rc_store(context, id, &auth);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_rc_store: %s %d", b->rcname, i);
+    }
+    krb5_rc_close(context, id);
+    krb5_free_context(context);
+    return NULL;
+}
+
+static void
+time_store(krb5_context context, const char *type, int nthreads,
+	   int iterations)
+{
+    struct timeval tv1, tv2;
+    krb5_error_code ret;
+    struct bench *b;
+    pthread_t *threads;
+    krb5_rcache id;
+    char *rcname;
+    double secs;
+    int i;
+
+    if (asprintf(&rcname, "%s:test_rcache.bench", type) < 0 ||
+	rcname == NULL)
+	errx(1, "out of memory");
+
+    ret = krb5_rc_resolve_full(context, &id, rcname);
+    if (ret == KRB5_RC_TYPE_NOTFOUND) {
+	free(rcname);
+	return;
+    }
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", rcname);
+    ret = krb5_rc_initialize(context, id, 600);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", rcname);
+
+    b = calloc(nthreads, sizeof(b[0]));
+    threads = calloc(nthreads, sizeof(threads[0]));
+    if (b == NULL || threads == NULL)
+	errx(1, "out of memory");
+
+    gettimeofday(&tv1, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+	b[i].rcname = rcname;
+	b[i].now = tv1.tv_sec;
+	b[i].first = i * (iterations / nthreads);
+	b[i].count = iterations / nthreads;
+	if (pthread_create(&threads[i], NULL, bench_thread, &b[i]) != 0)
+	    errx(1, "pthread_create");
+    }
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+
+    gettimeofday(&tv2, NULL);
+
+    timevalsub(&tv2, &tv1);
+    secs = tv2.tv_sec + tv2.tv_usec / 1000000.0;
+
+    printf("%-6s threads: %2d inserts: %d time: %3ld.%06ld (%.0f/s)\n",
+	   type, nthreads, (iterations / nthreads) * nthreads,
+	   (long)tv2.tv_sec, (long)tv2.tv_usec,
+	   secs > 0 ? (iterations / nthreads) * nthreads / secs : 0.0);
+
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy: %s", rcname);
+    free(threads);
+    free(b);
+    free(rcname);
+}
+
+#endif /* ENABLE_PTHREAD_SUPPORT */
+
+static int benchmark_flag = 0;
+static int iterations = 2000;
+static int help_flag = 0;
+
+static struct getargs args[] = {
+    {"benchmark", 0,	arg_flag,	&benchmark_flag,
+     "time inserts with 1, 8 and 32 threads", NULL },
+    {"iterations", 0,	arg_integer,	&iterations,
+     "number of inserts to time", "number" },
+    {"help",	0,	arg_flag,	&help_flag,
+     NULL, NULL }
+};
+
+static void
+usage (int ret)
+{
+    arg_printusage (args,
+		    sizeof(args)/sizeof(*args),
+		    NULL,
+		    "");
+    exit (ret);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    int optidx = 0;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &optidx))
+	usage(1);
+
+    if (help_flag)
+	usage (0);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx (1, "krb5_init_context failed: %d", ret);
+
+    if (benchmark_flag) {
+#ifdef ENABLE_PTHREAD_SUPPORT
+	static const char *types[] = { "FILE", "HASH", "MEMORY" };
+	static const int nthreads[] = { 1, 8, 32 };
+	size_t i, j;
+
+	for (i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+	    for (j = 0; j < sizeof(nthreads)/sizeof(nthreads[0]); j++)
+		time_store(context, types[i], nthreads[j], iterations);
+#else
+	errx(1, "benchmark needs thread support");
+#endif
+	krb5_free_context(context);
+	return 0;
+    }
+
+    test_type(context, "FILE");
+    test_type(context, "HASH");
+    test_type(context, "MEMORY");
+    test_hash_full();
+
+    krb5_free_context(context);
+
+    return 0;
+}
@@ -411,6 +411,7 @@ struct entry libdefaults_entries[] = {
     { "forward", krb5_config_string, check_boolean, 0 },
     { "forwardable", krb5_config_string, check_boolean, 0 },
     { "allow_hierarchical_capaths", krb5_config_string, check_boolean, 0 },
+    { "gssapi_replay_window", krb5_config_string, check_numeric, 0 },
     { "host_timeout", krb5_config_string, check_time, 0 },
     { "http_proxy", krb5_config_string, check_host /* XXX */, 0 },
     { "ignore_addresses", krb5_config_string, NULL, 0 },
@@ -428,6 +429,8 @@ struct entry libdefaults_entries[] = {
     { "no-addresses", krb5_config_string, check_boolean, 0 },
     { "pkinit_dh_min_bits", krb5_config_string, NULL, 0 },
     { "proxiable", krb5_config_string, check_boolean, 0 },
+    { "rcache_hash_rate", krb5_config_string, check_numeric, 0 },
+    { "rcache_hash_slots", krb5_config_string, check_numeric, 0 },
     { "renew_lifetime", krb5_config_string, check_time, 0 },
     { "scan_interfaces", krb5_config_string, check_boolean, 0 },
     { "srv_lookup", krb5_config_string, check_boolean, 0 },
@@ -558,10 +561,13 @@ struct entry kdc_entries[] = {
     { "enable-pkinit", krb5_config_string, check_boolean, 0 },
     { "encode_as_rep_as_tgs_rep", krb5_config_string, check_boolean, 0 },
     { "enforce-transited-policy", krb5_config_string, NULL, 1 },
+    { "entry-cache-lifetime", krb5_config_string, check_time, 0 },
+    { "entry-cache-size", krb5_config_string, check_numeric, 0 },
     { "hdb-ldap-create-base", krb5_config_string, NULL, 0 },
     { "iprop-acl", krb5_config_string, NULL, 0 },
     { "iprop-stats", krb5_config_string, NULL, 0 },
     { "kdc-request-log", krb5_config_string, NULL, 0 },
+    { "keep-db-open", krb5_config_string, check_boolean, 0 },
     { "kdc_warn_pwexpire", krb5_config_string, check_time, 0 },
     { "key-file", krb5_config_string, NULL, 0 },
     { "kx509_ca", krb5_config_string, NULL, 0 },
@@ -570,6 +576,9 @@ struct entry kdc_entries[] = {
     { "logging", krb5_config_string, check_log, 0 },
     { "max-kdc-datagram-reply-length", krb5_config_string, check_bytes, 0 },
     { "max-request", krb5_config_string, check_bytes, 0 },
+    { "num-kdc-processes", krb5_config_string, check_numeric, 0 },
+    { "num-threads", krb5_config_string, check_numeric, 0 },
+    { "pin-workers", krb5_config_string, check_boolean, 0 },
     { "pkinit_allow_proxy_certificate", krb5_config_string, check_boolean, 0 },
     { "pkinit_anchors", krb5_config_string, NULL, 0 },
     { "pkinit_dh_min_bits", krb5_config_string, check_numeric, 0 },
@@ -585,6 +594,7 @@ struct entry kdc_entries[] = {
     { "preauth-use-strongest-session-key", krb5_config_string, check_boolean, 0 },
     { "require_initial_kca_tickets", krb5_config_string, check_boolean, 0 },
     { "require-preauth", krb5_config_string, check_boolean, 0 },
+    { "reuse-port", krb5_config_string, check_boolean, 0 },
     { "svc-use-strongest-session-key", krb5_config_string, check_boolean, 0 },
     { "tgt-use-strongest-session-key", krb5_config_string, check_boolean, 0 },
     { "transited-policy", krb5_config_string, NULL, 0 },